@@ -82,7 +82,8 @@ typedef enum
 	GLITE_CATALOG_ERROR_SERVICEDISCOVERY,
 	GLITE_CATALOG_ERROR_NOTEXISTS,
 	GLITE_CATALOG_ERROR_EXISTS,
-	GLITE_CATALOG_ERROR_SOAP
+	GLITE_CATALOG_ERROR_SOAP,
+	GLITE_CATALOG_ERROR_TIMEOUT
 } glite_catalog_errclass;
 
 /**
@@ -372,6 +373,21 @@ struct _glite_catalog_SURLEntry
 #define GLITE_SEINDEX_SD_ENV		"GLITE_SD_SEINDEX_TYPE"
 #define GLITE_METADATA_SD_ENV		"GLITE_SD_METADATA_TYPE"
 
+/* Environment variables controlling the cache of the interface version and
+ * the limits of the services. GLITE_CATALOG_INFO_TTL is the number of
+ * seconds they are used for (default 3600, 0 asks the service every time
+ * a context is created). GLITE_CATALOG_INFO_CACHE names a file sharing them
+ * with other processes (unset to keep them in memory only). */
+#define GLITE_CATALOG_INFO_TTL_ENV	"GLITE_CATALOG_INFO_TTL"
+#define GLITE_CATALOG_INFO_CACHE_ENV	"GLITE_CATALOG_INFO_CACHE"
+
+/* Environment variables setting the default time limits of the calls, in
+ * seconds (0 waits without limit). GLITE_CATALOG_CONNECT_TIMEOUT applies to
+ * connecting to the service (default 30), GLITE_CATALOG_TIMEOUT to each
+ * send and receive of a call (default 300). */
+#define GLITE_CATALOG_CONNECT_TIMEOUT_ENV	"GLITE_CATALOG_CONNECT_TIMEOUT"
+#define GLITE_CATALOG_TIMEOUT_ENV	"GLITE_CATALOG_TIMEOUT"
+
 /**
  * \brief Allocates a new catalog context. 
  *
@@ -399,6 +415,44 @@ glite_catalog_ctx *glite_catalog_new(const char *endpoint);
  */
 void glite_catalog_free(glite_catalog_ctx *ctx);
 
+/**
+ * \brief Keep the connection to the service open between calls.
+ *
+ * Must be called before the first call using the context. The connection
+ * is closed by glite_catalog_free().
+ *
+ * @param ctx The global context.
+ * @param enable Non-zero to enable HTTP keep-alive.
+ */
+void glite_catalog_set_keepalive(glite_catalog_ctx *ctx, int enable);
+
+/**
+ * \brief Limit the time the calls of a context may wait for the service.
+ *
+ * Applies to connecting, sending a request and receiving the answer, each
+ * of them separately. The defaults are set by GLITE_CATALOG_CONNECT_TIMEOUT
+ * and GLITE_CATALOG_TIMEOUT.
+ *
+ * @param ctx The global context.
+ * @param seconds Maximum time to wait, 0 to wait without limit.
+ */
+void glite_catalog_set_timeout(glite_catalog_ctx *ctx, int seconds);
+
+/**
+ * \brief Set the time all the following calls of a context must be over by.
+ *
+ * Every call gets at most the time left: half of it for connecting, all
+ * of it for sending the request and receiving the answer. A call made
+ * after the deadline fails at once. Such failures have the error class
+ * GLITE_CATALOG_ERROR_TIMEOUT and count as connection errors.
+ *
+ * @param ctx The global context.
+ * @param deadline Time on the CLOCK_MONOTONIC clock, NULL to remove the
+ *  deadline.
+ */
+void glite_catalog_set_deadline(glite_catalog_ctx *ctx,
+	const struct timespec *deadline);
+
 /** 
  * Get the current endpoint.
  *
@@ -426,6 +480,16 @@ const char *glite_catalog_get_error(glite_catalog_ctx *ctx);
  */
 glite_catalog_errclass glite_catalog_get_errclass(glite_catalog_ctx *ctx);
 
+/**
+ * \brief Tells if the last error came from the connection to the service
+ * (the service could not be reached or did not answer) rather than from
+ * the service itself.
+ *
+ * @param ctx The global context.
+ * @return non-zero for a connection error.
+ */
+int glite_catalog_is_connection_error(glite_catalog_ctx *ctx);
+
 /**
  * \brief Set the error message in the context.
  *
@@ -110,6 +110,16 @@ glite_catalog_Attribute **glite_metadata_getAttributes(glite_catalog_ctx *ctx,
 	const char *item, int nattributes, const char * const attributes[],
 	int *resultCount);
 
+/* Get the same attribute values for several items. results[i] and
+ * resultCounts[i] are set like the result and *resultCount of
+ * glite_metadata_getAttributes() for items[i]. The call stops at the first
+ * item that fails, leaving its error in the context. Returns the number of
+ * items done before it, that is nitems if there was no error. */
+int glite_metadata_getAttributes_multi(glite_catalog_ctx *ctx, int nitems,
+	const char * const items[], int nattributes,
+	const char * const attributes[], glite_catalog_Attribute **results[],
+	int resultCounts[]);
+
 /* List all attributes of an item. The result might contain NULL
  * pointers if there was no response for that particular item */
 glite_catalog_Attribute **glite_metadata_listAttributes(glite_catalog_ctx *ctx,
@@ -133,6 +143,12 @@ int glite_metadata_createEntry(glite_catalog_ctx *ctx, const char *item,
 int glite_metadata_createEntry_multi(glite_catalog_ctx *ctx, int nitems,
 	const char **items[2]);
 
+/* Create an entry and set its attributes. If the attributes can not be set,
+ * the entry is removed again and the error of setAttributes is reported. */
+int glite_metadata_createEntryWithAttributes(glite_catalog_ctx *ctx,
+	const char *item, const char *schema, int nattributes,
+	const glite_catalog_Attribute * const attributes[]);
+
 /* Remove an entry */
 int glite_metadata_removeEntry(glite_catalog_ctx *ctx, const char *item);
 
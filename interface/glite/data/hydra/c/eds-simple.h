@@ -17,6 +17,15 @@
  *
  *  GLite Data Management - Simple encrypted data storage API
  *
+ *  Thread safety: the functions of this API may be called concurrently
+ *  from several threads as long as each context (EVP_CIPHER_CTX) is used
+ *  by one thread at a time. Errors are returned through the error
+ *  argument of each call, there is no shared error state. With OpenSSL
+ *  older than 1.1 the library installs the OpenSSL locking callbacks
+ *  unless the application has already done so.
+ *  glite_eds_library_cleanup() must not run concurrently with any other
+ *  call.
+ *
  *  Authors:
  *      Andrei Kruger <andrei.krueger@cern.ch>
  *	    Zoltan Farkas <Zoltan.Farkas@cern.ch>
@@ -27,14 +36,218 @@
 #ifndef GLITE_DATA_EDS_SIMPLE_H
 #define GLITE_DATA_EDS_SIMPLE_H
 
+#include <sys/types.h>
 #include <openssl/evp.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Environment variables tuning the key piece reads. GLITE_EDS_HEDGE is the
+ * latency percentile (1-100) of an endpoint after which a read is hedged
+ * by a duplicate to a spare endpoint; unset or 0 disables hedging, and all
+ * endpoints are then queried at once. GLITE_EDS_HEDGE_BUDGET is the
+ * percentage of the reads that may be hedges (default 5). */
+#define GLITE_EDS_HEDGE_ENV        "GLITE_EDS_HEDGE"
+#define GLITE_EDS_HEDGE_BUDGET_ENV "GLITE_EDS_HEDGE_BUDGET"
+
+/* Environment variables controlling the cache of the key store endpoints.
+ * GLITE_EDS_ENDPOINT_TTL is the number of seconds a discovered list is
+ * used for (default 300, 0 disables the cache). GLITE_EDS_ENDPOINT_CACHE
+ * is the file sharing the list with other processes (default
+ * $HOME/.glite/eds-endpoints, empty to keep it in memory only). The file
+ * is ignored unless it is a regular file owned by the user, and neither it
+ * nor its directory is writable by the group or others. */
+#define GLITE_EDS_ENDPOINT_TTL_ENV   "GLITE_EDS_ENDPOINT_TTL"
+#define GLITE_EDS_ENDPOINT_CACHE_ENV "GLITE_EDS_ENDPOINT_CACHE"
+
+/* Environment variables of the liveness check of the key store endpoints
+ * (glite_eds_get_valid_catalog_endpoints()). GLITE_EDS_PROBE_TIMEOUT is
+ * the number of seconds an endpoint may take to answer (default 5, 0 waits
+ * without limit), GLITE_EDS_PROBE_TTL the number of seconds a result is
+ * reused for (default 60, 0 checks every time). When
+ * GLITE_EDS_VALIDATE_ENDPOINTS is set to 1, new keys are only split among
+ * the endpoints that pass the check; the registration fails if fewer than
+ * GLITE_EDS_VALIDATE_MIN of them do (default: the number of pieces needed
+ * to rebuild a key split among all the endpoints). */
+#define GLITE_EDS_PROBE_TIMEOUT_ENV       "GLITE_EDS_PROBE_TIMEOUT"
+#define GLITE_EDS_PROBE_TTL_ENV           "GLITE_EDS_PROBE_TTL"
+#define GLITE_EDS_VALIDATE_ENDPOINTS_ENV  "GLITE_EDS_VALIDATE_ENDPOINTS"
+#define GLITE_EDS_VALIDATE_MIN_ENV        "GLITE_EDS_VALIDATE_MIN"
+
+/* Environment variable setting how many seconds an unused connection to a
+ * key store endpoint is kept open for the next request (default 60, 0
+ * opens a new connection for every request). */
+#define GLITE_EDS_POOL_IDLE_ENV "GLITE_EDS_POOL_IDLE"
+
+/* Environment variables controlling the cache of the joined keys used by
+ * glite_eds_encrypt_init() and glite_eds_decrypt_init().
+ * GLITE_EDS_KEY_CACHE_TTL is the number of seconds a key is reused for
+ * (default 0, the cache is disabled). GLITE_EDS_KEY_CACHE_SIZE is the
+ * number of keys kept (default 256), GLITE_EDS_KEY_CACHE_MISSING the number
+ * of seconds an id without a key is remembered (default 10, 0 to always
+ * ask the key stores again). A key is only given out again to the
+ * credential it was read with, known by the subject of the proxy (or of
+ * the user certificate); nothing is cached when it cannot be read. */
+#define GLITE_EDS_KEY_CACHE_TTL_ENV     "GLITE_EDS_KEY_CACHE_TTL"
+#define GLITE_EDS_KEY_CACHE_SIZE_ENV    "GLITE_EDS_KEY_CACHE_SIZE"
+#define GLITE_EDS_KEY_CACHE_MISSING_ENV "GLITE_EDS_KEY_CACHE_MISSING"
+
+/* Environment variables of the key agent (glite-eds-agent).
+ * GLITE_EDS_AGENT_SOCK is the socket of the agent: when it is set, keys
+ * are registered, looked up and unregistered by the agent, which keeps the
+ * key store endpoints, connections and a key cache between the commands.
+ * GLITE_EDS_AGENT_PID is the process id of the agent, used to stop it. */
+#define GLITE_EDS_AGENT_SOCK_ENV "GLITE_EDS_AGENT_SOCK"
+#define GLITE_EDS_AGENT_PID_ENV  "GLITE_EDS_AGENT_PID"
+
+/* Environment variable setting the largest number of threads running the
+ * asynchronous operations (glite_eds_*_async(), default 32). */
+#define GLITE_EDS_ASYNC_THREADS_ENV "GLITE_EDS_ASYNC_THREADS"
+
+/* Environment variables of the circuit breaker of the key store endpoints.
+ * After GLITE_EDS_BREAKER_FAILURES consecutive connection failures
+ * (default 3, 0 disables the breaker) an endpoint is skipped for
+ * GLITE_EDS_BREAKER_COOLDOWN seconds (default 30); then one request probes
+ * it, and its success makes the endpoint usable again. */
+#define GLITE_EDS_BREAKER_FAILURES_ENV "GLITE_EDS_BREAKER_FAILURES"
+#define GLITE_EDS_BREAKER_COOLDOWN_ENV "GLITE_EDS_BREAKER_COOLDOWN"
+
+/* Environment variable setting the default time budget in seconds of the
+ * key store requests of a register, init or unregister call (default 0:
+ * no budget, only the time limits of the catalog calls apply). See
+ * glite_eds_decrypt_init_timeout(). */
+#define GLITE_EDS_TIMEOUT_ENV "GLITE_EDS_TIMEOUT"
+
+/* Environment variables of the write quorum of key registrations. With
+ * GLITE_EDS_WRITE_QUORUM set to n > 0 a registration returns once n key
+ * stores have stored their piece of the key, and the others are completed
+ * in the background, see glite_eds_replication_wait(). The quorum is at
+ * least the number of pieces needed to join the key plus
+ * GLITE_EDS_WRITE_MARGIN (default 1). A key store that does not answer is
+ * asked again up to GLITE_EDS_WRITE_RETRIES times (default 5). At most
+ * GLITE_EDS_WRITE_THREADS pieces are stored at the same time (default 32),
+ * the others wait for their turn. Unset or 0: every key store stores its
+ * piece before the registration returns. */
+#define GLITE_EDS_WRITE_QUORUM_ENV  "GLITE_EDS_WRITE_QUORUM"
+#define GLITE_EDS_WRITE_MARGIN_ENV  "GLITE_EDS_WRITE_MARGIN"
+#define GLITE_EDS_WRITE_RETRIES_ENV "GLITE_EDS_WRITE_RETRIES"
+#define GLITE_EDS_WRITE_THREADS_ENV "GLITE_EDS_WRITE_THREADS"
+
+/* Environment variables of the write-behind journal. With
+ * GLITE_EDS_JOURNAL set to the absolute path of a directory, a
+ * registration appends the pieces of the new key to a journal file there
+ * and returns once they are on disk, without contacting the key stores;
+ * glite_eds_unregister() journals the removal the same way. A thread of
+ * the library sends the journalled requests in batches of up to
+ * GLITE_EDS_JOURNAL_BATCH ids (default 100), waiting up to
+ * GLITE_EDS_JOURNAL_DELAY milliseconds (default 200) for a batch to fill,
+ * and retries the ones a key store did not answer, up to
+ * GLITE_EDS_JOURNAL_RETRIES attempts (default 20). The requests given up
+ * are appended to the file "quarantine" of the directory, which the
+ * library never empties. The directory must be accessible by its owner
+ * only. See glite_eds_journal_flush(). */
+#define GLITE_EDS_JOURNAL_ENV       "GLITE_EDS_JOURNAL"
+#define GLITE_EDS_JOURNAL_BATCH_ENV "GLITE_EDS_JOURNAL_BATCH"
+#define GLITE_EDS_JOURNAL_DELAY_ENV "GLITE_EDS_JOURNAL_DELAY"
+#define GLITE_EDS_JOURNAL_RETRIES_ENV "GLITE_EDS_JOURNAL_RETRIES"
+
+/* Replication states of a registered key */
+#define GLITE_EDS_REPLICATION_DONE    0   /* every key store has its piece */
+#define GLITE_EDS_REPLICATION_PENDING 1   /* pieces are still being stored */
+#define GLITE_EDS_REPLICATION_FAILED  2   /* some pieces could not be stored */
+
+/* Counters of the library, for the whole process */
+struct glite_eds_stats {
+    unsigned long share_reads;  /* key piece requests sent, hedges included */
+    unsigned long hedges;       /* hedged key piece requests */
+    unsigned long hedges_won;   /* hedges answered before the request they hedged */
+    unsigned long connections;  /* key store connections opened (full handshake) */
+    unsigned long connections_reused; /* requests sent on an open connection */
+    unsigned long key_cache_hits;   /* keys (or their absence) found in the cache */
+    unsigned long key_cache_misses; /* keys looked up in the key stores */
+    unsigned long circuit_skips;    /* requests not sent to an endpoint with an open circuit */
+};
+
+/* Circuit breaker states of a key store endpoint */
+#define GLITE_EDS_CIRCUIT_CLOSED    0   /* in use */
+#define GLITE_EDS_CIRCUIT_OPEN      1   /* skipped after repeated failures */
+#define GLITE_EDS_CIRCUIT_HALF_OPEN 2   /* a request is probing it */
+
+/* Health of a key store endpoint, for the whole process */
+struct glite_eds_endpoint_stats {
+    char *endpoint;
+    double latency;             /* moving average in seconds, negative if unknown */
+    double error_rate;          /* moving average of the failed requests, 0-1 */
+    unsigned long requests;     /* requests answered or failed */
+    unsigned long failures;     /* requests that could not reach the endpoint */
+    int state;                  /* GLITE_EDS_CIRCUIT_* */
+};
+
+/**
+ * Initialize the library: seed the random number generator from a
+ * non-blocking source, load the cipher table and, with OpenSSL older than
+ * 1.1, install the OpenSSL locking callbacks. Called automatically by the
+ * first context initialization, calling it again has no effect.
+ *
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return 0 in case of no error. In other cases *error contains the error
+ *  string. The caller is responsible for freeing the allocated error string.
+ */
+int glite_eds_library_init(char **error);
+
+/**
+ * Release the resources allocated by glite_eds_library_init. No context
+ * may be in use anymore.
+ */
+void glite_eds_library_cleanup(void);
+
+/**
+ * Get the counters of the library
+ *
+ * @param stats [OUT] Current values of the counters.
+ */
+void glite_eds_get_stats(struct glite_eds_stats *stats);
+
+/**
+ * Get the health of the key store endpoints used so far
+ *
+ * @param stats [OUT] Array of *count elements, to be freed with
+ *  glite_eds_free_endpoint_stats().
+ * @param count [OUT] Number of endpoints.
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return 0 in case of no error. In other cases *error contains the error
+ *  string. The caller is responsible for freeing the allocated error string.
+ */
+int glite_eds_get_endpoint_stats(struct glite_eds_endpoint_stats **stats,
+    int *count, char **error);
+
+/**
+ * Free the array returned by glite_eds_get_endpoint_stats()
+ */
+void glite_eds_free_endpoint_stats(struct glite_eds_endpoint_stats *stats,
+    int count);
+
+/**
+ * Serve the requests sent by the library to the key agent over a connected
+ * Unix socket, until the client closes it. Used by glite-eds-agent, the
+ * requests are done without going through another agent.
+ *
+ * @param fd The connected socket, not closed by the call.
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return 0 once the client has closed the connection. In other cases
+ *  *error contains the error string. The caller is responsible for freeing
+ *  the allocated error string.
+ */
+int glite_eds_agent_serve(int fd, char **error);
+
 /**
  * Get endpoints of default catalog service and all associated services.
+ * The list found by service discovery is cached in memory and on disk
+ * until it expires or a key store operation fails.
  * 
  * @param count [OUT] count of returned endpoints.
  * @param error [OUT] Pointer to the error string. 
@@ -46,6 +259,24 @@ extern "C" {
  */
 char ** glite_eds_get_catalog_endpoints(int *count, char **error);
 
+/**
+ * Get the endpoints of glite_eds_get_catalog_endpoints() that are alive.
+ * All endpoints are asked at once for their version, a read-only request
+ * limited by GLITE_EDS_PROBE_TIMEOUT; the answers are reused for
+ * GLITE_EDS_PROBE_TTL seconds.
+ *
+ * @param count [OUT] count of returned endpoints.
+ * @param id Not used, kept for compatibility.
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return list of endpoints.
+ * The caller is responsible for freeing the allocated structure.
+ * In error cases (or if no endpoint answered) the NULL is returned and
+ * *error contains the error string.
+ * The caller is responsible for freeing the allocated error string.
+ */
+char ** glite_eds_get_valid_catalog_endpoints(int *count, int *id, char **error);
+
 /**
  * Register a new file in Hydra: create key entries (key/iv/...)
  * 
@@ -60,9 +291,38 @@ char ** glite_eds_get_catalog_endpoints(int *count, char **error);
 int glite_eds_register(char *id, char *cipher, int keysize,
     char **error);
 
+/**
+ * Register many new files in Hydra at once: all keys are generated first,
+ * then the key entries are created in large requests to all key stores.
+ * The key attributes are still set with one request per id and key store,
+ * several requests running at once on each key store.
+ * Each id is registered on all key stores or on none.
+ *
+ * @param ids The SURLs or GUIDs of the remote files.
+ * @param nids Number of ids.
+ * @param cipher The cipher name to use.
+ * @param keysize Key size to use in bits.
+ * @param results [OUT] If not NULL, an array of nids elements set to 0 for
+ *  each registered id and to -1 for the others.
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return 0 if all ids were registered. In other cases *error contains the
+ *  error of the first id that failed. The caller is responsible for freeing
+ *  the allocated error string.
+ */
+int glite_eds_register_multi(char **ids, int nids, char *cipher,
+    int keysize, int *results, char **error);
+
 /**
  * Register a new file in Hydra: create key entries (key/iv/...),
  * initalizes encryption context
+ *
+ * With an AEAD cipher (aes-256-gcm, chacha20-poly1305, ...) the data is
+ * written in a chunked container: a header, then fixed size chunks each
+ * with its own authentication tag. Chunks are encrypted and verified
+ * independently, so corruption is detected at the damaged chunk. Only GCM
+ * ciphers and ChaCha20-Poly1305 are supported, other AEAD ciphers (CCM,
+ * OCB) are refused.
  * 
  * @param id The ID by which the crypt will be registered (remote file name or GUID).
  * @param cipher The cipher name to use.
@@ -93,6 +353,9 @@ EVP_CIPHER_CTX *glite_eds_encrypt_init(char *id, char **error);
  * Initialize decryption context for a file. Query key/iv/... from
  * key storage
  *
+ * All key store endpoints are queried at once; the call returns as soon
+ * as enough consistent key pieces have arrived to rebuild the key.
+ *
  * @param id The ID by which the crypt key is stored (remote file name or GUID).
  * @param error [OUT] Pointer to the error string.
  *
@@ -102,6 +365,235 @@ EVP_CIPHER_CTX *glite_eds_encrypt_init(char *id, char **error);
  */
 EVP_CIPHER_CTX *glite_eds_decrypt_init(char *id, char **error); 
 
+/**
+ * Initialize decryption contexts for many files at once. The key pieces of
+ * all ids are read from each key store over a few connections kept open,
+ * instead of a separate lookup for each file.
+ *
+ * @param ids The IDs by which the crypt keys are stored.
+ * @param nids Number of ids.
+ * @param ctxs [OUT] Array of nids elements set to the decryption context of
+ *  each id, or to NULL for the ids that failed.
+ * @param errors [OUT] If not NULL, an array of nids elements set to the error
+ *  string of each id that failed, and to NULL for the others.
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return 0 if all contexts were initialized. In other cases *error contains
+ *  the error of the first id that failed. The caller is responsible for
+ *  freeing the contexts and the allocated error strings.
+ */
+int glite_eds_decrypt_init_multi(char **ids, int nids, EVP_CIPHER_CTX **ctxs,
+    char **errors, char **error);
+
+/**
+ * glite_eds_decrypt_init() within a time budget. The key store requests of
+ * the call share the budget: connecting to a key store gets at most half
+ * of the time left, each request at most all of it, and the call returns
+ * when the budget is spent, leaving the key stores that have not answered
+ * yet behind. The requests are also limited by the budget set by
+ * GLITE_EDS_TIMEOUT, whichever ends first.
+ *
+ * @param id The ID by which the crypt key is stored (remote file name or GUID).
+ * @param timeout_ms The budget in milliseconds, 0 or less for none.
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return Decryption context in case of no error. In other cases NULL is
+ *  returned, and *error contains the error string; errno is ETIMEDOUT if the
+ *  budget ran out. The caller is responsible for freeing the allocated
+ *  error string.
+ */
+EVP_CIPHER_CTX *glite_eds_decrypt_init_timeout(char *id, int timeout_ms,
+    char **error);
+
+/**
+ * glite_eds_encrypt_init() within a time budget, see
+ * glite_eds_decrypt_init_timeout().
+ */
+EVP_CIPHER_CTX *glite_eds_encrypt_init_timeout(char *id, int timeout_ms,
+    char **error);
+
+/**
+ * glite_eds_register_encrypt_init() within a time budget, see
+ * glite_eds_decrypt_init_timeout(). If the registration fails, removing the
+ * pieces already stored gets a budget of the same length.
+ */
+EVP_CIPHER_CTX *glite_eds_register_encrypt_init_timeout(char *id,
+    char *cipher, int keysize, int timeout_ms, char **error);
+
+/**
+ * glite_eds_unregister() within a time budget, see
+ * glite_eds_decrypt_init_timeout().
+ */
+int glite_eds_unregister_timeout(char *id, int timeout_ms, char **error);
+
+/**
+ * State of the key stores of a key registered with a write quorum (see
+ * GLITE_EDS_WRITE_QUORUM_ENV). A registration that is complete, or that
+ * did not use a write quorum, is not followed: it is reported as done with
+ * *stored and *total set to 0. A failed replication is reported once, then
+ * forgotten.
+ *
+ * @param id The ID by which the crypt key is stored (remote file name or GUID).
+ * @param stored [OUT] Number of key stores that have stored their piece.
+ * @param total [OUT] Number of key stores the key was split for.
+ * @param error [OUT] Pointer to the error string, set if the replication
+ *  failed. The caller is responsible for freeing the allocated string.
+ *
+ * @return GLITE_EDS_REPLICATION_DONE, GLITE_EDS_REPLICATION_PENDING or
+ *  GLITE_EDS_REPLICATION_FAILED.
+ */
+int glite_eds_replication_status(char *id, int *stored, int *total,
+    char **error);
+
+/**
+ * Wait until every key store has stored its piece of a key registered with
+ * a write quorum, or has been given up. A failed replication is reported
+ * once, then forgotten. The key can be read as long as a write quorum of
+ * key stores has its piece.
+ *
+ * @param id The ID by which the crypt key is stored, NULL for all the keys
+ *  registered by the process.
+ * @param timeout_ms Milliseconds to wait at most, -1 to wait without limit.
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return 0 if the replication is complete, 1 if the time is up first. In
+ *  other cases -1 is returned, and *error contains the error string. The
+ *  caller is responsible for freeing the allocated error string.
+ */
+int glite_eds_replication_wait(char *id, int timeout_ms, char **error);
+
+/**
+ * Flush barrier of the write-behind journal (see GLITE_EDS_JOURNAL_ENV):
+ * send the journalled requests without waiting for the batches to fill,
+ * and wait until all of them are done. The journals left behind by
+ * processes that exited are taken over first. A process that keeps
+ * running after this call also takes over such journals later, every 30
+ * seconds it has nothing else to send.
+ *
+ * @param timeout_ms Milliseconds to wait at most, -1 to wait without limit,
+ *  0 to start the flush without waiting.
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return 0 if the journal is empty, 1 if the time is up first. In other
+ *  cases -1 is returned, and *error contains the error string: the journal
+ *  can not be used, or requests were given up since the previous call
+ *  (they are kept in the quarantine file of the journal directory).
+ *  The caller is responsible for freeing the allocated error string.
+ */
+int glite_eds_journal_flush(int timeout_ms, char **error);
+
+/* Asynchronous context initialization, in progress or finished */
+typedef struct glite_eds_op glite_eds_op;
+
+/*
+ * Called once an asynchronous operation has finished, from a thread of the
+ * library. It may take the result and free the operation, but should not
+ * block.
+ */
+typedef void (*glite_eds_op_callback)(glite_eds_op *op, void *arg);
+
+/**
+ * Start glite_eds_decrypt_init() without waiting for it. The call runs on
+ * a thread of the library; when it has finished the callback (if any) is
+ * called and glite_eds_op_fd() becomes readable, so the operation can be
+ * driven from an event loop.
+ *
+ * @param id The ID by which the crypt key is stored (remote file name or GUID).
+ * @param callback Function called when the operation has finished, or NULL.
+ * @param arg Argument passed to the callback.
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return Handle of the operation, to be freed with glite_eds_op_free(). In
+ *  other cases NULL is returned, and *error contains the error string. The
+ *  caller is responsible for freeing the allocated error string.
+ */
+glite_eds_op *glite_eds_decrypt_init_async(char *id,
+    glite_eds_op_callback callback, void *arg, char **error);
+
+/**
+ * Start glite_eds_encrypt_init() without waiting for it, see
+ * glite_eds_decrypt_init_async().
+ */
+glite_eds_op *glite_eds_encrypt_init_async(char *id,
+    glite_eds_op_callback callback, void *arg, char **error);
+
+/**
+ * Start glite_eds_register_encrypt_init() without waiting for it, see
+ * glite_eds_decrypt_init_async().
+ */
+glite_eds_op *glite_eds_register_encrypt_init_async(char *id, char *cipher,
+    int keysize, glite_eds_op_callback callback, void *arg, char **error);
+
+/**
+ * File descriptor of an operation for poll(), select(), epoll or the main
+ * loop of a toolkit. It becomes readable when the operation has finished
+ * and stays so; it is closed by glite_eds_op_free() and must not be read
+ * or closed by the caller.
+ */
+int glite_eds_op_fd(glite_eds_op *op);
+
+/**
+ * Check whether an operation has finished, without blocking.
+ *
+ * @return 1 if the operation has finished, 0 otherwise.
+ */
+int glite_eds_op_done(glite_eds_op *op);
+
+/**
+ * Wait for an operation to finish.
+ *
+ * @param op The operation.
+ * @param timeout_ms Milliseconds to wait at most, -1 to wait without limit.
+ *
+ * @return 0 if the operation has finished, 1 if the time is up first.
+ */
+int glite_eds_op_wait(glite_eds_op *op, int timeout_ms);
+
+/**
+ * Take the result of a finished operation.
+ *
+ * @param op The operation.
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return The context initialized by the operation, to be finalized and
+ *  freed by the caller; it can be taken only once. In other cases NULL is
+ *  returned, and *error contains the error of the operation. The caller is
+ *  responsible for freeing the allocated error string.
+ */
+EVP_CIPHER_CTX *glite_eds_op_result(glite_eds_op *op, char **error);
+
+/**
+ * Free an operation. An operation still running is left to finish in the
+ * background, and a result that was not taken is discarded; its callback
+ * is still called.
+ */
+void glite_eds_op_free(glite_eds_op *op);
+
+/**
+ * Initialize decryption of a byte range of a file encrypted with a CBC
+ * or CTR cipher. Query key/iv/... from key storage
+ *
+ * Only the ciphertext bytes [*read_offset, *read_offset + *read_length)
+ * have to be read and passed to the decryption functions: the context
+ * drops the data outside of the requested range. If the range reaches
+ * the end of the file, the padding of the last block is checked.
+ *
+ * @param id The ID by which the crypt key is stored (remote file name or GUID).
+ * @param offset Plaintext offset of the range
+ * @param length Plaintext length of the range, -1 means up to the end
+ * @param cipher_size Size of the encrypted file
+ * @param read_offset [OUT] Offset of the ciphertext to read
+ * @param read_length [OUT] Number of ciphertext bytes to read
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return Decryption context in case of no error. In other cases NULL is
+ *  returned, and *error contains the error string. The caller is responsible
+ *  for freeing the allocated error string.
+ */
+EVP_CIPHER_CTX *glite_eds_decrypt_range_init(char *id, off_t offset,
+    off_t length, off_t cipher_size, off_t *read_offset, off_t *read_length,
+    char **error);
+
 /**
  * Encrypts a memory block using the encryption context
  * 
@@ -165,7 +657,109 @@ int glite_eds_decrypt_block(EVP_CIPHER_CTX *dctx, char *mem_in,  int mem_in_size
 int glite_eds_decrypt_final(EVP_CIPHER_CTX *dctx, char **mem_out, int *mem_out_size, char **error);
 
 /**
- * Finalize an encryption/decryption context
+ * Returns the size of the output buffer needed by the *_into functions
+ *
+ * @param ctx Encryption/decryption context
+ * @param mem_in_size Size of the memory block to be processed, or 0 to get
+ *  the size needed by glite_eds_encrypt_final_into and
+ *  glite_eds_decrypt_final_into
+ *
+ * @return the required output buffer size in bytes
+ */
+int glite_eds_output_size(EVP_CIPHER_CTX *ctx, int mem_in_size);
+
+/**
+ * Encrypts a memory block into a buffer owned by the caller
+ *
+ * The output buffer must be at least glite_eds_output_size(ectx, mem_in_size)
+ * bytes long. mem_out may be the same as mem_in, in which case the block is
+ * encrypted in place.
+ *
+ * @param ectx Encryption context
+ * @param mem_in Memory block to encrypt
+ * @param mem_in_size Memory block size
+ * @param mem_out Output buffer
+ * @param mem_out_capacity Size of the output buffer
+ * @param mem_out_size [OUT] Number of bytes written to the output buffer
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return 0 in case of there was no error. In other cases, *error contains
+ *  the error string. The caller is responsible for freeing the allocated string.
+ */
+int glite_eds_encrypt_block_into(EVP_CIPHER_CTX *ectx, char *mem_in, int mem_in_size,
+    char *mem_out, int mem_out_capacity, int *mem_out_size, char **error);
+
+/**
+ * Finalizes memory block encryption into a buffer owned by the caller
+ *
+ * @param ectx Encryption context
+ * @param mem_out Output buffer of at least glite_eds_output_size(ectx, 0) bytes
+ * @param mem_out_capacity Size of the output buffer
+ * @param mem_out_size [OUT] Number of bytes written to the output buffer
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return 0 in case of there was no error. In other cases, *error contains
+ *  the error string. The caller is responsible for freeing the allocated string.
+ */
+int glite_eds_encrypt_final_into(EVP_CIPHER_CTX *ectx, char *mem_out,
+    int mem_out_capacity, int *mem_out_size, char **error);
+
+/**
+ * Decrypts a memory block into a buffer owned by the caller
+ *
+ * The output buffer must be at least glite_eds_output_size(dctx, mem_in_size)
+ * bytes long. mem_out may be the same as mem_in, in which case the block is
+ * decrypted in place.
+ *
+ * @param dctx Decryption context
+ * @param mem_in Memory block to decrypt
+ * @param mem_in_size Memory block size
+ * @param mem_out Output buffer
+ * @param mem_out_capacity Size of the output buffer
+ * @param mem_out_size [OUT] Number of bytes written to the output buffer
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return 0 in case of there was no error. In other cases, *error contains
+ *  the error string. The caller is responsible for freeing the allocated string.
+ */
+int glite_eds_decrypt_block_into(EVP_CIPHER_CTX *dctx, char *mem_in, int mem_in_size,
+    char *mem_out, int mem_out_capacity, int *mem_out_size, char **error);
+
+/**
+ * Finalizes memory block decryption into a buffer owned by the caller
+ *
+ * @param dctx Decryption context
+ * @param mem_out Output buffer of at least glite_eds_output_size(dctx, 0) bytes
+ * @param mem_out_capacity Size of the output buffer
+ * @param mem_out_size [OUT] Number of bytes written to the output buffer
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return 0 in case of there was no error. In other cases, *error contains
+ *  the error string. The caller is responsible for freeing the allocated string.
+ */
+int glite_eds_decrypt_final_into(EVP_CIPHER_CTX *dctx, char *mem_out,
+    int mem_out_capacity, int *mem_out_size, char **error);
+
+/**
+ * Sets the number of threads used by a context
+ *
+ * Must be called before the first block is processed. CBC decryption,
+ * CTR and the chunked AEAD format are spread over several threads, other
+ * contexts keep working serially. The output is the same as
+ * the serial one.
+ *
+ * @param ctx Encryption/decryption context
+ * @param nthreads Number of threads, 0 means one per online processor
+ * @param error [OUT] Pointer to the error string.
+ *
+ * @return 0 in case of there was no error. In other cases, *error contains
+ *  the error string. The caller is responsible for freeing the allocated string.
+ */
+int glite_eds_set_threads(EVP_CIPHER_CTX *ctx, int nthreads, char **error);
+
+/**
+ * Finalize an encryption/decryption context. The context is freed and must
+ * not be used afterwards.
  *
  * @param ctx Encryption/decryption context
  * @param error [OUT] Pointer to the error string.
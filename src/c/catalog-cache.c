@@ -0,0 +1,415 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  GLite Data Management - Cache of the interface version and the limits
+ *  of the catalog endpoints
+ *
+ */
+
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glite/data/catalog/c/catalog-simple.h>
+
+#include <glite/data/catalog/metadata/c/metadataStub.h>
+#include "internal.h"
+#include "env_internal.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Default number of seconds the information is used for */
+#define CACHE_TTL		3600
+
+#define CACHE_MAGIC		"# glite-catalog endpoint info v1"
+#define CACHE_LINE		4096
+
+/* A service property with an integer value */
+struct cache_prop {
+	char			*name;
+	int			value;
+};
+
+/* What is known about one endpoint */
+struct cache_entry {
+	char			*endpoint;
+	char			*version;
+	time_t			fetched;
+	int			nprops;
+	struct cache_prop	*props;
+	struct cache_entry	*next;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry *cache;
+static int cache_loaded;
+
+/**********************************************************************
+ * Local helper functions
+ */
+
+/* Number of seconds the information is used for, 0 disables the cache */
+static int cache_ttl(void)
+{
+	return _glite_env_int(GLITE_CATALOG_INFO_TTL_ENV, CACHE_TTL, 0);
+}
+
+/* File the cache is kept in, NULL if it lives in memory only */
+static const char *cache_path(void)
+{
+	const char *path;
+
+	path = getenv(GLITE_CATALOG_INFO_CACHE_ENV);
+	if (!path || !*path)
+		return NULL;
+	return path;
+}
+
+static void entry_free(struct cache_entry *entry)
+{
+	int i;
+
+	for (i = 0; i < entry->nprops; i++)
+		free(entry->props[i].name);
+	free(entry->props);
+	free(entry->version);
+	free(entry->endpoint);
+	free(entry);
+}
+
+/* Unlink the entry of an endpoint. Must be called with the lock held. */
+static struct cache_entry *entry_unlink(const char *endpoint)
+{
+	struct cache_entry **p, *entry;
+
+	for (p = &cache; (entry = *p); p = &entry->next)
+	{
+		if (!strcmp(entry->endpoint, endpoint))
+		{
+			*p = entry->next;
+			entry->next = NULL;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* Find the entry of an endpoint, dropping it if it is too old. Must be
+ * called with the lock held. */
+static struct cache_entry *entry_find(const char *endpoint, int ttl)
+{
+	struct cache_entry *entry;
+
+	for (entry = cache; entry; entry = entry->next)
+	{
+		if (strcmp(entry->endpoint, endpoint))
+			continue;
+		if (time(NULL) - entry->fetched < ttl)
+			return entry;
+		entry_free(entry_unlink(endpoint));
+		return NULL;
+	}
+	return NULL;
+}
+
+static int entry_set_prop(struct cache_entry *entry, const char *name,
+	int value)
+{
+	struct cache_prop *props;
+	int i;
+
+	for (i = 0; i < entry->nprops; i++)
+	{
+		if (!strcmp(entry->props[i].name, name))
+		{
+			entry->props[i].value = value;
+			return 0;
+		}
+	}
+
+	props = realloc(entry->props, (entry->nprops + 1) * sizeof(*props));
+	if (!props)
+		return -1;
+	entry->props = props;
+	props[entry->nprops].name = strdup(name);
+	if (!props[entry->nprops].name)
+		return -1;
+	props[entry->nprops].value = value;
+	entry->nprops++;
+	return 0;
+}
+
+/* Parse one line of the cache file:
+ *   endpoint <TAB> fetched <TAB> version [<TAB> name=value]... */
+static struct cache_entry *entry_parse(char *line)
+{
+	struct cache_entry *entry;
+	char *field, *save, *value, *end;
+	long fetched;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return NULL;
+
+	field = strtok_r(line, "\t", &save);
+	if (!field || !(entry->endpoint = strdup(field)))
+		goto fail;
+	field = strtok_r(NULL, "\t", &save);
+	if (!field)
+		goto fail;
+	fetched = strtol(field, &end, 10);
+	if (*end)
+		goto fail;
+	entry->fetched = (time_t)fetched;
+	field = strtok_r(NULL, "\t", &save);
+	if (!field || !(entry->version = strdup(field)))
+		goto fail;
+
+	while ((field = strtok_r(NULL, "\t", &save)))
+	{
+		value = strchr(field, '=');
+		if (!value)
+			goto fail;
+		*value++ = '\0';
+		if (entry_set_prop(entry, field, strtol(value, &end, 10)) || *end)
+			goto fail;
+	}
+	return entry;
+
+fail:
+	entry_free(entry);
+	return NULL;
+}
+
+/* Read the cache file once per process, before anything is added to the
+ * cache. Must be called with the lock held. */
+static void cache_load(void)
+{
+	struct cache_entry *entry;
+	char line[CACHE_LINE];
+	const char *path;
+	size_t len;
+	FILE *f;
+
+	if (cache_loaded)
+		return;
+	cache_loaded = 1;
+
+	path = cache_path();
+	if (!path)
+		return;
+	f = fopen(path, "r");
+	if (!f)
+		return;
+
+	if (!fgets(line, sizeof(line), f) ||
+		strncmp(line, CACHE_MAGIC "\n", sizeof(line)))
+	{
+		fclose(f);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), f))
+	{
+		len = strcspn(line, "\n");
+		if (line[len] != '\n')
+			break;
+		line[len] = '\0';
+
+		entry = entry_parse(line);
+		if (!entry)
+			continue;
+		entry->next = cache;
+		cache = entry;
+	}
+	fclose(f);
+}
+
+/* Write the cache file. Must be called with the lock held. */
+static void cache_save(void)
+{
+	struct cache_entry *entry;
+	const char *path;
+	char *tmp = NULL;
+	FILE *f;
+	int fd, i, res;
+
+	path = cache_path();
+	if (!path)
+		return;
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+		return;
+	fd = mkstemp(tmp);
+	if (fd < 0)
+	{
+		free(tmp);
+		return;
+	}
+	f = fdopen(fd, "w");
+	if (!f)
+	{
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return;
+	}
+
+	res = fprintf(f, "%s\n", CACHE_MAGIC) < 0;
+	for (entry = cache; entry && !res; entry = entry->next)
+	{
+		res = fprintf(f, "%s\t%ld\t%s", entry->endpoint,
+			(long)entry->fetched, entry->version) < 0;
+		for (i = 0; i < entry->nprops && !res; i++)
+			res = fprintf(f, "\t%s=%d", entry->props[i].name,
+				entry->props[i].value) < 0;
+		res |= fputc('\n', f) == EOF;
+	}
+	res |= fclose(f) != 0;
+
+	if (res || rename(tmp, path))
+		unlink(tmp);
+	free(tmp);
+}
+
+/**********************************************************************
+ * Internal interface functions
+ */
+
+int _glite_catalog_cache_get_version(const char *endpoint, char **version)
+{
+	struct cache_entry *entry;
+	int ttl, ret = -1;
+
+	ttl = cache_ttl();
+	if (ttl <= 0)
+		return -1;
+
+	pthread_mutex_lock(&cache_lock);
+	cache_load();
+	entry = entry_find(endpoint, ttl);
+	if (entry && (*version = strdup(entry->version)))
+		ret = 0;
+	pthread_mutex_unlock(&cache_lock);
+
+	return ret;
+}
+
+void _glite_catalog_cache_set_version(const char *endpoint,
+	const char *version)
+{
+	struct cache_entry *entry;
+
+	if (cache_ttl() <= 0)
+		return;
+
+	pthread_mutex_lock(&cache_lock);
+	cache_load();
+
+	/* A new version may come with new limits */
+	entry = entry_unlink(endpoint);
+	if (entry && strcmp(entry->version, version))
+	{
+		entry_free(entry);
+		entry = NULL;
+	}
+	if (!entry)
+	{
+		entry = calloc(1, sizeof(*entry));
+		if (!entry || !(entry->endpoint = strdup(endpoint)) ||
+			!(entry->version = strdup(version)))
+		{
+			if (entry)
+				entry_free(entry);
+			pthread_mutex_unlock(&cache_lock);
+			return;
+		}
+	}
+	entry->fetched = time(NULL);
+	entry->next = cache;
+	cache = entry;
+
+	cache_save();
+	pthread_mutex_unlock(&cache_lock);
+}
+
+int _glite_catalog_cache_get_prop(const char *endpoint, const char *name,
+	int *value)
+{
+	struct cache_entry *entry;
+	int ttl, i, ret = -1;
+
+	ttl = cache_ttl();
+	if (ttl <= 0)
+		return -1;
+
+	pthread_mutex_lock(&cache_lock);
+	cache_load();
+	entry = entry_find(endpoint, ttl);
+	for (i = 0; entry && i < entry->nprops; i++)
+	{
+		if (!strcmp(entry->props[i].name, name))
+		{
+			*value = entry->props[i].value;
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	return ret;
+}
+
+void _glite_catalog_cache_set_prop(const char *endpoint, const char *name,
+	int value)
+{
+	struct cache_entry *entry;
+	int ttl;
+
+	ttl = cache_ttl();
+	if (ttl <= 0)
+		return;
+
+	/* Properties are only kept together with the version they belong to */
+	pthread_mutex_lock(&cache_lock);
+	cache_load();
+	entry = entry_find(endpoint, ttl);
+	if (entry && !entry_set_prop(entry, name, value))
+		cache_save();
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void _glite_catalog_cache_invalidate(const char *endpoint)
+{
+	struct cache_entry *entry;
+
+	pthread_mutex_lock(&cache_lock);
+	cache_load();
+	entry = entry_unlink(endpoint);
+	if (entry)
+	{
+		entry_free(entry);
+		cache_save();
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
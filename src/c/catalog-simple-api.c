@@ -31,6 +31,9 @@
 #include <config.h>
 #endif
 
+#include <stdlib.h>
+#include <time.h>
+
 #include <glite/data/catalog/c/catalog-simple.h>
 
 #include <cgsi_plugin.h>
@@ -39,13 +42,42 @@
 
 #include <glite/data/catalog/metadata/c/metadataStub.h>
 #include "internal.h"
+#include "env_internal.h"
+
+/* Default time limits of the calls, in seconds */
+#define CONNECT_TIMEOUT		30
+#define IO_TIMEOUT		300
+
+/* gSOAP takes negative timeouts as microseconds; longer limits than this
+ * are given in seconds so that they do not overflow */
+#define MAX_USEC_TIMEOUT	1000
 
 /**********************************************************************
  * Local helper functions
  */
 
-/* Convert the SOAP fault to an error message */
-void _glite_catalog_fault_to_error(glite_catalog_ctx *ctx, const char *method)
+/* Current time in seconds, not affected by clock changes */
+static double now_monotonic(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Convert a time limit to the gSOAP format */
+static int timeout_to_soap(double seconds)
+{
+	if (seconds >= MAX_USEC_TIMEOUT)
+		return (int)seconds;
+	/* 0 would mean no limit at all */
+	if (seconds < 1e-6)
+		return -1;
+	return -(int)(seconds * 1e6);
+}
+
+/* Decode the SOAP fault into an error message */
+static void decode_fault(glite_catalog_ctx *ctx, const char *method)
 {
 	const char **code, **string, **detail;
 
@@ -142,6 +174,74 @@ void _glite_catalog_fault_to_error(glite_catalog_ctx *ctx, const char *method)
 	soap_end(ctx->soap);
 }
 
+/* Convert the SOAP fault to an error message */
+void _glite_catalog_fault_to_error(glite_catalog_ctx *ctx, const char *method)
+{
+	int connection_error;
+
+	/* Anything but a fault sent by the service means the request (or its
+	 * answer) was lost on the way */
+	connection_error = ctx->soap->error == SOAP_EOF ||
+		ctx->soap->error == SOAP_TCP_ERROR ||
+		ctx->soap->error == SOAP_SSL_ERROR ||
+		ctx->soap->error == SOAP_HTTP_ERROR;
+
+	/* The service may have been replaced by another version */
+	if (ctx->soap->error == SOAP_VERSIONMISMATCH ||
+		ctx->soap->error == SOAP_NO_METHOD)
+		_glite_catalog_cache_invalidate(ctx->endpoint);
+
+	decode_fault(ctx, method);
+
+	/* A transport failure after the time limit of the call is a
+	 * timeout, the way gSOAP reports it varies */
+	if (connection_error && ctx->call_limit > 0 &&
+		now_monotonic() - ctx->call_start >= ctx->call_limit - 1e-3)
+		glite_catalog_set_error(ctx, GLITE_CATALOG_ERROR_TIMEOUT,
+			"%s: timed out after %.3f seconds (%s)", method,
+			now_monotonic() - ctx->call_start,
+			glite_catalog_get_error(ctx));
+
+	ctx->connection_error = connection_error;
+}
+
+int _glite_catalog_begin_call(glite_catalog_ctx *ctx)
+{
+	double connect_limit, io_limit, left;
+
+	ctx->call_start = now_monotonic();
+	connect_limit = ctx->connect_timeout;
+	io_limit = ctx->io_timeout;
+
+	if (ctx->deadline > 0)
+	{
+		left = ctx->deadline - ctx->call_start;
+		if (left <= 0)
+		{
+			glite_catalog_set_error(ctx, GLITE_CATALOG_ERROR_TIMEOUT,
+				"Deadline passed before the request was sent");
+			ctx->connection_error = 1;
+			return -1;
+		}
+		/* Connecting must leave time for the call itself */
+		if (!connect_limit || connect_limit > left / 2)
+			connect_limit = left / 2;
+		if (!io_limit || io_limit > left)
+			io_limit = left;
+	}
+
+	ctx->soap->connect_timeout =
+		connect_limit ? timeout_to_soap(connect_limit) : 0;
+	ctx->soap->send_timeout = io_limit ? timeout_to_soap(io_limit) : 0;
+	ctx->soap->recv_timeout = ctx->soap->send_timeout;
+
+	if (connect_limit && (!io_limit || connect_limit < io_limit))
+		ctx->call_limit = connect_limit;
+	else
+		ctx->call_limit = io_limit;
+	return 0;
+}
+
 /* Check if this is a http:// URL */
 static int is_http(const char *url)
 {
@@ -190,6 +290,13 @@ glite_catalog_ctx *glite_catalog_new(const char *endpoint)
 		return NULL;
 	}
 
+	/* A service that does not answer must not block the caller for
+	 * the TCP timeout of the kernel */
+	ctx->connect_timeout = _glite_env_int(
+		GLITE_CATALOG_CONNECT_TIMEOUT_ENV, CONNECT_TIMEOUT, 0);
+	ctx->io_timeout = _glite_env_int(GLITE_CATALOG_TIMEOUT_ENV,
+		IO_TIMEOUT, 0);
+
 	/* reset permissions */
 	ctx->defaultUserPerm = GLITE_CATALOG_DEFAULT_USERPERM;
 	ctx->defaultGroupPerm = GLITE_CATALOG_DEFAULT_GROUPPERM;
@@ -224,15 +331,57 @@ void glite_catalog_free(glite_catalog_ctx *ctx)
 	{
 		soap_destroy(ctx->soap);
 		soap_end(ctx->soap);
+		/* Closes a kept-alive connection */
+		soap_done(ctx->soap);
 		free(ctx->soap);
 	}
 	free(ctx);
 }
 
+void glite_catalog_set_keepalive(glite_catalog_ctx *ctx, int enable)
+{
+	if (!ctx)
+		return;
+
+	ctx->keepalive = enable;
+	if (enable)
+	{
+		soap_set_imode(ctx->soap, SOAP_IO_KEEPALIVE);
+		soap_set_omode(ctx->soap, SOAP_IO_KEEPALIVE);
+	}
+	else
+	{
+		soap_clr_imode(ctx->soap, SOAP_IO_KEEPALIVE);
+		soap_clr_omode(ctx->soap, SOAP_IO_KEEPALIVE);
+	}
+}
+
+void glite_catalog_set_timeout(glite_catalog_ctx *ctx, int seconds)
+{
+	if (!ctx || seconds < 0)
+		return;
+
+	/* Applied by the next call */
+	ctx->connect_timeout = seconds;
+	ctx->io_timeout = seconds;
+}
+
+void glite_catalog_set_deadline(glite_catalog_ctx *ctx,
+	const struct timespec *deadline)
+{
+	if (!ctx)
+		return;
+
+	if (deadline)
+		ctx->deadline = deadline->tv_sec + deadline->tv_nsec / 1e9;
+	else
+		ctx->deadline = 0;
+}
+
 int _glite_catalog_init_endpoint(glite_catalog_ctx *ctx,
 		struct Namespace *namespaces, const char *sd_type)
 {
-	int ret;
+	int ret, flags;
 
 	if (!ctx)
 		return -1;
@@ -259,13 +408,16 @@ int _glite_catalog_init_endpoint(glite_catalog_ctx *ctx,
 	}
 
 	/* Register the CGSI plugin if secure communication is requested */
+	flags = CGSI_OPT_DISABLE_NAME_CHECK;
+#ifdef CGSI_OPT_KEEP_ALIVE
+	if (ctx->keepalive)
+		flags |= CGSI_OPT_KEEP_ALIVE;
+#endif
 	if (is_https(ctx->endpoint))
 		ret = soap_cgsi_init(ctx->soap,
-			CGSI_OPT_DISABLE_NAME_CHECK |
-			CGSI_OPT_SSL_COMPATIBLE);
+			flags | CGSI_OPT_SSL_COMPATIBLE);
 	else if (is_httpg(ctx->endpoint))
-		ret = soap_cgsi_init(ctx->soap,
-			CGSI_OPT_DISABLE_NAME_CHECK);
+		ret = soap_cgsi_init(ctx->soap, flags);
 	else
 		ret = 0;
 	if (ret)
@@ -316,6 +468,13 @@ glite_catalog_errclass glite_catalog_get_errclass(glite_catalog_ctx *ctx)
 	return ctx->errclass;
 }
 
+int glite_catalog_is_connection_error(glite_catalog_ctx *ctx)
+{
+	if (!ctx)
+		return 0;
+	return ctx->connection_error;
+}
+
 void glite_catalog_set_verror(glite_catalog_ctx *ctx,
 	glite_catalog_errclass errclass, const char *fmt, va_list ap)
 {
@@ -331,6 +490,7 @@ void glite_catalog_set_verror(glite_catalog_ctx *ctx,
 	ctx->last_error = strdup(buf);
 
 	ctx->errclass = errclass;
+	ctx->connection_error = 0;
 }
 
 void glite_catalog_set_error(glite_catalog_ctx *ctx,
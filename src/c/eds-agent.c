@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  GLite Data Management - Requests sent to the key agent of the
+ *  encrypted data storage API, and their handling in the agent
+ *
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
+#include <glite/data/hydra/c/eds-simple.h>
+
+#include "eds_internal.h"
+
+/* A message is a field count followed by the fields, each of them a
+ * length and the bytes; all numbers are 32 bit, big endian. The first
+ * field of a request is the operation, the first field of an answer the
+ * status. A request made within a time budget ends with one more field,
+ * the milliseconds left. */
+#define EDS_AGENT_MAX_FIELDS    8
+#define EDS_AGENT_MAX_FIELD     65536
+
+#define EDS_AGENT_OK            "ok"
+#define EDS_AGENT_MISSING       "missing"
+#define EDS_AGENT_ERROR         "error"
+
+/* Seconds an answer of the agent is waited for without a deadline, and
+ * seconds the agent waits for the next request of a client */
+#define EDS_AGENT_TIMEOUT       300
+
+/* agent_connect(): the socket is served by another user */
+#define EDS_AGENT_FOREIGN       (-2)
+
+/**
+ * Helper function - write a whole buffer, without dying of SIGPIPE
+ */
+static int agent_write(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len)
+    {
+        n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Helper function - read a whole buffer. Returns 1 at the end of the
+ * stream before the first byte, -1 on other errors.
+ */
+static int agent_read(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len)
+    {
+        n = read(fd, p + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0 && !done)
+            return 1;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * Helper function - send a message
+ */
+static int agent_send(int fd, int nfields, const char * const fields[])
+{
+    uint32_t len;
+    int i;
+
+    len = htonl(nfields);
+    if (agent_write(fd, &len, sizeof(len)))
+        return -1;
+    for (i = 0; i < nfields; i++)
+    {
+        len = htonl(strlen(fields[i]));
+        if (agent_write(fd, &len, sizeof(len)) ||
+            agent_write(fd, fields[i], strlen(fields[i])))
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Helper function - wipe and free the fields of a message
+ */
+static void agent_free(int nfields, char **fields)
+{
+    int i;
+
+    for (i = 0; i < nfields; i++)
+    {
+        if (!fields[i])
+            continue;
+        OPENSSL_cleanse(fields[i], strlen(fields[i]));
+        free(fields[i]);
+    }
+}
+
+/**
+ * Helper function - receive a message of at most EDS_AGENT_MAX_FIELDS
+ * fields. Returns the number of fields, 0 at the end of the stream and -1
+ * on errors.
+ */
+static int agent_recv(int fd, char **fields)
+{
+    uint32_t len;
+    int i, nfields, res;
+
+    res = agent_read(fd, &len, sizeof(len));
+    if (res)
+        return res > 0 ? 0 : -1;
+    nfields = ntohl(len);
+    if (nfields < 1 || nfields > EDS_AGENT_MAX_FIELDS)
+        return -1;
+
+    for (i = 0; i < nfields; i++)
+    {
+        if (agent_read(fd, &len, sizeof(len)))
+            break;
+        len = ntohl(len);
+        if (len > EDS_AGENT_MAX_FIELD)
+            break;
+        fields[i] = (char *)malloc(len + 1);
+        if (!fields[i])
+            break;
+        if (agent_read(fd, fields[i], len))
+        {
+            free(fields[i]);
+            break;
+        }
+        fields[i][len] = '\0';
+    }
+    if (i < nfields)
+    {
+        agent_free(i, fields);
+        return -1;
+    }
+    return nfields;
+}
+
+/**
+ * Helper function - connect to the agent of the environment. Returns -1
+ * if there is none, or it can not be reached, and EDS_AGENT_FOREIGN if it
+ * is not run by the same user: the keys are not handed to it.
+ */
+static int agent_connect(void)
+{
+    struct sockaddr_un addr;
+    const char *path;
+    int fd;
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+#endif
+
+    path = getenv(GLITE_EDS_AGENT_SOCK_ENV);
+    if (!path || !*path || strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        close(fd);
+        return -1;
+    }
+#ifdef SO_PEERCRED
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) ||
+        cred.uid != getuid())
+    {
+        close(fd);
+        return EDS_AGENT_FOREIGN;
+    }
+#endif
+    return fd;
+}
+
+/**
+ * Helper function - send a request to the agent and wait for the answer,
+ * within the deadline of the thread. Returns EDS_AGENT_ABSENT if no agent
+ * could be reached, -1 if the request failed, 0 with the number of fields
+ * of the answer in *nresp otherwise.
+ */
+static int agent_call(int nreq, const char * const req[], char **resp,
+    int *nresp_p, char **error)
+{
+    const char *fields[EDS_AGENT_MAX_FIELDS];
+    char budget[16];
+    struct timeval tv;
+    double left;
+    int fd, nresp, i;
+
+    fd = agent_connect();
+    if (fd == EDS_AGENT_FOREIGN)
+    {
+        asprintf(error, "glite_eds agent error: %s is served by another "
+            "user", getenv(GLITE_EDS_AGENT_SOCK_ENV));
+        return -1;
+    }
+    if (fd < 0)
+        return EDS_AGENT_ABSENT;
+
+    /* The agent gets the time left, and its answer is not waited for
+     * longer; without a deadline a hung agent is given up after
+     * EDS_AGENT_TIMEOUT */
+    for (i = 0; i < nreq; i++)
+        fields[i] = req[i];
+    left = _glite_eds_deadline_left(_glite_eds_deadline_get());
+    if (left >= 0)
+    {
+        if (left < 1e-3)
+            left = 1e-3;
+        snprintf(budget, sizeof(budget), "%d", (int)(left * 1000));
+        fields[nreq++] = budget;
+    }
+    else
+        left = EDS_AGENT_TIMEOUT;
+    tv.tv_sec = (time_t)left;
+    tv.tv_usec = (long)((left - tv.tv_sec) * 1e6);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    nresp = -1;
+    if (!agent_send(fd, nreq, fields))
+        nresp = agent_recv(fd, resp);
+    close(fd);
+
+    /* The request may have been done, it is not sent again */
+    if (nresp < 1)
+    {
+        if (_glite_eds_deadline_passed(_glite_eds_deadline_get()))
+            _glite_eds_deadline_timed_out();
+        asprintf(error, "glite_eds agent error: no answer to '%s' from %s",
+            req[0], getenv(GLITE_EDS_AGENT_SOCK_ENV));
+        return -1;
+    }
+    if (strcmp(resp[0], EDS_AGENT_OK) && nresp < 2)
+    {
+        agent_free(nresp, resp);
+        asprintf(error, "glite_eds agent error: malformed answer to '%s'",
+            req[0]);
+        return -1;
+    }
+    *nresp_p = nresp;
+    return 0;
+}
+
+/**
+ * Helper function - status of a simple answer, takes over its error
+ */
+static int agent_status(int nresp, char **resp, char **error)
+{
+    int res = 0;
+
+    if (strcmp(resp[0], EDS_AGENT_OK))
+    {
+        *error = resp[1];
+        resp[1] = NULL;
+        res = -1;
+    }
+    agent_free(nresp, resp);
+    return res;
+}
+
+int _glite_eds_agent_get(const char *id, char **hex_key, char **hex_iv,
+    char **cipher, char **keyinfo, int *missing, char **error)
+{
+    const char *req[] = {"get", id};
+    char *resp[EDS_AGENT_MAX_FIELDS];
+    int res, nresp;
+
+    *missing = 0;
+    res = agent_call(2, req, resp, &nresp, error);
+    if (res)
+        return res;
+
+    if (!strcmp(resp[0], EDS_AGENT_OK))
+    {
+        if (nresp != 5)
+        {
+            agent_free(nresp, resp);
+            asprintf(error, "glite_eds agent error: malformed answer to 'get'");
+            return -1;
+        }
+        /* The strings go to the caller, who does not wipe them either */
+        *hex_key = resp[1];
+        *hex_iv = resp[2];
+        *cipher = resp[3];
+        *keyinfo = resp[4];
+        free(resp[0]);
+        return 0;
+    }
+
+    *missing = !strcmp(resp[0], EDS_AGENT_MISSING);
+    return agent_status(nresp, resp, error);
+}
+
+int _glite_eds_agent_put(const char *id, const char *hex_key,
+    const char *hex_iv, const char *cipher, const char *keyinfo,
+    char **error)
+{
+    const char *req[] = {"put", id, hex_key, hex_iv, cipher, keyinfo};
+    char *resp[EDS_AGENT_MAX_FIELDS];
+    int res, nresp;
+
+    res = agent_call(6, req, resp, &nresp, error);
+    if (res)
+        return res;
+    return agent_status(nresp, resp, error);
+}
+
+int _glite_eds_agent_unregister(const char *id, char **error)
+{
+    const char *req[] = {"unregister", id};
+    char *resp[EDS_AGENT_MAX_FIELDS];
+    int res, nresp;
+
+    res = agent_call(2, req, resp, &nresp, error);
+    if (res)
+        return res;
+    return agent_status(nresp, resp, error);
+}
+
+/**
+ * Helper function - do one request in the agent and send the answer
+ */
+static int agent_handle(int fd, int nreq, char **req)
+{
+    const char *resp[5];
+    char *hex_key, *hex_iv, *cipher, *keyinfo, *error = NULL;
+    int res, missing = 0, nresp, timeout_ms = 0, key = 0;
+    double previous;
+
+    /* The client may give the milliseconds left */
+    if ((!strcmp(req[0], "get") && nreq == 3) ||
+        (!strcmp(req[0], "put") && nreq == 7) ||
+        (!strcmp(req[0], "unregister") && nreq == 3))
+    {
+        timeout_ms = atoi(req[--nreq]);
+        if (timeout_ms < 1)
+            timeout_ms = 1;
+    }
+
+    previous = _glite_eds_deadline_begin(timeout_ms);
+    if (!strcmp(req[0], "get") && nreq == 2)
+    {
+        res = _glite_eds_key_get(req[1], &hex_key, &hex_iv, &cipher,
+            &keyinfo, &missing, &error);
+        key = !res;
+    }
+    else if (!strcmp(req[0], "put") && nreq == 6)
+        res = _glite_eds_key_put(req[1], req[2], req[3], req[4], req[5],
+            &error);
+    else if (!strcmp(req[0], "unregister") && nreq == 2)
+        res = glite_eds_unregister(req[1], &error);
+    else
+    {
+        res = -1;
+        asprintf(&error, "glite_eds agent error: unknown request '%s'", req[0]);
+    }
+    _glite_eds_deadline_end(previous, res);
+
+    if (key)
+    {
+        resp[0] = EDS_AGENT_OK;
+        resp[1] = hex_key;
+        resp[2] = hex_iv;
+        resp[3] = cipher;
+        resp[4] = keyinfo;
+        res = agent_send(fd, 5, resp);
+        OPENSSL_cleanse(hex_key, strlen(hex_key));
+        free(hex_key); free(hex_iv); free(cipher); free(keyinfo);
+        return res;
+    }
+
+    nresp = 1;
+    resp[0] = EDS_AGENT_OK;
+    if (res)
+    {
+        resp[0] = missing ? EDS_AGENT_MISSING : EDS_AGENT_ERROR;
+        resp[1] = error ? error : "glite_eds agent error: unknown error";
+        nresp = 2;
+    }
+    res = agent_send(fd, nresp, resp);
+    free(error);
+    return res;
+}
+
+/**
+ * Serve the requests of one client of the agent
+ */
+int glite_eds_agent_serve(int fd, char **error)
+{
+    char *req[EDS_AGENT_MAX_FIELDS];
+    struct timeval tv;
+    int nreq, res;
+
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    /* The socket may be reachable by others, the keys are not */
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) ||
+        cred.uid != getuid())
+    {
+        asprintf(error, "glite_eds_agent_serve error: connection from "
+            "another user refused");
+        return -1;
+    }
+#endif
+
+    if (glite_eds_library_init(error))
+        return -1;
+
+    /* An idle or stuck client does not keep its slot in the agent */
+    tv.tv_sec = EDS_AGENT_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    for (;;)
+    {
+        errno = 0;
+        nreq = agent_recv(fd, req);
+        if (!nreq)
+            return 0;
+        if (nreq < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            asprintf(error, "glite_eds_agent_serve error: no request for %d "
+                "seconds", EDS_AGENT_TIMEOUT);
+            return -1;
+        }
+        if (nreq < 0)
+        {
+            asprintf(error, "glite_eds_agent_serve error: malformed request");
+            return -1;
+        }
+        res = agent_handle(fd, nreq, req);
+        agent_free(nreq, req);
+        if (res)
+        {
+            asprintf(error, "glite_eds_agent_serve error: %s", strerror(errno));
+            return -1;
+        }
+    }
+}
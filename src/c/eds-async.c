@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  GLite Data Management - Asynchronous context initialization of the
+ *  encrypted data storage API
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glite/data/hydra/c/eds-simple.h>
+
+#include "eds_internal.h"
+
+/* Threads running the operations by default */
+#define EDS_ASYNC_THREADS       32
+
+enum eds_op_type {
+    EDS_OP_DECRYPT_INIT,
+    EDS_OP_ENCRYPT_INIT,
+    EDS_OP_REGISTER_ENCRYPT_INIT
+};
+
+struct glite_eds_op {
+    int refs;                   /* the caller and the queue/running thread */
+    int done;
+    int fds[2];                 /* readable end becomes ready when done */
+
+    enum eds_op_type type;
+    char *id;
+    char *cipher;
+    int keysize;
+    glite_eds_op_callback callback;
+    void *arg;
+
+    EVP_CIPHER_CTX *ctx;        /* result, until taken by the caller */
+    char *error;
+
+    struct glite_eds_op *next;  /* in the queue */
+};
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_stopped = PTHREAD_COND_INITIALIZER;
+static struct glite_eds_op *queue_first, *queue_last;
+static int nqueued, nthreads, nidle, stopping;
+
+/**
+ * Helper function - free an operation once nobody refers to it. Must be
+ * called with the lock held.
+ */
+static void op_release(glite_eds_op *op)
+{
+    char *error;
+
+    if (--op->refs > 0)
+        return;
+
+    if (op->ctx)
+        glite_eds_finalize(op->ctx, &error);
+    if (op->fds[0] >= 0)
+        close(op->fds[0]);
+    if (op->fds[1] >= 0)
+        close(op->fds[1]);
+    free(op->id);
+    free(op->cipher);
+    free(op->error);
+    free(op);
+}
+
+/**
+ * Helper function - do the blocking call of an operation
+ */
+static void op_run(glite_eds_op *op)
+{
+    EVP_CIPHER_CTX *ctx = NULL;
+    char *error = NULL;
+
+    switch (op->type)
+    {
+        case EDS_OP_DECRYPT_INIT:
+            ctx = glite_eds_decrypt_init(op->id, &error);
+            break;
+        case EDS_OP_ENCRYPT_INIT:
+            ctx = glite_eds_encrypt_init(op->id, &error);
+            break;
+        case EDS_OP_REGISTER_ENCRYPT_INIT:
+            ctx = glite_eds_register_encrypt_init(op->id, op->cipher,
+                op->keysize, &error);
+            break;
+    }
+
+    pthread_mutex_lock(&async_lock);
+    op->ctx = ctx;
+    op->error = ctx ? NULL : error;
+    if (ctx)
+        free(error);
+    op->done = 1;
+    pthread_mutex_unlock(&async_lock);
+
+    /* The pipe is never full: it gets a single byte */
+    while (write(op->fds[1], "", 1) < 0 && errno == EINTR)
+        ;
+
+    if (op->callback)
+        op->callback(op, op->arg);
+}
+
+/**
+ * Helper function - main loop of the threads: run the queued operations,
+ * then wait for new ones until the library is cleaned up
+ */
+static void *async_main(void *arg)
+{
+    glite_eds_op *op;
+
+    (void)arg;
+    pthread_mutex_lock(&async_lock);
+    for (;;)
+    {
+        while (!queue_first && !stopping)
+        {
+            nidle++;
+            pthread_cond_wait(&async_queued, &async_lock);
+            nidle--;
+        }
+        if (!queue_first)
+            break;
+
+        op = queue_first;
+        queue_first = op->next;
+        if (!queue_first)
+            queue_last = NULL;
+        nqueued--;
+        pthread_mutex_unlock(&async_lock);
+
+        op_run(op);
+
+        pthread_mutex_lock(&async_lock);
+        op_release(op);
+    }
+    if (--nthreads == 0)
+        pthread_cond_broadcast(&async_stopped);
+    pthread_mutex_unlock(&async_lock);
+
+    return NULL;
+}
+
+/**
+ * Helper function - create and queue an operation
+ */
+static glite_eds_op *op_start(enum eds_op_type type, const char *func,
+    char *id, char *cipher, int keysize, glite_eds_op_callback callback,
+    void *arg, char **error)
+{
+    glite_eds_op *op;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int res = 0;
+
+    if (glite_eds_library_init(error))
+        return NULL;
+
+    op = (glite_eds_op *)calloc(1, sizeof(*op));
+    if (!op)
+    {
+        asprintf(error, "%s error: out of memory", func);
+        return NULL;
+    }
+    op->fds[0] = op->fds[1] = -1;
+    op->type = type;
+    op->keysize = keysize;
+    op->callback = callback;
+    op->arg = arg;
+    op->id = strdup(id);
+    op->cipher = cipher ? strdup(cipher) : NULL;
+    if (!op->id || (cipher && !op->cipher))
+    {
+        asprintf(error, "%s error: out of memory", func);
+        op->refs = 1;
+        op_release(op);
+        return NULL;
+    }
+    if (pipe(op->fds) ||
+        fcntl(op->fds[0], F_SETFL, O_NONBLOCK) ||
+        fcntl(op->fds[0], F_SETFD, FD_CLOEXEC) ||
+        fcntl(op->fds[1], F_SETFD, FD_CLOEXEC))
+    {
+        asprintf(error, "%s error: pipe() failed: %s", func, strerror(errno));
+        op->refs = 1;
+        op_release(op);
+        return NULL;
+    }
+    op->refs = 2;
+
+    pthread_mutex_lock(&async_lock);
+    if (queue_last)
+        queue_last->next = op;
+    else
+        queue_first = op;
+    queue_last = op;
+    nqueued++;
+
+    /* The idle threads may already be promised to earlier operations */
+    if (nidle > 0)
+        pthread_cond_signal(&async_queued);
+    if (nqueued > nidle && nthreads < _glite_env_int(
+        GLITE_EDS_ASYNC_THREADS_ENV, EDS_ASYNC_THREADS, 1))
+    {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        res = pthread_create(&thread, &attr, async_main, NULL);
+        pthread_attr_destroy(&attr);
+        if (!res)
+            nthreads++;
+    }
+
+    /* Without any thread to run it the operation would never finish */
+    if (res && !nthreads)
+    {
+        queue_first = queue_last = NULL;
+        nqueued = 0;
+        op->refs = 1;
+        op_release(op);
+        pthread_mutex_unlock(&async_lock);
+        asprintf(error, "%s error: cannot start a thread", func);
+        return NULL;
+    }
+    pthread_mutex_unlock(&async_lock);
+
+    return op;
+}
+
+glite_eds_op *glite_eds_decrypt_init_async(char *id,
+    glite_eds_op_callback callback, void *arg, char **error)
+{
+    return op_start(EDS_OP_DECRYPT_INIT, "glite_eds_decrypt_init_async", id,
+        NULL, 0, callback, arg, error);
+}
+
+glite_eds_op *glite_eds_encrypt_init_async(char *id,
+    glite_eds_op_callback callback, void *arg, char **error)
+{
+    return op_start(EDS_OP_ENCRYPT_INIT, "glite_eds_encrypt_init_async", id,
+        NULL, 0, callback, arg, error);
+}
+
+glite_eds_op *glite_eds_register_encrypt_init_async(char *id, char *cipher,
+    int keysize, glite_eds_op_callback callback, void *arg, char **error)
+{
+    return op_start(EDS_OP_REGISTER_ENCRYPT_INIT,
+        "glite_eds_register_encrypt_init_async", id, cipher, keysize,
+        callback, arg, error);
+}
+
+int glite_eds_op_fd(glite_eds_op *op)
+{
+    return op->fds[0];
+}
+
+int glite_eds_op_done(glite_eds_op *op)
+{
+    int done;
+
+    pthread_mutex_lock(&async_lock);
+    done = op->done;
+    pthread_mutex_unlock(&async_lock);
+
+    return done;
+}
+
+int glite_eds_op_wait(glite_eds_op *op, int timeout_ms)
+{
+    struct pollfd pfd;
+    int res;
+
+    pfd.fd = op->fds[0];
+    pfd.events = POLLIN;
+    do
+    {
+        res = poll(&pfd, 1, timeout_ms);
+    } while (res < 0 && errno == EINTR);
+
+    return glite_eds_op_done(op) ? 0 : 1;
+}
+
+EVP_CIPHER_CTX *glite_eds_op_result(glite_eds_op *op, char **error)
+{
+    EVP_CIPHER_CTX *ctx;
+
+    pthread_mutex_lock(&async_lock);
+    if (!op->done)
+    {
+        pthread_mutex_unlock(&async_lock);
+        asprintf(error, "glite_eds_op_result error: the operation is still "
+            "running");
+        return NULL;
+    }
+    ctx = op->ctx;
+    op->ctx = NULL;
+    if (!ctx)
+    {
+        if (op->error)
+            *error = strdup(op->error);
+        else
+            asprintf(error, "glite_eds_op_result error: the result was "
+                "already taken");
+    }
+    pthread_mutex_unlock(&async_lock);
+
+    return ctx;
+}
+
+void glite_eds_op_free(glite_eds_op *op)
+{
+    if (!op)
+        return;
+
+    pthread_mutex_lock(&async_lock);
+    op_release(op);
+    pthread_mutex_unlock(&async_lock);
+}
+
+void _glite_eds_async_cleanup(void)
+{
+    pthread_mutex_lock(&async_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&async_queued);
+    while (nthreads > 0)
+        pthread_cond_wait(&async_stopped, &async_lock);
+    stopping = 0;
+    pthread_mutex_unlock(&async_lock);
+}
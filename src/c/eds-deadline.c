@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  GLite Data Management - Time budget of the key store requests of the
+ *  encrypted data storage API
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <glite/data/catalog/c/catalog-simple.h>
+#include <glite/data/hydra/c/eds-simple.h>
+
+#include "eds_internal.h"
+
+/* The deadline of the operation the thread is doing, 0 if there is none;
+ * the threads working for it get a copy */
+static __thread double eds_deadline;
+/* A request of that operation has run out of time */
+static __thread int eds_timed_out;
+
+/**
+ * Helper function - current time in seconds, not affected by clock changes
+ */
+static double deadline_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int _glite_eds_default_timeout(void)
+{
+    int res;
+
+    res = _glite_env_int(GLITE_EDS_TIMEOUT_ENV, 0, 1);
+    if (res > 86400)
+        return 0;
+    return res * 1000;
+}
+
+double _glite_eds_deadline_get(void)
+{
+    return eds_deadline;
+}
+
+double _glite_eds_deadline_set(double deadline)
+{
+    double previous = eds_deadline;
+
+    eds_deadline = deadline;
+    return previous;
+}
+
+double _glite_eds_deadline_begin(int timeout_ms)
+{
+    double previous = eds_deadline;
+
+    /* A budget never extends the one of the caller */
+    eds_deadline = _glite_eds_deadline_within(timeout_ms);
+    if (!previous)
+        eds_timed_out = 0;
+    return previous;
+}
+
+double _glite_eds_deadline_within(int timeout_ms)
+{
+    double deadline;
+
+    if (timeout_ms <= 0)
+        return eds_deadline;
+    deadline = deadline_now() + timeout_ms / 1000.0;
+    if (eds_deadline && eds_deadline < deadline)
+        return eds_deadline;
+    return deadline;
+}
+
+void _glite_eds_deadline_end(double previous, int failed)
+{
+    if (failed && (eds_timed_out || _glite_eds_deadline_passed(eds_deadline)))
+        errno = ETIMEDOUT;
+    eds_deadline = previous;
+    if (!previous)
+        eds_timed_out = 0;
+}
+
+void _glite_eds_deadline_timed_out(void)
+{
+    eds_timed_out = 1;
+}
+
+int _glite_eds_deadline_passed(double deadline)
+{
+    return deadline > 0 && deadline_now() >= deadline;
+}
+
+double _glite_eds_deadline_left(double deadline)
+{
+    double left;
+
+    if (deadline <= 0)
+        return -1;
+    left = deadline - deadline_now();
+    return left > 0 ? left : 0;
+}
+
+void _glite_eds_deadline_apply(glite_catalog_ctx *ctx, double deadline)
+{
+    struct timespec ts;
+
+    if (deadline <= 0)
+    {
+        glite_catalog_set_deadline(ctx, NULL);
+        return;
+    }
+    ts.tv_sec = (time_t)deadline;
+    ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1e9);
+    glite_catalog_set_deadline(ctx, &ts);
+}
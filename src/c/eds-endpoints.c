@@ -0,0 +1,812 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  GLite Data Management - Key store endpoint discovery of the encrypted
+ *  data storage API
+ *
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <glite/data/glite-util.h>
+#include <glite/data/hydra/c/eds-simple.h>
+#include <glite/data/catalog/c/catalog-simple.h>
+#include <glite/data/catalog/metadata/c/metadata-simple.h>
+#include <ServiceDiscovery.h>
+
+#include "eds_internal.h"
+
+/* Seconds a discovered endpoint list is used for */
+#define EDS_ENDPOINT_TTL 300
+
+/* Seconds the result of a liveness check is used for */
+#define EDS_PROBE_TTL 60
+/* Seconds a liveness check may wait for an endpoint */
+#define EDS_PROBE_TIMEOUT 5
+
+/* Cache file, relative to the home directory */
+#define EDS_ENDPOINT_CACHE_DIR  ".glite"
+#define EDS_ENDPOINT_CACHE_FILE ".glite/eds-endpoints"
+
+/* First line of the cache file */
+#define EDS_ENDPOINT_CACHE_MAGIC "# glite-eds endpoint cache v1"
+
+/* Longest line accepted in the cache file */
+#define EDS_ENDPOINT_LINE 4096
+
+/* Serializes the calls into the service discovery library */
+static pthread_mutex_t sd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The current endpoint list. While one thread discovers, concurrent
+ * callers wait for its result instead of discovering again. */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_done = PTHREAD_COND_INITIALIZER;
+static _glite_eds_endpoints *current;
+static int discovering;
+
+/* Result of the last liveness check of an endpoint */
+struct eds_probe_entry {
+    char *endpoint;
+    int alive;
+    time_t checked;
+    struct eds_probe_entry *next;
+};
+
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct eds_probe_entry *probes;
+
+/* Liveness check of one endpoint, run by a worker */
+struct eds_probe_job {
+    const char *endpoint;
+    double deadline;
+    int alive;
+};
+
+/**
+ * Helper function - the service type looked up
+ */
+static const char *sd_type_get(void)
+{
+    const char *sd_type;
+
+    sd_type = getenv(GLITE_METADATA_SD_ENV);
+    if (!sd_type) sd_type = GLITE_METADATA_SD_TYPE;
+    return sd_type;
+}
+
+/**
+ * Helper function - path of the cache file, NULL if there is none.
+ * *is_default tells if it is the one in the home directory.
+ */
+static char *cache_path(int *is_default)
+{
+    const char *value, *home;
+    char *path = NULL;
+
+    *is_default = 0;
+    value = getenv(GLITE_EDS_ENDPOINT_CACHE_ENV);
+    if (value)
+        return *value ? strdup(value) : NULL;
+
+    home = getenv("HOME");
+    if (!home || !*home)
+        return NULL;
+    if (asprintf(&path, "%s/%s", home, EDS_ENDPOINT_CACHE_FILE) < 0)
+        return NULL;
+    *is_default = 1;
+    return path;
+}
+
+/**
+ * Helper function - allocate a list of count endpoints
+ */
+static _glite_eds_endpoints *list_new(const char *sd_type, int count)
+{
+    _glite_eds_endpoints *list;
+
+    list = (_glite_eds_endpoints *)calloc(1, sizeof(*list));
+    if (!list)
+        return NULL;
+    list->endpoints = (char **)calloc(count, sizeof(*list->endpoints));
+    list->sd_type = strdup(sd_type);
+    if (!list->endpoints || !list->sd_type)
+    {
+        free(list->endpoints);
+        free(list->sd_type);
+        free(list);
+        return NULL;
+    }
+    list->refs = 1;
+    return list;
+}
+
+/**
+ * Helper function - free a list
+ */
+static void list_free(_glite_eds_endpoints *list)
+{
+    int i;
+
+    for (i = 0; i < list->count; i++)
+        free(list->endpoints[i]);
+    free(list->endpoints);
+    free(list->sd_type);
+    free(list);
+}
+
+/**
+ * Helper function - check if a list may still be used
+ */
+static int list_fresh(_glite_eds_endpoints *list, const char *sd_type,
+    time_t now, int ttl)
+{
+    return list && !strcmp(list->sd_type, sd_type) &&
+        now >= list->fetched && now - list->fetched < ttl;
+}
+
+/**
+ * Helper function - check that the cache file could only have been written
+ * by the user: the endpoints read from it receive the key pieces
+ */
+static int cache_trusted(int fd, const char *path)
+{
+    struct stat st;
+    char *dir, *slash;
+    int res;
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != getuid() ||
+        (st.st_mode & (S_IWGRP | S_IWOTH)))
+        return 0;
+
+    dir = strdup(path);
+    if (!dir)
+        return 0;
+    slash = strrchr(dir, '/');
+    if (!slash)
+        strcpy(dir, ".");
+    else if (slash == dir)
+        slash[1] = '\0';
+    else
+        *slash = '\0';
+    res = !stat(dir, &st) && !(st.st_mode & (S_IWGRP | S_IWOTH));
+    free(dir);
+
+    return res;
+}
+
+/**
+ * Helper function - load the list saved by an earlier process. Returns
+ * NULL if there is none, it can not be read or it is not trusted.
+ */
+static _glite_eds_endpoints *cache_load(const char *path, const char *sd_type)
+{
+    _glite_eds_endpoints *list = NULL;
+    char line[EDS_ENDPOINT_LINE];
+    char **endpoints;
+    long fetched;
+    size_t len;
+    FILE *f;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (!cache_trusted(fd, path) || !(f = fdopen(fd, "r")))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    /* Magic, service type, time of the discovery */
+    if (!fgets(line, sizeof(line), f) ||
+        strncmp(line, EDS_ENDPOINT_CACHE_MAGIC "\n", sizeof(line)))
+        goto out;
+    if (!fgets(line, sizeof(line), f))
+        goto out;
+    line[strcspn(line, "\n")] = '\0';
+    if (strcmp(line, sd_type))
+        goto out;
+    if (!fgets(line, sizeof(line), f) || sscanf(line, "%ld", &fetched) != 1)
+        goto out;
+
+    list = list_new(sd_type, 1);
+    if (!list)
+        goto out;
+    list->fetched = (time_t)fetched;
+
+    /* One endpoint per line */
+    while (fgets(line, sizeof(line), f))
+    {
+        len = strcspn(line, "\n");
+        if (line[len] != '\n')
+            break;
+        line[len] = '\0';
+        if (!len)
+            continue;
+
+        endpoints = (char **)realloc(list->endpoints,
+            (list->count + 1) * sizeof(*endpoints));
+        if (!endpoints)
+            break;
+        list->endpoints = endpoints;
+        if (!(list->endpoints[list->count] = strdup(line)))
+            break;
+        list->count++;
+    }
+
+    if (!feof(f) || !list->count)
+    {
+        list_free(list);
+        list = NULL;
+    }
+
+out:
+    fclose(f);
+    return list;
+}
+
+/**
+ * Helper function - save the list for later processes. The file is
+ * replaced atomically; failures are ignored, the cache is an optimization.
+ */
+static void cache_save(const char *path, int is_default,
+    _glite_eds_endpoints *list)
+{
+    char *tmp = NULL, *dir = NULL;
+    FILE *f;
+    int fd, i, res;
+
+    if (is_default && asprintf(&dir, "%s/%s", getenv("HOME"),
+        EDS_ENDPOINT_CACHE_DIR) >= 0)
+    {
+        mkdir(dir, 0700);
+        free(dir);
+    }
+
+    if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+        return;
+    fd = mkstemp(tmp);
+    if (fd < 0)
+    {
+        free(tmp);
+        return;
+    }
+    f = fdopen(fd, "w");
+    if (!f)
+    {
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return;
+    }
+
+    res = fprintf(f, "%s\n%s\n%ld\n", EDS_ENDPOINT_CACHE_MAGIC,
+        list->sd_type, (long)list->fetched) < 0;
+    for (i = 0; i < list->count && !res; i++)
+        res = fprintf(f, "%s\n", list->endpoints[i]) < 0;
+    res |= fclose(f) != 0;
+
+    if (res || rename(tmp, path))
+        unlink(tmp);
+    free(tmp);
+}
+
+char **_glite_eds_discover_endpoints(int *epcount, char **error)
+{
+    SDService *service;
+    SDServiceList * serv_list;
+    SDException exc;
+    const char *sd_type;
+    char * serv_name;
+    char **endpoints;
+    int associated_count;
+    int i;
+
+    sd_type = sd_type_get();
+
+    /* The service discovery library is not thread safe */
+    pthread_mutex_lock(&sd_lock);
+
+    serv_name = glite_discover_service_by_version(sd_type, NULL /*name*/, NULL /*version*/, error);
+    if (!serv_name) {
+        pthread_mutex_unlock(&sd_lock);
+        return NULL;
+    }
+
+    service = SD_getService(serv_name, &exc);
+    if (!service) {
+        asprintf(error, "glite_eds_get_catalog_endpoints: %s", exc.reason);
+        SD_freeException(&exc);
+        free(serv_name);
+        pthread_mutex_unlock(&sd_lock);
+        return NULL;
+    }
+
+    /* Get list of (associated) services.
+     * NULL is returned also in case of numServices=0, that is not the error here.
+     */
+    serv_list = SD_listAssociatedServices(serv_name, sd_type, NULL/*site*/, NULL/*vos*/, &exc);
+
+    pthread_mutex_unlock(&sd_lock);
+
+    if (!serv_list)
+        associated_count = 0;
+    else
+        associated_count = serv_list->numServices;
+
+    /* Create list of endpoints */
+
+    endpoints = malloc(sizeof(char *) * (1 + associated_count));
+    if (!endpoints) {
+        SD_freeService(service);
+        SD_freeServiceList(serv_list);
+        free(serv_name);
+        asprintf(error, "glite_eds_get_catalog_endpoints: out of memory");
+        return NULL;
+    }
+
+    endpoints[0] = strdup(service->endpoint);
+    for (i = 0; i < associated_count; i++)
+        endpoints[i+1] = strdup(serv_list->services[i]->endpoint);
+
+    /* free resources */
+    SD_freeService(service);
+    SD_freeServiceList(serv_list);
+    free(serv_name);
+
+    *epcount = 1 + associated_count;
+
+    return endpoints;
+}
+
+_glite_eds_endpoints *_glite_eds_endpoints_get(char **error)
+{
+    _glite_eds_endpoints *list;
+    const char *sd_type;
+    char *path;
+    char **endpoints;
+    time_t now;
+    int ttl, count, i, is_default;
+
+    sd_type = sd_type_get();
+    ttl = _glite_env_int(GLITE_EDS_ENDPOINT_TTL_ENV, EDS_ENDPOINT_TTL, 0);
+    now = time(NULL);
+
+    pthread_mutex_lock(&cache_lock);
+    while (discovering)
+        pthread_cond_wait(&cache_done, &cache_lock);
+
+    /* Another process may have done the discovery recently */
+    path = ttl > 0 ? cache_path(&is_default) : NULL;
+    if (path && !list_fresh(current, sd_type, now, ttl))
+    {
+        list = cache_load(path, sd_type);
+        if (list_fresh(list, sd_type, now, ttl))
+        {
+            if (current && !--current->refs)
+                list_free(current);
+            current = list;
+        }
+        else if (list)
+            list_free(list);
+    }
+
+    /* The lock is not held during the discovery, the other callers wait
+     * for its result */
+    if (!list_fresh(current, sd_type, now, ttl))
+    {
+        discovering = 1;
+        pthread_mutex_unlock(&cache_lock);
+
+        list = NULL;
+        endpoints = _glite_eds_discover_endpoints(&count, error);
+        if (endpoints)
+        {
+            list = list_new(sd_type, 1);
+            if (!list)
+            {
+                for (i = 0; i < count; i++)
+                    free(endpoints[i]);
+                free(endpoints);
+                asprintf(error, "glite_eds_get_catalog_endpoints: out of memory");
+            }
+        }
+
+        pthread_mutex_lock(&cache_lock);
+        discovering = 0;
+        pthread_cond_broadcast(&cache_done);
+        if (!list)
+        {
+            pthread_mutex_unlock(&cache_lock);
+            free(path);
+            return NULL;
+        }
+        free(list->endpoints);
+        list->endpoints = endpoints;
+        list->count = count;
+        list->fetched = now;
+
+        if (current && !--current->refs)
+            list_free(current);
+        current = list;
+
+        if (path)
+            cache_save(path, is_default, current);
+    }
+
+    list = current;
+    list->refs++;
+
+    /* Without caching nobody else needs the list */
+    if (ttl <= 0)
+    {
+        current = NULL;
+        list->refs--;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+    free(path);
+
+    return list;
+}
+
+void _glite_eds_endpoints_release(_glite_eds_endpoints *list)
+{
+    int refs;
+
+    if (!list)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+    refs = --list->refs;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (!refs)
+        list_free(list);
+}
+
+void _glite_eds_endpoints_invalidate(_glite_eds_endpoints *list)
+{
+    char *path;
+    int is_default;
+
+    pthread_mutex_lock(&cache_lock);
+    if (list && list == current)
+    {
+        current = NULL;
+        list->refs--;
+
+        /* Do not let other processes pick it up either */
+        path = cache_path(&is_default);
+        if (path)
+            unlink(path);
+        free(path);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Get endpoints of default catalog service and all associated services.
+ * User should free the list (or error string) after use.
+ */
+char ** glite_eds_get_catalog_endpoints(int *epcount, char **error)
+{
+    _glite_eds_endpoints *list;
+    char **endpoints;
+    int i;
+
+    if (glite_eds_library_init(error))
+        return NULL;
+
+    list = _glite_eds_endpoints_get(error);
+    if (!list)
+        return NULL;
+
+    endpoints = malloc(sizeof(char *) * list->count);
+    if (!endpoints) {
+        _glite_eds_endpoints_release(list);
+        asprintf(error, "glite_eds_get_catalog_endpoints: out of memory");
+        return NULL;
+    }
+    for (i = 0; i < list->count; i++)
+        endpoints[i] = strdup(list->endpoints[i]);
+    *epcount = list->count;
+
+    _glite_eds_endpoints_release(list);
+
+    return endpoints;
+}
+
+/**
+ * Helper function - look up the cached liveness of an endpoint. Returns
+ * -1 if it is unknown or too old. Must be called with the probe lock held.
+ */
+static int probe_cached(const char *endpoint, time_t now, int ttl)
+{
+    struct eds_probe_entry *entry;
+
+    for (entry = probes; entry; entry = entry->next)
+    {
+        if (strcmp(entry->endpoint, endpoint))
+            continue;
+        if (now >= entry->checked && now - entry->checked < ttl)
+            return entry->alive;
+        return -1;
+    }
+    return -1;
+}
+
+/**
+ * Helper function - remember the liveness of an endpoint. Must be called
+ * with the probe lock held.
+ */
+static void probe_store(const char *endpoint, int alive, time_t now)
+{
+    struct eds_probe_entry *entry;
+
+    for (entry = probes; entry; entry = entry->next)
+    {
+        if (!strcmp(entry->endpoint, endpoint))
+            break;
+    }
+    if (!entry)
+    {
+        entry = (struct eds_probe_entry *)calloc(1, sizeof(*entry));
+        if (!entry)
+            return;
+        entry->endpoint = strdup(endpoint);
+        if (!entry->endpoint)
+        {
+            free(entry);
+            return;
+        }
+        entry->next = probes;
+        probes = entry;
+    }
+    entry->alive = alive;
+    entry->checked = now;
+}
+
+/**
+ * Helper function - check that an endpoint answers a read-only request.
+ * An endpoint whose circuit is open is not asked at all.
+ */
+static void probe_job_run(void *arg)
+{
+    struct eds_probe_job *job = arg;
+    glite_catalog_ctx *ctx;
+    char *version;
+    double previous;
+
+    job->alive = 0;
+    if (!_glite_eds_endpoint_allowed(job->endpoint))
+        return;
+
+    previous = _glite_eds_deadline_set(job->deadline);
+    ctx = _glite_eds_ctx_get(job->endpoint);
+    if (ctx)
+    {
+        version = glite_metadata_getVersion(ctx);
+        job->alive = version != NULL;
+        free(version);
+        _glite_eds_ctx_put(ctx, job->endpoint, !job->alive);
+    }
+    _glite_eds_deadline_set(previous);
+}
+
+int _glite_eds_endpoints_probe(_glite_eds_endpoints *list, int *alive)
+{
+    _glite_eds_workers *workers = NULL;
+    struct eds_probe_job *jobs;
+    time_t now;
+    double deadline;
+    int ttl, timeout, njobs = 0, count = 0, i;
+
+    ttl = _glite_env_int(GLITE_EDS_PROBE_TTL_ENV, EDS_PROBE_TTL, 0);
+    timeout = _glite_env_int(GLITE_EDS_PROBE_TIMEOUT_ENV,
+        EDS_PROBE_TIMEOUT, 0);
+    now = time(NULL);
+
+    /* The probes get the short timeout, within the budget of the caller */
+    deadline = _glite_eds_deadline_within(timeout * 1000);
+
+    jobs = (struct eds_probe_job *)calloc(list->count ? list->count : 1,
+        sizeof(*jobs));
+    if (!jobs)
+        return -1;
+
+    pthread_mutex_lock(&probe_lock);
+    for (i = 0; i < list->count; i++)
+    {
+        alive[i] = ttl > 0 ? probe_cached(list->endpoints[i], now, ttl) : -1;
+        if (alive[i] < 0)
+        {
+            jobs[njobs].endpoint = list->endpoints[i];
+            jobs[njobs].deadline = deadline;
+            njobs++;
+        }
+    }
+    pthread_mutex_unlock(&probe_lock);
+
+    /* All endpoints at once, the total time is that of the slowest one */
+    if (njobs > 1)
+        workers = _glite_eds_workers_new(njobs < EDS_MAX_ENDPOINT_THREADS ?
+            njobs : EDS_MAX_ENDPOINT_THREADS);
+    _glite_eds_workers_run(workers, probe_job_run, jobs, sizeof(*jobs), njobs);
+    _glite_eds_workers_free(workers);
+
+    pthread_mutex_lock(&probe_lock);
+    for (i = 0, njobs = 0; i < list->count; i++)
+    {
+        if (alive[i] < 0)
+        {
+            alive[i] = jobs[njobs++].alive;
+            probe_store(list->endpoints[i], alive[i], now);
+        }
+        count += alive[i];
+    }
+    pthread_mutex_unlock(&probe_lock);
+
+    free(jobs);
+    return count;
+}
+
+/**
+ * Helper function - copy of the endpoints of a list that answer a
+ * read-only request
+ */
+static _glite_eds_endpoints *live_list(_glite_eds_endpoints *list,
+    char **error)
+{
+    _glite_eds_endpoints *live;
+    int *alive;
+    int count, i, j;
+
+    alive = (int *)calloc(list->count ? list->count : 1, sizeof(*alive));
+    count = alive ? _glite_eds_endpoints_probe(list, alive) : -1;
+    if (count < 0)
+    {
+        free(alive);
+        asprintf(error, "glite_eds_get_valid_catalog_endpoints: out of memory");
+        return NULL;
+    }
+    if (!count)
+    {
+        free(alive);
+        asprintf(error, "glite_eds_get_valid_catalog_endpoints: none of the "
+            "key stores answered");
+        return NULL;
+    }
+
+    live = list_new(list->sd_type, count);
+    if (live)
+    {
+        live->fetched = list->fetched;
+        for (i = 0, j = 0; i < list->count; i++)
+        {
+            if (!alive[i])
+                continue;
+            live->endpoints[j] = strdup(list->endpoints[i]);
+            if (!live->endpoints[j])
+                break;
+            live->count = ++j;
+        }
+        if (j < count)
+        {
+            list_free(live);
+            live = NULL;
+        }
+    }
+    if (!live)
+        asprintf(error, "glite_eds_get_valid_catalog_endpoints: out of memory");
+
+    free(alive);
+    return live;
+}
+
+_glite_eds_endpoints *_glite_eds_endpoints_live(char **error)
+{
+    _glite_eds_endpoints *list, *live;
+
+    list = _glite_eds_endpoints_get(error);
+    if (!list)
+        return NULL;
+    live = live_list(list, error);
+    _glite_eds_endpoints_release(list);
+    return live;
+}
+
+_glite_eds_endpoints *_glite_eds_endpoints_write(char **error)
+{
+    _glite_eds_endpoints *list, *live;
+    int needed;
+
+    if (_glite_env_int(GLITE_EDS_VALIDATE_ENDPOINTS_ENV, 0, 0) <= 0)
+        return _glite_eds_endpoints_get(error);
+
+    list = _glite_eds_endpoints_get(error);
+    if (!list)
+        return NULL;
+    live = live_list(list, error);
+
+    /* Splitting a key among too few key stores would weaken it for good,
+     * for a key store that is down only for a while */
+    needed = _glite_env_int(GLITE_EDS_VALIDATE_MIN_ENV, 0, 1);
+    if (!needed)
+        needed = _glite_eds_keys_needed(list->count);
+    if (live && live->count < needed)
+    {
+        asprintf(error, "glite_eds_register error: only %d of the %d key "
+            "stores answered, %d needed", live->count, list->count, needed);
+        _glite_eds_endpoints_release(live);
+        live = NULL;
+    }
+
+    _glite_eds_endpoints_release(list);
+    return live;
+}
+
+/**
+ * Get the endpoints of the key stores that answer a read-only request.
+ * User should free the list (or error string) after use.
+ */
+char ** glite_eds_get_valid_catalog_endpoints(int *epcount, int *id, char **error)
+{
+    _glite_eds_endpoints *list;
+    char **endpoints;
+
+    (void)id;
+
+    if (glite_eds_library_init(error))
+        return NULL;
+
+    list = _glite_eds_endpoints_live(error);
+    if (!list)
+        return NULL;
+
+    /* The array and its strings are handed over */
+    endpoints = list->endpoints;
+    *epcount = list->count;
+    list->endpoints = NULL;
+    list->count = 0;
+    list_free(list);
+
+    return endpoints;
+}
+
+void _glite_eds_probe_cleanup(void)
+{
+    struct eds_probe_entry *entry;
+
+    pthread_mutex_lock(&probe_lock);
+    while (probes)
+    {
+        entry = probes;
+        probes = entry->next;
+        free(entry->endpoint);
+        free(entry);
+    }
+    pthread_mutex_unlock(&probe_lock);
+}
@@ -0,0 +1,1439 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  GLite Data Management - Write-behind journal of the key registrations
+ *  of the encrypted data storage API
+ *
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
+#include <glite/data/hydra/c/eds-simple.h>
+#include <glite/security/ssss.h>
+
+#include "eds_internal.h"
+
+/* Ids sent in one batch, by default */
+#define EDS_JOURNAL_BATCH       100
+/* Milliseconds a batch waits to fill, by default */
+#define EDS_JOURNAL_DELAY       200
+/* Seconds a flusher with nothing to send waits before it looks for the
+ * journals of the processes that exited */
+#define EDS_JOURNAL_ADOPT       30
+/* First and longest pause before a request is sent again, in seconds */
+#define EDS_JOURNAL_RETRY       1
+#define EDS_JOURNAL_RETRY_MAX   60
+/* Attempts to reach the key stores before a request is given up, by
+ * default */
+#define EDS_JOURNAL_RETRIES     20
+
+/* Names of the journal files in the directory */
+#define EDS_JOURNAL_PREFIX      "journal."
+/* File of the requests given up, in the same format. The library only ever
+ * appends to it. */
+#define EDS_JOURNAL_QUARANTINE  "quarantine"
+
+/*
+ * The journal is a text file of records, one per line, with the fields
+ * separated by a blank:
+ *
+ *   P seq id cipher keyinfo keys_needed hex_iv epcount endpoint... piece...
+ *   U seq id
+ *   S seq          the requests of an entry were sent
+ *   D seq          the entry is done
+ *   E seq error    the entry was given up, and is in the quarantine
+ *
+ * Blanks, control characters and '%' in the fields are written as %XX. A
+ * line without its newline was cut by a crash and is ignored.
+ */
+#define EDS_JOURNAL_PUT         'P'
+#define EDS_JOURNAL_UNREGISTER  'U'
+
+/* Registration or removal of a key, until the key stores have it */
+struct eds_journal_entry {
+    unsigned long seq;
+    char type;              /* EDS_JOURNAL_PUT or EDS_JOURNAL_UNREGISTER */
+    char *id;
+    char *cipher;
+    char *keyinfo;
+    char *hex_iv;
+    unsigned int keys_needed;
+    int epcount;
+    char **endpoints;
+    char **pieces;          /* one per endpoint */
+    int sent;               /* pieces of an earlier attempt may be stored */
+    int busy;               /* being sent by the flusher */
+    int done;
+    int kept;               /* given up, but the quarantine could not take
+                             * it: it stays in the journal */
+    int attempts;           /* failed to reach the key stores */
+    int delay;              /* seconds to wait after the next failure */
+    double queued;
+    double not_before;
+    struct eds_journal_entry *next;
+};
+
+/* Record being built */
+struct eds_journal_line {
+    char *buf;
+    size_t len;
+    size_t size;
+    int failed;
+};
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_changed = PTHREAD_COND_INITIALIZER;
+static char *journal_dir;
+static char *journal_path;
+static int journal_fd = -1;
+static unsigned long journal_seq;
+static struct eds_journal_entry *queue_first, *queue_last;
+static pthread_t flusher;
+static int flusher_running, stopping, barrier;
+static char *journal_error;     /* first request given up since the last barrier */
+static int journal_failed;
+
+/**
+ * Helper function - current time in seconds, not affected by clock changes
+ */
+static double journal_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Helper function - wait until the state changes, or some seconds have
+ * passed. Must be called with the lock held.
+ */
+static void journal_wait(double seconds)
+{
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += (time_t)seconds;
+    until.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+    if (until.tv_nsec >= 1000000000)
+    {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&journal_changed, &journal_lock, &until);
+}
+
+/**
+ * Helper function - append a field to a record
+ */
+static void line_add(struct eds_journal_line *l, const char *field)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    size_t need = 3 * strlen(field) + 5;
+    unsigned char c;
+    char *buf;
+
+    if (l->failed)
+        return;
+    if (l->len + need > l->size)
+    {
+        buf = (char *)realloc(l->buf, l->len + need + 256);
+        if (!buf)
+        {
+            l->failed = 1;
+            return;
+        }
+        l->buf = buf;
+        l->size = l->len + need + 256;
+    }
+    if (l->len && l->buf[l->len - 1] != '\n')
+        l->buf[l->len++] = ' ';
+    /* An empty field still needs a token */
+    if (!*field)
+    {
+        memcpy(l->buf + l->len, "%00", 3);
+        l->len += 3;
+    }
+    for (; *field; field++)
+    {
+        c = (unsigned char)*field;
+        if (c <= ' ' || c == '%' || c == 0x7f)
+        {
+            l->buf[l->len++] = '%';
+            l->buf[l->len++] = hex[c >> 4];
+            l->buf[l->len++] = hex[c & 15];
+        }
+        else
+            l->buf[l->len++] = c;
+    }
+    l->buf[l->len] = '\0';
+}
+
+/**
+ * Helper function - end a record
+ */
+static void line_end(struct eds_journal_line *l)
+{
+    /* The empty field only makes room for the newline */
+    line_add(l, "");
+    if (l->failed)
+        return;
+    l->len -= 4;
+    l->buf[l->len++] = '\n';
+    l->buf[l->len] = '\0';
+}
+
+/**
+ * Helper function - append a number to a record
+ */
+static void line_add_number(struct eds_journal_line *l, unsigned long n)
+{
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%lu", n);
+    line_add(l, buf);
+}
+
+/**
+ * Helper function - decode a field of a record in place
+ */
+static void field_decode(char *field)
+{
+    char *out = field;
+    unsigned int c;
+
+    for (; *field; field++)
+    {
+        if (*field == '%' && sscanf(field + 1, "%2x", &c) == 1 &&
+            field[1] && field[2])
+        {
+            *out++ = (char)c;
+            field += 2;
+        }
+        else
+            *out++ = *field;
+    }
+    *out = '\0';
+}
+
+/**
+ * Helper function - free an entry, wiping its key pieces
+ */
+static void entry_free(struct eds_journal_entry *e)
+{
+    int i;
+
+    for (i = 0; i < e->epcount; i++)
+    {
+        if (e->endpoints)
+            free(e->endpoints[i]);
+        if (e->pieces && e->pieces[i])
+        {
+            OPENSSL_cleanse(e->pieces[i], strlen(e->pieces[i]));
+            free(e->pieces[i]);
+        }
+    }
+    free(e->endpoints);
+    free(e->pieces);
+    free(e->id);
+    free(e->cipher);
+    free(e->keyinfo);
+    free(e->hex_iv);
+    free(e);
+}
+
+/**
+ * Helper function - new entry of a type, NULL if out of memory
+ */
+static struct eds_journal_entry *entry_new(char type, const char *id)
+{
+    struct eds_journal_entry *e;
+
+    e = (struct eds_journal_entry *)calloc(1, sizeof(*e));
+    if (!e)
+        return NULL;
+    e->type = type;
+    e->delay = EDS_JOURNAL_RETRY;
+    e->id = strdup(id);
+    if (!e->id)
+    {
+        free(e);
+        return NULL;
+    }
+    return e;
+}
+
+/**
+ * Helper function - append data to the journal of the process. A record
+ * that can not be written completely is cut off again. Must be called with
+ * the lock held.
+ */
+static int journal_write(const char *data, size_t len)
+{
+    off_t end;
+    ssize_t n;
+
+    end = lseek(journal_fd, 0, SEEK_END);
+    while (len > 0)
+    {
+        n = write(journal_fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            if (end >= 0 && ftruncate(journal_fd, end))
+            {
+                /* nothing more can be done */
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Helper function - add a short record about an entry
+ */
+static void line_add_mark(struct eds_journal_line *l, char type,
+    unsigned long seq, const char *error)
+{
+    char name[2] = {type, '\0'};
+
+    line_add(l, name);
+    line_add_number(l, seq);
+    if (error)
+        line_add(l, error);
+    line_end(l);
+}
+
+/**
+ * Helper function - add the record of an entry, and tell if it was sent
+ * already
+ */
+static void line_add_entry(struct eds_journal_line *l,
+    struct eds_journal_entry *e)
+{
+    char name[2] = {e->type, '\0'};
+    int i;
+
+    line_add(l, name);
+    line_add_number(l, e->seq);
+    line_add(l, e->id);
+    if (e->type == EDS_JOURNAL_PUT)
+    {
+        line_add(l, e->cipher);
+        line_add(l, e->keyinfo);
+        line_add_number(l, e->keys_needed);
+        line_add(l, e->hex_iv);
+        line_add_number(l, e->epcount);
+        for (i = 0; i < e->epcount; i++)
+            line_add(l, e->endpoints[i]);
+        for (i = 0; i < e->epcount; i++)
+            line_add(l, e->pieces[i]);
+    }
+    line_end(l);
+    if (e->sent)
+        line_add_mark(l, 'S', e->seq, NULL);
+}
+
+/**
+ * Helper function - append a short record about an entry. Must be called
+ * with the lock held.
+ */
+static int journal_mark(char type, unsigned long seq, const char *error)
+{
+    struct eds_journal_line l;
+    int res = -1;
+
+    memset(&l, 0, sizeof(l));
+    line_add_mark(&l, type, seq, error);
+    if (!l.failed)
+        res = journal_write(l.buf, l.len);
+    free(l.buf);
+    return res;
+}
+
+/**
+ * Helper function - append the records of an entry. Must be called with
+ * the lock held.
+ */
+static int journal_write_entry(struct eds_journal_entry *e)
+{
+    struct eds_journal_line l;
+    int res = -1;
+
+    memset(&l, 0, sizeof(l));
+    line_add_entry(&l, e);
+    if (!l.failed)
+        res = journal_write(l.buf, l.len);
+    if (l.buf)
+        OPENSSL_cleanse(l.buf, l.size);
+    free(l.buf);
+    return res;
+}
+
+/**
+ * Helper function - make the new and removed journal files durable
+ */
+static void journal_sync_dir(void)
+{
+    int fd;
+
+    fd = open(journal_dir, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (fsync(fd))
+    {
+        /* the directory entry may need a little longer */
+    }
+    close(fd);
+}
+
+/**
+ * Helper function - create the journal of the process in the directory
+ * given by GLITE_EDS_JOURNAL. Must be called with the lock held.
+ */
+static int journal_open(const char *func, char **error)
+{
+    struct stat st;
+    char *dir;
+    int fd;
+
+    if (journal_fd >= 0)
+        return 0;
+
+    dir = getenv(GLITE_EDS_JOURNAL_ENV);
+    if (!dir || !*dir)
+    {
+        asprintf(error, "%s error: %s is not set", func, GLITE_EDS_JOURNAL_ENV);
+        return -1;
+    }
+    if (mkdir(dir, 0700) && errno != EEXIST)
+    {
+        asprintf(error, "%s error: cannot create the journal directory %s: %s",
+            func, dir, strerror(errno));
+        return -1;
+    }
+    /* The journal holds whole keys: nobody else may look into it */
+    if (lstat(dir, &st) || !S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+        (st.st_mode & 077))
+    {
+        asprintf(error, "%s error: the journal directory %s must be a "
+            "directory accessible by its owner only", func, dir);
+        return -1;
+    }
+
+    journal_dir = strdup(dir);
+    if (!journal_dir || asprintf(&journal_path, "%s/%s%d.XXXXXX", dir,
+        EDS_JOURNAL_PREFIX, (int)getpid()) < 0)
+    {
+        free(journal_dir);
+        journal_dir = NULL;
+        journal_path = NULL;
+        asprintf(error, "%s error: out of memory", func);
+        return -1;
+    }
+    /* The lock tells the other processes that the journal is in use */
+    fd = mkostemp(journal_path, O_APPEND | O_CLOEXEC);
+    if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB))
+    {
+        asprintf(error, "%s error: cannot create the journal %s: %s", func,
+            journal_path, strerror(errno));
+        if (fd >= 0)
+        {
+            unlink(journal_path);
+            close(fd);
+        }
+        free(journal_dir);
+        free(journal_path);
+        journal_dir = journal_path = NULL;
+        return -1;
+    }
+    journal_fd = fd;
+    journal_sync_dir();
+
+    return 0;
+}
+
+/**
+ * Helper function - add an entry to the queue. Must be called with the lock
+ * held.
+ */
+static void journal_enqueue(struct eds_journal_entry *e)
+{
+    e->next = NULL;
+    e->queued = journal_now();
+    if (queue_last)
+        queue_last->next = e;
+    else
+        queue_first = e;
+    queue_last = e;
+}
+
+/**
+ * Helper function - free the entries that are done, and empty the journal
+ * once nothing is left in it. Must be called with the lock held.
+ */
+static void journal_sweep(void)
+{
+    struct eds_journal_entry **p, *e;
+
+    queue_last = NULL;
+    for (p = &queue_first; (e = *p); )
+    {
+        if (e->done)
+        {
+            *p = e->next;
+            entry_free(e);
+        }
+        else
+        {
+            queue_last = e;
+            p = &e->next;
+        }
+    }
+
+    if (!queue_first && journal_fd >= 0)
+    {
+        if (ftruncate(journal_fd, 0) || fsync(journal_fd))
+        {
+            /* the records say that everything is done anyway */
+        }
+    }
+}
+
+/**
+ * Helper function - parse the entries of a journal left by another process
+ * and return the ones that are not done yet, in order
+ */
+static struct eds_journal_entry *journal_load(int fd)
+{
+    struct eds_journal_entry **entries = NULL, **grown, *e, *first = NULL,
+        **last = &first;
+    char *buf = NULL, *line, *next, *end, *p, **fields = NULL;
+    size_t len = 0, size = 0;
+    int nentries = 0, nfields, lo, hi, mid, i, epcount;
+    unsigned long seq;
+    ssize_t n;
+
+    /* Read it all */
+    for (;;)
+    {
+        if (len + 4096 > size)
+        {
+            p = (char *)realloc(buf, size + 65536);
+            if (!p)
+                goto out;
+            buf = p;
+            size += 65536;
+        }
+        n = read(fd, buf + len, size - len - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    if (!buf)
+        return NULL;
+    buf[len] = '\0';
+
+    for (line = buf; (end = strchr(line, '\n')); line = next)
+    {
+        next = end + 1;
+        *end = '\0';
+
+        nfields = 1;
+        for (p = line; *p; p++)
+            nfields += *p == ' ';
+        free(fields);
+        fields = (char **)calloc(nfields, sizeof(*fields));
+        if (!fields)
+            goto out;
+        for (i = 0, p = strtok_r(line, " ", &end); p && i < nfields;
+            p = strtok_r(NULL, " ", &end))
+        {
+            field_decode(p);
+            fields[i++] = p;
+        }
+        nfields = i;
+        if (nfields < 2 || strlen(fields[0]) != 1)
+            continue;
+        seq = strtoul(fields[1], NULL, 10);
+
+        if (fields[0][0] == EDS_JOURNAL_PUT || fields[0][0] == EDS_JOURNAL_UNREGISTER)
+        {
+            if (nfields < 3)
+                continue;
+            e = entry_new(fields[0][0], fields[2]);
+            if (!e)
+                goto out;
+            e->seq = seq;
+            if (e->type == EDS_JOURNAL_PUT)
+            {
+                epcount = nfields >= 8 ? atoi(fields[7]) : 0;
+                if (epcount < 1 || nfields != 8 + 2 * epcount)
+                {
+                    entry_free(e);
+                    continue;
+                }
+                e->cipher = strdup(fields[3]);
+                e->keyinfo = strdup(fields[4]);
+                e->keys_needed = (unsigned int)atoi(fields[5]);
+                e->hex_iv = strdup(fields[6]);
+                e->endpoints = (char **)calloc(epcount, sizeof(char *));
+                e->pieces = (char **)calloc(epcount, sizeof(char *));
+                e->epcount = e->endpoints && e->pieces ? epcount : 0;
+                for (i = 0; i < e->epcount; i++)
+                {
+                    e->endpoints[i] = strdup(fields[8 + i]);
+                    e->pieces[i] = strdup(fields[8 + epcount + i]);
+                    if (!e->endpoints[i] || !e->pieces[i])
+                        break;
+                }
+                if (!e->cipher || !e->keyinfo || !e->hex_iv ||
+                    !e->epcount || i < e->epcount)
+                {
+                    entry_free(e);
+                    goto out;
+                }
+            }
+            grown = (struct eds_journal_entry **)realloc(entries,
+                (nentries + 1) * sizeof(*entries));
+            if (!grown)
+            {
+                entry_free(e);
+                goto out;
+            }
+            entries = grown;
+            entries[nentries++] = e;
+            continue;
+        }
+
+        /* The entries are written in the order of their numbers */
+        for (lo = 0, hi = nentries; lo < hi; )
+        {
+            mid = (lo + hi) / 2;
+            if (entries[mid]->seq < seq)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == nentries || entries[lo]->seq != seq)
+            continue;
+        if (fields[0][0] == 'S')
+            entries[lo]->sent = 1;
+        else if (fields[0][0] == 'D' || fields[0][0] == 'E')
+            entries[lo]->done = 1;
+    }
+
+out:
+    for (i = 0; i < nentries; i++)
+    {
+        if (entries[i]->done)
+            entry_free(entries[i]);
+        else
+        {
+            *last = entries[i];
+            last = &entries[i]->next;
+        }
+    }
+    *last = NULL;
+    free(entries);
+    free(fields);
+    if (buf)
+    {
+        OPENSSL_cleanse(buf, size);
+        free(buf);
+    }
+    return first;
+}
+
+/**
+ * Helper function - take over the journals of the processes that exited
+ * before sending everything. Must be called with the lock held.
+ */
+static void journal_adopt(void)
+{
+    struct eds_journal_entry *list, *e, *next;
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    char *path;
+    off_t end;
+    int fd, failed;
+
+    dir = opendir(journal_dir);
+    if (!dir)
+        return;
+    while ((de = readdir(dir)))
+    {
+        if (strncmp(de->d_name, EDS_JOURNAL_PREFIX, strlen(EDS_JOURNAL_PREFIX)))
+            continue;
+        if (asprintf(&path, "%s/%s", journal_dir, de->d_name) < 0)
+            break;
+        if (!strcmp(path, journal_path))
+        {
+            free(path);
+            continue;
+        }
+
+        /* A locked journal belongs to a running process, a deleted one was
+         * taken over meanwhile */
+        fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) || fstat(fd, &st) ||
+            st.st_nlink == 0 || st.st_uid != geteuid())
+        {
+            if (fd >= 0)
+                close(fd);
+            free(path);
+            continue;
+        }
+        list = journal_load(fd);
+
+        /* Into the journal of this process first, then the other one goes */
+        end = lseek(journal_fd, 0, SEEK_END);
+        failed = 0;
+        for (e = list; e && !failed; e = e->next)
+        {
+            e->seq = ++journal_seq;
+            failed = journal_write_entry(e);
+        }
+        if (!failed)
+            failed = fsync(journal_fd);
+        if (failed)
+        {
+            if (end >= 0 && ftruncate(journal_fd, end))
+            {
+                /* the entries are numbered again when they are taken over */
+            }
+            for (e = list; e; e = next)
+            {
+                next = e->next;
+                entry_free(e);
+            }
+            close(fd);
+            free(path);
+            break;
+        }
+        unlink(path);
+        journal_sync_dir();
+        close(fd);
+        free(path);
+
+        for (e = list; e; e = next)
+        {
+            next = e->next;
+            journal_enqueue(e);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * Helper function - tell if an entry can be sent now. A removal waits for
+ * the registration of the same id before it. Must be called with the lock
+ * held.
+ */
+static int journal_ready(struct eds_journal_entry *e, double now)
+{
+    struct eds_journal_entry *before;
+
+    if (e->busy || e->done || e->kept || e->not_before > now)
+        return 0;
+    if (e->type == EDS_JOURNAL_UNREGISTER)
+    {
+        for (before = queue_first; before != e; before = before->next)
+        {
+            if (!before->done && !strcmp(before->id, e->id))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Helper function - tell if two entries can go in the same batch
+ */
+static int journal_same_batch(struct eds_journal_entry *a,
+    struct eds_journal_entry *b)
+{
+    int i;
+
+    if (a->type != b->type)
+        return 0;
+    if (a->type == EDS_JOURNAL_UNREGISTER)
+        return 1;
+    if (strcmp(a->cipher, b->cipher) || strcmp(a->keyinfo, b->keyinfo) ||
+        a->keys_needed != b->keys_needed || a->epcount != b->epcount)
+        return 0;
+    for (i = 0; i < a->epcount; i++)
+    {
+        if (strcmp(a->endpoints[i], b->endpoints[i]))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Helper function - wait longer before an entry is sent again
+ */
+static void entry_backoff(struct eds_journal_entry *e, double now)
+{
+    e->not_before = now + e->delay;
+    e->delay = e->delay * 2 < EDS_JOURNAL_RETRY_MAX ?
+        e->delay * 2 : EDS_JOURNAL_RETRY_MAX;
+}
+
+/**
+ * Helper function - append an entry given up and its error to the
+ * quarantine file of the journal directory. Must be called with the lock
+ * held.
+ */
+static int journal_quarantine(struct eds_journal_entry *e, const char *error)
+{
+    struct eds_journal_line l;
+    const char *data;
+    size_t len;
+    ssize_t n;
+    char *path;
+    int fd, res = -1;
+
+    memset(&l, 0, sizeof(l));
+    line_add_entry(&l, e);
+    line_add_mark(&l, 'E', e->seq, error);
+    if (l.failed || asprintf(&path, "%s/%s", journal_dir,
+        EDS_JOURNAL_QUARANTINE) < 0)
+        goto out;
+
+    /* Other processes may give up requests at the same time */
+    fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    free(path);
+    if (fd < 0)
+        goto out;
+    if (!flock(fd, LOCK_EX))
+    {
+        for (data = l.buf, len = l.len; len > 0; )
+        {
+            n = write(fd, data, len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            data += n;
+            len -= n;
+        }
+        if (!len && !fsync(fd))
+            res = 0;
+    }
+    close(fd);
+
+out:
+    if (l.buf)
+        OPENSSL_cleanse(l.buf, l.size);
+    free(l.buf);
+    return res;
+}
+
+/**
+ * Helper function - give up an entry, keeping it in the quarantine, and
+ * remember the error for the next flush barrier. The error is taken over.
+ * Must be called with the lock held.
+ */
+static void journal_give_up(struct eds_journal_entry *e, char *error)
+{
+    char *reason;
+
+    if (e->sent && asprintf(&reason, "%s (pieces of an earlier attempt may "
+        "be left on the key stores)", error) >= 0)
+    {
+        free(error);
+        error = reason;
+    }
+
+    if (!journal_quarantine(e, error))
+    {
+        if (journal_mark('E', e->seq, error))
+        {
+            /* sent again after a crash at worst */
+        }
+        e->done = 1;
+    }
+    else
+    {
+        /* Kept in the journal instead: the process that takes it over
+         * tries again */
+        e->kept = 1;
+        if (asprintf(&reason, "%s (cannot write the quarantine: kept in %s)",
+            error, journal_path) >= 0)
+        {
+            free(error);
+            error = reason;
+        }
+    }
+
+    if (!journal_failed++)
+        journal_error = error;
+    else
+        free(error);
+}
+
+/**
+ * Helper function - tell if entries are waiting to be sent. Must be called
+ * with the lock held.
+ */
+static int journal_pending(void)
+{
+    struct eds_journal_entry *e;
+
+    for (e = queue_first; e; e = e->next)
+    {
+        if (!e->done && !e->kept)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Helper function - send a batch of entries of the same kind and record
+ * the outcome, giving up an entry after some attempts to reach the key
+ * stores. Must be called with the lock held, which is released while the
+ * key stores are busy.
+ */
+static void journal_send(struct eds_journal_entry **batch, int n, int retries)
+{
+    struct eds_journal_entry *e = batch[0];
+    _glite_eds_endpoints *list;
+    char **ids, **errors, **shares = NULL, **ivs = NULL, *error = NULL,
+        *reason;
+    unsigned char *why;
+    int i, j, lost, marked = 0, tried = 0;
+    double previous, now;
+
+    ids = (char **)calloc(n, sizeof(*ids));
+    errors = (char **)calloc(n, sizeof(*errors));
+    why = (unsigned char *)calloc(n, sizeof(*why));
+    if (e->type == EDS_JOURNAL_PUT)
+    {
+        shares = (char **)calloc((size_t)n * e->epcount, sizeof(*shares));
+        ivs = (char **)calloc(n, sizeof(*ivs));
+    }
+    if (!ids || !errors || !why ||
+        (e->type == EDS_JOURNAL_PUT && (!shares || !ivs)))
+        goto out;
+
+    /* The pieces are never removed before they are stored again: an entry
+     * of the same id found then may as well belong to somebody else */
+    if (e->type == EDS_JOURNAL_PUT)
+    {
+        for (i = 0; i < n; i++)
+        {
+            if (!batch[i]->sent && !journal_mark('S', batch[i]->seq, NULL))
+                marked = 1;
+        }
+        if (marked && fsync(journal_fd))
+            goto out;
+    }
+    for (i = 0; i < n; i++)
+    {
+        batch[i]->busy = 1;
+        ids[i] = batch[i]->id;
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    previous = _glite_eds_deadline_begin(_glite_eds_default_timeout());
+    if (e->type == EDS_JOURNAL_PUT)
+    {
+        for (i = 0; i < n; i++)
+        {
+            for (j = 0; j < e->epcount; j++)
+                shares[i * e->epcount + j] = batch[i]->pieces[j];
+            ivs[i] = batch[i]->hex_iv;
+        }
+        _glite_eds_key_put_multi(ids, n, e->endpoints, e->epcount, shares,
+            ivs, e->cipher, e->keyinfo, e->keys_needed, errors, why);
+    }
+    else
+    {
+        list = _glite_eds_endpoints_get(&error);
+        if (!list)
+        {
+            for (i = 0; i < n; i++)
+            {
+                errors[i] = strdup(error ? error : "glite_eds_journal error: "
+                    "no key store endpoints");
+                why[i] = EDS_FAILED_LOST;
+            }
+            free(error);
+        }
+        else
+        {
+            _glite_eds_key_remove_multi(ids, n, list->endpoints, list->count,
+                errors, why);
+            for (i = 0, lost = 0; i < n; i++)
+                lost |= errors[i] && (why[i] & EDS_FAILED_LOST);
+            if (lost)
+                _glite_eds_endpoints_invalidate(list);
+            _glite_eds_endpoints_release(list);
+        }
+    }
+    _glite_eds_deadline_end(previous, 0);
+
+    pthread_mutex_lock(&journal_lock);
+    tried = 1;
+    now = journal_now();
+    for (i = 0; i < n; i++)
+    {
+        e = batch[i];
+        e->busy = 0;
+        if (!errors[i])
+        {
+            journal_mark('D', e->seq, NULL);
+            e->done = 1;
+            continue;
+        }
+        /* Some pieces of a registration may have been stored */
+        if (e->type == EDS_JOURNAL_PUT && (why[i] & EDS_FAILED_LOST))
+            e->sent = 1;
+        if (why[i] == EDS_FAILED_LOST && ++e->attempts < retries)
+        {
+            /* Only the key stores that did not answer are in the way */
+            entry_backoff(e, now);
+            free(errors[i]);
+        }
+        else
+        {
+            if (why[i] == EDS_FAILED_LOST && asprintf(&reason,
+                "%s (given up after %d attempts)", errors[i], e->attempts) >= 0)
+            {
+                free(errors[i]);
+                errors[i] = reason;
+            }
+            journal_give_up(e, errors[i]);
+        }
+        errors[i] = NULL;
+    }
+    if (fsync(journal_fd))
+    {
+        /* after a crash the entries are sent again, and a registration
+         * that the key stores have already is given up */
+    }
+    journal_sweep();
+    pthread_cond_broadcast(&journal_changed);
+
+out:
+    /* Nothing was sent: not again at once */
+    if (!tried)
+    {
+        now = journal_now();
+        for (i = 0; i < n; i++)
+            entry_backoff(batch[i], now);
+    }
+    if (errors)
+    {
+        for (i = 0; i < n; i++)
+            free(errors[i]);
+    }
+    free(ids);
+    free(errors);
+    free(why);
+    free(shares);
+    free(ivs);
+}
+
+/**
+ * Helper function - main function of the flusher thread: send the entries
+ * in batches, a batch waiting a little to fill unless a flush barrier is
+ * waiting for it
+ */
+static void *journal_flusher(void *arg)
+{
+    struct eds_journal_entry **batch, *e;
+    double now, next, delay, last_adopt, t;
+    int max, n, retries;
+
+    (void)arg;
+    max = _glite_env_int(GLITE_EDS_JOURNAL_BATCH_ENV,
+        EDS_JOURNAL_BATCH, 1);
+    delay = _glite_env_int(GLITE_EDS_JOURNAL_DELAY_ENV,
+        EDS_JOURNAL_DELAY, 1) /
+        1000.0;
+    retries = _glite_env_int(GLITE_EDS_JOURNAL_RETRIES_ENV,
+        EDS_JOURNAL_RETRIES, 1);
+    batch = (struct eds_journal_entry **)calloc(max, sizeof(*batch));
+
+    pthread_mutex_lock(&journal_lock);
+    last_adopt = journal_now();
+    while (!stopping && batch)
+    {
+        now = journal_now();
+        for (n = 0, e = queue_first; e && n < max; e = e->next)
+        {
+            if (journal_ready(e, now) && (!n || journal_same_batch(batch[0], e)))
+                batch[n++] = e;
+        }
+        if (n && (n == max || barrier || now >= batch[0]->queued + delay))
+        {
+            journal_send(batch, n, retries);
+            continue;
+        }
+
+        if (!journal_pending() && now >= last_adopt + EDS_JOURNAL_ADOPT)
+        {
+            journal_adopt();
+            last_adopt = now;
+            continue;
+        }
+
+        /* Until a batch is due, or an entry may be sent again */
+        next = (journal_pending() ? now : last_adopt) + EDS_JOURNAL_ADOPT;
+        for (e = queue_first; e; e = e->next)
+        {
+            if (e->busy || e->done || e->kept)
+                continue;
+            t = e->queued + delay;
+            if (t < e->not_before)
+                t = e->not_before;
+            if (t < next)
+                next = t;
+        }
+        journal_wait(next > now + 0.001 ? next - now : 0.001);
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    free(batch);
+    return NULL;
+}
+
+/**
+ * Helper function - start the flusher if it is not running. Must be called
+ * with the lock held.
+ */
+static void journal_start(void)
+{
+    if (flusher_running || stopping)
+        return;
+    if (!pthread_create(&flusher, NULL, journal_flusher, NULL))
+        flusher_running = 1;
+}
+
+int _glite_eds_journal_enabled(void)
+{
+    char *value = getenv(GLITE_EDS_JOURNAL_ENV);
+
+    return value && *value;
+}
+
+int _glite_eds_journal_put(char *id, char **endpoints, int epcount,
+    unsigned char **pieces, char *hex_iv, char *cipher, char *keyinfo,
+    unsigned int keys_needed, char **error)
+{
+    struct eds_journal_entry *e;
+    int i;
+
+    e = entry_new(EDS_JOURNAL_PUT, id);
+    if (e)
+    {
+        e->pieces = (char **)pieces;
+        e->epcount = epcount;
+        e->keys_needed = keys_needed;
+        e->cipher = strdup(cipher);
+        e->keyinfo = strdup(keyinfo);
+        e->hex_iv = strdup(hex_iv);
+        e->endpoints = (char **)calloc(epcount, sizeof(char *));
+        for (i = 0; e->endpoints && i < epcount; i++)
+        {
+            if (!(e->endpoints[i] = strdup(endpoints[i])))
+                break;
+        }
+    }
+    if (!e || !e->cipher || !e->keyinfo || !e->hex_iv || !e->endpoints ||
+        i < epcount)
+    {
+        if (e)
+            entry_free(e);
+        else
+        {
+            for (i = 0; i < epcount; i++)
+            {
+                OPENSSL_cleanse(pieces[i], strlen((char *)pieces[i]));
+                free(pieces[i]);
+            }
+            free(pieces);
+        }
+        asprintf(error, "glite_eds_register error: out of memory");
+        return -1;
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    if (journal_open("glite_eds_register", error))
+    {
+        pthread_mutex_unlock(&journal_lock);
+        entry_free(e);
+        return -1;
+    }
+    e->seq = ++journal_seq;
+    if (journal_write_entry(e) || fsync(journal_fd))
+    {
+        asprintf(error, "glite_eds_register error: cannot write the journal "
+            "%s: %s", journal_path, strerror(errno));
+        pthread_mutex_unlock(&journal_lock);
+        entry_free(e);
+        return -1;
+    }
+    journal_enqueue(e);
+    journal_start();
+    pthread_cond_broadcast(&journal_changed);
+    pthread_mutex_unlock(&journal_lock);
+
+    return 0;
+}
+
+int _glite_eds_journal_unregister(char *id, char **error)
+{
+    struct eds_journal_entry *e, *found = NULL, *u;
+
+    pthread_mutex_lock(&journal_lock);
+    if (journal_open("glite_eds_unregister", error))
+    {
+        pthread_mutex_unlock(&journal_lock);
+        return -1;
+    }
+    for (e = queue_first; e; e = e->next)
+    {
+        if (!e->done && e->type == EDS_JOURNAL_PUT && !strcmp(e->id, id))
+            found = e;
+    }
+
+    /* A registration that was never sent is simply dropped */
+    if (found && !found->busy && !found->sent)
+    {
+        if (journal_mark('D', found->seq, NULL) || fsync(journal_fd))
+        {
+            asprintf(error, "glite_eds_unregister error: cannot write the "
+                "journal %s: %s", journal_path, strerror(errno));
+            pthread_mutex_unlock(&journal_lock);
+            return -1;
+        }
+        found->done = 1;
+        journal_sweep();
+        pthread_cond_broadcast(&journal_changed);
+        pthread_mutex_unlock(&journal_lock);
+        return 0;
+    }
+
+    u = entry_new(EDS_JOURNAL_UNREGISTER, id);
+    if (!u)
+    {
+        asprintf(error, "glite_eds_unregister error: out of memory");
+        pthread_mutex_unlock(&journal_lock);
+        return -1;
+    }
+    u->seq = ++journal_seq;
+    if (journal_write_entry(u) || fsync(journal_fd))
+    {
+        asprintf(error, "glite_eds_unregister error: cannot write the "
+            "journal %s: %s", journal_path, strerror(errno));
+        pthread_mutex_unlock(&journal_lock);
+        entry_free(u);
+        return -1;
+    }
+    /* The removal takes care of a registration waiting for a retry */
+    if (found && !found->busy && !journal_mark('D', found->seq, NULL))
+    {
+        found->done = 1;
+        journal_sweep();
+    }
+    journal_enqueue(u);
+    journal_start();
+    pthread_cond_broadcast(&journal_changed);
+    pthread_mutex_unlock(&journal_lock);
+
+    return 0;
+}
+
+int _glite_eds_journal_get(const char *id, char **hex_key, char **hex_iv,
+    char **cipher, char **keyinfo)
+{
+    struct eds_journal_entry *e, *found = NULL;
+    int res = 0;
+
+    pthread_mutex_lock(&journal_lock);
+    for (e = queue_first; e; e = e->next)
+    {
+        if (e->done || e->kept || strcmp(e->id, id))
+            continue;
+        found = e->type == EDS_JOURNAL_PUT ? e : NULL;
+    }
+    if (found)
+    {
+        *hex_key = (char *)glite_security_ssss_join_keys(
+            (unsigned char **)found->pieces, found->epcount);
+        *hex_iv = strdup(found->hex_iv);
+        *cipher = strdup(found->cipher);
+        *keyinfo = strdup(found->keyinfo);
+        if (*hex_key && *hex_iv && *cipher && *keyinfo)
+            res = 1;
+        else
+        {
+            if (*hex_key)
+                OPENSSL_cleanse(*hex_key, strlen(*hex_key));
+            free(*hex_key);
+            free(*hex_iv);
+            free(*cipher);
+            free(*keyinfo);
+            *hex_key = *hex_iv = *cipher = *keyinfo = NULL;
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    return res;
+}
+
+int glite_eds_journal_flush(int timeout_ms, char **error)
+{
+    struct timespec until;
+    int res, timedout = 0;
+
+    if (!_glite_eds_journal_enabled())
+        return 0;
+    if (glite_eds_library_init(error))
+        return -1;
+
+    if (timeout_ms > 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += timeout_ms / 1000;
+        until.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000)
+        {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    if (journal_open("glite_eds_journal_flush", error))
+    {
+        pthread_mutex_unlock(&journal_lock);
+        return -1;
+    }
+    journal_adopt();
+    journal_start();
+    if (!flusher_running)
+    {
+        pthread_mutex_unlock(&journal_lock);
+        asprintf(error, "glite_eds_journal_flush error: cannot start a thread");
+        return -1;
+    }
+
+    barrier++;
+    pthread_cond_broadcast(&journal_changed);
+    for (;;)
+    {
+        if (!journal_pending())
+        {
+            res = 0;
+            break;
+        }
+        if (timedout || timeout_ms == 0)
+        {
+            res = 1;
+            break;
+        }
+        if (timeout_ms < 0)
+            pthread_cond_wait(&journal_changed, &journal_lock);
+        else if (pthread_cond_timedwait(&journal_changed, &journal_lock,
+            &until) == ETIMEDOUT)
+            timedout = 1;
+    }
+    barrier--;
+
+    if (journal_error)
+    {
+        if (journal_failed > 1)
+            asprintf(error, "%s (and %d more requests given up, see %s/%s)",
+                journal_error, journal_failed - 1, journal_dir,
+                EDS_JOURNAL_QUARANTINE);
+        else
+            asprintf(error, "%s (see %s/%s)", journal_error, journal_dir,
+                EDS_JOURNAL_QUARANTINE);
+        free(journal_error);
+        journal_error = NULL;
+        journal_failed = 0;
+        res = -1;
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    return res;
+}
+
+void _glite_eds_journal_cleanup(void)
+{
+    struct eds_journal_entry *e;
+
+    pthread_mutex_lock(&journal_lock);
+    if (flusher_running)
+    {
+        stopping = 1;
+        pthread_cond_broadcast(&journal_changed);
+        pthread_mutex_unlock(&journal_lock);
+        pthread_join(flusher, NULL);
+        pthread_mutex_lock(&journal_lock);
+        flusher_running = 0;
+        stopping = 0;
+    }
+
+    /* What was not sent stays for the next process */
+    if (journal_fd >= 0)
+    {
+        if (!queue_first)
+        {
+            unlink(journal_path);
+            journal_sync_dir();
+        }
+        close(journal_fd);
+        journal_fd = -1;
+    }
+    while ((e = queue_first))
+    {
+        queue_first = e->next;
+        entry_free(e);
+    }
+    queue_last = NULL;
+    free(journal_dir);
+    free(journal_path);
+    journal_dir = journal_path = NULL;
+    free(journal_error);
+    journal_error = NULL;
+    journal_failed = 0;
+    pthread_mutex_unlock(&journal_lock);
+}
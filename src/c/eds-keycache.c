@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  GLite Data Management - Cache of the joined keys of the encrypted data
+ *  storage API
+ *
+ */
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <glite/data/hydra/c/eds-simple.h>
+
+#include "eds_internal.h"
+
+/* Keys kept by default */
+#define EDS_KEYCACHE_SIZE       256
+/* Seconds a missing key is remembered by default */
+#define EDS_KEYCACHE_MISSING    10
+
+/* Longest key and iv kept, in hex format with the terminating zero */
+#define EDS_KEYCACHE_KEY_LEN    (2 * EVP_MAX_KEY_LENGTH + 1)
+#define EDS_KEYCACHE_IV_LEN     (2 * EVP_MAX_IV_LENGTH + 1)
+
+/* Key material of an entry, kept in locked memory */
+struct eds_key_secret {
+    char hex_key[EDS_KEYCACHE_KEY_LEN];
+    char hex_iv[EDS_KEYCACHE_IV_LEN];
+};
+
+/* What is known about the key of an id, as seen by a credential */
+struct eds_key_entry {
+    char *id;                   /* NULL if the slot is free */
+    char *owner;                /* subject of the credential that read it */
+    char *cipher;
+    char *keyinfo;
+    int missing;                /* no key is registered for the id */
+    time_t expires;
+    struct eds_key_secret *secret;
+    struct eds_key_entry *prev; /* in the order of use, most recent first */
+    struct eds_key_entry *next;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct eds_key_entry *entries;
+static struct eds_key_secret *secrets;
+static int cache_size;
+static struct eds_key_entry *first, *last;
+
+/* Subject of the credential in use, and the file it was read from */
+static char *owner;
+static char *owner_path;
+static struct stat owner_stat;
+
+/**
+ * Helper function - file of the credential the key store requests are made
+ * with: the proxy, or else the user certificate
+ */
+static char *cache_credential(void)
+{
+    char *path, *home;
+    struct stat st;
+
+    path = getenv("X509_USER_PROXY");
+    if (path && *path)
+        return strdup(path);
+    if (asprintf(&path, "/tmp/x509up_u%d", (int)getuid()) < 0)
+        return NULL;
+    if (!stat(path, &st))
+        return path;
+    free(path);
+
+    path = getenv("X509_USER_CERT");
+    if (path && *path)
+        return strdup(path);
+    home = getenv("HOME");
+    if (!home || asprintf(&path, "%s/.globus/usercert.pem", home) < 0)
+        return NULL;
+    return path;
+}
+
+/**
+ * Helper function - subject of the credential in use. The keys read with
+ * one credential are never given out to another one, and no key is cached
+ * when the credential cannot be read. The subject is read again only when
+ * the credential file changes. Must be called with the lock held.
+ */
+static const char *cache_owner(void)
+{
+    struct stat st;
+    X509 *cert;
+    FILE *fp;
+    char *path;
+
+    path = cache_credential();
+    if (!path)
+        return NULL;
+    if (stat(path, &st))
+    {
+        free(path);
+        return NULL;
+    }
+    if (owner && !strcmp(path, owner_path) && st.st_dev == owner_stat.st_dev &&
+        st.st_ino == owner_stat.st_ino && st.st_size == owner_stat.st_size &&
+        st.st_mtime == owner_stat.st_mtime)
+    {
+        free(path);
+        return owner;
+    }
+
+    free(owner);
+    free(owner_path);
+    owner = owner_path = NULL;
+
+    fp = fopen(path, "r");
+    if (!fp)
+    {
+        free(path);
+        return NULL;
+    }
+    cert = PEM_read_X509(fp, NULL, NULL, NULL);
+    fclose(fp);
+    if (!cert)
+    {
+        free(path);
+        return NULL;
+    }
+    owner = X509_NAME_oneline(X509_get_subject_name(cert), NULL, 0);
+    X509_free(cert);
+    if (!owner)
+    {
+        free(path);
+        return NULL;
+    }
+    owner_path = path;
+    owner_stat = st;
+
+    return owner;
+}
+
+/**
+ * Helper function - allocate the slots on first use. The key material is
+ * locked in memory and left out of core dumps; without that the cache is
+ * not used at all. Must be called with the lock held.
+ */
+static int cache_alloc(void)
+{
+    size_t len;
+    void *mem;
+    int i, size;
+
+    if (entries)
+        return 0;
+
+    size = _glite_env_int(GLITE_EDS_KEY_CACHE_SIZE_ENV,
+        EDS_KEYCACHE_SIZE, 0);
+    if (size <= 0)
+        return -1;
+
+    len = size * sizeof(*secrets);
+    mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+        -1, 0);
+    if (mem == MAP_FAILED)
+        return -1;
+    if (mlock(mem, len))
+    {
+        munmap(mem, len);
+        return -1;
+    }
+#ifdef MADV_DONTDUMP
+    madvise(mem, len, MADV_DONTDUMP);
+#endif
+
+    entries = (struct eds_key_entry *)calloc(size, sizeof(*entries));
+    if (!entries)
+    {
+        munlock(mem, len);
+        munmap(mem, len);
+        return -1;
+    }
+    secrets = (struct eds_key_secret *)mem;
+    cache_size = size;
+
+    /* All slots are in the list, the free ones at the end */
+    for (i = 0; i < size; i++)
+    {
+        entries[i].secret = &secrets[i];
+        entries[i].prev = i ? &entries[i - 1] : NULL;
+        entries[i].next = i < size - 1 ? &entries[i + 1] : NULL;
+    }
+    first = &entries[0];
+    last = &entries[size - 1];
+
+    return 0;
+}
+
+/**
+ * Helper function - empty a slot and move it to the end of the list. Must
+ * be called with the lock held.
+ */
+static void entry_clear(struct eds_key_entry *entry)
+{
+    free(entry->id);
+    free(entry->owner);
+    free(entry->cipher);
+    free(entry->keyinfo);
+    entry->id = entry->owner = entry->cipher = entry->keyinfo = NULL;
+    OPENSSL_cleanse(entry->secret, sizeof(*entry->secret));
+
+    if (entry == last)
+        return;
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        first = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = last;
+    entry->next = NULL;
+    last->next = entry;
+    last = entry;
+}
+
+/**
+ * Helper function - move a slot to the head of the list. Must be called
+ * with the lock held.
+ */
+static void entry_touch(struct eds_key_entry *entry)
+{
+    if (entry == first)
+        return;
+    entry->prev->next = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        last = entry->prev;
+    entry->prev = NULL;
+    entry->next = first;
+    first->prev = entry;
+    first = entry;
+}
+
+/**
+ * Helper function - find the entry of an id for a credential, dropping it
+ * if it has expired. Must be called with the lock held.
+ */
+static struct eds_key_entry *entry_find(const char *id, const char *subject)
+{
+    struct eds_key_entry *entry;
+
+    for (entry = first; entry && entry->id; entry = entry->next)
+    {
+        if (strcmp(entry->id, id) || strcmp(entry->owner, subject))
+            continue;
+        if (time(NULL) < entry->expires)
+            return entry;
+        entry_clear(entry);
+        return NULL;
+    }
+    return NULL;
+}
+
+/**
+ * Helper function - take a slot for an id and a credential: its current
+ * one, or the least recently used. Must be called with the lock held.
+ */
+static struct eds_key_entry *entry_new(const char *id, const char *subject)
+{
+    struct eds_key_entry *entry;
+
+    entry = entry_find(id, subject);
+    if (!entry)
+        entry = last;
+    entry_clear(entry);
+    entry->id = strdup(id);
+    entry->owner = strdup(subject);
+    if (!entry->id || !entry->owner)
+    {
+        entry_clear(entry);
+        return NULL;
+    }
+    entry_touch(entry);
+    return entry;
+}
+
+int _glite_eds_keycache_get(const char *id, char **hex_key, char **hex_iv,
+    char **cipher, char **keyinfo)
+{
+    struct eds_key_entry *entry = NULL;
+    const char *subject;
+    int res = 0;
+
+    if (_glite_env_int(GLITE_EDS_KEY_CACHE_TTL_ENV, 0, 0) <= 0)
+        return 0;
+
+    pthread_mutex_lock(&cache_lock);
+    if (entries && (subject = cache_owner()))
+        entry = entry_find(id, subject);
+    if (entry && entry->missing)
+    {
+        entry_touch(entry);
+        res = -1;
+    }
+    else if (entry)
+    {
+        *hex_key = strdup(entry->secret->hex_key);
+        *hex_iv = strdup(entry->secret->hex_iv);
+        *cipher = strdup(entry->cipher);
+        *keyinfo = strdup(entry->keyinfo);
+        if (*hex_key && *hex_iv && *cipher && *keyinfo)
+        {
+            entry_touch(entry);
+            res = 1;
+        }
+        else
+        {
+            free(*hex_key); free(*hex_iv); free(*cipher); free(*keyinfo);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    _glite_eds_count_key_cache(res != 0);
+    return res;
+}
+
+void _glite_eds_keycache_put(const char *id, const char *hex_key,
+    const char *hex_iv, const char *cipher, const char *keyinfo)
+{
+    struct eds_key_entry *entry;
+    const char *subject;
+    int ttl;
+
+    ttl = _glite_env_int(GLITE_EDS_KEY_CACHE_TTL_ENV, 0, 0);
+    if (ttl <= 0 || strlen(hex_key) >= EDS_KEYCACHE_KEY_LEN ||
+        strlen(hex_iv) >= EDS_KEYCACHE_IV_LEN)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+    if (!cache_alloc() && (subject = cache_owner()) &&
+        (entry = entry_new(id, subject)))
+    {
+        entry->cipher = strdup(cipher);
+        entry->keyinfo = strdup(keyinfo);
+        if (entry->cipher && entry->keyinfo)
+        {
+            strcpy(entry->secret->hex_key, hex_key);
+            strcpy(entry->secret->hex_iv, hex_iv);
+            entry->missing = 0;
+            entry->expires = time(NULL) + ttl;
+        }
+        else
+            entry_clear(entry);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void _glite_eds_keycache_put_missing(const char *id)
+{
+    struct eds_key_entry *entry;
+    const char *subject;
+    int ttl;
+
+    if (_glite_env_int(GLITE_EDS_KEY_CACHE_TTL_ENV, 0, 0) <= 0)
+        return;
+    ttl = _glite_env_int(GLITE_EDS_KEY_CACHE_MISSING_ENV,
+        EDS_KEYCACHE_MISSING, 0);
+    if (ttl <= 0)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+    if (!cache_alloc() && (subject = cache_owner()) &&
+        (entry = entry_new(id, subject)))
+    {
+        entry->missing = 1;
+        entry->expires = time(NULL) + ttl;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void _glite_eds_keycache_invalidate(const char *id)
+{
+    struct eds_key_entry *entry, *next;
+
+    pthread_mutex_lock(&cache_lock);
+    if (entries)
+    {
+        /* A cleared slot moves to the tail, the next one is taken first so
+         * that the entries of all subjects are cleared */
+        for (entry = first; entry && entry->id; entry = next)
+        {
+            next = entry->next;
+            if (!strcmp(entry->id, id))
+                entry_clear(entry);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void _glite_eds_keycache_cleanup(void)
+{
+    size_t len;
+    int i;
+
+    pthread_mutex_lock(&cache_lock);
+    if (entries)
+    {
+        for (i = 0; i < cache_size; i++)
+        {
+            free(entries[i].id);
+            free(entries[i].owner);
+            free(entries[i].cipher);
+            free(entries[i].keyinfo);
+        }
+        free(entries);
+
+        len = cache_size * sizeof(*secrets);
+        OPENSSL_cleanse(secrets, len);
+        munlock(secrets, len);
+        munmap(secrets, len);
+
+        entries = NULL;
+        secrets = NULL;
+        first = last = NULL;
+        cache_size = 0;
+    }
+    free(owner);
+    free(owner_path);
+    owner = owner_path = NULL;
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  GLite Data Management - Library initialization of the encrypted data
+ *  storage API
+ *
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <glite/data/hydra/c/eds-simple.h>
+
+#include "eds_internal.h"
+
+/* Size of the per-thread buffer holding OpenSSL error strings */
+#define EDS_SSL_ERROR_LEN     256
+
+/* Non-blocking source used to seed the random number generator */
+#define EDS_RANDOM_SOURCE     "/dev/urandom"
+#define EDS_RANDOM_SEED_BYTES 32
+
+/* Cipher lookup cache */
+struct eds_cipher_entry {
+    char *name;
+    const EVP_CIPHER *cipher;
+    int fetched;        /* owned by the cache (OpenSSL 3 fetch) */
+    struct eds_cipher_entry *next;
+};
+
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static int initialized;
+static struct eds_cipher_entry *cipher_cache;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* Locks handed to OpenSSL, NULL if the application installed its own */
+static pthread_mutex_t *ssl_locks;
+
+/**
+ * Helper function - OpenSSL locking callback
+ */
+static void eds_ssl_locking(int mode, int n, const char *file, int line)
+{
+    (void)file;
+    (void)line;
+
+    if (mode & CRYPTO_LOCK)
+        pthread_mutex_lock(&ssl_locks[n]);
+    else
+        pthread_mutex_unlock(&ssl_locks[n]);
+}
+
+/**
+ * Helper function - OpenSSL thread id callback
+ */
+static unsigned long eds_ssl_thread_id(void)
+{
+    return (unsigned long)pthread_self();
+}
+
+/**
+ * Helper function - make OpenSSL usable from several threads. Older
+ * OpenSSL versions rely on the application to provide the locks; if the
+ * application (or Globus) has already done so, leave them alone.
+ */
+static int eds_ssl_threads_setup(void)
+{
+    int i, n;
+
+    if (CRYPTO_get_locking_callback())
+        return 0;
+
+    n = CRYPTO_num_locks();
+    ssl_locks = (pthread_mutex_t *)calloc(n, sizeof(*ssl_locks));
+    if (!ssl_locks)
+        return -1;
+    for (i = 0; i < n; i++)
+        pthread_mutex_init(&ssl_locks[i], NULL);
+
+    CRYPTO_set_id_callback(eds_ssl_thread_id);
+    CRYPTO_set_locking_callback(eds_ssl_locking);
+    return 0;
+}
+
+/**
+ * Helper function - remove the callbacks installed by eds_ssl_threads_setup
+ */
+static void eds_ssl_threads_cleanup(void)
+{
+    int i, n;
+
+    if (!ssl_locks || CRYPTO_get_locking_callback() != eds_ssl_locking)
+        return;
+
+    CRYPTO_set_locking_callback(NULL);
+    CRYPTO_set_id_callback(NULL);
+
+    n = CRYPTO_num_locks();
+    for (i = 0; i < n; i++)
+        pthread_mutex_destroy(&ssl_locks[i]);
+    free(ssl_locks);
+    ssl_locks = NULL;
+}
+#endif
+
+/**
+ * Initialize the library
+ */
+int glite_eds_library_init(char **error)
+{
+    int res = 0;
+
+    pthread_mutex_lock(&init_lock);
+    if (!initialized)
+    {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+        if (eds_ssl_threads_setup())
+        {
+            asprintf(error, "glite_eds_library_init error: out of memory");
+            pthread_mutex_unlock(&init_lock);
+            return -1;
+        }
+#endif
+        if (RAND_load_file(EDS_RANDOM_SOURCE, EDS_RANDOM_SEED_BYTES) !=
+            EDS_RANDOM_SEED_BYTES)
+        {
+            asprintf(error, "glite_eds_library_init error: seeding from %s "
+                "failed: %s", EDS_RANDOM_SOURCE,
+                _glite_eds_ssl_error());
+            res = -1;
+        }
+        else
+        {
+            OpenSSL_add_all_ciphers();
+            initialized = 1;
+        }
+    }
+    pthread_mutex_unlock(&init_lock);
+
+    return res;
+}
+
+/**
+ * Release the resources allocated by glite_eds_library_init
+ */
+void glite_eds_library_cleanup(void)
+{
+    struct eds_cipher_entry *entry;
+
+    _glite_eds_async_cleanup();
+    _glite_eds_replication_cleanup();
+    _glite_eds_journal_cleanup();
+    _glite_eds_pool_cleanup();
+    _glite_eds_keycache_cleanup();
+    _glite_eds_probe_cleanup();
+
+    pthread_mutex_lock(&init_lock);
+    while (cipher_cache)
+    {
+        entry = cipher_cache;
+        cipher_cache = entry->next;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        if (entry->fetched)
+            EVP_CIPHER_free((EVP_CIPHER *)entry->cipher);
+#endif
+        free(entry->name);
+        free(entry);
+    }
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    eds_ssl_threads_cleanup();
+#endif
+    initialized = 0;
+    pthread_mutex_unlock(&init_lock);
+}
+
+const char *_glite_eds_ssl_error(void)
+{
+    static __thread char buf[EDS_SSL_ERROR_LEN];
+
+    ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+    return buf;
+}
+
+const EVP_CIPHER *_glite_eds_get_cipher(const char *name)
+{
+    struct eds_cipher_entry *entry;
+    const EVP_CIPHER *cipher = NULL;
+    int fetched = 0;
+
+    pthread_mutex_lock(&init_lock);
+
+    for (entry = cipher_cache; entry; entry = entry->next)
+    {
+        if (!strcmp(entry->name, name))
+        {
+            pthread_mutex_unlock(&init_lock);
+            return entry->cipher;
+        }
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    /* A fetched cipher spares the implicit fetch of every EVP_*Init call */
+    cipher = EVP_CIPHER_fetch(NULL, name, NULL);
+    if (cipher)
+        fetched = 1;
+    else
+        ERR_clear_error();
+#endif
+    if (!cipher)
+        cipher = EVP_get_cipherbyname(name);
+
+    /* Failed lookups are not cached, the error stays in the OpenSSL queue */
+    if (cipher)
+    {
+        entry = (struct eds_cipher_entry *)calloc(1, sizeof(*entry));
+        if (entry && (entry->name = strdup(name)))
+        {
+            entry->cipher = cipher;
+            entry->fetched = fetched;
+            entry->next = cipher_cache;
+            cipher_cache = entry;
+        }
+        else
+        {
+            free(entry);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+            if (fetched)
+            {
+                EVP_CIPHER_free((EVP_CIPHER *)cipher);
+                cipher = EVP_get_cipherbyname(name);
+            }
+#endif
+        }
+    }
+
+    pthread_mutex_unlock(&init_lock);
+
+    return cipher;
+}
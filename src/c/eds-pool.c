@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  GLite Data Management - Catalog connection pool of the encrypted data
+ *  storage API
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glite/data/catalog/c/catalog-simple.h>
+#include <glite/data/hydra/c/eds-simple.h>
+
+#include "eds_internal.h"
+
+/* Seconds an unused connection is kept open by default */
+#define EDS_POOL_IDLE       60
+/* Unused connections kept open per endpoint */
+#define EDS_POOL_MAX_IDLE   8
+
+/* An unused context, connected to its endpoint */
+struct eds_pool_entry {
+    char *endpoint;
+    glite_catalog_ctx *ctx;
+    time_t last_used;
+    struct eds_pool_entry *next;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct eds_pool_entry *pool;
+
+/**
+ * Helper function - idle timeout of the pooled connections in seconds,
+ * 0 disables pooling
+ */
+static int pool_idle(void)
+{
+    return _glite_env_int(GLITE_EDS_POOL_IDLE_ENV, EDS_POOL_IDLE, 0);
+}
+
+/**
+ * Helper function - unlink the entries idle for longer than idle seconds
+ * and return them. Must be called with the lock held.
+ */
+static struct eds_pool_entry *pool_expire(time_t now, int idle)
+{
+    struct eds_pool_entry **p, *entry, *expired = NULL;
+
+    p = &pool;
+    while ((entry = *p))
+    {
+        if (now - entry->last_used >= idle)
+        {
+            *p = entry->next;
+            entry->next = expired;
+            expired = entry;
+        }
+        else
+            p = &entry->next;
+    }
+    return expired;
+}
+
+/**
+ * Helper function - close the connections of a list of entries. Called
+ * without the lock, closing may take a while.
+ */
+static void pool_free(struct eds_pool_entry *entry)
+{
+    struct eds_pool_entry *next;
+
+    for (; entry; entry = next)
+    {
+        next = entry->next;
+        glite_catalog_free(entry->ctx);
+        free(entry->endpoint);
+        free(entry);
+    }
+}
+
+glite_catalog_ctx *_glite_eds_ctx_get(const char *endpoint)
+{
+    struct eds_pool_entry **p, *entry, *found = NULL, *expired = NULL;
+    glite_catalog_ctx *ctx;
+    int idle;
+
+    idle = pool_idle();
+    if (idle > 0)
+    {
+        pthread_mutex_lock(&pool_lock);
+        expired = pool_expire(time(NULL), idle);
+        /* The most recently returned context is the least likely to have
+         * been closed by the server */
+        for (p = &pool; (entry = *p); p = &entry->next)
+        {
+            if (!strcmp(entry->endpoint, endpoint))
+            {
+                *p = entry->next;
+                found = entry;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&pool_lock);
+        pool_free(expired);
+    }
+
+    if (found)
+    {
+        ctx = found->ctx;
+        free(found->endpoint);
+        free(found);
+        _glite_eds_count_connection(1);
+    }
+    else
+    {
+        ctx = glite_catalog_new(endpoint);
+        if (!ctx)
+            return NULL;
+        if (idle > 0)
+            glite_catalog_set_keepalive(ctx, 1);
+        _glite_eds_count_connection(0);
+    }
+
+    /* A pooled context may still have the deadline of its last user */
+    _glite_eds_deadline_apply(ctx, _glite_eds_deadline_get());
+    return ctx;
+}
+
+void _glite_eds_ctx_put(glite_catalog_ctx *ctx, const char *endpoint,
+    int failed)
+{
+    struct eds_pool_entry *entry, *other, *expired = NULL;
+    int idle, count = 0;
+
+    if (!ctx)
+        return;
+
+    /* Only a connection that failed counts against the endpoint */
+    _glite_eds_endpoint_result(endpoint,
+        !(failed && glite_catalog_is_connection_error(ctx)));
+
+    /* A fault sent by the service (such as a missing entry) leaves the
+     * secure connection usable. Any other error may have lost it, or the
+     * context may not be initialized at all. */
+    idle = pool_idle();
+    if (idle <= 0 || (failed && (glite_catalog_is_connection_error(ctx) ||
+        glite_catalog_get_errclass(ctx) >= GLITE_CATALOG_ERROR_NONE)))
+    {
+        glite_catalog_free(ctx);
+        return;
+    }
+
+    entry = (struct eds_pool_entry *)calloc(1, sizeof(*entry));
+    if (!entry || !(entry->endpoint = strdup(endpoint)))
+    {
+        free(entry);
+        glite_catalog_free(ctx);
+        return;
+    }
+    entry->ctx = ctx;
+    entry->last_used = time(NULL);
+
+    pthread_mutex_lock(&pool_lock);
+    expired = pool_expire(entry->last_used, idle);
+    for (other = pool; other; other = other->next)
+    {
+        if (!strcmp(other->endpoint, endpoint))
+            count++;
+    }
+    if (count < EDS_POOL_MAX_IDLE)
+    {
+        entry->next = pool;
+        pool = entry;
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    pool_free(entry);
+    pool_free(expired);
+}
+
+void _glite_eds_pool_cleanup(void)
+{
+    struct eds_pool_entry *entries;
+
+    pthread_mutex_lock(&pool_lock);
+    entries = pool;
+    pool = NULL;
+    pthread_mutex_unlock(&pool_lock);
+
+    pool_free(entries);
+}
@@ -0,0 +1,689 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  GLite Data Management - Write quorum key registration of the encrypted
+ *  data storage API
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/crypto.h>
+#include <glite/data/hydra/c/eds-simple.h>
+
+#include "eds_internal.h"
+
+/* Margin of the write quorum above the pieces needed, by default */
+#define EDS_WRITE_MARGIN        1
+/* Retries of a key store that does not answer, by default */
+#define EDS_WRITE_RETRIES       5
+/* First and longest pause between the retries, in seconds */
+#define EDS_RETRY_DELAY         1
+#define EDS_RETRY_DELAY_MAX     60
+/* Threads storing the pieces, by default */
+#define EDS_WRITE_THREADS       32
+
+/* State of the piece of one key store */
+#define EDS_PIECE_PENDING   0
+#define EDS_PIECE_STORED    1
+#define EDS_PIECE_FAILED    2   /* given up */
+
+struct eds_replication;
+
+/* Piece of a key for one key store, queued until a thread stores it */
+struct eds_replica {
+    struct eds_replication *r;
+    struct eds_replica *next_queued;
+    int index;              /* of the endpoint and of the piece */
+    char *hex_key;
+    int state;              /* EDS_PIECE_* */
+    int tried;              /* the first attempt has finished */
+    int attempt;            /* retries done */
+    int delay;              /* pause before the next retry, in seconds */
+    double retry_at;        /* the next retry is not due before */
+    int unreachable;        /* of the last attempt */
+    char *error;            /* ditto */
+};
+
+/* Registration of one key, until every piece is stored or given up. Shared
+ * by the registering thread, the list of registrations and the queued
+ * pieces, the last one to let go frees it. */
+struct eds_replication {
+    int refs;
+    char *id;
+    _glite_eds_endpoints *list;
+    char *hex_iv;
+    char *cipher;
+    char *keyinfo;
+    int keys_needed;
+    double deadline;        /* of the first attempts, 0 if there is none */
+    int count;
+    struct eds_replica *replicas;
+    int stored;
+    int finished;           /* pieces stored or given up */
+    int aborted;            /* the registration failed or was removed */
+    int listed;
+    struct eds_replication *next;
+};
+
+/* Removal of a piece stored by a registration that failed */
+struct eds_remove_job {
+    char *endpoint;
+    char *id;
+    double deadline;
+};
+
+static pthread_mutex_t repl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t repl_changed = PTHREAD_COND_INITIALIZER;
+static struct eds_replication *repl_list;
+static struct eds_replica *queue_first, *queue_last;
+static int nthreads, stopping;
+
+/**
+ * Helper function - current time in seconds, not affected by clock changes
+ */
+static double repl_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Helper function - free a registration once nobody refers to it. Must be
+ * called with the lock held.
+ */
+static void repl_release(struct eds_replication *r)
+{
+    int i;
+
+    if (--r->refs > 0)
+        return;
+
+    for (i = 0; i < r->count; i++)
+    {
+        if (r->replicas[i].hex_key)
+        {
+            OPENSSL_cleanse(r->replicas[i].hex_key,
+                strlen(r->replicas[i].hex_key));
+            free(r->replicas[i].hex_key);
+        }
+        free(r->replicas[i].error);
+    }
+    free(r->replicas);
+    _glite_eds_endpoints_release(r->list);
+    free(r->id);
+    free(r->hex_iv);
+    free(r->cipher);
+    free(r->keyinfo);
+    free(r);
+}
+
+/**
+ * Helper function - drop a registration from the list. Must be called with
+ * the lock held.
+ */
+static void repl_unlink(struct eds_replication *r)
+{
+    struct eds_replication **p;
+
+    if (!r->listed)
+        return;
+    for (p = &repl_list; *p; p = &(*p)->next)
+    {
+        if (*p == r)
+        {
+            *p = r->next;
+            break;
+        }
+    }
+    r->listed = 0;
+    repl_release(r);
+}
+
+/**
+ * Helper function - queue a piece for the replica threads. Must be called
+ * with the lock held.
+ */
+static void replica_queue(struct eds_replica *rep)
+{
+    rep->next_queued = NULL;
+    if (queue_last)
+        queue_last->next_queued = rep;
+    else
+        queue_first = rep;
+    queue_last = rep;
+}
+
+/**
+ * Helper function - take the first queued piece that is due, or whose
+ * registration is given up. Otherwise sets *wait_until to the time the
+ * first one is due and returns NULL. Must be called with the lock held.
+ */
+static struct eds_replica *replica_take(double *wait_until)
+{
+    struct eds_replica *rep, *prev = NULL;
+    double now = repl_now();
+
+    *wait_until = 0;
+    for (rep = queue_first; rep; prev = rep, rep = rep->next_queued)
+    {
+        if (rep->retry_at <= now || rep->r->aborted || stopping)
+        {
+            if (prev)
+                prev->next_queued = rep->next_queued;
+            else
+                queue_first = rep->next_queued;
+            if (queue_last == rep)
+                queue_last = prev;
+            rep->next_queued = NULL;
+            return rep;
+        }
+        if (!*wait_until || rep->retry_at < *wait_until)
+            *wait_until = rep->retry_at;
+    }
+    return NULL;
+}
+
+/**
+ * Helper function - account for a piece that is stored or given up, and
+ * let go of its registration. Must be called with the lock held.
+ */
+static void replica_finish(struct eds_replica *rep)
+{
+    struct eds_replication *r = rep->r;
+
+    rep->tried = 1;
+
+    /* A complete registration needs no following any more */
+    if (++r->finished == r->count && r->stored == r->count)
+        repl_unlink(r);
+    pthread_cond_broadcast(&repl_changed);
+    repl_release(r);
+}
+
+/**
+ * Helper function - try once to store a piece. A key store that does not
+ * answer is asked again later: the piece goes back to the queue, so that
+ * the thread stores other pieces meanwhile. Must be called with the lock
+ * held, which is released meanwhile.
+ */
+static void replica_store(struct eds_replica *rep)
+{
+    struct eds_replication *r = rep->r;
+    char *endpoint = r->list->endpoints[rep->index];
+    double deadline = r->deadline;
+    int retries, res, unreachable;
+    char *error;
+
+    retries = _glite_env_int(GLITE_EDS_WRITE_RETRIES_ENV,
+        EDS_WRITE_RETRIES, 0);
+
+    if (!r->aborted && !stopping)
+    {
+        pthread_mutex_unlock(&repl_lock);
+
+        /* The retries are not bound to the time of the registration */
+        if (rep->attempt)
+            deadline = _glite_eds_deadline_within(_glite_eds_default_timeout());
+        error = NULL;
+        res = _glite_eds_piece_put(endpoint, r->id, rep->hex_key, r->hex_iv,
+            r->cipher, r->keyinfo, r->keys_needed, rep->index, deadline,
+            &unreachable, &error);
+        if (res && unreachable)
+            _glite_eds_endpoints_invalidate(r->list);
+
+        pthread_mutex_lock(&repl_lock);
+        rep->tried = 1;
+        rep->unreachable = unreachable;
+        free(rep->error);
+        rep->error = error;
+        if (!res)
+        {
+            rep->state = EDS_PIECE_STORED;
+            r->stored++;
+        }
+        /* An error of the service would only come again */
+        else if (unreachable && rep->attempt < retries && !r->aborted &&
+            !stopping)
+        {
+            rep->attempt++;
+            rep->retry_at = repl_now() + rep->delay;
+            rep->delay = rep->delay * 2 < EDS_RETRY_DELAY_MAX ?
+                rep->delay * 2 : EDS_RETRY_DELAY_MAX;
+            replica_queue(rep);
+            pthread_cond_broadcast(&repl_changed);
+            return;
+        }
+    }
+
+    /* A piece stored after the registration was given up must not stay */
+    if (rep->state == EDS_PIECE_STORED && r->aborted)
+    {
+        rep->state = EDS_PIECE_FAILED;
+        r->stored--;
+        pthread_mutex_unlock(&repl_lock);
+        error = NULL;
+        _glite_eds_piece_remove(endpoint, r->id,
+            _glite_eds_deadline_within(_glite_eds_default_timeout()), &error);
+        free(error);
+        pthread_mutex_lock(&repl_lock);
+    }
+    if (rep->state != EDS_PIECE_STORED)
+    {
+        rep->state = EDS_PIECE_FAILED;
+        if (!rep->error)
+            asprintf(&rep->error, "glite_eds_replication error: storing the "
+                "key piece in %s was given up", endpoint);
+    }
+    replica_finish(rep);
+}
+
+/**
+ * Helper function - main function of the replica threads: store the queued
+ * pieces when they are due, until there are none left
+ */
+static void *replica_run(void *arg)
+{
+    struct eds_replica *rep;
+    struct timespec until;
+    double wait_until, left;
+
+    (void)arg;
+    pthread_mutex_lock(&repl_lock);
+    while (queue_first)
+    {
+        rep = replica_take(&wait_until);
+        if (rep)
+        {
+            replica_store(rep);
+            continue;
+        }
+
+        /* Only retries that are not due yet, unless a piece comes */
+        left = wait_until - repl_now();
+        if (left < 0)
+            left = 0;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += (time_t)left;
+        until.tv_nsec += (long)((left - (time_t)left) * 1e9);
+        if (until.tv_nsec >= 1000000000)
+        {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&repl_changed, &repl_lock, &until);
+    }
+    nthreads--;
+    pthread_cond_broadcast(&repl_changed);
+    pthread_mutex_unlock(&repl_lock);
+
+    return NULL;
+}
+
+/**
+ * Helper function - worker side of the removal of the stored pieces
+ */
+static void repl_remove_job_run(void *arg)
+{
+    struct eds_remove_job *job = arg;
+    char *error = NULL;
+
+    _glite_eds_piece_remove(job->endpoint, job->id, job->deadline, &error);
+    free(error);
+}
+
+/**
+ * Helper function - number of pieces whose first attempt has not finished
+ * yet. Must be called with the lock held.
+ */
+static int repl_untried(struct eds_replication *r)
+{
+    int i, n = 0;
+
+    for (i = 0; i < r->count; i++)
+    {
+        if (r->replicas[i].state == EDS_PIECE_PENDING && !r->replicas[i].tried)
+            n++;
+    }
+    return n;
+}
+
+/**
+ * Helper function - error of a replication that has failed, in endpoint
+ * order. Must be called with the lock held.
+ */
+static char *repl_error(struct eds_replication *r, const char *func)
+{
+    char *error = NULL;
+    int i;
+
+    for (i = 0; i < r->count; i++)
+    {
+        if (r->replicas[i].state != EDS_PIECE_STORED && r->replicas[i].error)
+        {
+            asprintf(&error, "%s error: key of %s stored in %d of %d key "
+                "stores:%s%s", func, r->id, r->stored, r->count,
+                *r->replicas[i].error == ' ' ? "" : " ", r->replicas[i].error);
+            return error;
+        }
+    }
+    asprintf(&error, "%s error: key of %s stored in %d of %d key stores",
+        func, r->id, r->stored, r->count);
+    return error;
+}
+
+int _glite_eds_write_quorum(int epcount, int keys_needed)
+{
+    int quorum, margin;
+
+    quorum = _glite_env_int(GLITE_EDS_WRITE_QUORUM_ENV, 0, 0);
+    if (quorum <= 0)
+        return 0;
+    margin = _glite_env_int(GLITE_EDS_WRITE_MARGIN_ENV,
+        EDS_WRITE_MARGIN, 0);
+    if (quorum < keys_needed + margin)
+        quorum = keys_needed + margin;
+    if (quorum >= epcount)
+        return 0;
+    return quorum;
+}
+
+int _glite_eds_replicate(char *id, _glite_eds_endpoints *list,
+    unsigned char **pieces, char *hex_iv, char *cipher, char *keyinfo,
+    int keys_needed, int quorum, char **error)
+{
+    struct eds_replication *r;
+    struct eds_replica *rep;
+    struct eds_remove_job *jobs = NULL;
+    _glite_eds_workers *workers = NULL;
+    pthread_attr_t attr;
+    pthread_t thread;
+    double start, deadline;
+    int i, nremove = 0, timedout = 0, max_threads;
+    int res = 0;
+
+    start = repl_now();
+    r = (struct eds_replication *)calloc(1, sizeof(*r));
+    if (r)
+        r->replicas = (struct eds_replica *)calloc(list->count,
+            sizeof(*r->replicas));
+    if (!r || !r->replicas)
+    {
+        for (i = 0; i < list->count; i++)
+        {
+            OPENSSL_cleanse(pieces[i], strlen((char *)pieces[i]));
+            free(pieces[i]);
+        }
+        free(pieces);
+        if (r)
+            free(r);
+        _glite_eds_endpoints_release(list);
+        asprintf(error, "glite_eds_put_metadata error: out of memory");
+        return -1;
+    }
+    r->count = list->count;
+    r->list = list;
+    r->keys_needed = keys_needed;
+    r->deadline = _glite_eds_deadline_get();
+    for (i = 0; i < r->count; i++)
+    {
+        r->replicas[i].r = r;
+        r->replicas[i].index = i;
+        r->replicas[i].hex_key = (char *)pieces[i];
+        r->replicas[i].delay = EDS_RETRY_DELAY;
+    }
+    free(pieces);
+    r->id = strdup(id);
+    r->hex_iv = strdup(hex_iv);
+    r->cipher = strdup(cipher);
+    r->keyinfo = strdup(keyinfo);
+    r->refs = 1;
+    if (!r->id || !r->hex_iv || !r->cipher || !r->keyinfo)
+    {
+        pthread_mutex_lock(&repl_lock);
+        repl_release(r);
+        pthread_mutex_unlock(&repl_lock);
+        asprintf(error, "glite_eds_put_metadata error: out of memory");
+        return -1;
+    }
+
+    /* The pieces are queued for a bounded number of threads, up to one
+     * per piece: the stragglers outlive the call */
+    max_threads = _glite_env_int(GLITE_EDS_WRITE_THREADS_ENV,
+        EDS_WRITE_THREADS, 1);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_mutex_lock(&repl_lock);
+    r->next = repl_list;
+    repl_list = r;
+    r->listed = 1;
+    r->refs++;
+    for (i = 0; i < r->count; i++)
+    {
+        r->refs++;
+        replica_queue(&r->replicas[i]);
+    }
+    pthread_cond_broadcast(&repl_changed);
+    for (i = 0; i < r->count && nthreads < max_threads; i++)
+    {
+        if (pthread_create(&thread, &attr, replica_run, NULL))
+            break;
+        nthreads++;
+    }
+    pthread_attr_destroy(&attr);
+
+    /* Nobody would store the queued pieces */
+    while (!nthreads && (rep = queue_first))
+    {
+        queue_first = rep->next_queued;
+        if (!queue_first)
+            queue_last = NULL;
+        rep->next_queued = NULL;
+        rep->state = EDS_PIECE_FAILED;
+        asprintf(&rep->error, "glite_eds_put_metadata error: cannot start "
+            "a thread");
+        replica_finish(rep);
+    }
+
+    /* Wait for the quorum, or until the first attempts can not reach it */
+    while (!r->aborted && r->stored < quorum &&
+        r->stored + repl_untried(r) >= quorum)
+        pthread_cond_wait(&repl_changed, &repl_lock);
+
+    if (r->stored < quorum)
+    {
+        if (r->aborted)
+            asprintf(error, "glite_eds_put_metadata error: the registration "
+                "of %s was removed", r->id);
+        else
+            *error = repl_error(r, "glite_eds_put_metadata");
+        res = -1;
+
+        /* The pieces stored so far are removed here, the ones still on
+         * their way by their threads */
+        r->aborted = 1;
+        pthread_cond_broadcast(&repl_changed);
+        jobs = (struct eds_remove_job *)calloc(r->count, sizeof(*jobs));
+        for (i = 0; jobs && i < r->count; i++)
+        {
+            if (r->replicas[i].unreachable == EDS_TIMED_OUT)
+                timedout = 1;
+            if (r->replicas[i].state != EDS_PIECE_STORED)
+                continue;
+            r->replicas[i].state = EDS_PIECE_FAILED;
+            r->stored--;
+            jobs[nremove++].endpoint = list->endpoints[i];
+        }
+        repl_unlink(r);
+    }
+    pthread_mutex_unlock(&repl_lock);
+
+    if (timedout)
+        _glite_eds_deadline_timed_out();
+    if (nremove)
+    {
+        /* The time is likely to be up, the removal gets a budget of its
+         * own rather than leaving the pieces behind */
+        deadline = r->deadline ? repl_now() + (r->deadline - start) : 0;
+        for (i = 0; i < nremove; i++)
+        {
+            jobs[i].id = r->id;
+            jobs[i].deadline = deadline;
+        }
+        if (nremove > 1)
+            workers = _glite_eds_workers_new(nremove < EDS_MAX_ENDPOINT_THREADS ?
+                nremove : EDS_MAX_ENDPOINT_THREADS);
+        _glite_eds_workers_run(workers, repl_remove_job_run, jobs,
+            sizeof(*jobs), nremove);
+        _glite_eds_workers_free(workers);
+    }
+    free(jobs);
+
+    pthread_mutex_lock(&repl_lock);
+    repl_release(r);
+    pthread_mutex_unlock(&repl_lock);
+
+    return res;
+}
+
+void _glite_eds_replication_cancel(const char *id)
+{
+    struct eds_replication *r, *next;
+
+    pthread_mutex_lock(&repl_lock);
+    for (r = repl_list; r; r = next)
+    {
+        next = r->next;
+        if (strcmp(r->id, id))
+            continue;
+        r->aborted = 1;
+        repl_unlink(r);
+    }
+    pthread_cond_broadcast(&repl_changed);
+    pthread_mutex_unlock(&repl_lock);
+}
+
+int glite_eds_replication_status(char *id, int *stored, int *total,
+    char **error)
+{
+    struct eds_replication *r;
+    int res = GLITE_EDS_REPLICATION_DONE;
+
+    *stored = *total = 0;
+
+    pthread_mutex_lock(&repl_lock);
+    for (r = repl_list; r; r = r->next)
+    {
+        if (!strcmp(r->id, id))
+            break;
+    }
+    if (r)
+    {
+        *stored = r->stored;
+        *total = r->count;
+        if (r->finished < r->count)
+            res = GLITE_EDS_REPLICATION_PENDING;
+        else
+        {
+            res = GLITE_EDS_REPLICATION_FAILED;
+            *error = repl_error(r, "glite_eds_replication_status");
+            repl_unlink(r);
+        }
+    }
+    pthread_mutex_unlock(&repl_lock);
+
+    return res;
+}
+
+int glite_eds_replication_wait(char *id, int timeout_ms, char **error)
+{
+    struct eds_replication *r;
+    struct timespec until;
+    int pending, timedout = 0;
+    int res;
+
+    if (timeout_ms > 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += timeout_ms / 1000;
+        until.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000)
+        {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&repl_lock);
+    for (;;)
+    {
+        pending = 0;
+        for (r = repl_list; r; r = r->next)
+        {
+            if (id && strcmp(r->id, id))
+                continue;
+            if (r->finished == r->count)
+                break;
+            pending = 1;
+        }
+        if (r)
+        {
+            *error = repl_error(r, "glite_eds_replication_wait");
+            repl_unlink(r);
+            res = -1;
+            break;
+        }
+        if (!pending)
+        {
+            res = 0;
+            break;
+        }
+        if (timedout || timeout_ms == 0)
+        {
+            res = 1;
+            break;
+        }
+        if (timeout_ms < 0)
+            pthread_cond_wait(&repl_changed, &repl_lock);
+        else if (pthread_cond_timedwait(&repl_changed, &repl_lock, &until) ==
+            ETIMEDOUT)
+            timedout = 1;
+    }
+    pthread_mutex_unlock(&repl_lock);
+
+    return res;
+}
+
+void _glite_eds_replication_cleanup(void)
+{
+    pthread_mutex_lock(&repl_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&repl_changed);
+    while (nthreads > 0)
+        pthread_cond_wait(&repl_changed, &repl_lock);
+    while (repl_list)
+        repl_unlink(repl_list);
+    stopping = 0;
+    pthread_mutex_unlock(&repl_lock);
+}
@@ -27,17 +27,22 @@
 
 /* asprintf() is GNU extension */
 #define _GNU_SOURCE
+#include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
 #include <openssl/rand.h>
 #include <glite/data/glite-util.h>
 #include <glite/data/hydra/c/eds-simple.h>
 #include <glite/data/catalog/metadata/c/metadata-simple.h>
-#include <ServiceDiscovery.h>
 #include <glite/security/ssss.h>
 
+#include "eds_internal.h"
+
 
 /* Attribute values in Metadata Catalog */
 #define EDS_ATTR_IV      "edsiv"
@@ -50,6 +55,23 @@
 /* Default cipher */
 #define EDS_DEFAULT_CIPHER "bf-cbc"
 
+/* Size of the stack buffer used for in-place encryption/decryption */
+#define EDS_INPLACE_CHUNK 16384
+
+/* Minimum amount of data handed to a single worker thread */
+#define EDS_PARALLEL_MIN_CHUNK 65536
+
+/* Chunked AEAD container: magic, version, tag length, chunk size */
+#define EDS_AEAD_MAGIC      "gEDS"
+#define EDS_AEAD_VERSION    1
+#define EDS_AEAD_HEADER_LEN 12
+#define EDS_AEAD_TAG_LEN    16
+/* Authenticated data of a chunk: header, chunk index, last chunk flag */
+#define EDS_AEAD_AAD_LEN    (EDS_AEAD_HEADER_LEN + 9)
+/* Plaintext bytes per chunk written, and the largest chunk accepted */
+#define EDS_AEAD_CHUNK      65536
+#define EDS_AEAD_MAX_CHUNK  1048576
+
 struct hydra_data {
     char *hex_key;
     char *hex_iv;
@@ -59,6 +81,186 @@ struct hydra_data {
     int key_index;
 };
 
+/* State of the read of one key piece */
+#define EDS_READ_IDLE     0
+#define EDS_READ_RUNNING  1
+#define EDS_READ_HEDGED   2     /* running, and a duplicate was sent */
+#define EDS_READ_ANSWERED 3
+
+/* Default share of the key piece reads that may be hedges, in percent */
+#define EDS_HEDGE_BUDGET 5
+
+/* Key share reads of one glite_eds_get_metadata call. Shared by the caller
+ * and the reader threads, the last one to let go frees it. */
+struct eds_quorum {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int refs;
+    char *id;
+    _glite_eds_endpoints *list;
+    char **endpoints;       /* from list, in the order they are asked */
+    int epcount;
+    int *state;             /* EDS_READ_* of each endpoint */
+    int *hedge_of;          /* read duplicated by this one, or -1 */
+    double *hedge_at;       /* time to hedge a read, or a negative value */
+    int next;               /* next endpoint to ask */
+    int running;            /* reads not answered yet */
+    int done;               /* the outcome is known, later answers are dropped */
+    int missing;            /* reads answered with "no such entry" */
+    unsigned char **key_list;
+    unsigned int key_shares;
+    unsigned int keycount;  /* distinct pieces in key_list */
+    unsigned int keys_needed;
+    char *hex_iv;
+    char *keyinfo;
+    char *cipher;
+    char *error;            /* first error */
+    double deadline;        /* the reads are given up then, 0 for never */
+    int timedout;           /* a read ran out of time */
+    int forced;             /* ask the endpoints whatever their circuit */
+};
+
+/* One key share read, owned by the thread doing it */
+struct eds_quorum_read {
+    struct eds_quorum *quorum;
+    int index;
+};
+
+/* Catalog attributes holding one key piece */
+#define EDS_ATTR_COUNT 6
+static const char * const eds_attr_names[EDS_ATTR_COUNT] = {EDS_ATTR_IV,
+    EDS_ATTR_KEY, EDS_ATTR_CIPHER, EDS_ATTR_KEYINFO, EDS_ATTR_KEYSNEEDED,
+    EDS_ATTR_KEYINDEX};
+struct eds_attrs {
+    char keysneeded_str[10];
+    char keyindex_str[10];
+    glite_catalog_Attribute attr[EDS_ATTR_COUNT];
+    const glite_catalog_Attribute *attrs[EDS_ATTR_COUNT];
+};
+
+/* Ids handled by one job of a batch, and entries created by one request */
+#define EDS_BATCH_SIZE 100
+/* Jobs of a batch running at once on each endpoint, each on a connection of
+ * its own: no more than the pool keeps open */
+#define EDS_BATCH_CONNECTIONS 8
+
+/* Progress of one id on one endpoint in a batch */
+#define EDS_ENTRY_NONE    0
+#define EDS_ENTRY_CREATED 1     /* may exist, attributes not set */
+#define EDS_ENTRY_DONE    2     /* registered, or key piece read */
+
+/* Keys registered by one glite_eds_register_multi call, or looked up by
+ * one glite_eds_decrypt_init_multi call */
+struct eds_batch {
+    pthread_mutex_t lock;
+    const char *func;       /* for the error messages */
+    char **ids;
+    int nids;
+    char **endpoints;
+    int epcount;
+    char **shares;          /* key piece of id i for endpoint j at i * epcount + j */
+    struct hydra_data *pieces;  /* key pieces read, like shares */
+    char **hex_ivs;
+    char *cipher;
+    char *keyinfo;
+    unsigned int keys_needed;
+    unsigned char *state;   /* EDS_ENTRY_* of each piece, like shares */
+    char **errors;          /* first error of each id */
+    unsigned char *why;     /* EDS_FAILED_* of each id, NULL if not wanted */
+    int unreachable;        /* an endpoint could not be reached */
+};
+
+/* Consecutive ids of a batch on one endpoint, run by a worker */
+struct eds_batch_job {
+    struct eds_batch *batch;
+    int endpoint;
+    int first;
+    int count;
+};
+
+/* Operation on one key store endpoint, run by a worker */
+struct eds_endpoint_job {
+    char *endpoint;
+    char *id;
+    struct hydra_data data;
+    int res;
+    int unreachable;        /* the failure came from the transport:
+                             * EDS_UNREACHABLE or EDS_TIMED_OUT */
+    char *error;
+    double deadline;        /* of the operation, 0 if there is none */
+};
+
+/* Piece of a parallel CBC decryption done by one worker */
+struct eds_cbc_job {
+    EVP_CIPHER_CTX *ctx;
+    unsigned char iv[EVP_MAX_IV_LENGTH];
+    unsigned char *in;
+    unsigned char *out;
+    int len;
+    int ok;
+};
+
+/* Piece of a parallel CTR encryption/decryption done by one worker */
+struct eds_ctr_job {
+    EVP_CIPHER_CTX *ctx;
+    unsigned char counter[EVP_MAX_IV_LENGTH];
+    int skip;       /* keystream bytes to drop in the first counter block */
+    unsigned char *in;
+    unsigned char *out;
+    int len;
+    int ok;
+};
+
+/* One chunk of a chunked AEAD stream */
+struct eds_aead_job {
+    EVP_CIPHER_CTX *ctx;
+    int encrypt;
+    unsigned char nonce[EVP_MAX_IV_LENGTH];
+    unsigned char aad[EDS_AEAD_AAD_LEN];
+    unsigned char *in;
+    unsigned char *out;
+    int len;        /* plaintext bytes */
+    int ok;
+};
+
+/* State of the contexts created by this library, kept as their app_data */
+struct eds_ctx_data {
+    int encrypt;
+    int started;    /* set once data has been processed */
+    unsigned char iv[EVP_MAX_IV_LENGTH];
+    int iv_len;
+
+    /* Parallel CBC decryption */
+    int nthreads;
+    _glite_eds_workers *workers;
+    EVP_CIPHER_CTX **wctx;  /* one context per job, padding disabled */
+    struct eds_cbc_job *jobs;
+    struct eds_ctr_job *ctr_jobs;
+    off_t ctr_pos;      /* CTR: stream offset of the next byte */
+    unsigned char chain[EVP_MAX_IV_LENGTH];     /* last ciphertext block */
+    unsigned char partial[EVP_MAX_BLOCK_LENGTH];/* incomplete ciphertext block */
+    int partial_len;
+    unsigned char held[EVP_MAX_BLOCK_LENGTH];   /* last plaintext block */
+    int held_len;
+
+    /* Range decryption */
+    int padding;        /* the stream ends with the padded block */
+    int iv_missing;     /* IV bytes still expected at the head of the stream */
+    off_t range_skip;   /* plaintext bytes to drop before the range */
+    off_t range_left;   /* plaintext bytes left in the range, -1: no limit */
+
+    /* Chunked AEAD container */
+    int aead;
+    unsigned char header[EDS_AEAD_HEADER_LEN];
+    int header_len;     /* header bytes written or read so far */
+    int chunk_size;     /* plaintext bytes per chunk, 0: not known yet */
+    unsigned long long chunk_index;
+    unsigned char *slots;   /* one chunk buffer per job */
+    int nslots;
+    int slot_fill;      /* bytes waiting in the first slot */
+    struct eds_aead_job *aead_jobs;
+};
+
 EVP_CIPHER_CTX *glite_eds_init(char *id, char **key, char **iv,
                                const EVP_CIPHER **type, char **error);
 
@@ -200,79 +402,83 @@ static unsigned char ** realloc_str_list(unsigned char ** list, unsigned int *co
 }
 
 /**
- * Helper function - register data to the single named metadata catalog
+ * Helper function - tell if a failed catalog call could not reach the
+ * service at all (as opposed to an error reported by the service), and
+ * if it ran out of time
+ */
+static void eds_check_unreachable(glite_catalog_ctx *ctx, int *unreachable)
+{
+    if (!unreachable)
+        return;
+    if (glite_catalog_get_errclass(ctx) == GLITE_CATALOG_ERROR_TIMEOUT)
+        *unreachable = EDS_TIMED_OUT;
+    else if (glite_catalog_is_connection_error(ctx))
+        *unreachable = EDS_UNREACHABLE;
+    else
+        *unreachable = 0;
+}
+
+/**
+ * Helper function - fill the catalog attributes of a key piece
+ */
+static void eds_attrs_init(struct eds_attrs *a, const struct hydra_data *data)
+{
+    char *names[EDS_ATTR_COUNT] = {EDS_ATTR_CIPHER, EDS_ATTR_KEY, EDS_ATTR_IV,
+        EDS_ATTR_KEYINFO, EDS_ATTR_KEYSNEEDED, EDS_ATTR_KEYINDEX};
+    char *values[EDS_ATTR_COUNT] = {data->cipher, data->hex_key, data->hex_iv,
+        data->keyinfo, a->keysneeded_str, a->keyindex_str};
+    int i;
+
+    snprintf(a->keysneeded_str, sizeof(a->keysneeded_str), "%d", data->keys_needed);
+    snprintf(a->keyindex_str, sizeof(a->keyindex_str), "%d", data->key_index);
+
+    memset(a->attr, 0, sizeof(a->attr));
+    for (i = 0; i < EDS_ATTR_COUNT; i++)
+    {
+        a->attr[i].name = names[i];
+        a->attr[i].value = values[i];
+        a->attrs[i] = &a->attr[i];
+    }
+}
+
+/**
+ * Helper function - register data to the single named metadata catalog.
+ * *unreachable (if not NULL) tells if a failure came from the transport.
  */
 static int glite_eds_put_metadata_single(char *endpoint, char *id,
-    const struct hydra_data *data, char **error)
+    const struct hydra_data *data, char **error, int *unreachable)
 {
     glite_catalog_ctx *ctx;
-    char keysneeded_str[10], keyindex_str[10];
-    const glite_catalog_Attribute iv_attr = {EDS_ATTR_IV, data->hex_iv, NULL};
-    const glite_catalog_Attribute key_attr = {EDS_ATTR_KEY, data->hex_key, NULL};
-    const glite_catalog_Attribute cipher_attr = {EDS_ATTR_CIPHER, data->cipher, NULL};
-    const glite_catalog_Attribute keyinfo_attr = {EDS_ATTR_KEYINFO, data->keyinfo, NULL};
-    const glite_catalog_Attribute keysneeded_attr = {EDS_ATTR_KEYSNEEDED, keysneeded_str, NULL};
-    const glite_catalog_Attribute keyindex_attr = {EDS_ATTR_KEYINDEX, keyindex_str, NULL};
-    const glite_catalog_Attribute *attrs[] = {&cipher_attr, &key_attr,
-        &iv_attr, &keyinfo_attr, &keysneeded_attr, &keyindex_attr};
-    const int attrs_count = sizeof(attrs)/sizeof(*attrs);
-
-    snprintf(keysneeded_str, sizeof(keysneeded_str), "%d", data->keys_needed);
-    snprintf(keyindex_str, sizeof(keyindex_str), "%d", data->key_index);
+    struct eds_attrs a;
+
+    eds_attrs_init(&a, data);
  
-    if (NULL == (ctx = glite_catalog_new(endpoint)))
+    if (NULL == (ctx = _glite_eds_ctx_get(endpoint)))
     {
       asprintf(error, " glite_eds_put_metadata_single error (init): %s", glite_catalog_get_error(NULL));
        return -1;
     }
-    if (glite_metadata_createEntry(ctx, id, "eds"))
-    {
-        asprintf(error, " glite_eds_put_metadata_single error (createEntry): %s", glite_catalog_get_error(ctx));
-        glite_catalog_free(ctx);
-        return -1;
-    }
-
-    if (glite_metadata_setAttributes(ctx, id, attrs_count, attrs))
+    if (glite_metadata_createEntryWithAttributes(ctx, id, "eds", EDS_ATTR_COUNT, a.attrs))
     {
-        asprintf(error, " glite_eds_put_metadata_single error (setAttributes): %s", glite_catalog_get_error(ctx));
-        glite_catalog_free(ctx);
+        asprintf(error, " glite_eds_put_metadata_single error: %s", glite_catalog_get_error(ctx));
+        eds_check_unreachable(ctx, unreachable);
+        _glite_eds_ctx_put(ctx, endpoint, 1);
         return -1;
     }
-    glite_catalog_free(ctx);
+    _glite_eds_ctx_put(ctx, endpoint, 0);
 
     return 0;
 }
 
 /**
- * Helper function - get metadata related to the id from the single endpoint.
+ * Helper function - take the key piece out of the catalog attributes of an
+ * entry. Returns -1 if some of them are missing.
  */
-static int glite_eds_get_metadata_single(char *endpoint, char *id,
-    struct hydra_data *data, char **error)
+static int eds_data_from_attrs(glite_catalog_Attribute **result, int result_cnt,
+    struct hydra_data *data)
 {
-    glite_catalog_ctx *ctx;
-    glite_catalog_Attribute **result;
-    int result_cnt;
-    const char *attrs[] = {EDS_ATTR_IV, EDS_ATTR_KEY, EDS_ATTR_CIPHER, EDS_ATTR_KEYINFO,
-                           EDS_ATTR_KEYSNEEDED, EDS_ATTR_KEYINDEX};
-    const int attrs_count = sizeof(attrs)/sizeof(*attrs);
     char *keysneeded_str, *keyindex_str;
 
-    /* Get Metadata Catalog attributes for the file */
-    ctx = glite_catalog_new(endpoint);
-    if (!ctx)
-    {
-        asprintf(error, "glite_eds_init error: %s", glite_catalog_get_error(NULL));
-        return -1;
-    }
-
-    result = glite_metadata_getAttributes(ctx, id, attrs_count, attrs, &result_cnt);
-    if (result_cnt < 0)
-    {
-        asprintf(error, "glite_eds_init error: %s", glite_catalog_get_error(ctx));
-        glite_catalog_free(ctx);
-        return -1;
-    }
-
     data->hex_iv = get_attr_value(result, result_cnt, EDS_ATTR_IV, NULL);
     data->hex_key = get_attr_value(result, result_cnt, EDS_ATTR_KEY, NULL);
     data->keyinfo = get_attr_value(result, result_cnt, EDS_ATTR_KEYINFO, NULL);
@@ -286,13 +492,9 @@ static int glite_eds_get_metadata_single(char *endpoint, char *id,
     data->key_index = ustrtoi(keyindex_str);
     free(keyindex_str);
 
-    glite_catalog_Attribute_freeArray(ctx, result_cnt, result);
-    glite_catalog_free(ctx);
-
     /* Check required attributes */
     if (!data->hex_iv || !data->hex_key || !data->keyinfo || 
         !data->cipher || data->keys_needed < 0 || data->key_index < 0) {
-        asprintf(error, "glite_eds_get_metadata_single: required attributes missing");
         free(data->hex_iv);
         free(data->hex_key);
         free(data->keyinfo);
@@ -303,14 +505,58 @@ static int glite_eds_get_metadata_single(char *endpoint, char *id,
     return 0;
 }
 
+/**
+ * Helper function - get metadata related to the id from the single endpoint.
+ * *unreachable (if not NULL) tells if a failure came from the transport,
+ * *missing (if not NULL) if the endpoint has no entry for the id.
+ */
+static int glite_eds_get_metadata_single(char *endpoint, char *id,
+    struct hydra_data *data, char **error, int *unreachable, int *missing)
+{
+    glite_catalog_ctx *ctx;
+    glite_catalog_Attribute **result;
+    int result_cnt, res;
+
+    /* Get Metadata Catalog attributes for the file */
+    ctx = _glite_eds_ctx_get(endpoint);
+    if (!ctx)
+    {
+        asprintf(error, "glite_eds_init error: %s", glite_catalog_get_error(NULL));
+        return -1;
+    }
+
+    result = glite_metadata_getAttributes(ctx, id, EDS_ATTR_COUNT,
+        eds_attr_names, &result_cnt);
+    if (result_cnt < 0)
+    {
+        asprintf(error, "glite_eds_init error: %s", glite_catalog_get_error(ctx));
+        eds_check_unreachable(ctx, unreachable);
+        if (missing)
+            *missing = glite_catalog_get_errclass(ctx) ==
+                GLITE_CATALOG_EXCEPTION_NOTEXISTS;
+        _glite_eds_ctx_put(ctx, endpoint, 1);
+        return -1;
+    }
+
+    res = eds_data_from_attrs(result, result_cnt, data);
+    glite_catalog_Attribute_freeArray(ctx, result_cnt, result);
+    _glite_eds_ctx_put(ctx, endpoint, 0);
+
+    if (res)
+        asprintf(error, "glite_eds_get_metadata_single: required attributes missing");
+    return res;
+}
+
 /**
  * Unregister catalog entries in case of error (key/iv)
  * from the single endpoint.
+ * *unreachable (if not NULL) tells if a failure came from the transport.
  */
-static int glite_eds_unregister_single(char *endpoint, char *id, char **error)
+static int glite_eds_unregister_single(char *endpoint, char *id, char **error,
+    int *unreachable)
 {
     glite_catalog_ctx *ctx;
-    if (NULL == (ctx = glite_catalog_new(endpoint)))
+    if (NULL == (ctx = _glite_eds_ctx_get(endpoint)))
     {
         asprintf(error, "glite_eds_unregister_single error: %s", glite_catalog_get_error(NULL));
         return -1;
@@ -319,182 +565,513 @@ static int glite_eds_unregister_single(char *endpoint, char *id, char **error)
     if (glite_metadata_removeEntry(ctx, id))
     {
         asprintf(error, "glite_eds_unregister_single error: %s", glite_catalog_get_error(ctx));
-        glite_catalog_free(ctx);
+        eds_check_unreachable(ctx, unreachable);
+        _glite_eds_ctx_put(ctx, endpoint, 1);
         return -1;
     }
 
-    glite_catalog_free(ctx);
+    _glite_eds_ctx_put(ctx, endpoint, 0);
     return 0;
 }
 
 /**
- * Get endpoints of default catalog service and all associated services.
- * User should free the list (or error string) after use.
+ * Helper function - fail a job at once if its endpoint keeps failing,
+ * instead of waiting for the connection to time out again, or if its
+ * operation is out of time
  */
-char ** glite_eds_get_catalog_endpoints(int *epcount, char **error)
+static int eds_endpoint_skipped(struct eds_endpoint_job *job)
 {
-    SDService *service;
-    SDServiceList * serv_list;
-    SDException exc;
-    const char *sd_type;
-    char * serv_name;
-    char **endpoints;
-    int associated_count;
+    if (_glite_eds_deadline_passed(job->deadline))
+    {
+        job->res = -1;
+        job->unreachable = EDS_TIMED_OUT;
+        asprintf(&job->error, "glite_eds error: no time left to ask %s",
+            job->endpoint);
+        return 1;
+    }
+    if (_glite_eds_endpoint_allowed(job->endpoint))
+        return 0;
+    job->res = -1;
+    asprintf(&job->error, "glite_eds error: %s skipped after repeated "
+        "connection failures", job->endpoint);
+    return 1;
+}
+
+/**
+ * Helper function - worker side of glite_eds_put_metadata_single
+ */
+static void eds_put_job_run(void *arg)
+{
+    struct eds_endpoint_job *job = arg;
+    double previous;
+
+    if (eds_endpoint_skipped(job))
+        return;
+    previous = _glite_eds_deadline_set(job->deadline);
+    job->res = glite_eds_put_metadata_single(job->endpoint, job->id,
+        &job->data, &job->error, &job->unreachable);
+    _glite_eds_deadline_set(previous);
+}
+
+/**
+ * Helper function - worker side of glite_eds_unregister_single
+ */
+static void eds_unregister_job_run(void *arg)
+{
+    struct eds_endpoint_job *job = arg;
+    double previous;
+
+    if (eds_endpoint_skipped(job))
+        return;
+    previous = _glite_eds_deadline_set(job->deadline);
+    job->res = glite_eds_unregister_single(job->endpoint, job->id,
+        &job->error, &job->unreachable);
+    _glite_eds_deadline_set(previous);
+}
+
+/**
+ * Store one key piece, for the write quorum replication
+ */
+int _glite_eds_piece_put(char *endpoint, char *id, char *hex_key,
+    char *hex_iv, char *cipher, char *keyinfo, int keys_needed, int key_index,
+    double deadline, int *unreachable, char **error)
+{
+    struct eds_endpoint_job job;
+    double previous;
+
+    memset(&job, 0, sizeof(job));
+    job.endpoint = endpoint;
+    job.id = id;
+    job.data.hex_key = hex_key;
+    job.data.hex_iv = hex_iv;
+    job.data.cipher = cipher;
+    job.data.keyinfo = keyinfo;
+    job.data.keys_needed = keys_needed;
+    job.data.key_index = key_index;
+    job.deadline = deadline;
+
+    if (eds_endpoint_skipped(&job))
+    {
+        /* A skipped endpoint is asked again later, like one that is down */
+        if (!job.unreachable)
+            job.unreachable = EDS_UNREACHABLE;
+    }
+    else
+    {
+        previous = _glite_eds_deadline_set(deadline);
+        job.res = glite_eds_put_metadata_single(endpoint, id, &job.data,
+            &job.error, &job.unreachable);
+        _glite_eds_deadline_set(previous);
+    }
+
+    *unreachable = job.res ? job.unreachable : 0;
+    *error = job.error;
+    return job.res;
+}
+
+/**
+ * Remove one key piece, for the write quorum replication
+ */
+int _glite_eds_piece_remove(char *endpoint, char *id, double deadline,
+    char **error)
+{
+    struct eds_endpoint_job job;
+
+    memset(&job, 0, sizeof(job));
+    job.endpoint = endpoint;
+    job.id = id;
+    job.deadline = deadline;
+    eds_unregister_job_run(&job);
+
+    *error = job.error;
+    return job.res;
+}
+
+/**
+ * Helper function - run the same operation on several endpoints at once
+ * and wait for all of them, within the deadline of the calling thread. If
+ * the threads can not be started, the operations run one after the other.
+ */
+static void eds_endpoint_run(_glite_eds_job_func func,
+    struct eds_endpoint_job *jobs, int njobs)
+{
+    _glite_eds_workers *workers = NULL;
     int i;
 
-    sd_type = getenv(GLITE_METADATA_SD_ENV);
-    if (!sd_type) sd_type = GLITE_METADATA_SD_TYPE;
+    for (i = 0; i < njobs; i++)
+        jobs[i].deadline = _glite_eds_deadline_get();
+    if (njobs > 1)
+        workers = _glite_eds_workers_new(njobs < EDS_MAX_ENDPOINT_THREADS ?
+            njobs : EDS_MAX_ENDPOINT_THREADS);
+    _glite_eds_workers_run(workers, func, jobs, sizeof(*jobs), njobs);
+    _glite_eds_workers_free(workers);
+}
 
-    serv_name = glite_discover_service_by_version(sd_type, NULL /*name*/, NULL /*version*/, error);
-    if (!serv_name)
-        return NULL;
+/**
+ * Helper function - return the error of the first failed job (in endpoint
+ * order) or NULL, free the others. A job that ran out of time marks the
+ * operation of the thread as timed out.
+ */
+static char *eds_endpoint_error(struct eds_endpoint_job *jobs, int njobs)
+{
+    char *first = NULL;
+    int i;
+
+    for (i = 0; i < njobs; i++)
+    {
+        if (jobs[i].res && jobs[i].unreachable == EDS_TIMED_OUT)
+            _glite_eds_deadline_timed_out();
+        if (jobs[i].res && !first)
+            first = jobs[i].error;
+        else
+            free(jobs[i].error);
+        jobs[i].error = NULL;
+    }
+
+    return first;
+}
+
+/**
+ * Minimum count of pieces required to reconstruct a key split for epcount
+ * catalogs
+ */
+unsigned int _glite_eds_keys_needed(int epcount)
+{
+    unsigned int keys_needed;
+    int i;
+
+    for (keys_needed = 0, i = epcount; i; i /= 2)
+        keys_needed += 1;
+
+    return keys_needed;
+}
+
+/**
+ * Helper function - current time in seconds, not affected by clock changes
+ */
+static double eds_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Helper function - allocate a quorum reading the key pieces of id from
+ * the endpoints of list. The quorum takes over the reference to the list.
+ */
+static struct eds_quorum *eds_quorum_new(char *id, _glite_eds_endpoints *list)
+{
+    struct eds_quorum *q;
+    pthread_condattr_t attr;
+    int epcount = list->count;
+    int i;
 
-    service = SD_getService(serv_name, &exc);
-    if (!service) {
-        asprintf(error, "glite_eds_get_catalog_endpoints: %s", exc.reason);
-	SD_freeException(&exc);
-	free(serv_name);
+    q = (struct eds_quorum *)calloc(1, sizeof(*q));
+    if (!q)
+        return NULL;
+    q->refs = 1;
+    q->epcount = epcount;
+    q->id = strdup(id);
+    q->endpoints = (char **)calloc(epcount, sizeof(*q->endpoints));
+    q->state = (int *)calloc(epcount, sizeof(*q->state));
+    q->hedge_of = (int *)calloc(epcount, sizeof(*q->hedge_of));
+    q->hedge_at = (double *)calloc(epcount, sizeof(*q->hedge_at));
+    /* default key_shares to numServices. Note: it's possible that it's not
+     * the same as original key_shares if the number of the services has
+     * been changed later! */
+    q->key_list = realloc_str_list(NULL, &q->key_shares, epcount);
+    if (!q->id || !q->endpoints || !q->state || !q->hedge_of ||
+        !q->hedge_at || !q->key_list)
+    {
+        free(q->endpoints);
+        free(q->key_list);
+        free(q->hedge_at);
+        free(q->hedge_of);
+        free(q->state);
+        free(q->id);
+        free(q);
         return NULL;
     }
+    q->list = list;
+    q->deadline = _glite_eds_deadline_get();
+    for (i = 0; i < epcount; i++)
+    {
+        q->endpoints[i] = list->endpoints[i];
+        q->hedge_of[i] = -1;
+        q->hedge_at[i] = -1;
+    }
 
-    /* Get list of (associated) services.
-     * NULL is returned also in case of numServices=0, that is not the error here.
-     */
-    serv_list = SD_listAssociatedServices(serv_name, sd_type, NULL/*site*/, NULL/*vos*/, &exc);
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&q->cond, &attr);
+    pthread_condattr_destroy(&attr);
 
-    if (!serv_list)
-	associated_count = 0;
-    else
-        associated_count = serv_list->numServices;
+    return q;
+}
+
+/**
+ * Helper function - drop one reference to a quorum, free it with the last
+ */
+static void eds_quorum_release(struct eds_quorum *q)
+{
+    int refs;
+
+    pthread_mutex_lock(&q->lock);
+    refs = --q->refs;
+    pthread_mutex_unlock(&q->lock);
+    if (refs)
+        return;
+
+    free_str_list((char **)q->key_list, q->key_shares);
+    free(q->endpoints);
+    _glite_eds_endpoints_release(q->list);
+    free(q->hedge_at);
+    free(q->hedge_of);
+    free(q->state);
+    free(q->hex_iv);
+    free(q->keyinfo);
+    free(q->cipher);
+    free(q->error);
+    free(q->id);
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+}
+
+/**
+ * Helper function - account for the answer of one endpoint. The first
+ * piece sets the common data, the others are checked against it. Must be
+ * called with the lock held.
+ */
+static void eds_quorum_add(struct eds_quorum *q, int index, int res,
+    struct hydra_data *data, char *error)
+{
+    int hedged = q->hedge_of[index];
 
-    /* Create list of endpoints */
+    q->state[index] = EDS_READ_ANSWERED;
+    q->running--;
 
-    endpoints = malloc(sizeof(char *) * (1 + associated_count));
-    if (!endpoints) {
-        SD_freeService(service);
-        SD_freeServiceList(serv_list);
-	free(serv_name);
-        asprintf(error, "glite_eds_get_catalog_endpoints: out of memory");
-	return NULL;
+    if (q->done)
+    {
+        /* Too late, the caller has what it needs */
+    }
+    else if (res)
+    {
+        /* Keep first error only */
+        if (!q->error)
+        {
+            q->error = error;
+            error = NULL;
+        }
+    }
+    else if (q->keycount && ((unsigned int)data->keys_needed != q->keys_needed ||
+        strcmp(data->hex_iv, q->hex_iv) || strcmp(data->keyinfo, q->keyinfo) ||
+        strcmp(data->cipher, q->cipher)))
+    {
+        free(q->error);
+        asprintf(&q->error, "glite_eds_get_metadata: metadata corrupted");
+        q->keys_needed = 0;
+        q->done = 1;
     }
+    else
+    {
+        if (!q->keycount)
+        {
+            q->keys_needed = data->keys_needed;
+            q->hex_iv = strdup(data->hex_iv);
+            q->keyinfo = strdup(data->keyinfo);
+            q->cipher = strdup(data->cipher);
+        }
+
+        /* Realloc list if key_index is greater than expected. */
+        if ((unsigned int)data->key_index >= q->key_shares)
+        {
+            unsigned char **key_list = realloc_str_list(q->key_list,
+                &q->key_shares, data->key_index + 1);
 
-    endpoints[0] = strdup(service->endpoint);
-    // fprintf(stdout, "glite_eds_get_catalog_endpoints: First end point %s \n", endpoints[0]);
-    for (i = 0; i < associated_count; i++) {
-        endpoints[i+1] = strdup(serv_list->services[i]->endpoint);
-        // fprintf(stdout, "glite_eds_get_catalog_endpoints: Next point %s \n", endpoints[i+1]);
+            if (key_list)
+                q->key_list = key_list;
+            else
+            {
+                free(q->error);
+                asprintf(&q->error, "glite_eds_get_metadata: out of memory");
+                q->keys_needed = 0;
+                q->done = 1;
+            }
+        }
+
+        /* Save one key piece, the same piece twice does not count */
+        if (!q->done && !q->key_list[data->key_index])
+        {
+            q->key_list[data->key_index] = (unsigned char *)strdup(data->hex_key);
+            q->keycount++;
+            if (hedged >= 0 && q->state[hedged] != EDS_READ_ANSWERED)
+                _glite_eds_count_hedge_won();
+        }
+
+        /* Don't wait for more if we have enough pieces */
+        if (q->keycount >= q->keys_needed)
+            q->done = 1;
     }
 
-    /* free resources */
-    SD_freeService(service);
-    SD_freeServiceList(serv_list);
-    free(serv_name);
+    if (!res)
+    {
+        free(data->hex_iv);
+        free(data->hex_key);
+        free(data->keyinfo);
+        free(data->cipher);
+    }
+    free(error);
 
-    *epcount = 1 + associated_count;
-    
-    return endpoints;
+    /* The caller may have to ask another endpoint */
+    pthread_cond_broadcast(&q->cond);
 }
 
 /**
- * Get endpoints of default catalog service and all associated services.
- * User should free the list (or error string) after use.
+ * Helper function - read one key piece on behalf of a quorum
  */
-char ** glite_eds_get_valid_catalog_endpoints(int *epcount, int *id,char **error)
+static void *eds_quorum_read_run(void *arg)
 {
-    SDService *service;
-    SDServiceList * serv_list;
-    SDException exc;
-    const char *sd_type;
+    struct eds_quorum_read *r = arg;
+    struct eds_quorum *q = r->quorum;
     struct hydra_data data;
-    char * serv_name;
-    char **endpoints;
-    int associated_count;
-    int i,j;
-    int err = 0;
-    char *dummy_key,  *dummy_iv,  *dummy_cipher,  *dummy_info, *DEBUG;
+    char *error = NULL;
+    double start, previous;
+    int res, unreachable = 0, missing = 0;
+
+    /* The probe of an open circuit is only claimed by a read really sent */
+    previous = _glite_eds_deadline_set(q->deadline);
+    start = eds_now();
+    if (q->forced || _glite_eds_endpoint_allowed(q->endpoints[r->index]))
+        res = glite_eds_get_metadata_single(q->endpoints[r->index], q->id,
+            &data, &error, &unreachable, &missing);
+    else
+    {
+        res = -1;
+        asprintf(&error, "glite_eds error: %s skipped after repeated "
+            "connection failures", q->endpoints[r->index]);
+    }
+    if (!res)
+        _glite_eds_latency_record(q->endpoints[r->index], eds_now() - start);
+    else if (unreachable)
+        _glite_eds_endpoints_invalidate(q->list);
+    _glite_eds_deadline_set(previous);
+
+    pthread_mutex_lock(&q->lock);
+    if (res && missing)
+        q->missing++;
+    if (res && unreachable == EDS_TIMED_OUT)
+        q->timedout = 1;
+    eds_quorum_add(q, r->index, res, &data, error);
+    pthread_mutex_unlock(&q->lock);
+
+    eds_quorum_release(q);
+    free(r);
+
+    return NULL;
+}
 
-    dummy_key = "dummy_key";
-    dummy_iv = "dummy_iv";
-    dummy_cipher = "dummy_cipher";
-    dummy_info = "dummy_info";
+/**
+ * Helper function - start reading the key piece of the next endpoint. The
+ * read runs in its own thread, or in the caller's if that is not possible.
+ * Must be called with the lock held, which is released meanwhile.
+ */
+static void eds_quorum_start(struct eds_quorum *q, int hedge_of,
+    int percentile, int threaded)
+{
+    struct eds_quorum_read *r;
+    pthread_attr_t attr;
+    pthread_t thread;
+    double latency = -1;
+    int index, started = 0;
+
+    index = q->next++;
+    q->state[index] = EDS_READ_RUNNING;
+    q->hedge_of[index] = hedge_of;
+    q->running++;
+    q->refs++;
+    pthread_mutex_unlock(&q->lock);
+
+    _glite_eds_count_reads(1);
+    if (percentile)
+        latency = _glite_eds_latency_percentile(q->endpoints[index], percentile);
+
+    r = (struct eds_quorum_read *)calloc(1, sizeof(*r));
+    if (!r)
+    {
+        char *error = NULL;
 
-    DEBUG = NULL;
- 
-    sd_type = getenv(GLITE_METADATA_SD_ENV);
-    if (!sd_type) sd_type = GLITE_METADATA_SD_TYPE;
+        asprintf(&error, "glite_eds_get_metadata: out of memory");
+        pthread_mutex_lock(&q->lock);
+        eds_quorum_add(q, index, -1, NULL, error);
+        q->refs--;
+        return;
+    }
+    r->quorum = q;
+    r->index = index;
 
-    serv_name = glite_discover_service_by_version(sd_type, NULL /*name*/, NULL /*version*/, error);
-    if (!serv_name)
-        return NULL;
+    pthread_mutex_lock(&q->lock);
+    if (latency >= 0)
+        q->hedge_at[index] = eds_now() + latency;
+    pthread_mutex_unlock(&q->lock);
 
-    service = SD_getService(serv_name, &exc);
-    if (!service) {
-        asprintf(error, "glite_eds_get_catalog_endpoints: %s", exc.reason);
-	SD_freeException(&exc);
-	free(serv_name);
-        return NULL;
+    if (threaded && !pthread_attr_init(&attr))
+    {
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        started = !pthread_create(&thread, &attr, eds_quorum_read_run, r);
+        pthread_attr_destroy(&attr);
     }
+    if (!started)
+        eds_quorum_read_run(r);
 
-    /* Get list of (associated) services.
-     * NULL is returned also in case of numServices=0, that is not the error here.
-     */
-    serv_list = SD_listAssociatedServices(serv_name, sd_type, NULL/*site*/, NULL/*vos*/, &exc);
+    pthread_mutex_lock(&q->lock);
+}
 
-    if (!serv_list)
-	associated_count = 0;
-    else
-        associated_count = serv_list->numServices;
+/**
+ * Helper function - order the endpoints for reading: the ones whose
+ * circuit is closed first, by their average latency, the ones not known
+ * yet before the others so that they get measured. Returns the number of
+ * endpoints that may be asked. The circuits are only looked at, the
+ * probe of an open one is claimed when the read is sent.
+ */
+static int eds_sort_endpoints(char **endpoints, int epcount)
+{
+    double *latency;
+    double m;
+    char *e;
+    int i, j, allowed = 0;
+
+    latency = (double *)malloc(epcount * sizeof(*latency));
+    if (!latency)
+        return epcount;
+    for (i = 0; i < epcount; i++)
+    {
+        latency[i] = _glite_eds_latency_average(endpoints[i]);
+        /* Skipped endpoints go last */
+        if (_glite_eds_endpoint_usable(endpoints[i]))
+            allowed++;
+        else
+            latency[i] = HUGE_VAL;
+    }
 
-    /* Create list of endpoints */
+    for (i = 1; i < epcount; i++)
+    {
+        m = latency[i];
+        e = endpoints[i];
+        for (j = i; j > 0 && latency[j - 1] > m; j--)
+        {
+            latency[j] = latency[j - 1];
+            endpoints[j] = endpoints[j - 1];
+        }
+        latency[j] = m;
+        endpoints[j] = e;
+    }
 
-    endpoints = malloc(sizeof(char *) * (1 + associated_count));
-    
-    if (!endpoints) {
-        SD_freeService(service);
-        SD_freeServiceList(serv_list);
-	free(serv_name);
-        asprintf(error, "glite_eds_get_catalog_endpoints: out of memory");
-	return NULL;
-    }
-
-    endpoints[0] = strdup(service->endpoint);
-    if(DEBUG)
-        fprintf(stdout, "* JSW * First end point %s \n", endpoints[0]);
-
-    j = 1;
-    for (i = 0; i < associated_count; i++) {
-        endpoints[j] = strdup(serv_list->services[i]->endpoint);
-        const struct hydra_data data = {
-	  .hex_key = dummy_key,
-	  .hex_iv = dummy_iv,
-	  .cipher = dummy_cipher,
-	  .keyinfo = dummy_info,
-          .keys_needed = 1,
-          .key_index = 0 };
-        err = 0;
-        err = glite_eds_put_metadata_single(endpoints[j], id, &data, error); // if an error is generated here it is hard to tell why...
-        // fprintf(stdout, "* JSW * Error code is : %d \n", err);
-        if (err){
-                fprintf(stdout, "A connection could not be made to : %s \n", endpoints[j]);
-	}
-        else {
-            if(DEBUG)
-	        fprintf(stdout, "* JSW * end point %d %s  is valid.\n", j,endpoints[j]);
-            char *dummy_error = NULL;
-            glite_eds_unregister_single(endpoints[j], id, &dummy_error);
-            free(dummy_error);
-            j++;
-	}
-    }
-
-    /* free resources */
-    SD_freeService(service);
-    SD_freeServiceList(serv_list);
-    free(serv_name);
-
-    *epcount = j;
-    
-    return endpoints;
+    free(latency);
+    return allowed;
 }
 
 /**
@@ -504,382 +1081,2687 @@ char ** glite_eds_get_valid_catalog_endpoints(int *epcount, int *id,char **error
 static int glite_eds_put_metadata(char *id, char *hex_key, char *hex_iv, char *cipher,
     char *keyinfo, char **error)
 {
+    _glite_eds_endpoints *list;
     char **endpoints;
     int epcount;
     unsigned char ** key_list;
     unsigned int keys_needed;
-    int i;
+    struct eds_endpoint_job *jobs;
+    char *first_error;
+    double start, deadline, previous;
+    int i, rollback, quorum;
     int err = 0;
 
-    // endpoints = glite_eds_get_valid_catalog_endpoints(&epcount, id,error);
-    endpoints = glite_eds_get_catalog_endpoints(&epcount, error);
+    start = eds_now();
+    deadline = _glite_eds_deadline_get();
+    list = _glite_eds_endpoints_write(error);
 
-    if (!endpoints)
+    if (!list)
         return -1;
+    endpoints = list->endpoints;
+    epcount = list->count;
     // fprintf(stdout," * JSW * endpoints %d \n",epcount);
 
     /* Calculate minimum count of pieces required to reconstruct the original key */
-    for(keys_needed = 0, i = epcount; i ; i/=2){
-        keys_needed += 1;
-	// fprintf(stdout,"glite_eds_put_metadata: i %d keys needed %d \n",i,keys_needed);
-     }
+    keys_needed = _glite_eds_keys_needed(epcount);
+    quorum = _glite_eds_write_quorum(epcount, keys_needed);
 
     /* Split the key by Shamir's Secret Sharing Scheme. */
     key_list = glite_security_ssss_split_key(hex_key, epcount, keys_needed);
     if (!key_list) {
         asprintf(error, "glite_eds_put_metadata error: ssss_split failed");
-        free_str_list(endpoints, epcount);
+        _glite_eds_endpoints_release(list);
+        return -1;
+    }
+
+    /* A new key replaces whatever was known about the id */
+    _glite_eds_keycache_invalidate(id);
+
+    /* With a write quorum the stragglers are left to the background, which
+     * takes over the list and the pieces */
+    if (quorum)
+        return _glite_eds_replicate(id, list, key_list, hex_iv, cipher,
+            keyinfo, keys_needed, quorum, error);
+
+    jobs = (struct eds_endpoint_job *)calloc(epcount, sizeof(*jobs));
+    if (!jobs) {
+        asprintf(error, "glite_eds_put_metadata error: out of memory");
+        _glite_eds_endpoints_release(list);
+        free_str_list((char**)key_list, epcount);
         return -1;
     }
 
-    /* Save each key piece to different catalog. */
+    /* Save each key piece to different catalog, all at once. */
     for (i = 0; i < epcount; i++) {
-        const struct hydra_data data = {
-            .hex_key = key_list[i],
-            .hex_iv = hex_iv,
-            .cipher = cipher,
-            .keyinfo = keyinfo,
-            .keys_needed = keys_needed,
-            .key_index = i };
-        err = glite_eds_put_metadata_single(endpoints[i], id, &data, error);
-        if (err) 
-            break;
+        jobs[i].endpoint = endpoints[i];
+        jobs[i].id = id;
+        jobs[i].data.hex_key = (char *)key_list[i];
+        jobs[i].data.hex_iv = hex_iv;
+        jobs[i].data.cipher = cipher;
+        jobs[i].data.keyinfo = keyinfo;
+        jobs[i].data.keys_needed = keys_needed;
+        jobs[i].data.key_index = i;
+    }
+    eds_endpoint_run(eds_put_job_run, jobs, epcount);
+
+    for (i = 0; i < epcount; i++) {
+        if (jobs[i].res && jobs[i].unreachable)
+            _glite_eds_endpoints_invalidate(list);
+    }
+    first_error = eds_endpoint_error(jobs, epcount);
+    if (first_error) {
+        *error = first_error;
+        err = -1;
     }
 
     /* If the storage of any of the key pieces failed, then we
      * should attempt to remove already committed pieces.  */
     if (err) {
-        for(i=i-1; i >= 0; i--) {
-           char *dummy_error = NULL;
-           if (glite_eds_unregister_single(endpoints[i], id, &dummy_error))
-             free(dummy_error);
+        /* The jobs are reused for the stores that did succeed */
+        for (i = 0, rollback = 0; i < epcount; i++) {
+            if (!jobs[i].res)
+                jobs[rollback++].endpoint = endpoints[i];
         }
+        /* The time is likely to be up, the removal gets a budget of its
+         * own rather than leaving the pieces behind */
+        previous = _glite_eds_deadline_set(deadline ?
+            eds_now() + (deadline - start) : 0);
+        eds_endpoint_run(eds_unregister_job_run, jobs, rollback);
+        _glite_eds_deadline_set(previous);
+        for (i = 0; i < rollback; i++)
+            free(jobs[i].error);
     }
 
     /* cleanup */
-    free_str_list(endpoints, epcount);
+    _glite_eds_endpoints_release(list);
     free_str_list((char**)key_list, epcount);
+    free(jobs);
 
     return err;
 }
 
 /**
- * Helper function - get and join metadata related to the id.
+ * Helper function - split a new key and append the pieces to the journal,
+ * the key stores get them later
  */
-static int glite_eds_get_metadata(char *id, char **hex_key, char **hex_iv, char **cipher,
-    char **keyinfo, char **error)
+static int eds_journal_put(char *id, char *hex_key, char *hex_iv,
+    char *cipher, char *keyinfo, char **error)
 {
-    char **endpoints;
-    int epcount;
-    unsigned char ** key_list;
+    _glite_eds_endpoints *list;
+    unsigned char **key_list;
+    unsigned int keys_needed;
+    int res;
+
+    /* The list is normally known already, no key store is contacted */
+    list = _glite_eds_endpoints_get(error);
+    if (!list)
+        return -1;
+
+    keys_needed = _glite_eds_keys_needed(list->count);
+    key_list = glite_security_ssss_split_key(hex_key, list->count, keys_needed);
+    if (!key_list) {
+        asprintf(error, "glite_eds_put_metadata error: ssss_split failed");
+        _glite_eds_endpoints_release(list);
+        return -1;
+    }
+
+    _glite_eds_keycache_invalidate(id);
+    res = _glite_eds_journal_put(id, list->endpoints, list->count, key_list,
+        hex_iv, cipher, keyinfo, keys_needed, error);
+    _glite_eds_endpoints_release(list);
+
+    return res;
+}
+
+/**
+ * Helper function - get and join metadata related to the id. On failure
+ * *missing tells if every key store answered that it has no entry.
+ */
+static int glite_eds_get_metadata(char *id, char **hex_key, char **hex_iv, char **cipher,
+    char **keyinfo, int *missing, char **error)
+{
+    _glite_eds_endpoints *list;
+    int epcount;
+    struct eds_quorum *q;
+    struct timespec ts;
+    unsigned int wanted;
+    int percentile, budget;
+    double now, hedge_at, wake;
+    int i, slowest, usable;
+    int res = 0;
+
+    *missing = 0;
+    list = _glite_eds_endpoints_get(error);
+    if (!list)
+        return -1;
+    epcount = list->count;
+
+    percentile = _glite_env_int(GLITE_EDS_HEDGE_ENV, 0, 0);
+    if (percentile < 0 || percentile > 100)
+        percentile = 0;
+    budget = _glite_env_int(GLITE_EDS_HEDGE_BUDGET_ENV,
+        EDS_HEDGE_BUDGET, 0);
+
+    q = eds_quorum_new(id, list);
+    if (!q) {
+        asprintf(error, "glite_eds_get_metadata: out of memory");
+        _glite_eds_endpoints_release(list);
+        return -1;
+    }
+    /* Endpoints that keep failing are left out, unless the key can not be
+     * rebuilt without them */
+    usable = eds_sort_endpoints(q->endpoints, epcount);
+    if (usable < (int)_glite_eds_keys_needed(epcount))
+    {
+        usable = epcount;
+        q->forced = 1;
+    }
+    else
+        _glite_eds_count_skips(epcount - usable);
+
+    /* Without hedging every usable catalog is asked at once. With hedging only as
+     * many as needed are, the fastest first; a failed read is replaced by
+     * another endpoint, and a read slower than the usual latency of its
+     * endpoint is duplicated to one. Either way we go on as soon as enough
+     * consistent pieces are there, or the deadline is reached: the reads
+     * that are still running finish in the background and their answers
+     * are dropped. */
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        if (q->done)
+            break;
+
+        if (!percentile)
+            wanted = epcount;
+        else if (q->keycount)
+            wanted = q->keys_needed;
+        else
+            wanted = _glite_eds_keys_needed(epcount);
+        while (q->next < usable && q->keycount + q->running < wanted)
+            eds_quorum_start(q, -1, percentile, usable > 1);
+        if (q->done)
+            break;
+        if (!q->running) {
+            /* Nobody left to ask */
+            q->done = 1;
+            break;
+        }
+
+        /* Find the read to hedge first */
+        slowest = -1;
+        hedge_at = 0;
+        if (percentile && q->next < usable) {
+            for (i = 0; i < q->next; i++) {
+                if (q->state[i] == EDS_READ_RUNNING && q->hedge_at[i] >= 0 &&
+                    (slowest < 0 || q->hedge_at[i] < hedge_at)) {
+                    slowest = i;
+                    hedge_at = q->hedge_at[i];
+                }
+            }
+        }
+
+        if (slowest < 0 && !q->deadline) {
+            pthread_cond_wait(&q->cond, &q->lock);
+            continue;
+        }
+
+        now = eds_now();
+        if (q->deadline && now >= q->deadline) {
+            free(q->error);
+            asprintf(&q->error, "glite_eds_get_metadata: timed out waiting "
+                "for the key stores");
+            q->timedout = 1;
+            q->done = 1;
+            break;
+        }
+        if (slowest < 0 || hedge_at > now) {
+            wake = slowest < 0 || (q->deadline && q->deadline < hedge_at) ?
+                q->deadline : hedge_at;
+            ts.tv_sec = (time_t)wake;
+            ts.tv_nsec = (long)((wake - ts.tv_sec) * 1e9);
+            pthread_cond_timedwait(&q->cond, &q->lock, &ts);
+            continue;
+        }
+
+        q->state[slowest] = EDS_READ_HEDGED;
+        if (_glite_eds_hedge_acquire(budget))
+            eds_quorum_start(q, slowest, percentile, 1);
+    }
+
+    if (!q->keys_needed || q->keycount < q->keys_needed) {
+        if (q->error) {
+            *error = q->error;
+            q->error = NULL;
+        } else
+            asprintf(error, "glite_eds_get_metadata: failed to get all key pieces");
+        *missing = q->missing && q->missing == q->next;
+        if (q->timedout)
+            _glite_eds_deadline_timed_out();
+        res = -1;
+    } else {
+        /* Join ssss key pieces */
+        *hex_key = glite_security_ssss_join_keys(q->key_list, q->key_shares);
+        if (! (*hex_key)) {
+            asprintf(error, "glite_eds_get_metadata: Error join keys");
+            res = -1;
+        } else {
+            *hex_iv = q->hex_iv;
+            *keyinfo = q->keyinfo;
+            *cipher = q->cipher;
+            q->hex_iv = q->keyinfo = q->cipher = NULL;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    eds_quorum_release(q);
+
+    return res;
+}
+
+/**
+ * Helper function - release the worker threads of a context
+ */
+static void eds_stop_threads(struct eds_ctx_data *data)
+{
+    int i;
+
+    _glite_eds_workers_free(data->workers);
+    data->workers = NULL;
+
+    if (data->wctx)
+    {
+        for (i = 0; i < data->nthreads; i++)
+            if (data->wctx[i])
+                EVP_CIPHER_CTX_free(data->wctx[i]);
+        free(data->wctx);
+        data->wctx = NULL;
+    }
+
+    free(data->jobs);
+    data->jobs = NULL;
+    free(data->ctr_jobs);
+    data->ctr_jobs = NULL;
+    data->nthreads = 1;
+}
+
+/**
+ * Helper function - tell if the chunked container can drive an AEAD cipher:
+ * it uses the GCM tag controls, which ChaCha20-Poly1305 shares, while CCM
+ * and OCB need their tag set up before the key
+ */
+static int eds_cipher_chunked(const EVP_CIPHER *type)
+{
+    if (EVP_CIPHER_mode(type) == EVP_CIPH_GCM_MODE)
+        return 1;
+#ifdef NID_chacha20_poly1305
+    if (EVP_CIPHER_nid(type) == NID_chacha20_poly1305)
+        return 1;
+#endif
+    return 0;
+}
+
+/**
+ * Helper function - refuse the AEAD ciphers the chunked container does not
+ * support
+ */
+static int eds_check_cipher(const EVP_CIPHER *type, const char *name,
+    const char *func, char **error)
+{
+    if ((EVP_CIPHER_flags(type) & EVP_CIPH_FLAG_AEAD_CIPHER) &&
+        !eds_cipher_chunked(type))
+    {
+        asprintf(error, "%s error: AEAD cipher %s is not supported, only GCM "
+            "and ChaCha20-Poly1305 are", func, name);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Helper function - attach the library specific state to a freshly
+ * initialized context
+ */
+static int eds_attach_data(EVP_CIPHER_CTX *ctx, int encrypt, const char *iv,
+    int iv_len, char **error)
+{
+    struct eds_ctx_data *data;
+
+    data = (struct eds_ctx_data *)calloc(1, sizeof(*data));
+    if (!data)
+    {
+        asprintf(error, "glite_eds_init error: calloc() of %d "
+            "bytes failed", (int)sizeof(*data));
+        return -1;
+    }
+
+    data->encrypt = encrypt;
+    data->nthreads = 1;
+    data->padding = 1;
+    data->range_left = -1;
+    if (iv_len > (int)sizeof(data->iv))
+        iv_len = sizeof(data->iv);
+    memcpy(data->iv, iv, iv_len);
+    data->iv_len = iv_len;
+
+    /* AEAD ciphers use the chunked container format */
+    if (eds_check_cipher(EVP_CIPHER_CTX_cipher(ctx),
+        OBJ_nid2sn(EVP_CIPHER_CTX_nid(ctx)), "glite_eds_init", error))
+    {
+        free(data);
+        return -1;
+    }
+    if (eds_cipher_chunked(EVP_CIPHER_CTX_cipher(ctx)))
+    {
+        if (iv_len < 8)
+        {
+            asprintf(error, "glite_eds_init error: the iv of the cipher is "
+                "too short for the chunked format");
+            free(data);
+            return -1;
+        }
+        data->aead = 1;
+        if (encrypt)
+            data->chunk_size = EDS_AEAD_CHUNK;
+    }
+
+    EVP_CIPHER_CTX_set_app_data(ctx, data);
+    return 0;
+}
+
+/**
+ * Helper function - free the library specific state of a context
+ */
+static void eds_free_data(EVP_CIPHER_CTX *ctx)
+{
+    struct eds_ctx_data *data;
+
+    data = (struct eds_ctx_data *)EVP_CIPHER_CTX_get_app_data(ctx);
+    if (!data)
+        return;
+
+    eds_stop_threads(data);
+    if (data->slots)
+    {
+        OPENSSL_cleanse(data->slots,
+            data->nslots * (data->chunk_size + EDS_AEAD_TAG_LEN));
+        free(data->slots);
+    }
+    free(data->aead_jobs);
+    OPENSSL_cleanse(data, sizeof(*data));
+    free(data);
+    EVP_CIPHER_CTX_set_app_data(ctx, NULL);
+}
+
+/**
+ * Look up the joined key of an id in the key cache, then in the key stores
+ */
+int _glite_eds_key_get(char *id, char **hex_key, char **hex_iv,
+    char **cipher, char **keyinfo, int *missing, char **error)
+{
+    int cached;
+
+    *missing = 0;
+    /* A key still in the journal is not in the key stores yet */
+    if (_glite_eds_journal_get(id, hex_key, hex_iv, cipher, keyinfo))
+        return 0;
+    cached = _glite_eds_keycache_get(id, hex_key, hex_iv, cipher, keyinfo);
+    if (cached < 0)
+    {
+        *missing = 1;
+        asprintf(error, "glite_eds_init error: no key is registered for %s", id);
+        return -1;
+    }
+    if (cached)
+        return 0;
+
+    if (glite_eds_get_metadata(id, hex_key, hex_iv, cipher, keyinfo,
+        missing, error))
+    {
+        if (*missing)
+            _glite_eds_keycache_put_missing(id);
+        return -1;
+    }
+    _glite_eds_keycache_put(id, *hex_key, *hex_iv, *cipher, *keyinfo);
+    return 0;
+}
+
+/**
+ * Store the pieces of a new key in the key stores
+ */
+int _glite_eds_key_put(char *id, char *hex_key, char *hex_iv, char *cipher,
+    char *keyinfo, char **error)
+{
+    return glite_eds_put_metadata(id, hex_key, hex_iv, cipher, keyinfo, error);
+}
+
+/**
+ * Helper function - used by glite_eds_encrypt_init and glite_eds_decrypt_init
+ */
+EVP_CIPHER_CTX *glite_eds_init(char *id, char **key, char **iv,
+    const EVP_CIPHER **type, char **error)
+{
+    EVP_CIPHER_CTX *ectx;
+    char *cipher_name, *keyinfo, *hex_key, *hex_iv;
+    double previous;
+    int res, missing;
+
+    if (glite_eds_library_init(error))
+        return NULL;
+
+    /* The agent, if there is one, has the connections and the cache */
+    previous = _glite_eds_deadline_begin(_glite_eds_default_timeout());
+    res = _glite_eds_agent_get(id, &hex_key, &hex_iv, &cipher_name, &keyinfo,
+        &missing, error);
+    if (res == EDS_AGENT_ABSENT)
+        res = _glite_eds_key_get(id, &hex_key, &hex_iv, &cipher_name,
+            &keyinfo, &missing, error);
+    _glite_eds_deadline_end(previous, res);
+    if (res)
+        return NULL;
+
+    to_bin(hex_key, (unsigned char **)key);
+    to_bin(hex_iv, (unsigned char **)iv);
+
+    *type = _glite_eds_get_cipher(cipher_name);
+    if (!(*type))
+    {
+        asprintf(error, "glite_eds_init error: %s",
+            _glite_eds_ssl_error());
+        return NULL;
+    }
+
+    ectx = EVP_CIPHER_CTX_new();
+    if (!ectx)
+    {
+        asprintf(error, "glite_eds_init error: EVP_CIPHER_CTX_new() "
+            "failed");
+        return NULL;
+    }
+
+    free(cipher_name); free(keyinfo); free(hex_key); free(hex_iv);
+
+    return ectx;
+}
+
+/**
+ * Helper function - generate a new key and initialization vector for the
+ * cipher, in binary and hex format. The caller frees *key_p and *iv_p even
+ * on failure.
+ */
+static int eds_new_key(const EVP_CIPHER *type, int keysize, char **key_p,
+    char **iv_p, unsigned char **hex_key, unsigned char **hex_iv,
+    int *keylen_p, char **error)
+{
+    int keyLength, ivLength;
+
+    /* Initialize encryption key and initialization vector */
+    ivLength = EVP_CIPHER_iv_length(type);
+    keyLength = (keysize) ? (keysize >> 3) : EVP_CIPHER_key_length(type);
+    if (NULL == (*iv_p = (char *)malloc(ivLength)))
+    {
+        asprintf(error, "glite_eds_register error: malloc() of %d bytes "
+            "failed", ivLength);
+        return -1;
+    }
+    if (NULL == (*key_p = (char *)malloc(keyLength)))
+    {
+        asprintf(error, "glite_eds_register error: malloc() of %d bytes "
+            "failed", keyLength);
+        return -1;
+    }
+    RAND_bytes((char *)*key_p, keyLength);
+    if (keyLength * 2 != to_hex(*key_p, keyLength, hex_key))
+    {
+        asprintf(error, "glite_eds_register error: converting key to hex "
+            "format failed");
+        return -1;
+    }
+    RAND_pseudo_bytes((char *)*iv_p, ivLength);
+    if (ivLength * 2 != to_hex(*iv_p, ivLength, hex_iv))
+    {
+        free(*hex_key);
+        asprintf(error, "glite_eds_register error: converting iv to hex "
+            "format failed");
+        return -1;
+    }
+
+    *keylen_p = keyLength;
+    return 0;
+}
+
+static int _glite_eds_register_common(char *id, char * cipher, int keysize,
+    char **key_p, char **iv_p, const EVP_CIPHER **type_p, char **error)
+{
+    char *cipher_to_use, *keyl_str;
+    unsigned char *hex_key, *hex_iv;
+    double previous;
+    int keyLength;
+    int res;
+
+    *key_p = *iv_p = NULL;
+
+    /* Do OpenSSL cipher initialization */
+    if (glite_eds_library_init(error))
+        return -1;
+    cipher_to_use = (cipher) ? cipher : EDS_DEFAULT_CIPHER;
+    if (0 == ((*type_p) = _glite_eds_get_cipher(cipher_to_use)))
+    {
+        asprintf(error, "glite_eds_register error: %s",
+            _glite_eds_ssl_error());
+        return -1;
+    }
+    if (eds_check_cipher(*type_p, cipher_to_use, "glite_eds_register",
+        error))
+        return -1;
+
+    if (eds_new_key(*type_p, keysize, key_p, iv_p, &hex_key, &hex_iv,
+        &keyLength, error))
+        return -1;
+
+    /* Do the Metadata Catalog stuff */
+    asprintf(&keyl_str, "%d", keyLength<<3);
+    previous = _glite_eds_deadline_begin(_glite_eds_default_timeout());
+    if (_glite_eds_journal_enabled())
+        res = eds_journal_put(id, (char *)hex_key, (char *)hex_iv,
+            cipher_to_use, keyl_str, error);
+    else
+    {
+        res = _glite_eds_agent_put(id, (char *)hex_key, (char *)hex_iv,
+            cipher_to_use, keyl_str, error);
+        if (res == EDS_AGENT_ABSENT)
+            res = glite_eds_put_metadata(id, hex_key, hex_iv, cipher_to_use, keyl_str, error);
+        else
+            _glite_eds_keycache_invalidate(id);
+    }
+    _glite_eds_deadline_end(previous, res);
+
+    free(hex_iv); free(hex_key); free(keyl_str);
+    
+    return res;
+}
+
+/**
+ * Register a new file in Hydra: create metadata entries (key/iv/...)
+ */
+int glite_eds_register(char *id, char *cipher, int keysize, char **error)
+{
+    char *key, *iv;
+    const EVP_CIPHER *type;
+    int ret;
+
+    ret = _glite_eds_register_common(id, cipher, keysize,
+        &key, &iv, &type, error);
+
+    free(key); free(iv);
+    return ret;
+}
+
+/**
+ * Register a new file in Hydra: create metadata entries (key/iv/...)
+ * But this version checks whether the key stores are valid 23/05/2013
+ */
+int glite_eds_register_valid(char *id, char *cipher, char *valid, int keysize, char **error)
+{
+    char *key, *iv;
+    const EVP_CIPHER *type;
+    int ret;
+
+    ret = _glite_eds_register_common(id, cipher, keysize,
+        &key, &iv, &type, error);
+
+    free(key); free(iv);
+    return ret;
+}
+
+/**
+ * Helper function - record an error of an id of a batch on one endpoint,
+ * only the first one is kept
+ */
+static void eds_batch_error(struct eds_batch *b, int id, int endpoint,
+    const char *reason)
+{
+    pthread_mutex_lock(&b->lock);
+    if (!b->errors[id])
+        asprintf(&b->errors[id], "%s error (%s on %s): %s", b->func,
+            b->ids[id], b->endpoints[endpoint], reason);
+    pthread_mutex_unlock(&b->lock);
+}
+
+/**
+ * Helper function - record the failure of a catalog request for an id of
+ * a batch on one endpoint
+ */
+static void eds_batch_fail(struct eds_batch *b, int id, int endpoint,
+    glite_catalog_ctx *ctx)
+{
+    int lost = glite_catalog_is_connection_error(ctx);
+
+    pthread_mutex_lock(&b->lock);
+    if (lost)
+        b->unreachable = 1;
+    if (b->why)
+        b->why[id] |= lost ? EDS_FAILED_LOST : EDS_FAILED_REFUSED;
+    pthread_mutex_unlock(&b->lock);
+    eds_batch_error(b, id, endpoint, glite_catalog_get_error(ctx));
+}
+
+/**
+ * Helper function - record that an endpoint of a batch was skipped as it
+ * keeps failing
+ */
+static void eds_batch_skip(struct eds_batch *b, int id, int endpoint)
+{
+    pthread_mutex_lock(&b->lock);
+    if (b->why)
+        b->why[id] |= EDS_FAILED_LOST;
+    pthread_mutex_unlock(&b->lock);
+    eds_batch_error(b, id, endpoint,
+        "skipped after repeated connection failures");
+}
+
+/**
+ * Helper function - number of entries one request to the endpoint of a
+ * context may name, at most count. The limit of the service is kept by the
+ * catalog cache, it is usually known without asking.
+ */
+static int eds_batch_limit(glite_catalog_ctx *ctx, int count)
+{
+    int limit = glite_metadata_get_query_limit(ctx);
+
+    return limit > 0 && limit < count ? limit : count;
+}
+
+/**
+ * Helper function - create the entries of a range of ids on one endpoint
+ * and store their key pieces
+ */
+static void eds_batch_create_run(void *arg)
+{
+    struct eds_batch_job *job = arg;
+    struct eds_batch *b = job->batch;
+    const char *names[EDS_BATCH_SIZE], *schemas[EDS_BATCH_SIZE];
+    const char **items[2] = {names, schemas};
+    unsigned char *state = b->state;
     struct hydra_data data;
-    unsigned int keys_needed = 0;
-    unsigned int key_shares = 0;
-    unsigned int keycount = 0;
-    char *err;
+    struct eds_attrs a;
+    glite_catalog_ctx *ctx;
+    int i, id, piece, failed, first, n, limit, broken = 0;
+
+    if (!_glite_eds_endpoint_allowed(b->endpoints[job->endpoint]))
+    {
+        for (i = 0; i < job->count; i++)
+            eds_batch_skip(b, job->first + i, job->endpoint);
+        return;
+    }
+    ctx = _glite_eds_ctx_get(b->endpoints[job->endpoint]);
+    if (!ctx)
+    {
+        for (i = 0; i < job->count; i++)
+            eds_batch_fail(b, job->first + i, job->endpoint, NULL);
+        return;
+    }
+
+    /* As many entries in one request as the service takes. It refuses all
+     * of them if one fails, ask for each one then to know which. */
+    limit = eds_batch_limit(ctx, job->count);
+    for (first = 0; first < job->count; first += n)
+    {
+        n = job->count - first < limit ? job->count - first : limit;
+        if (broken)
+        {
+            for (i = first; i < first + n; i++)
+                eds_batch_fail(b, job->first + i, job->endpoint, ctx);
+            continue;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            names[i] = b->ids[job->first + first + i];
+            schemas[i] = "eds";
+        }
+        if (!glite_metadata_createEntry_multi(ctx, n, items))
+        {
+            for (i = first; i < first + n; i++)
+                state[(job->first + i) * b->epcount + job->endpoint] = EDS_ENTRY_CREATED;
+        }
+        else if (glite_catalog_is_connection_error(ctx))
+        {
+            /* Some of them may exist now, but so may entries of the same
+             * name created by somebody else: none of them is removed */
+            for (i = first; i < first + n; i++)
+                eds_batch_fail(b, job->first + i, job->endpoint, ctx);
+            broken = 1;
+        }
+        else
+        {
+            for (i = first; i < first + n; i++)
+            {
+                id = job->first + i;
+                if (broken)
+                    eds_batch_fail(b, id, job->endpoint, ctx);
+                else if (glite_metadata_createEntry(ctx, b->ids[id], "eds"))
+                {
+                    eds_batch_fail(b, id, job->endpoint, ctx);
+                    broken = glite_catalog_is_connection_error(ctx);
+                }
+                else
+                    state[id * b->epcount + job->endpoint] = EDS_ENTRY_CREATED;
+            }
+        }
+    }
+
+    /* There is no request setting the attributes of several entries */
+    data.cipher = b->cipher;
+    data.keyinfo = b->keyinfo;
+    data.keys_needed = b->keys_needed;
+    data.key_index = job->endpoint;
+    for (i = 0; i < job->count; i++)
+    {
+        id = job->first + i;
+        piece = id * b->epcount + job->endpoint;
+        if (state[piece] != EDS_ENTRY_CREATED)
+            continue;
+        /* No use if the id failed on another endpoint */
+        pthread_mutex_lock(&b->lock);
+        failed = b->errors[id] != NULL;
+        pthread_mutex_unlock(&b->lock);
+        if (failed)
+            continue;
+        if (broken)
+        {
+            eds_batch_fail(b, id, job->endpoint, ctx);
+            continue;
+        }
+
+        data.hex_key = b->shares[piece];
+        data.hex_iv = b->hex_ivs[id];
+        eds_attrs_init(&a, &data);
+        if (glite_metadata_setAttributes(ctx, b->ids[id], EDS_ATTR_COUNT, a.attrs))
+        {
+            eds_batch_fail(b, id, job->endpoint, ctx);
+            broken = glite_catalog_is_connection_error(ctx);
+        }
+        else
+            state[piece] = EDS_ENTRY_DONE;
+    }
+
+    _glite_eds_ctx_put(ctx, b->endpoints[job->endpoint], broken);
+}
+
+/**
+ * Helper function - remove the entries of the failed ids of a range on one
+ * endpoint
+ */
+static void eds_batch_remove_run(void *arg)
+{
+    struct eds_batch_job *job = arg;
+    struct eds_batch *b = job->batch;
+    const char *names[EDS_BATCH_SIZE];
+    glite_catalog_ctx *ctx;
+    int i, id, first, n, limit, count = 0, failed;
+
+    for (i = 0; i < job->count; i++)
+    {
+        id = job->first + i;
+        if (b->errors[id] && b->state[id * b->epcount + job->endpoint] != EDS_ENTRY_NONE)
+            names[count++] = b->ids[id];
+    }
+    if (!count)
+        return;
+
+    ctx = _glite_eds_ctx_get(b->endpoints[job->endpoint]);
+    if (!ctx)
+        return;
+
+    /* Entries that may not exist make the request fail, remove the others
+     * one by one then */
+    limit = eds_batch_limit(ctx, count);
+    for (first = 0, failed = 0; first < count && !failed; first += n)
+    {
+        n = count - first < limit ? count - first : limit;
+        failed = glite_metadata_removeEntry_multi(ctx, n, names + first);
+        if (failed && !glite_catalog_is_connection_error(ctx))
+        {
+            for (i = first, failed = 0; i < first + n && !failed; i++)
+            {
+                if (glite_metadata_removeEntry(ctx, names[i]))
+                    failed = glite_catalog_is_connection_error(ctx);
+            }
+        }
+    }
+
+    _glite_eds_ctx_put(ctx, b->endpoints[job->endpoint], failed);
+}
+
+/**
+ * Helper function - remove the entries of a range of ids from one
+ * endpoint, an entry that does not exist counting as removed
+ */
+static void eds_batch_unregister_run(void *arg)
+{
+    struct eds_batch_job *job = arg;
+    struct eds_batch *b = job->batch;
+    const char *names[EDS_BATCH_SIZE];
+    glite_catalog_ctx *ctx;
+    int i, id, first, n, limit, broken = 0;
+
+    if (!_glite_eds_endpoint_allowed(b->endpoints[job->endpoint]))
+    {
+        for (i = 0; i < job->count; i++)
+            eds_batch_skip(b, job->first + i, job->endpoint);
+        return;
+    }
+    ctx = _glite_eds_ctx_get(b->endpoints[job->endpoint]);
+    if (!ctx)
+    {
+        for (i = 0; i < job->count; i++)
+            eds_batch_fail(b, job->first + i, job->endpoint, NULL);
+        return;
+    }
+
+    for (i = 0; i < job->count; i++)
+        names[i] = b->ids[job->first + i];
+
+    /* The service refuses all of them if one does not exist, remove each
+     * one then */
+    limit = eds_batch_limit(ctx, job->count);
+    for (first = 0; first < job->count; first += n)
+    {
+        n = job->count - first < limit ? job->count - first : limit;
+        if (!broken && !glite_metadata_removeEntry_multi(ctx, n, names + first))
+            continue;
+        broken = broken || glite_catalog_is_connection_error(ctx);
+        for (i = first; i < first + n; i++)
+        {
+            id = job->first + i;
+            if (broken)
+                eds_batch_fail(b, id, job->endpoint, ctx);
+            else if (glite_metadata_removeEntry(ctx, b->ids[id]) &&
+                glite_catalog_get_errclass(ctx) != GLITE_CATALOG_EXCEPTION_NOTEXISTS)
+            {
+                eds_batch_fail(b, id, job->endpoint, ctx);
+                broken = glite_catalog_is_connection_error(ctx);
+            }
+        }
+    }
+
+    _glite_eds_ctx_put(ctx, b->endpoints[job->endpoint], broken);
+}
+
+/**
+ * Helper function - read the key pieces of a range of ids from one endpoint
+ */
+static void eds_batch_get_run(void *arg)
+{
+    struct eds_batch_job *job = arg;
+    struct eds_batch *b = job->batch;
+    const char *names[EDS_BATCH_SIZE];
+    glite_catalog_Attribute **results[EDS_BATCH_SIZE];
+    int counts[EDS_BATCH_SIZE];
+    glite_catalog_ctx *ctx;
+    int i, piece, done, answered, n, limit, broken = 0;
+
+    if (!_glite_eds_endpoint_allowed(b->endpoints[job->endpoint]))
+    {
+        for (i = 0; i < job->count; i++)
+            eds_batch_skip(b, job->first + i, job->endpoint);
+        return;
+    }
+    ctx = _glite_eds_ctx_get(b->endpoints[job->endpoint]);
+    if (!ctx)
+    {
+        for (i = 0; i < job->count; i++)
+            eds_batch_fail(b, job->first + i, job->endpoint, NULL);
+        return;
+    }
+
+    for (i = 0; i < job->count; i++)
+        names[i] = b->ids[job->first + i];
+    _glite_eds_count_reads(job->count);
+
+    /* A missing entry only stops the requests until the next one, a lost
+     * connection stops them all */
+    limit = eds_batch_limit(ctx, job->count);
+    for (done = 0; done < job->count; done = answered + (answered < done + n))
+    {
+        n = job->count - done < limit ? job->count - done : limit;
+        answered = done + glite_metadata_getAttributes_multi(ctx,
+            n, names + done, EDS_ATTR_COUNT, eds_attr_names,
+            results + done, counts + done);
+
+        for (i = done; i < answered; i++)
+        {
+            piece = (job->first + i) * b->epcount + job->endpoint;
+            if (eds_data_from_attrs(results[i], counts[i], &b->pieces[piece]))
+                eds_batch_error(b, job->first + i, job->endpoint,
+                    "required attributes missing");
+            else
+                b->state[piece] = EDS_ENTRY_DONE;
+            glite_catalog_Attribute_freeArray(ctx, counts[i], results[i]);
+        }
+
+        if (answered < done + n)
+        {
+            eds_batch_fail(b, job->first + answered, job->endpoint, ctx);
+            if (glite_catalog_is_connection_error(ctx))
+            {
+                for (i = answered + 1; i < job->count; i++)
+                    eds_batch_fail(b, job->first + i, job->endpoint, ctx);
+                broken = 1;
+                break;
+            }
+        }
+    }
+
+    _glite_eds_ctx_put(ctx, b->endpoints[job->endpoint], broken);
+}
+
+/**
+ * Helper function - run a batch operation on all endpoints, each range of
+ * ids being a separate job
+ */
+static void eds_batch_run(struct eds_batch *b, _glite_eds_job_func func)
+{
+    _glite_eds_workers *workers = NULL;
+    struct eds_batch_job *jobs;
+    int chunks, njobs, nworkers, i;
+
+    chunks = (b->nids + EDS_BATCH_SIZE - 1) / EDS_BATCH_SIZE;
+    njobs = chunks * b->epcount;
+    jobs = (struct eds_batch_job *)calloc(njobs, sizeof(*jobs));
+    if (!jobs)
+    {
+        pthread_mutex_lock(&b->lock);
+        for (i = 0; i < b->nids; i++)
+        {
+            if (!b->errors[i])
+                asprintf(&b->errors[i], "%s error: out of memory", b->func);
+        }
+        pthread_mutex_unlock(&b->lock);
+        return;
+    }
+
+    /* Neighbouring jobs go to different endpoints, so that all of them
+     * are busy at the same time */
+    for (i = 0; i < njobs; i++)
+    {
+        jobs[i].batch = b;
+        jobs[i].endpoint = i % b->epcount;
+        jobs[i].first = (i / b->epcount) * EDS_BATCH_SIZE;
+        jobs[i].count = b->nids - jobs[i].first;
+        if (jobs[i].count > EDS_BATCH_SIZE)
+            jobs[i].count = EDS_BATCH_SIZE;
+    }
+
+    /* The attributes are set one entry per request, so the endpoints are
+     * kept busy with several requests each */
+    nworkers = b->epcount * EDS_BATCH_CONNECTIONS;
+    if (nworkers > njobs)
+        nworkers = njobs;
+    if (nworkers > 1)
+        workers = _glite_eds_workers_new(nworkers);
+    _glite_eds_workers_run(workers, func, jobs, sizeof(*jobs), njobs);
+    _glite_eds_workers_free(workers);
+    free(jobs);
+}
+
+/**
+ * Register new files in Hydra, the keys of all of them at once
+ */
+int glite_eds_register_multi(char **ids, int nids, char *cipher, int keysize,
+    int *results, char **error)
+{
+    struct eds_batch b;
+    _glite_eds_endpoints *list;
+    const EVP_CIPHER *type;
+    unsigned char **key_list, *hex_key, *hex_iv;
+    char *key, *iv;
+    int i, j, keyLength, res = 0;
+
+    *error = NULL;
+    for (i = 0; results && i < nids; i++)
+        results[i] = -1;
+    if (nids < 1)
+        return 0;
+
+    if (glite_eds_library_init(error))
+        return -1;
+    if (!cipher)
+        cipher = EDS_DEFAULT_CIPHER;
+    if (0 == (type = _glite_eds_get_cipher(cipher)))
+    {
+        asprintf(error, "glite_eds_register_multi error: %s",
+            _glite_eds_ssl_error());
+        return -1;
+    }
+    if (eds_check_cipher(type, cipher, "glite_eds_register_multi",
+        error))
+        return -1;
+
+    list = _glite_eds_endpoints_write(error);
+    if (!list)
+        return -1;
+
+    memset(&b, 0, sizeof(b));
+    pthread_mutex_init(&b.lock, NULL);
+    b.func = "glite_eds_register_multi";
+    b.ids = ids;
+    b.nids = nids;
+    b.endpoints = list->endpoints;
+    b.epcount = list->count;
+    b.cipher = cipher;
+    b.keys_needed = _glite_eds_keys_needed(b.epcount);
+    b.shares = (char **)calloc((size_t)nids * b.epcount, sizeof(*b.shares));
+    b.state = (unsigned char *)calloc((size_t)nids * b.epcount, sizeof(*b.state));
+    b.hex_ivs = (char **)calloc(nids, sizeof(*b.hex_ivs));
+    b.errors = (char **)calloc(nids, sizeof(*b.errors));
+    if (!b.shares || !b.state || !b.hex_ivs || !b.errors)
+    {
+        asprintf(error, "glite_eds_register_multi error: out of memory");
+        res = -1;
+        goto out;
+    }
+
+    /* Generate and split all keys before talking to the key stores */
+    for (i = 0; i < nids; i++)
+    {
+        key = iv = NULL;
+        if (eds_new_key(type, keysize, &key, &iv, &hex_key, &hex_iv,
+            &keyLength, error))
+        {
+            free(key); free(iv);
+            res = -1;
+            goto out;
+        }
+        free(key); free(iv);
+        b.hex_ivs[i] = (char *)hex_iv;
+
+        key_list = glite_security_ssss_split_key((char *)hex_key, b.epcount,
+            b.keys_needed);
+        free(hex_key);
+        if (!key_list)
+        {
+            asprintf(error, "glite_eds_register_multi error: ssss_split failed");
+            res = -1;
+            goto out;
+        }
+        for (j = 0; j < b.epcount; j++)
+            b.shares[i * b.epcount + j] = (char *)key_list[j];
+        free(key_list);
+    }
+    asprintf(&b.keyinfo, "%d", keyLength << 3);
+
+    /* New keys replace whatever was known about the ids */
+    for (i = 0; i < nids; i++)
+        _glite_eds_keycache_invalidate(ids[i]);
+
+    eds_batch_run(&b, eds_batch_create_run);
+    if (b.unreachable)
+        _glite_eds_endpoints_invalidate(list);
+
+    /* An id is registered on all endpoints or on none */
+    for (i = 0; i < nids; i++)
+    {
+        if (b.errors[i])
+            break;
+    }
+    if (i < nids)
+    {
+        eds_batch_run(&b, eds_batch_remove_run);
+        res = -1;
+    }
+
+    for (i = 0; i < nids; i++)
+    {
+        if (!b.errors[i])
+        {
+            if (results)
+                results[i] = 0;
+        }
+        else if (!*error)
+        {
+            *error = b.errors[i];
+            b.errors[i] = NULL;
+        }
+    }
+
+out:
+    if (b.shares)
+        free_str_list(b.shares, nids * b.epcount);
+    if (b.hex_ivs)
+        free_str_list(b.hex_ivs, nids);
+    if (b.errors)
+        free_str_list(b.errors, nids);
+    free(b.state);
+    free(b.keyinfo);
+    pthread_mutex_destroy(&b.lock);
+    _glite_eds_endpoints_release(list);
+
+    return res;
+}
+
+/**
+ * Store the split keys of several ids with batched requests, for the
+ * journal. An id is registered on all endpoints or on none.
+ */
+void _glite_eds_key_put_multi(char **ids, int nids, char **endpoints,
+    int epcount, char **shares, char **hex_ivs, char *cipher, char *keyinfo,
+    unsigned int keys_needed, char **errors, unsigned char *why)
+{
+    struct eds_batch b;
+    int i;
+
+    memset(&b, 0, sizeof(b));
+    pthread_mutex_init(&b.lock, NULL);
+    b.func = "glite_eds_journal";
+    b.ids = ids;
+    b.nids = nids;
+    b.endpoints = endpoints;
+    b.epcount = epcount;
+    b.shares = shares;
+    b.hex_ivs = hex_ivs;
+    b.cipher = cipher;
+    b.keyinfo = keyinfo;
+    b.keys_needed = keys_needed;
+    b.errors = errors;
+    b.why = why;
+    b.state = (unsigned char *)calloc((size_t)nids * epcount, sizeof(*b.state));
+    if (!b.state)
+    {
+        for (i = 0; i < nids; i++)
+            asprintf(&errors[i], "glite_eds_journal error: out of memory");
+        pthread_mutex_destroy(&b.lock);
+        return;
+    }
+
+    eds_batch_run(&b, eds_batch_create_run);
+    for (i = 0; i < nids; i++)
+    {
+        if (errors[i])
+            break;
+    }
+    if (i < nids)
+        eds_batch_run(&b, eds_batch_remove_run);
+
+    free(b.state);
+    pthread_mutex_destroy(&b.lock);
+}
+
+/**
+ * Remove the keys of several ids with batched requests, for the journal
+ */
+void _glite_eds_key_remove_multi(char **ids, int nids, char **endpoints,
+    int epcount, char **errors, unsigned char *why)
+{
+    struct eds_batch b;
+    int i;
+
+    memset(&b, 0, sizeof(b));
+    pthread_mutex_init(&b.lock, NULL);
+    b.func = "glite_eds_journal";
+    b.ids = ids;
+    b.nids = nids;
+    b.endpoints = endpoints;
+    b.epcount = epcount;
+    b.errors = errors;
+    b.why = why;
+
+    eds_batch_run(&b, eds_batch_unregister_run);
+    for (i = 0; i < nids; i++)
+        _glite_eds_keycache_invalidate(ids[i]);
+
+    pthread_mutex_destroy(&b.lock);
+}
+
+/**
+ * Register a new file in Hydra: create metadata entries (key/iv/...),
+ * initalizes encryption context
+ */
+EVP_CIPHER_CTX *glite_eds_register_encrypt_init(char *id,
+    char *cipher, int keysize, char **error)
+{
+    char *key, *iv;
+    EVP_CIPHER_CTX *ectx;
+    const EVP_CIPHER *type;
+    int ret;
+
+    ret = _glite_eds_register_common(id, cipher, keysize,
+        &key, &iv, &type, error);
+
+    if (ret) return NULL;
+
+    if (NULL == (ectx = EVP_CIPHER_CTX_new()))
+    {
+        asprintf(error, "glite_eds_register_encrypt_init error: "
+            "EVP_CIPHER_CTX_new() failed");
+        free(key); free(iv);
+        return NULL;
+    }
+    EVP_EncryptInit(ectx, type, key, iv);
+
+    if (eds_attach_data(ectx, 1, iv, EVP_CIPHER_iv_length(type), error))
+    {
+        EVP_CIPHER_CTX_free(ectx);
+        ectx = NULL;
+    }
+
+    free(key); free(iv);
+
+    return ectx;
+}
+
+/**
+ * Initialize encryption context for a file. Query key/iv pairs from
+ * metadata catalog
+ */
+EVP_CIPHER_CTX *glite_eds_encrypt_init(char *id, char **error)
+{
+    char *iv, *key;
+    const EVP_CIPHER *type;
+    EVP_CIPHER_CTX *ectx;
+    
+    ectx = glite_eds_init(id, &key, &iv, &type, error);
+    if (!ectx)
+        return NULL;
+
+    EVP_EncryptInit(ectx, type, key, iv);
+
+    if (eds_attach_data(ectx, 1, iv, EVP_CIPHER_iv_length(type), error))
+    {
+        EVP_CIPHER_CTX_free(ectx);
+        ectx = NULL;
+    }
+    
+    free(key); free(iv);
+
+    return ectx;
+}
+
+/**
+ * Initialize decryption context for a file. Query key/iv pairs from
+ * metadata catalog
+ */
+EVP_CIPHER_CTX *glite_eds_decrypt_init(char *id, char **error)
+{
+    char *iv, *key;
+    const EVP_CIPHER *type;
+    EVP_CIPHER_CTX *dctx;
+    
+    dctx = glite_eds_init(id, &key, &iv, &type, error);
+    if (!dctx)
+        return NULL;
+
+    EVP_DecryptInit(dctx, type, key, iv);
+
+    if (eds_attach_data(dctx, 0, iv, EVP_CIPHER_iv_length(type), error))
+    {
+        EVP_CIPHER_CTX_free(dctx);
+        dctx = NULL;
+    }
+
+    free(key); free(iv);
+
+    return dctx;
+}
+
+EVP_CIPHER_CTX *glite_eds_register_encrypt_init_timeout(char *id,
+    char *cipher, int keysize, int timeout_ms, char **error)
+{
+    EVP_CIPHER_CTX *ctx;
+    double previous;
+
+    previous = _glite_eds_deadline_begin(timeout_ms);
+    ctx = glite_eds_register_encrypt_init(id, cipher, keysize, error);
+    _glite_eds_deadline_end(previous, !ctx);
+
+    return ctx;
+}
+
+EVP_CIPHER_CTX *glite_eds_encrypt_init_timeout(char *id, int timeout_ms,
+    char **error)
+{
+    EVP_CIPHER_CTX *ctx;
+    double previous;
+
+    previous = _glite_eds_deadline_begin(timeout_ms);
+    ctx = glite_eds_encrypt_init(id, error);
+    _glite_eds_deadline_end(previous, !ctx);
+
+    return ctx;
+}
+
+EVP_CIPHER_CTX *glite_eds_decrypt_init_timeout(char *id, int timeout_ms,
+    char **error)
+{
+    EVP_CIPHER_CTX *ctx;
+    double previous;
+
+    previous = _glite_eds_deadline_begin(timeout_ms);
+    ctx = glite_eds_decrypt_init(id, error);
+    _glite_eds_deadline_end(previous, !ctx);
+
+    return ctx;
+}
+
+/**
+ * Helper function - join the key pieces of an id read by a batch. Returns
+ * the key in hex format and points the common data to the first piece, or
+ * NULL with the reason in *error (NULL if there are not enough pieces).
+ */
+static char *eds_batch_join(struct eds_batch *b, int id,
+    struct hydra_data *common, const char **error)
+{
+    struct hydra_data *data;
+    unsigned char **key_list;
+    unsigned int key_shares = 0, keycount = 0;
+    char *hex_key = NULL;
+    int j;
+
+    *error = NULL;
+    memset(common, 0, sizeof(*common));
+    key_list = realloc_str_list(NULL, &key_shares, b->epcount);
+    if (!key_list)
+    {
+        *error = "out of memory";
+        return NULL;
+    }
+
+    /* The first piece sets the common data, the others are checked
+     * against it */
+    for (j = 0; j < b->epcount; j++)
+    {
+        if (b->state[id * b->epcount + j] != EDS_ENTRY_DONE)
+            continue;
+        data = &b->pieces[id * b->epcount + j];
+
+        if (!keycount)
+        {
+            common->keys_needed = data->keys_needed;
+            common->hex_iv = data->hex_iv;
+            common->keyinfo = data->keyinfo;
+            common->cipher = data->cipher;
+        }
+        else if (data->keys_needed != common->keys_needed ||
+            strcmp(data->hex_iv, common->hex_iv) ||
+            strcmp(data->keyinfo, common->keyinfo) ||
+            strcmp(data->cipher, common->cipher))
+        {
+            *error = "metadata corrupted";
+            keycount = 0;
+            break;
+        }
+
+        /* Realloc list if key_index is greater than expected. */
+        if ((unsigned int)data->key_index >= key_shares)
+        {
+            unsigned char **list = realloc_str_list(key_list, &key_shares,
+                data->key_index + 1);
+
+            if (!list)
+            {
+                *error = "out of memory";
+                keycount = 0;
+                break;
+            }
+            key_list = list;
+        }
+
+        /* The same piece twice does not count */
+        if (!key_list[data->key_index])
+        {
+            key_list[data->key_index] = (unsigned char *)data->hex_key;
+            keycount++;
+        }
+    }
+
+    if (keycount && keycount >= (unsigned int)common->keys_needed)
+    {
+        hex_key = glite_security_ssss_join_keys(key_list, key_shares);
+        if (!hex_key)
+            *error = "Error join keys";
+    }
+
+    /* The strings stay with the pieces, freed by the caller */
+    free(key_list);
+    return hex_key;
+}
+
+/**
+ * Helper function - decryption context from the joined key of an id
+ */
+static EVP_CIPHER_CTX *eds_decrypt_ctx(char *hex_key, char *hex_iv,
+    char *cipher_name, char **error)
+{
+    EVP_CIPHER_CTX *dctx;
+    const EVP_CIPHER *type;
+    char *key = NULL, *iv = NULL;
+
+    type = _glite_eds_get_cipher(cipher_name);
+    if (!type)
+    {
+        asprintf(error, "glite_eds_decrypt_init_multi error: %s",
+            _glite_eds_ssl_error());
+        return NULL;
+    }
+
+    dctx = EVP_CIPHER_CTX_new();
+    if (!dctx)
+    {
+        asprintf(error, "glite_eds_decrypt_init_multi error: "
+            "EVP_CIPHER_CTX_new() failed");
+        return NULL;
+    }
+
+    to_bin(hex_key, (unsigned char **)&key);
+    to_bin(hex_iv, (unsigned char **)&iv);
+
+    EVP_DecryptInit(dctx, type, key, iv);
+
+    if (eds_attach_data(dctx, 0, iv, EVP_CIPHER_iv_length(type), error))
+    {
+        EVP_CIPHER_CTX_free(dctx);
+        dctx = NULL;
+    }
+
+    free(key); free(iv);
+
+    return dctx;
+}
+
+/**
+ * Initialize decryption contexts for many files, the key pieces of all of
+ * them being read at once
+ */
+int glite_eds_decrypt_init_multi(char **ids, int nids, EVP_CIPHER_CTX **ctxs,
+    char **errors, char **error)
+{
+    struct eds_batch b;
+    struct hydra_data common, *data;
+    _glite_eds_endpoints *list;
+    const char *reason;
+    char *hex_key, *id_error;
+    int i, res = 0;
+
+    *error = NULL;
+    for (i = 0; i < nids; i++)
+    {
+        ctxs[i] = NULL;
+        if (errors)
+            errors[i] = NULL;
+    }
+    if (nids < 1)
+        return 0;
+
+    if (glite_eds_library_init(error))
+        return -1;
+    list = _glite_eds_endpoints_get(error);
+    if (!list)
+        return -1;
+
+    memset(&b, 0, sizeof(b));
+    pthread_mutex_init(&b.lock, NULL);
+    b.func = "glite_eds_decrypt_init_multi";
+    b.ids = ids;
+    b.nids = nids;
+    b.endpoints = list->endpoints;
+    b.epcount = list->count;
+    b.pieces = (struct hydra_data *)calloc((size_t)nids * b.epcount,
+        sizeof(*b.pieces));
+    b.state = (unsigned char *)calloc((size_t)nids * b.epcount, sizeof(*b.state));
+    b.errors = (char **)calloc(nids, sizeof(*b.errors));
+    if (!b.pieces || !b.state || !b.errors)
+    {
+        asprintf(error, "glite_eds_decrypt_init_multi error: out of memory");
+        res = -1;
+        goto out;
+    }
+
+    /* Every key store is asked for all ids: a missing piece of one id
+     * does not need another round */
+    eds_batch_run(&b, eds_batch_get_run);
+    if (b.unreachable)
+        _glite_eds_endpoints_invalidate(list);
+
+    for (i = 0; i < nids; i++)
+    {
+        id_error = NULL;
+        hex_key = eds_batch_join(&b, i, &common, &reason);
+        if (!hex_key)
+        {
+            /* Missing pieces are explained by the error of a key store,
+             * if there was one */
+            if (!reason && b.errors[i])
+            {
+                id_error = b.errors[i];
+                b.errors[i] = NULL;
+            }
+            else
+                asprintf(&id_error, "glite_eds_decrypt_init_multi error "
+                    "(%s): %s", ids[i],
+                    reason ? reason : "failed to get all key pieces");
+        }
+        else
+        {
+            ctxs[i] = eds_decrypt_ctx(hex_key, common.hex_iv, common.cipher,
+                &id_error);
+            OPENSSL_cleanse(hex_key, strlen(hex_key));
+            free(hex_key);
+        }
+
+        if (ctxs[i])
+            continue;
+        res = -1;
+        if (!*error && id_error)
+            *error = strdup(id_error);
+        if (errors)
+            errors[i] = id_error;
+        else
+            free(id_error);
+    }
+
+out:
+    for (i = 0; b.pieces && b.state && i < nids * b.epcount; i++)
+    {
+        if (b.state[i] != EDS_ENTRY_DONE)
+            continue;
+        data = &b.pieces[i];
+        free(data->hex_iv);
+        free(data->hex_key);
+        free(data->keyinfo);
+        free(data->cipher);
+    }
+    free(b.pieces);
+    if (b.errors)
+        free_str_list(b.errors, nids);
+    free(b.state);
+    pthread_mutex_destroy(&b.lock);
+    _glite_eds_endpoints_release(list);
+
+    if (res && !*error)
+        asprintf(error, "glite_eds_decrypt_init_multi error: out of memory");
+    return res;
+}
+
+/**
+ * Helper function - counter block of a CTR stream for the given offset:
+ * the IV plus the number of whole blocks, as a big endian number
+ */
+static int eds_ctr_counter(struct eds_ctx_data *data, off_t pos,
+    unsigned char *counter)
+{
+    unsigned long long blocks;
+    unsigned int sum = 0;
     int i;
 
-    endpoints = glite_eds_get_catalog_endpoints(&epcount, error);
-    if (!endpoints)
-        return -1;
+    memcpy(counter, data->iv, data->iv_len);
+    blocks = (unsigned long long)(pos / data->iv_len);
+    for (i = data->iv_len - 1; i >= 0 && (blocks || sum); i--)
+    {
+        sum += counter[i] + (unsigned int)(blocks & 0xff);
+        counter[i] = (unsigned char)sum;
+        sum >>= 8;
+        blocks >>= 8;
+    }
+
+    return (int)(pos % data->iv_len);
+}
+
+/**
+ * Helper function - set the keystream of a CTR context to the given offset
+ */
+static int eds_ctr_seek(EVP_CIPHER_CTX *ctx, struct eds_ctx_data *data,
+    off_t pos, const unsigned char *counter, int skip)
+{
+    unsigned char scratch[EVP_MAX_IV_LENGTH];
+    int len;
+
+    if (!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, counter, -1))
+        return -1;
+
+    memset(scratch, 0, sizeof(scratch));
+    if (skip && !EVP_CipherUpdate(ctx, scratch, &len, scratch, skip))
+        return -1;
+
+    data->ctr_pos = pos;
+    return 0;
+}
+
+/**
+ * Initialize decryption of a byte range of an encrypted file
+ */
+EVP_CIPHER_CTX *glite_eds_decrypt_range_init(char *id, off_t offset,
+    off_t length, off_t cipher_size, off_t *read_offset, off_t *read_length,
+    char **error)
+{
+    EVP_CIPHER_CTX *dctx;
+    struct eds_ctx_data *data;
+    unsigned char counter[EVP_MAX_IV_LENGTH];
+    off_t end, first, last;
+    int block_size, skip;
+
+    if (offset < 0)
+    {
+        asprintf(error, "glite_eds_decrypt_range_init error: invalid "
+            "offset %lld", (long long)offset);
+        return NULL;
+    }
+
+    dctx = glite_eds_decrypt_init(id, error);
+    if (!dctx)
+        return NULL;
+
+    data = (struct eds_ctx_data *)EVP_CIPHER_CTX_get_app_data(dctx);
+    block_size = EVP_CIPHER_CTX_block_size(dctx);
+
+    if (length < 0 || length > cipher_size - offset)
+        end = cipher_size;
+    else
+        end = offset + length;
+    if (offset > end)
+        offset = end;
+
+    /* CTR: the keystream of any offset is known */
+    if (EVP_CIPHER_CTX_mode(dctx) == EVP_CIPH_CTR_MODE)
+    {
+        skip = eds_ctr_counter(data, offset, counter);
+        if (eds_ctr_seek(dctx, data, offset, counter, skip))
+        {
+            asprintf(error, "glite_eds_decrypt_range_init error: %s",
+                _glite_eds_ssl_error());
+            goto err;
+        }
+        *read_offset = offset;
+        *read_length = end - offset;
+        return dctx;
+    }
+
+    /* Block i of a CBC stream only depends on the ciphertext block i - 1 */
+    if (EVP_CIPHER_CTX_mode(dctx) != EVP_CIPH_CBC_MODE ||
+        data->iv_len != block_size)
+    {
+        asprintf(error, "glite_eds_decrypt_range_init error: random access "
+            "is only supported for CBC and CTR ciphers");
+        goto err;
+    }
+    if (cipher_size < block_size || cipher_size % block_size)
+    {
+        asprintf(error, "glite_eds_decrypt_range_init error: %lld bytes is "
+            "not a valid encrypted file size", (long long)cipher_size);
+        goto err;
+    }
+
+    first = offset / block_size;
+
+    /* The plaintext is 1 to block_size bytes shorter than the ciphertext:
+     * if the range may reach the last block, it is read for the padding */
+    if (offset < end && end > cipher_size - block_size)
+        last = cipher_size / block_size - 1;
+    else
+    {
+        last = (end + block_size - 1) / block_size - 1;
+        data->padding = 0;
+        EVP_CIPHER_CTX_set_padding(dctx, 0);
+    }
+
+    if (last < first)
+    {
+        *read_offset = 0;
+        *read_length = 0;
+        data->range_left = 0;
+        return dctx;
+    }
+
+    /* The ciphertext block before the range is the IV */
+    if (first > 0)
+    {
+        *read_offset = (first - 1) * block_size;
+        data->iv_missing = block_size;
+    }
+    else
+        *read_offset = 0;
+    *read_length = (last + 1) * block_size - *read_offset;
+
+    data->range_skip = offset - first * block_size;
+    data->range_left = end - offset;
+
+    return dctx;
+
+err:
+    eds_free_data(dctx);
+    EVP_CIPHER_CTX_free(dctx);
+    return NULL;
+}
+
+/**
+ * Set the number of threads used by a context
+ */
+int glite_eds_set_threads(EVP_CIPHER_CTX *ctx, int nthreads, char **error)
+{
+    struct eds_ctx_data *data;
+    int i, mode;
+
+    data = (struct eds_ctx_data *)EVP_CIPHER_CTX_get_app_data(ctx);
+    if (!data)
+    {
+        asprintf(error, "glite_eds_set_threads error: the context was not "
+            "created by this library");
+        return -1;
+    }
+    if (data->started)
+    {
+        asprintf(error, "glite_eds_set_threads error: the context has "
+            "already processed data");
+        return -1;
+    }
+
+    if (nthreads <= 0)
+        nthreads = _glite_eds_cpu_count();
+
+    eds_stop_threads(data);
+
+    /* CBC decryption, CTR and the chunked AEAD format can be spread over
+     * several threads */
+    mode = EVP_CIPHER_CTX_mode(ctx);
+    if (nthreads == 1)
+        return 0;
+    if (!data->aead && mode != EVP_CIPH_CTR_MODE && (data->encrypt ||
+        mode != EVP_CIPH_CBC_MODE ||
+        EVP_CIPHER_CTX_block_size(ctx) != data->iv_len))
+        return 0;
+
+    data->wctx = (EVP_CIPHER_CTX **)calloc(nthreads, sizeof(*data->wctx));
+    data->jobs = (struct eds_cbc_job *)calloc(nthreads, sizeof(*data->jobs));
+    data->ctr_jobs = (struct eds_ctr_job *)calloc(nthreads,
+        sizeof(*data->ctr_jobs));
+    if (!data->wctx || !data->jobs || !data->ctr_jobs)
+    {
+        eds_stop_threads(data);
+        asprintf(error, "glite_eds_set_threads error: out of memory");
+        return -1;
+    }
+    data->nthreads = nthreads;
+
+    for (i = 0; i < nthreads; i++)
+    {
+        data->wctx[i] = EVP_CIPHER_CTX_new();
+        if (!data->wctx[i] || !EVP_CIPHER_CTX_copy(data->wctx[i], ctx))
+        {
+            eds_stop_threads(data);
+            asprintf(error, "glite_eds_set_threads error: %s",
+                _glite_eds_ssl_error());
+            return -1;
+        }
+        EVP_CIPHER_CTX_set_app_data(data->wctx[i], NULL);
+        EVP_CIPHER_CTX_set_padding(data->wctx[i], 0);
+    }
+
+    data->workers = _glite_eds_workers_new(nthreads);
+    if (!data->workers)
+    {
+        eds_stop_threads(data);
+        asprintf(error, "glite_eds_set_threads error: failed to start "
+            "%d threads", nthreads);
+        return -1;
+    }
+
+    memcpy(data->chain, data->iv, data->iv_len);
+    data->partial_len = 0;
+    data->held_len = 0;
+
+    return 0;
+}
+
+/**
+ * Helper function - decrypt one piece of a CBC stream (worker thread)
+ */
+static void eds_cbc_job_run(void *arg)
+{
+    struct eds_cbc_job *job = (struct eds_cbc_job *)arg;
+    int len;
+
+    job->ok = EVP_DecryptInit_ex(job->ctx, NULL, NULL, NULL, job->iv) &&
+        EVP_DecryptUpdate(job->ctx, job->out, &len, job->in, job->len) &&
+        len == job->len;
+}
+
+/**
+ * Helper function - decrypt nblocks complete CBC blocks. Every worker gets a
+ * contiguous range of blocks and starts from the ciphertext block preceding
+ * its range, so the result is the same as the serial decryption. in and out
+ * may be the same buffer.
+ */
+static int eds_cbc_decrypt_blocks(struct eds_ctx_data *data, int block_size,
+    const unsigned char *iv, unsigned char *in, unsigned char *out,
+    int nblocks)
+{
+    int njobs, i, start, count;
+
+    if (nblocks <= 0)
+        return 0;
+
+    njobs = (nblocks * block_size) / EDS_PARALLEL_MIN_CHUNK;
+    if (njobs > data->nthreads)
+        njobs = data->nthreads;
+    if (njobs < 1)
+        njobs = 1;
+
+    /* The IVs are saved first, in-place decryption overwrites them */
+    for (i = 0, start = 0; i < njobs; i++, start += count)
+    {
+        count = nblocks / njobs + (i < nblocks % njobs);
+        data->jobs[i].ctx = data->wctx[i];
+        if (i == 0)
+            memcpy(data->jobs[i].iv, iv, block_size);
+        else
+            memcpy(data->jobs[i].iv, in + (start - 1) * block_size, block_size);
+        data->jobs[i].in = in + start * block_size;
+        data->jobs[i].out = out + start * block_size;
+        data->jobs[i].len = count * block_size;
+        data->jobs[i].ok = 0;
+    }
+
+    _glite_eds_workers_run(data->workers, eds_cbc_job_run, data->jobs,
+        sizeof(*data->jobs), njobs);
+
+    for (i = 0; i < njobs; i++)
+        if (!data->jobs[i].ok)
+            return -1;
+
+    return 0;
+}
+
+/**
+ * Helper function - parallel replacement of EVP_DecryptUpdate for CBC
+ * contexts. Like OpenSSL, the last complete plaintext block is held back
+ * until more data arrives or the decryption is finalized, because it may
+ * contain the padding.
+ */
+static int eds_cbc_decrypt_update(EVP_CIPHER_CTX *ctx, struct eds_ctx_data *data,
+    char *mem_in, int mem_in_size, char *mem_out, int *mem_out_size,
+    char **error)
+{
+    unsigned char first[EVP_MAX_BLOCK_LENGTH], last[EVP_MAX_BLOCK_LENGTH];
+    unsigned char last_iv[EVP_MAX_BLOCK_LENGTH];
+    unsigned char *in = (unsigned char *)mem_in, *out = (unsigned char *)mem_out;
+    unsigned char *region, *region_iv;
+    int block_size, nblocks, first_in, skip, region_blocks, work_blocks;
+    int region_out, tail;
+
+    block_size = EVP_CIPHER_CTX_block_size(ctx);
+    *mem_out_size = 0;
+
+    /* Not even one complete block: just keep it */
+    nblocks = (data->partial_len + mem_in_size) / block_size;
+    if (nblocks == 0)
+    {
+        memcpy(data->partial + data->partial_len, in, mem_in_size);
+        data->partial_len += mem_in_size;
+        return 0;
+    }
+
+    /* Complete the block left over from the previous call */
+    first_in = (data->partial_len > 0);
+    skip = first_in ? block_size - data->partial_len : 0;
+    if (first_in)
+    {
+        memcpy(first, data->partial, data->partial_len);
+        memcpy(first + data->partial_len, in, skip);
+    }
+
+    /* The rest of the complete blocks are taken directly from the input:
+     * all of them but the last one are given to the workers */
+    region = in + skip;
+    region_blocks = nblocks - first_in;
+    region_iv = first_in ? first : data->chain;
+    if (region_blocks > 0)
+    {
+        memcpy(last, region + (region_blocks - 1) * block_size, block_size);
+        if (region_blocks > 1)
+            memcpy(last_iv, region + (region_blocks - 2) * block_size, block_size);
+        else
+            memcpy(last_iv, region_iv, block_size);
+        work_blocks = region_blocks - 1;
+    }
+    else
+    {
+        memcpy(last, first, block_size);
+        memcpy(last_iv, data->chain, block_size);
+        work_blocks = 0;
+    }
+
+    /* Save the incomplete tail before the output may overwrite it */
+    tail = mem_in_size - skip - region_blocks * block_size;
+    memcpy(data->partial, region + region_blocks * block_size, tail);
+
+    /* Output: held back block, first block, then the worker blocks */
+    region_out = (data->held_len ? block_size : 0) +
+        ((first_in && region_blocks > 0) ? block_size : 0);
+
+    if (mem_out == mem_in)
+    {
+        if (eds_cbc_decrypt_blocks(data, block_size, region_iv, region,
+            region, work_blocks))
+            goto err;
+        memmove(out + region_out, region, work_blocks * block_size);
+    }
+    else if (eds_cbc_decrypt_blocks(data, block_size, region_iv, region,
+        out + region_out, work_blocks))
+        goto err;
+
+    if (data->held_len)
+        memcpy(out, data->held, block_size);
+
+    if (first_in && region_blocks > 0)
+    {
+        if (!EVP_DecryptInit_ex(data->wctx[0], NULL, NULL, NULL, data->chain) ||
+            !EVP_DecryptUpdate(data->wctx[0], out + region_out - block_size,
+                mem_out_size, first, block_size))
+            goto err;
+    }
+
+    if (!EVP_DecryptInit_ex(data->wctx[0], NULL, NULL, NULL, last_iv) ||
+        !EVP_DecryptUpdate(data->wctx[0], data->held, mem_out_size,
+            last, block_size))
+        goto err;
+
+    memcpy(data->chain, last, block_size);
+    data->held_len = block_size;
+    data->partial_len = tail;
+    *mem_out_size = region_out + work_blocks * block_size;
+
+    return 0;
+
+err:
+    asprintf(error, "glite_eds_decrypt_block error: %s",
+        _glite_eds_ssl_error());
+    return -1;
+}
+
+/**
+ * Helper function - parallel replacement of EVP_DecryptFinal for CBC
+ * contexts: check and strip the padding of the held back block
+ */
+static int eds_cbc_decrypt_final(struct eds_ctx_data *data, int block_size,
+    char *mem_out, int *mem_out_size, char **error)
+{
+    int pad, i;
+
+    if (!data->padding && !data->partial_len)
+    {
+        memcpy(mem_out, data->held, data->held_len);
+        *mem_out_size = data->held_len;
+        data->held_len = 0;
+        return 0;
+    }
+
+    if (data->partial_len || !data->held_len)
+    {
+        asprintf(error, "glite_eds_decrypt_final error: wrong final "
+            "block length");
+        return -1;
+    }
+
+    pad = data->held[block_size - 1];
+    if (pad == 0 || pad > block_size)
+    {
+        asprintf(error, "glite_eds_decrypt_final error: bad decrypt");
+        return -1;
+    }
+    for (i = block_size - pad; i < block_size; i++)
+    {
+        if (data->held[i] != pad)
+        {
+            asprintf(error, "glite_eds_decrypt_final error: bad decrypt");
+            return -1;
+        }
+    }
+
+    memcpy(mem_out, data->held, block_size - pad);
+    *mem_out_size = block_size - pad;
+    data->held_len = 0;
+
+    return 0;
+}
+
+/**
+ * Helper function - encrypt or decrypt one piece of a CTR stream
+ * (worker thread)
+ */
+static void eds_ctr_job_run(void *arg)
+{
+    struct eds_ctr_job *job = (struct eds_ctr_job *)arg;
+    unsigned char scratch[EVP_MAX_IV_LENGTH];
+    int len;
+
+    memset(scratch, 0, sizeof(scratch));
+    job->ok = EVP_CipherInit_ex(job->ctx, NULL, NULL, NULL, job->counter, -1) &&
+        (!job->skip || EVP_CipherUpdate(job->ctx, scratch, &len, scratch,
+            job->skip)) &&
+        EVP_CipherUpdate(job->ctx, job->out, &len, job->in, job->len) &&
+        len == job->len;
+}
+
+/**
+ * Helper function - parallel replacement of EVP_CipherUpdate for CTR
+ * contexts. The keystream of every piece is computed from its offset in
+ * the stream, so the result is the same as the serial one.
+ */
+static int eds_ctr_update(struct eds_ctx_data *data, const char *func,
+    char *mem_in, int mem_in_size, char *mem_out, int *mem_out_size,
+    char **error)
+{
+    struct eds_ctr_job *job;
+    int njobs, i, start, count;
+
+    njobs = mem_in_size / EDS_PARALLEL_MIN_CHUNK;
+    if (njobs > data->nthreads)
+        njobs = data->nthreads;
+    if (njobs < 1)
+        njobs = 1;
+
+    for (i = 0, start = 0; i < njobs; i++, start += count)
+    {
+        count = mem_in_size / njobs + (i < mem_in_size % njobs);
+        job = &data->ctr_jobs[i];
+        job->ctx = data->wctx[i];
+        job->skip = eds_ctr_counter(data, data->ctr_pos + start, job->counter);
+        job->in = (unsigned char *)mem_in + start;
+        job->out = (unsigned char *)mem_out + start;
+        job->len = count;
+        job->ok = 0;
+    }
+
+    _glite_eds_workers_run(data->workers, eds_ctr_job_run, data->ctr_jobs,
+        sizeof(*data->ctr_jobs), njobs);
+
+    for (i = 0; i < njobs; i++)
+    {
+        if (!data->ctr_jobs[i].ok)
+        {
+            asprintf(error, "%s error: %s", func,
+                _glite_eds_ssl_error());
+            return -1;
+        }
+    }
+
+    data->ctr_pos += mem_in_size;
+    *mem_out_size = mem_in_size;
+
+    return 0;
+}
+
+/**
+ * Helper function - encrypt or decrypt one chunk of an AEAD stream
+ * (worker thread). The tag follows the ciphertext of the chunk.
+ */
+static void eds_aead_job_run(void *arg)
+{
+    struct eds_aead_job *job = (struct eds_aead_job *)arg;
+    int len = 0, final_len;
+
+    if (job->encrypt)
+        job->ok = EVP_EncryptInit_ex(job->ctx, NULL, NULL, NULL, job->nonce) &&
+            EVP_EncryptUpdate(job->ctx, NULL, &len, job->aad, sizeof(job->aad)) &&
+            (!job->len || EVP_EncryptUpdate(job->ctx, job->out, &len,
+                job->in, job->len)) &&
+            EVP_EncryptFinal_ex(job->ctx, job->out + job->len, &final_len) &&
+            EVP_CIPHER_CTX_ctrl(job->ctx, EVP_CTRL_GCM_GET_TAG,
+                EDS_AEAD_TAG_LEN, job->out + job->len) > 0;
+    else
+        job->ok = EVP_DecryptInit_ex(job->ctx, NULL, NULL, NULL, job->nonce) &&
+            EVP_DecryptUpdate(job->ctx, NULL, &len, job->aad, sizeof(job->aad)) &&
+            (!job->len || EVP_DecryptUpdate(job->ctx, job->out, &len,
+                job->in, job->len)) &&
+            EVP_CIPHER_CTX_ctrl(job->ctx, EVP_CTRL_GCM_SET_TAG,
+                EDS_AEAD_TAG_LEN, job->in + job->len) > 0 &&
+            EVP_DecryptFinal_ex(job->ctx, job->out + job->len, &final_len);
+}
+
+/**
+ * Helper function - allocate the chunk buffers once the chunk size is known
+ */
+static int eds_aead_alloc(struct eds_ctx_data *data, const char *func,
+    char **error)
+{
+    data->nslots = data->nthreads;
+    data->slots = (unsigned char *)malloc(data->nslots *
+        (data->chunk_size + EDS_AEAD_TAG_LEN));
+    data->aead_jobs = (struct eds_aead_job *)calloc(data->nslots,
+        sizeof(*data->aead_jobs));
+    if (!data->slots || !data->aead_jobs)
+    {
+        asprintf(error, "%s error: out of memory", func);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Helper function - write the header of a new AEAD stream
+ */
+static int eds_aead_write_header(struct eds_ctx_data *data, const char *func,
+    unsigned char *out, char **error)
+{
+    memcpy(data->header, EDS_AEAD_MAGIC, 4);
+    data->header[4] = EDS_AEAD_VERSION;
+    data->header[5] = EDS_AEAD_TAG_LEN;
+    data->header[6] = 0;
+    data->header[7] = 0;
+    data->header[8] = (unsigned char)(data->chunk_size >> 24);
+    data->header[9] = (unsigned char)(data->chunk_size >> 16);
+    data->header[10] = (unsigned char)(data->chunk_size >> 8);
+    data->header[11] = (unsigned char)data->chunk_size;
+    data->header_len = EDS_AEAD_HEADER_LEN;
+
+    memcpy(out, data->header, EDS_AEAD_HEADER_LEN);
+
+    return eds_aead_alloc(data, func, error);
+}
+
+/**
+ * Helper function - collect and check the header of an AEAD stream
+ */
+static int eds_aead_read_header(struct eds_ctx_data *data, const char *func,
+    unsigned char **in, int *n, char **error)
+{
+    int len;
+
+    len = EDS_AEAD_HEADER_LEN - data->header_len;
+    if (len > *n)
+        len = *n;
+    memcpy(data->header + data->header_len, *in, len);
+    data->header_len += len;
+    *in += len;
+    *n -= len;
+
+    if (data->header_len < EDS_AEAD_HEADER_LEN)
+        return 0;
+
+    data->chunk_size = (data->header[8] << 24) | (data->header[9] << 16) |
+        (data->header[10] << 8) | data->header[11];
+    if (memcmp(data->header, EDS_AEAD_MAGIC, 4))
+    {
+        asprintf(error, "%s error: not a chunked encrypted stream", func);
+        return -1;
+    }
+    if (data->header[4] != EDS_AEAD_VERSION ||
+        data->header[5] != EDS_AEAD_TAG_LEN ||
+        data->header[6] || data->header[7] ||
+        data->chunk_size <= 0 || data->chunk_size > EDS_AEAD_MAX_CHUNK)
+    {
+        asprintf(error, "%s error: unsupported chunked stream format "
+            "(version %d)", func, data->header[4]);
+        data->chunk_size = 0;
+        return -1;
+    }
+
+    return eds_aead_alloc(data, func, error);
+}
+
+/**
+ * Helper function - process the first njobs chunk buffers. Chunks are
+ * numbered in stream order: the nonce is the registered IV xored with the
+ * chunk index, and the header, the index and the last chunk flag are
+ * authenticated, so chunks can not be reordered, dropped or truncated.
+ */
+static int eds_aead_flush(EVP_CIPHER_CTX *ctx, struct eds_ctx_data *data,
+    const char *func, int njobs, int last_len, unsigned char *out,
+    int *out_size, char **error)
+{
+    struct eds_aead_job *job;
+    int stride, i, b;
+
+    stride = data->chunk_size + EDS_AEAD_TAG_LEN;
+
+    for (i = 0; i < njobs; i++)
+    {
+        job = &data->aead_jobs[i];
+        job->ctx = data->wctx ? data->wctx[i] : ctx;
+        job->encrypt = data->encrypt;
+        job->in = data->slots + i * stride;
+        job->len = (last_len >= 0) ? last_len : data->chunk_size;
+        job->out = out + *out_size;
+        job->ok = 0;
+        *out_size += data->encrypt ? job->len + EDS_AEAD_TAG_LEN : job->len;
+
+        memcpy(job->nonce, data->iv, data->iv_len);
+        memcpy(job->aad, data->header, EDS_AEAD_HEADER_LEN);
+        for (b = 0; b < 8; b++)
+        {
+            job->nonce[data->iv_len - 1 - b] ^=
+                (unsigned char)(data->chunk_index >> (8 * b));
+            job->aad[EDS_AEAD_HEADER_LEN + 7 - b] =
+                (unsigned char)(data->chunk_index >> (8 * b));
+        }
+        job->aad[EDS_AEAD_AAD_LEN - 1] = (last_len >= 0);
+        data->chunk_index++;
+    }
+
+    _glite_eds_workers_run(data->workers, eds_aead_job_run, data->aead_jobs,
+        sizeof(*data->aead_jobs), njobs);
+
+    for (i = 0; i < njobs; i++)
+    {
+        if (data->aead_jobs[i].ok)
+            continue;
+        if (data->encrypt)
+            asprintf(error, "%s error: %s", func,
+                _glite_eds_ssl_error());
+        else
+            asprintf(error, "%s error: chunk %llu failed the integrity "
+                "check", func, data->chunk_index - njobs + i);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Helper function - update step of the chunked AEAD format. The data is
+ * collected into the chunk buffers, and every complete chunk is processed,
+ * in parallel if the context has worker threads. A complete chunk is never
+ * the last one: a stream always ends with a shorter, possibly empty chunk.
+ */
+static int eds_aead_update(EVP_CIPHER_CTX *ctx, struct eds_ctx_data *data,
+    const char *func, char *mem_in, int mem_in_size, char *mem_out,
+    int *mem_out_size, char **error)
+{
+    unsigned char *in = (unsigned char *)mem_in, *out = (unsigned char *)mem_out;
+    int n = mem_in_size, unit, stride, slot, len;
+
+    *mem_out_size = 0;
 
-    /* default key_shares to numServices. Note: it's possible that it's not
-     * the same as original key_shares if the number of the services has
-     * been changed later! */
-    key_list = realloc_str_list(NULL, &key_shares, epcount);
-    if (!key_list) {
-        asprintf(error, "glite_eds_get_metadata: out of memory");
-        free_str_list(endpoints, epcount);
-        return -1;
+    if (!data->encrypt && data->header_len < EDS_AEAD_HEADER_LEN)
+    {
+        if (eds_aead_read_header(data, func, &in, &n, error))
+            return -1;
+        if (!n)
+            return 0;
     }
 
-    /* Fetch each key piece from separate catalog. */
-    *error = NULL;
-    for (i = 0; i < epcount; i++) {
-        if (glite_eds_get_metadata_single(endpoints[i], id, &data, &err)) {
-	    /* Keep first error only */
-            if (*error == NULL) *error = err;
-            else free(err);
-        } else {
-            /* Realloc list if key_index is greater than expected. */
-            if ((unsigned int)data.key_index >= key_shares)
-            {
-                key_list = realloc_str_list(key_list, &key_shares, data.key_index);
-                if (!key_list) {
-                    free_str_list(endpoints, epcount);
-                    asprintf(error, "glite_eds_get_metadata: out of memory");
-                    return -1;
-                }
-            }
+    /* In place: move the input to the end of the output buffer, so the
+     * output never catches up with the input not yet read */
+    if (mem_out == mem_in && n > 0)
+    {
+        len = glite_eds_output_size(ctx, n) - n;
+        memmove(out + len, in, n);
+        in = out + len;
+    }
 
-            /* Save one key piece. */
-            key_list[data.key_index] = strdup(data.hex_key);
-
-	    /* Save common data from first entry and
-             * make some cross checks for the rest. */
-	    if (keycount == 0) {
-                keys_needed = data.keys_needed;
-                *hex_iv = strdup(data.hex_iv);
-                *keyinfo = strdup(data.keyinfo);
-                *cipher = strdup(data.cipher);
-            } else if ((unsigned int)data.keys_needed != keys_needed ||
-                strcmp(data.hex_iv, *hex_iv) ||
-                strcmp(data.keyinfo, *keyinfo) ||
-                strcmp(data.cipher, *cipher))
-            {
-                free(*error);
-                asprintf(error, "glite_eds_get_metadata: metadata corrupted");
-                keys_needed = 0; /* break the loop */
-            }
-            keycount++;
-           
-            free(data.hex_iv);
-            free(data.hex_key);
-            free(data.keyinfo);
-            free(data.cipher);
-
-            /* Don't continue if we have enough pieces */
-            if (keycount >= keys_needed)
-                break;
-        }
+    if (data->encrypt && !data->header_len)
+    {
+        if (eds_aead_write_header(data, func, out, error))
+            return -1;
+        *mem_out_size = EDS_AEAD_HEADER_LEN;
     }
 
-    free_str_list(endpoints, epcount);
+    stride = data->chunk_size + EDS_AEAD_TAG_LEN;
+    unit = data->encrypt ? data->chunk_size : stride;
 
-    if (!keys_needed || keycount < keys_needed) {
-        if (*error == NULL) 
-            asprintf(error, "glite_eds_get_metadata: failed to get all key pieces");
-        free_str_list((char**)key_list, key_shares);
-        return -1;
+    for (slot = 0; n > 0; )
+    {
+        len = unit - data->slot_fill;
+        if (len > n)
+            len = n;
+        memcpy(data->slots + slot * stride + data->slot_fill, in, len);
+        data->slot_fill += len;
+        in += len;
+        n -= len;
+
+        if (data->slot_fill < unit)
+            break;
+
+        data->slot_fill = 0;
+        if (++slot == data->nslots)
+        {
+            if (eds_aead_flush(ctx, data, func, slot, -1, out,
+                mem_out_size, error))
+                return -1;
+            slot = 0;
+        }
     }
-    
-    free(*error);
 
-    /* Join ssss key pieces */ 
-    *hex_key = glite_security_ssss_join_keys(key_list, key_shares);
-    free_str_list((char**)key_list, key_shares);
-    
-    if (! (*hex_key)) {
-        asprintf(error, "glite_eds_get_metadata: Error join keys");
-        return -1;
+    if (slot > 0)
+    {
+        if (eds_aead_flush(ctx, data, func, slot, -1, out, mem_out_size, error))
+            return -1;
+        if (data->slot_fill)
+            memcpy(data->slots, data->slots + slot * stride, data->slot_fill);
     }
-  
+
     return 0;
 }
 
 /**
- * Helper function - used by glite_eds_encrypt_init and glite_eds_decrypt_init
+ * Helper function - final step of the chunked AEAD format: process the
+ * last chunk
  */
-EVP_CIPHER_CTX *glite_eds_init(char *id, char **key, char **iv,
-    const EVP_CIPHER **type, char **error)
+static int eds_aead_final(EVP_CIPHER_CTX *ctx, struct eds_ctx_data *data,
+    const char *func, char *mem_out, int *mem_out_size, char **error)
 {
-    EVP_CIPHER_CTX *ectx;
-    char *cipher_name, *keyinfo, *hex_key, *hex_iv;
+    unsigned char *out = (unsigned char *)mem_out;
+    int last_len;
 
-    if (glite_eds_get_metadata(id, &hex_key, &hex_iv, &cipher_name, &keyinfo, error))
-        return NULL;
+    *mem_out_size = 0;
 
-    to_bin(hex_key, (unsigned char **)key);
-    to_bin(hex_iv, (unsigned char **)iv);
- 
-    if (!RAND_load_file("/dev/random", 1))
+    if (data->encrypt)
     {
-        asprintf(error, "glite_eds_init error: %s",
-            ERR_error_string(ERR_get_error(), NULL));
-        return NULL;
+        if (!data->header_len)
+        {
+            if (eds_aead_write_header(data, func, out, error))
+                return -1;
+            *mem_out_size = EDS_AEAD_HEADER_LEN;
+        }
+        last_len = data->slot_fill;
+    }
+    else
+    {
+        if (data->header_len < EDS_AEAD_HEADER_LEN ||
+            data->slot_fill < EDS_AEAD_TAG_LEN)
+        {
+            asprintf(error, "%s error: the chunked stream is truncated", func);
+            return -1;
+        }
+        last_len = data->slot_fill - EDS_AEAD_TAG_LEN;
     }
 
-    OpenSSL_add_all_ciphers();
+    data->slot_fill = 0;
+    return eds_aead_flush(ctx, data, func, 1, last_len, out, mem_out_size,
+        error);
+}
 
-    *type = EVP_get_cipherbyname(cipher_name);
-    if (!(*type))
+/**
+ * Helper function - run one update step of the context into a caller owned
+ * buffer. If mem_out is the same as mem_in, the input is first moved up by one
+ * cipher block and then fed to OpenSSL through a small stack buffer: the output
+ * never runs more than one block ahead of the consumed input, so it can not
+ * overwrite data which has not been read yet.
+ */
+static int eds_update_into(EVP_CIPHER_CTX *ctx, int encrypt, const char *func,
+    char *mem_in, int mem_in_size, char *mem_out, int mem_out_capacity,
+    int *mem_out_size, char **error)
+{
+    unsigned char chunk[EDS_INPLACE_CHUNK];
+    struct eds_ctx_data *data;
+    int block_size, out_size, chunk_size, pos, res;
+    char *src;
+
+    block_size = EVP_CIPHER_CTX_block_size(ctx);
+    if (mem_in_size < 0 ||
+        mem_out_capacity < glite_eds_output_size(ctx, mem_in_size))
     {
-        asprintf(error, "glite_eds_init error: %s",
-            ERR_error_string(ERR_get_error(), NULL));
-        return NULL;
+        asprintf(error, "%s error: output buffer of %d bytes is too small, "
+            "%d bytes are needed", func, mem_out_capacity,
+            glite_eds_output_size(ctx, mem_in_size));
+        return -1;
     }
 
-    ectx = (EVP_CIPHER_CTX *)malloc(sizeof(EVP_CIPHER_CTX));
-    if (!ectx)
+    data = (struct eds_ctx_data *)EVP_CIPHER_CTX_get_app_data(ctx);
+    if (data)
     {
-        asprintf(error, "glite_eds_init error: calloc() of %d "
-            "bytes failed", sizeof(*ectx));
-        return NULL;
+        data->started = 1;
+        if (data->aead)
+            return eds_aead_update(ctx, data, func, mem_in, mem_in_size,
+                mem_out, mem_out_size, error);
+        if (data->workers && EVP_CIPHER_CTX_mode(ctx) == EVP_CIPH_CTR_MODE)
+            return eds_ctr_update(data, func, mem_in, mem_in_size,
+                mem_out, mem_out_size, error);
+        if (data->workers && !encrypt)
+            return eds_cbc_decrypt_update(ctx, data, mem_in, mem_in_size,
+                mem_out, mem_out_size, error);
+    }
+
+    if (mem_out != mem_in || block_size == 1)
+    {
+        if (encrypt)
+            res = EVP_EncryptUpdate(ctx, (unsigned char *)mem_out, &out_size,
+                (unsigned char *)mem_in, mem_in_size);
+        else
+            res = EVP_DecryptUpdate(ctx, (unsigned char *)mem_out, &out_size,
+                (unsigned char *)mem_in, mem_in_size);
+        if (!res)
+        {
+            asprintf(error, "%s error: %s", func,
+                _glite_eds_ssl_error());
+            return -1;
+        }
+        *mem_out_size = out_size;
+        return 0;
     }
 
-    EVP_CIPHER_CTX_init(ectx);
+    /* In-place operation */
+    src = mem_in + block_size;
+    memmove(src, mem_in, mem_in_size);
 
-    free(cipher_name); free(keyinfo); free(hex_key); free(hex_iv);
+    *mem_out_size = 0;
+    for (pos = 0; pos < mem_in_size; pos += chunk_size)
+    {
+        chunk_size = mem_in_size - pos;
+        if (chunk_size > (int)sizeof(chunk))
+            chunk_size = sizeof(chunk);
+        memcpy(chunk, src + pos, chunk_size);
+
+        if (encrypt)
+            res = EVP_EncryptUpdate(ctx, (unsigned char *)mem_out + *mem_out_size,
+                &out_size, chunk, chunk_size);
+        else
+            res = EVP_DecryptUpdate(ctx, (unsigned char *)mem_out + *mem_out_size,
+                &out_size, chunk, chunk_size);
+        if (!res)
+        {
+            asprintf(error, "%s error: %s", func,
+                _glite_eds_ssl_error());
+            return -1;
+        }
+        *mem_out_size += out_size;
+    }
 
-    return ectx;
+    return 0;
 }
 
-static int _glite_eds_register_common(char *id, char * cipher, int keysize,
-    char **key_p, char **iv_p, const EVP_CIPHER **type_p, char **error)
+/**
+ * Helper function - finalize the context into a caller owned buffer
+ */
+static int eds_final_into(EVP_CIPHER_CTX *ctx, int encrypt, const char *func,
+    char *mem_out, int mem_out_capacity, int *mem_out_size, char **error)
 {
-    char *cipher_to_use, *keyl_str;
-    unsigned char *hex_key, *hex_iv;
-    int keyLength, ivLength;
+    struct eds_ctx_data *data;
     int res;
 
-    /* Do OpenSSL cipher initialization */
-    if (!RAND_load_file("/dev/random", 1))
+    if (mem_out_capacity < glite_eds_output_size(ctx, 0))
     {
-        asprintf(error, "glite_eds_register error: %s",
-            ERR_error_string(ERR_get_error(), NULL));
+        asprintf(error, "%s error: output buffer of %d bytes is too small, "
+            "%d bytes are needed", func, mem_out_capacity,
+            glite_eds_output_size(ctx, 0));
         return -1;
     }
-    OpenSSL_add_all_ciphers();
-    cipher_to_use = (cipher) ? cipher : EDS_DEFAULT_CIPHER;
-    if (0 == ((*type_p) = EVP_get_cipherbyname(cipher_to_use)))
+
+    data = (struct eds_ctx_data *)EVP_CIPHER_CTX_get_app_data(ctx);
+    if (data)
     {
-        asprintf(error, "glite_eds_register error: %s",
-            ERR_error_string(ERR_get_error(), NULL));
-        return -1;
+        data->started = 1;
+        if (data->aead)
+            return eds_aead_final(ctx, data, func, mem_out, mem_out_size,
+                error);
+        if (data->workers && EVP_CIPHER_CTX_mode(ctx) == EVP_CIPH_CTR_MODE)
+        {
+            *mem_out_size = 0;
+            return 0;
+        }
+        if (data->workers && !encrypt)
+            return eds_cbc_decrypt_final(data, EVP_CIPHER_CTX_block_size(ctx),
+                mem_out, mem_out_size, error);
     }
 
-    /* Initialize encryption key and initialization vector */
-    ivLength = EVP_CIPHER_iv_length(*type_p);
-    keyLength = (keysize) ? (keysize >> 3) : EVP_CIPHER_key_length(*type_p);
-    if (NULL == (*iv_p = (char *)malloc(ivLength)))
+    if (encrypt)
+        res = EVP_EncryptFinal_ex(ctx, (unsigned char *)mem_out, mem_out_size);
+    else
+        res = EVP_DecryptFinal_ex(ctx, (unsigned char *)mem_out, mem_out_size);
+    if (!res)
     {
-        asprintf(error, "glite_eds_register error: malloc() of %d bytes "
-            "failed", ivLength);
+        asprintf(error, "%s error: %s", func,
+            _glite_eds_ssl_error());
         return -1;
     }
-    if (NULL == (*key_p = (char *)malloc(keyLength)))
+
+    return 0;
+}
+
+/**
+ * Helper function - take the IV of a range decryption from the head of
+ * the ciphertext. If the data is decrypted in place, the rest of the input
+ * is moved to the start of the buffer.
+ */
+static int eds_range_read_iv(EVP_CIPHER_CTX *ctx, struct eds_ctx_data *data,
+    char **mem_in, int *mem_in_size, char *mem_out, char **error)
+{
+    int n;
+
+    data->started = 1;
+
+    n = (*mem_in_size < data->iv_missing) ? *mem_in_size : data->iv_missing;
+    memcpy(data->iv + data->iv_len - data->iv_missing, *mem_in, n);
+    data->iv_missing -= n;
+
+    if (*mem_in == mem_out)
     {
-        asprintf(error, "glite_eds_register error: malloc() of %d bytes "
-            "failed", keyLength);
-        return -1;
+        memmove(mem_out, *mem_in + n, *mem_in_size - n);
+        *mem_in_size -= n;
     }
-    RAND_bytes((char *)*key_p, keyLength);
-    if (keyLength * 2 != to_hex(*key_p, keyLength, &hex_key))
+    else
     {
-        asprintf(error, "glite_eds_register error: converting key to hex "
-            "format failed");
-        return -1;
+        *mem_in += n;
+        *mem_in_size -= n;
     }
-    RAND_pseudo_bytes((char *)*iv_p, ivLength);
-    if (ivLength * 2 != to_hex(*iv_p, ivLength, &hex_iv))
+
+    if (data->iv_missing)
+        return 0;
+
+    if (!EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, data->iv))
     {
-        asprintf(error, "glite_eds_register error: converting iv to hex "
-            "format failed");
+        asprintf(error, "glite_eds_decrypt_block error: %s",
+            _glite_eds_ssl_error());
         return -1;
     }
+    memcpy(data->chain, data->iv, data->iv_len);
 
-    /* Do the Metadata Catalog stuff */
-    asprintf(&keyl_str, "%d", keyLength<<3);
-    res = glite_eds_put_metadata(id, hex_key, hex_iv, cipher_to_use, keyl_str, error);
-
-    free(hex_iv); free(hex_key); free(keyl_str);
-    
-    return res;
+    return 0;
 }
 
 /**
- * Register a new file in Hydra: create metadata entries (key/iv/...)
+ * Helper function - cut the decrypted data to the requested range
  */
-int glite_eds_register(char *id, char *cipher, int keysize, char **error)
+static void eds_range_trim(struct eds_ctx_data *data, char *mem_out,
+    int *mem_out_size)
 {
-    char *key, *iv;
-    const EVP_CIPHER *type;
-    int ret;
+    int skip;
 
-    ret = _glite_eds_register_common(id, cipher, keysize,
-        &key, &iv, &type, error);
+    if (data->range_skip)
+    {
+        skip = (data->range_skip < *mem_out_size) ?
+            (int)data->range_skip : *mem_out_size;
+        memmove(mem_out, mem_out + skip, *mem_out_size - skip);
+        *mem_out_size -= skip;
+        data->range_skip -= skip;
+    }
 
-    free(key); free(iv);
-    return ret;
+    if (data->range_left >= 0)
+    {
+        if (*mem_out_size > data->range_left)
+            *mem_out_size = (int)data->range_left;
+        data->range_left -= *mem_out_size;
+    }
 }
 
 /**
- * Register a new file in Hydra: create metadata entries (key/iv/...)
- * But this version checks whether the key stores are valid 23/05/2013
+ * Returns the output buffer size needed by the *_into functions
  */
-int glite_eds_register_valid(char *id, char *cipher, char *valid, int keysize, char **error)
+int glite_eds_output_size(EVP_CIPHER_CTX *ctx, int mem_in_size)
 {
-    char *key, *iv;
-    const EVP_CIPHER *type;
-    int ret;
+    struct eds_ctx_data *data;
+    int chunk;
 
-    ret = _glite_eds_register_common(id, cipher, keysize,
-        &key, &iv, &type, error);
+    /* Header, tags, and a chunk buffered from previous calls */
+    data = (struct eds_ctx_data *)EVP_CIPHER_CTX_get_app_data(ctx);
+    if (data && data->aead)
+    {
+        chunk = data->chunk_size ? data->chunk_size : EDS_AEAD_MAX_CHUNK;
+        return mem_in_size + EDS_AEAD_HEADER_LEN + chunk +
+            (mem_in_size / chunk + 2) * EDS_AEAD_TAG_LEN;
+    }
 
-    free(key); free(iv);
-    return ret;
+    return mem_in_size + EVP_CIPHER_CTX_block_size(ctx);
 }
+
 /**
- * Register a new file in Hydra: create metadata entries (key/iv/...),
- * initalizes encryption context
+ * Encrypts a memory block into a caller owned buffer
  */
-EVP_CIPHER_CTX *glite_eds_register_encrypt_init(char *id,
-    char *cipher, int keysize, char **error)
+int glite_eds_encrypt_block_into(EVP_CIPHER_CTX *ectx, char *mem_in, int mem_in_size,
+    char *mem_out, int mem_out_capacity, int *mem_out_size, char **error)
 {
-    char *key, *iv;
-    EVP_CIPHER_CTX *ectx;
-    const EVP_CIPHER *type;
-    int ret;
-
-    ret = _glite_eds_register_common(id, cipher, keysize,
-        &key, &iv, &type, error);
-
-    if (ret) return NULL;
-
-    if (NULL == (ectx = (EVP_CIPHER_CTX *)calloc(1, sizeof(*ectx))))
-    {
-        asprintf(error, "glite_eds_register_encrypt_init error: calloc() of %d "
-            "bytes failed", sizeof(*ectx));
-        return NULL;
-    }
-    EVP_CIPHER_CTX_init(ectx);
-    EVP_EncryptInit(ectx, type, key, iv);
-
-    free(key); free(iv);
+    return eds_update_into(ectx, 1, "glite_eds_encrypt_block", mem_in,
+        mem_in_size, mem_out, mem_out_capacity, mem_out_size, error);
+}
 
-    return ectx;
+/**
+ * Finalizes a block encryption into a caller owned buffer
+ */
+int glite_eds_encrypt_final_into(EVP_CIPHER_CTX *ectx, char *mem_out,
+    int mem_out_capacity, int *mem_out_size, char **error)
+{
+    return eds_final_into(ectx, 1, "glite_eds_encrypt_final", mem_out,
+        mem_out_capacity, mem_out_size, error);
 }
 
 /**
- * Initialize encryption context for a file. Query key/iv pairs from
- * metadata catalog
+ * Decrypts a memory block into a caller owned buffer
  */
-EVP_CIPHER_CTX *glite_eds_encrypt_init(char *id, char **error)
+int glite_eds_decrypt_block_into(EVP_CIPHER_CTX *dctx, char *mem_in, int mem_in_size,
+    char *mem_out, int mem_out_capacity, int *mem_out_size, char **error)
 {
-    char *iv, *key;
-    const EVP_CIPHER *type;
-    EVP_CIPHER_CTX *ectx;
-    
-    ectx = glite_eds_init(id, &key, &iv, &type, error);
-    if (!ectx)
-        return NULL;
+    struct eds_ctx_data *data;
 
-    EVP_EncryptInit(ectx, type, key, iv);
-    
-    free(key); free(iv);
+    data = (struct eds_ctx_data *)EVP_CIPHER_CTX_get_app_data(dctx);
+    if (data && data->iv_missing && mem_in_size > 0)
+    {
+        if (eds_range_read_iv(dctx, data, &mem_in, &mem_in_size, mem_out, error))
+            return -1;
+    }
 
-    return ectx;
+    if (eds_update_into(dctx, 0, "glite_eds_decrypt_block", mem_in,
+        mem_in_size, mem_out, mem_out_capacity, mem_out_size, error))
+        return -1;
+
+    if (data)
+        eds_range_trim(data, mem_out, mem_out_size);
+
+    return 0;
 }
 
 /**
- * Initialize decryption context for a file. Query key/iv pairs from
- * metadata catalog
+ * Finalizes memory block decryption into a caller owned buffer
  */
-EVP_CIPHER_CTX *glite_eds_decrypt_init(char *id, char **error)
+int glite_eds_decrypt_final_into(EVP_CIPHER_CTX *dctx, char *mem_out,
+    int mem_out_capacity, int *mem_out_size, char **error)
 {
-    char *iv, *key;
-    const EVP_CIPHER *type;
-    EVP_CIPHER_CTX *dctx;
-    
-    dctx = glite_eds_init(id, &key, &iv, &type, error);
-    if (!dctx)
-        return NULL;
+    struct eds_ctx_data *data;
 
-    EVP_DecryptInit(dctx, type, key, iv);
+    data = (struct eds_ctx_data *)EVP_CIPHER_CTX_get_app_data(dctx);
+    if (data && data->iv_missing)
+    {
+        asprintf(error, "glite_eds_decrypt_final error: the ciphertext "
+            "ended before the start of the range");
+        return -1;
+    }
 
-    free(key); free(iv);
+    if (eds_final_into(dctx, 0, "glite_eds_decrypt_final", mem_out,
+        mem_out_capacity, mem_out_size, error))
+        return -1;
 
-    return dctx;
+    if (data)
+        eds_range_trim(data, mem_out, mem_out_size);
+
+    return 0;
 }
 
 /**
@@ -888,22 +3770,26 @@ EVP_CIPHER_CTX *glite_eds_decrypt_init(char *id, char **error)
 int glite_eds_encrypt_block(EVP_CIPHER_CTX *ectx, char *mem_in, int mem_in_size,
     char **mem_out, int *mem_out_size, char **error)
 {
-    int enc_buffer_size;
+    int enc_buffer_capacity;
     char *enc_buffer;
 
-    enc_buffer = (char *)malloc(mem_in_size + EVP_CIPHER_CTX_block_size(ectx));
+    enc_buffer_capacity = glite_eds_output_size(ectx, mem_in_size);
+    enc_buffer = (char *)malloc(enc_buffer_capacity);
     if (!enc_buffer)
     {
         asprintf(error, "glite_eds_encrypt_block error: failed to allocate "
-            "%d bytes of memory", mem_in_size + EVP_CIPHER_CTX_block_size(ectx));
+            "%d bytes of memory", enc_buffer_capacity);
         return -1;
     }
 
-    EVP_EncryptUpdate(ectx, enc_buffer, &enc_buffer_size,
-        mem_in, mem_in_size);
+    if (glite_eds_encrypt_block_into(ectx, mem_in, mem_in_size, enc_buffer,
+        enc_buffer_capacity, mem_out_size, error))
+    {
+        free(enc_buffer);
+        return -1;
+    }
 
     *mem_out = enc_buffer;
-    *mem_out_size = enc_buffer_size;
 
     return 0;
 }
@@ -913,21 +3799,26 @@ int glite_eds_encrypt_block(EVP_CIPHER_CTX *ectx, char *mem_in, int mem_in_size,
  */
 int glite_eds_encrypt_final(EVP_CIPHER_CTX *ectx, char **mem_out, int *mem_out_size, char **error)
 {
-    int enc_buffer_size;
+    int enc_buffer_capacity;
     char *enc_buffer;
 
-    enc_buffer = (char *)malloc(EVP_CIPHER_CTX_block_size(ectx));
+    enc_buffer_capacity = glite_eds_output_size(ectx, 0);
+    enc_buffer = (char *)malloc(enc_buffer_capacity);
     if (!enc_buffer)
     {
         asprintf(error, "glite_eds_encrypt_final error: failed to allocate "
-            "%d bytes of memory", EVP_CIPHER_CTX_block_size(ectx));
+            "%d bytes of memory", enc_buffer_capacity);
         return -1;
     }
 
-    EVP_EncryptFinal(ectx, enc_buffer, &enc_buffer_size);
+    if (glite_eds_encrypt_final_into(ectx, enc_buffer, enc_buffer_capacity,
+        mem_out_size, error))
+    {
+        free(enc_buffer);
+        return -1;
+    }
 
     *mem_out = enc_buffer;
-    *mem_out_size = enc_buffer_size;
 
     return 0;
 }
@@ -938,22 +3829,26 @@ int glite_eds_encrypt_final(EVP_CIPHER_CTX *ectx, char **mem_out, int *mem_out_s
 int glite_eds_decrypt_block(EVP_CIPHER_CTX *dctx, char *mem_in,  int mem_in_size,
     char **mem_out, int *mem_out_size, char **error)
 {
-    int dec_buffer_size;
+    int dec_buffer_capacity;
     char *dec_buffer;
 
-    dec_buffer = (char *)malloc(mem_in_size + EVP_CIPHER_CTX_block_size(dctx));
+    dec_buffer_capacity = glite_eds_output_size(dctx, mem_in_size);
+    dec_buffer = (char *)malloc(dec_buffer_capacity);
     if (!dec_buffer)
     {
         asprintf(error, "glite_eds_decrypt_block error: failed to allocate "
-            "%d bytes of memory", mem_in_size + EVP_CIPHER_CTX_block_size(dctx));
+            "%d bytes of memory", dec_buffer_capacity);
         return -1;
     }
 
-    EVP_DecryptUpdate(dctx, dec_buffer, &dec_buffer_size,
-        mem_in, mem_in_size);
+    if (glite_eds_decrypt_block_into(dctx, mem_in, mem_in_size, dec_buffer,
+        dec_buffer_capacity, mem_out_size, error))
+    {
+        free(dec_buffer);
+        return -1;
+    }
 
     *mem_out = dec_buffer;
-    *mem_out_size = dec_buffer_size;
 
     return 0;
 }
@@ -963,21 +3858,26 @@ int glite_eds_decrypt_block(EVP_CIPHER_CTX *dctx, char *mem_in,  int mem_in_size
  */
 int glite_eds_decrypt_final(EVP_CIPHER_CTX *dctx, char **mem_out, int *mem_out_size, char **error)
 {
-    int dec_buffer_size;
+    int dec_buffer_capacity;
     char *dec_buffer;
 
-    dec_buffer = (char *)malloc(EVP_CIPHER_CTX_block_size(dctx));
+    dec_buffer_capacity = glite_eds_output_size(dctx, 0);
+    dec_buffer = (char *)malloc(dec_buffer_capacity);
     if (!dec_buffer)
     {
         asprintf(error, "glite_eds_decrypt_final error: failed to allocate "
-            "%d bytes of memory", EVP_CIPHER_CTX_block_size(dctx));
+            "%d bytes of memory", dec_buffer_capacity);
         return -1;
     }
 
-    EVP_DecryptFinal(dctx, dec_buffer, &dec_buffer_size);
+    if (glite_eds_decrypt_final_into(dctx, dec_buffer, dec_buffer_capacity,
+        mem_out_size, error))
+    {
+        free(dec_buffer);
+        return -1;
+    }
 
     *mem_out = dec_buffer;
-    *mem_out_size = dec_buffer_size;
 
     return 0;
 }
@@ -987,33 +3887,102 @@ int glite_eds_decrypt_final(EVP_CIPHER_CTX *dctx, char **mem_out, int *mem_out_s
  */
 int glite_eds_finalize(EVP_CIPHER_CTX *ctx, char **error)
 {
-    EVP_CIPHER_CTX_cleanup(ctx);
+    eds_free_data(ctx);
+    EVP_CIPHER_CTX_free(ctx);
     *error = NULL;
     return 0;
 }
 
 /**
- * Unregister catalog entries in case of error (key/iv)
+ * Helper function - remove the key pieces of an id from the key stores
  */
-int glite_eds_unregister(char *id, char **error)
+static int eds_unregister(char *id, char **error)
 {
+    _glite_eds_endpoints *list;
     char **endpoints;
+    struct eds_endpoint_job *jobs;
+    char *first_error;
     int epcount;
     int i;
     int res = 0;
 
-    endpoints = glite_eds_get_catalog_endpoints(&epcount, error);
-    if (!endpoints)
+    /* The pieces still being stored would outlive the removal */
+    _glite_eds_replication_cancel(id);
+
+    /* The removal is retried in the background rather than waited for */
+    if (_glite_eds_journal_enabled())
+        return _glite_eds_journal_unregister(id, error);
+
+    res = _glite_eds_agent_unregister(id, error);
+    if (res != EDS_AGENT_ABSENT) {
+        _glite_eds_keycache_invalidate(id);
+        return res;
+    }
+    res = 0;
+
+    list = _glite_eds_endpoints_get(error);
+    if (!list)
+        return -1;
+    endpoints = list->endpoints;
+    epcount = list->count;
+
+    jobs = (struct eds_endpoint_job *)calloc(epcount, sizeof(*jobs));
+    if (!jobs) {
+        asprintf(error, "glite_eds_unregister error: out of memory");
+        _glite_eds_endpoints_release(list);
         return -1;
+    }
+
+    /* Remove the entry from each catalog, all at once. */
+    for (i = 0; i < epcount; i++) {
+        jobs[i].endpoint = endpoints[i];
+        jobs[i].id = id;
+    }
+    eds_endpoint_run(eds_unregister_job_run, jobs, epcount);
+    _glite_eds_keycache_invalidate(id);
 
-    /* Remove the entry from each catalog. */
     for (i = 0; i < epcount; i++) {
-	if (glite_eds_unregister_single(endpoints[i], id, error))
-		res = -1;
+        if (jobs[i].res && jobs[i].unreachable)
+            _glite_eds_endpoints_invalidate(list);
     }
+    first_error = eds_endpoint_error(jobs, epcount);
+    if (first_error) {
+        *error = first_error;
+        res = -1;
+    }
+
+    free(jobs);
+    _glite_eds_endpoints_release(list);
+
+    return res;
+}
+
+/**
+ * Unregister catalog entries in case of error (key/iv)
+ */
+int glite_eds_unregister(char *id, char **error)
+{
+    double previous;
+    int res;
 
-    free_str_list(endpoints, epcount);
+    if (glite_eds_library_init(error))
+        return -1;
+
+    previous = _glite_eds_deadline_begin(_glite_eds_default_timeout());
+    res = eds_unregister(id, error);
+    _glite_eds_deadline_end(previous, res);
 
     return res;
 }
 
+int glite_eds_unregister_timeout(char *id, int timeout_ms, char **error)
+{
+    double previous;
+    int res;
+
+    previous = _glite_eds_deadline_begin(timeout_ms);
+    res = glite_eds_unregister(id, error);
+    _glite_eds_deadline_end(previous, res);
+
+    return res;
+}
@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  GLite Data Management - Endpoint latencies, health and counters of the
+ *  encrypted data storage API
+ *
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glite/data/hydra/c/eds-simple.h>
+
+#include "eds_internal.h"
+
+/* Latencies remembered per endpoint */
+#define EDS_LATENCY_SAMPLES     64
+/* Fewer samples than this do not give a usable percentile */
+#define EDS_LATENCY_MIN_SAMPLES 8
+/* Weight of the last request in the moving averages */
+#define EDS_EWMA_WEIGHT         0.2
+/* Consecutive failures opening the circuit of an endpoint by default */
+#define EDS_BREAKER_FAILURES    3
+/* Seconds an open circuit stays open by default */
+#define EDS_BREAKER_COOLDOWN    30
+
+/* Recent latencies and health of one endpoint */
+struct eds_endpoint_entry {
+    char *endpoint;
+    double samples[EDS_LATENCY_SAMPLES];
+    int count;          /* valid samples */
+    int next;           /* slot of the next sample */
+    double latency;     /* moving average, negative until the first sample */
+    double error_rate;  /* moving average of the failed requests */
+    unsigned long requests;
+    unsigned long failures;
+    int consecutive;    /* failures since the last success */
+    int state;          /* GLITE_EDS_CIRCUIT_* */
+    time_t open_until;  /* end of the cooldown of an open circuit */
+    time_t probe_until; /* a half-open probe is running until then */
+    struct eds_endpoint_entry *next_entry;
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct eds_endpoint_entry *endpoint_stats;
+static struct glite_eds_stats stats;
+
+/**
+ * Helper function - find the entry of an endpoint, optionally creating it.
+ * Must be called with the lock held.
+ */
+static struct eds_endpoint_entry *find_entry(const char *endpoint, int create)
+{
+    struct eds_endpoint_entry *entry;
+
+    for (entry = endpoint_stats; entry; entry = entry->next_entry)
+    {
+        if (!strcmp(entry->endpoint, endpoint))
+            return entry;
+    }
+    if (!create)
+        return NULL;
+
+    entry = (struct eds_endpoint_entry *)calloc(1, sizeof(*entry));
+    if (!entry)
+        return NULL;
+    entry->endpoint = strdup(endpoint);
+    if (!entry->endpoint)
+    {
+        free(entry);
+        return NULL;
+    }
+    entry->latency = -1;
+    entry->state = GLITE_EDS_CIRCUIT_CLOSED;
+    entry->next_entry = endpoint_stats;
+    endpoint_stats = entry;
+    return entry;
+}
+
+/**
+ * Helper function - comparison for qsort()
+ */
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+void _glite_eds_latency_record(const char *endpoint, double seconds)
+{
+    struct eds_endpoint_entry *entry;
+
+    pthread_mutex_lock(&stats_lock);
+    entry = find_entry(endpoint, 1);
+    if (entry)
+    {
+        entry->samples[entry->next] = seconds;
+        entry->next = (entry->next + 1) % EDS_LATENCY_SAMPLES;
+        if (entry->count < EDS_LATENCY_SAMPLES)
+            entry->count++;
+        if (entry->latency < 0)
+            entry->latency = seconds;
+        else
+            entry->latency += EDS_EWMA_WEIGHT * (seconds - entry->latency);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+double _glite_eds_latency_percentile(const char *endpoint, int percentile)
+{
+    struct eds_endpoint_entry *entry;
+    double sorted[EDS_LATENCY_SAMPLES];
+    double res = -1;
+    int count = 0;
+
+    pthread_mutex_lock(&stats_lock);
+    entry = find_entry(endpoint, 0);
+    if (entry && entry->count >= EDS_LATENCY_MIN_SAMPLES)
+    {
+        count = entry->count;
+        memcpy(sorted, entry->samples, count * sizeof(*sorted));
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    if (count)
+    {
+        qsort(sorted, count, sizeof(*sorted), compare_double);
+        if (percentile < 0)
+            percentile = 0;
+        if (percentile > 100)
+            percentile = 100;
+        res = sorted[(count - 1) * percentile / 100];
+    }
+
+    return res;
+}
+
+double _glite_eds_latency_average(const char *endpoint)
+{
+    struct eds_endpoint_entry *entry;
+    double res = -1;
+
+    pthread_mutex_lock(&stats_lock);
+    entry = find_entry(endpoint, 0);
+    if (entry)
+        res = entry->latency;
+    pthread_mutex_unlock(&stats_lock);
+
+    return res;
+}
+
+void _glite_eds_endpoint_result(const char *endpoint, int ok)
+{
+    struct eds_endpoint_entry *entry;
+    int threshold, cooldown;
+
+    threshold = _glite_env_int(GLITE_EDS_BREAKER_FAILURES_ENV,
+        EDS_BREAKER_FAILURES, 0);
+    cooldown = _glite_env_int(GLITE_EDS_BREAKER_COOLDOWN_ENV,
+        EDS_BREAKER_COOLDOWN, 0);
+
+    pthread_mutex_lock(&stats_lock);
+    entry = find_entry(endpoint, 1);
+    if (entry)
+    {
+        entry->requests++;
+        entry->error_rate += EDS_EWMA_WEIGHT * ((ok ? 0 : 1) - entry->error_rate);
+        if (ok)
+        {
+            entry->consecutive = 0;
+            entry->state = GLITE_EDS_CIRCUIT_CLOSED;
+        }
+        else
+        {
+            entry->failures++;
+            entry->consecutive++;
+            /* A failed probe opens the circuit again at once */
+            if (threshold > 0 && (entry->state == GLITE_EDS_CIRCUIT_HALF_OPEN ||
+                entry->consecutive >= threshold))
+            {
+                entry->state = GLITE_EDS_CIRCUIT_OPEN;
+                entry->open_until = time(NULL) + cooldown;
+            }
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Helper function - tell if the circuit of an endpoint keeps requests
+ * away: it is open and cooling down, or a probe is running. Must be
+ * called with the lock held.
+ */
+static int circuit_blocks(struct eds_endpoint_entry *entry, time_t now)
+{
+    return now < entry->open_until ||
+        (entry->state == GLITE_EDS_CIRCUIT_HALF_OPEN && now < entry->probe_until);
+}
+
+int _glite_eds_endpoint_usable(const char *endpoint)
+{
+    struct eds_endpoint_entry *entry;
+    int res = 1;
+
+    if (_glite_env_int(GLITE_EDS_BREAKER_FAILURES_ENV,
+        EDS_BREAKER_FAILURES, 0) <= 0)
+        return 1;
+
+    pthread_mutex_lock(&stats_lock);
+    entry = find_entry(endpoint, 0);
+    if (entry && entry->state != GLITE_EDS_CIRCUIT_CLOSED)
+        res = !circuit_blocks(entry, time(NULL));
+    pthread_mutex_unlock(&stats_lock);
+
+    return res;
+}
+
+int _glite_eds_endpoint_allowed(const char *endpoint)
+{
+    struct eds_endpoint_entry *entry;
+    time_t now;
+    int res = 1, cooldown;
+
+    if (_glite_env_int(GLITE_EDS_BREAKER_FAILURES_ENV,
+        EDS_BREAKER_FAILURES, 0) <= 0)
+        return 1;
+    cooldown = _glite_env_int(GLITE_EDS_BREAKER_COOLDOWN_ENV,
+        EDS_BREAKER_COOLDOWN, 0);
+
+    pthread_mutex_lock(&stats_lock);
+    entry = find_entry(endpoint, 0);
+    if (entry && entry->state != GLITE_EDS_CIRCUIT_CLOSED)
+    {
+        now = time(NULL);
+        if (circuit_blocks(entry, now))
+            res = 0;
+        else
+        {
+            /* One request probes the endpoint; if its answer never comes,
+             * another one may try after the cooldown */
+            entry->state = GLITE_EDS_CIRCUIT_HALF_OPEN;
+            entry->probe_until = now + cooldown;
+        }
+    }
+    if (!res)
+        stats.circuit_skips++;
+    pthread_mutex_unlock(&stats_lock);
+
+    return res;
+}
+
+void _glite_eds_count_reads(int n)
+{
+    pthread_mutex_lock(&stats_lock);
+    stats.share_reads += n;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void _glite_eds_count_skips(int n)
+{
+    pthread_mutex_lock(&stats_lock);
+    stats.circuit_skips += n;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+int _glite_eds_hedge_acquire(int budget)
+{
+    int res;
+
+    /* One hedge is always allowed, so that the budget can start at all */
+    pthread_mutex_lock(&stats_lock);
+    res = stats.hedges * 100 < stats.share_reads * (unsigned long)budget + 100;
+    if (res)
+        stats.hedges++;
+    pthread_mutex_unlock(&stats_lock);
+
+    return res;
+}
+
+void _glite_eds_count_hedge_won(void)
+{
+    pthread_mutex_lock(&stats_lock);
+    stats.hedges_won++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void _glite_eds_count_connection(int reused)
+{
+    pthread_mutex_lock(&stats_lock);
+    if (reused)
+        stats.connections_reused++;
+    else
+        stats.connections++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void _glite_eds_count_key_cache(int hit)
+{
+    pthread_mutex_lock(&stats_lock);
+    if (hit)
+        stats.key_cache_hits++;
+    else
+        stats.key_cache_misses++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Get the counters of the library
+ */
+void glite_eds_get_stats(struct glite_eds_stats *result)
+{
+    pthread_mutex_lock(&stats_lock);
+    *result = stats;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Get the health of the endpoints used so far
+ */
+int glite_eds_get_endpoint_stats(struct glite_eds_endpoint_stats **result,
+    int *count, char **error)
+{
+    struct eds_endpoint_entry *entry;
+    struct glite_eds_endpoint_stats *list;
+    int n = 0, i;
+
+    *result = NULL;
+    *count = 0;
+
+    pthread_mutex_lock(&stats_lock);
+    for (entry = endpoint_stats; entry; entry = entry->next_entry)
+        n++;
+    list = (struct glite_eds_endpoint_stats *)calloc(n ? n : 1, sizeof(*list));
+    for (entry = endpoint_stats, i = 0; list && entry; entry = entry->next_entry, i++)
+    {
+        list[i].endpoint = strdup(entry->endpoint);
+        if (!list[i].endpoint)
+        {
+            glite_eds_free_endpoint_stats(list, i);
+            list = NULL;
+            break;
+        }
+        list[i].latency = entry->latency;
+        list[i].error_rate = entry->error_rate;
+        list[i].requests = entry->requests;
+        list[i].failures = entry->failures;
+        list[i].state = entry->state;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    if (!list)
+    {
+        asprintf(error, "glite_eds_get_endpoint_stats error: out of memory");
+        return -1;
+    }
+    *result = list;
+    *count = n;
+    return 0;
+}
+
+void glite_eds_free_endpoint_stats(struct glite_eds_endpoint_stats *stats,
+    int count)
+{
+    int i;
+
+    if (!stats)
+        return;
+    for (i = 0; i < count; i++)
+        free(stats[i].endpoint);
+    free(stats);
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  GLite Data Management - Worker threads of the encrypted data storage API
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "eds_internal.h"
+
+struct _glite_eds_workers
+{
+    pthread_mutex_t      lock;
+    pthread_cond_t       start;     /* a new batch was posted */
+    pthread_cond_t       done;      /* the current batch has finished */
+    pthread_mutex_t      run_lock;  /* serializes _glite_eds_workers_run() */
+    pthread_t           *threads;
+    int                  nthreads;  /* background threads */
+    int                  shutdown;
+    unsigned long        generation;
+
+    /* The current batch */
+    _glite_eds_job_func  func;
+    char                *jobs;
+    size_t               job_size;
+    int                  njobs;
+    int                  next;      /* next job to pick up */
+    int                  remaining; /* jobs not finished yet */
+};
+
+/**
+ * Helper function - pick up jobs of the current batch until there are
+ * none left. Must be called with the lock held.
+ */
+static void do_jobs(_glite_eds_workers *w)
+{
+    int i;
+
+    while (w->next < w->njobs)
+    {
+        i = w->next++;
+        pthread_mutex_unlock(&w->lock);
+
+        w->func(w->jobs + i * w->job_size);
+
+        pthread_mutex_lock(&w->lock);
+        if (--w->remaining == 0)
+            pthread_cond_broadcast(&w->done);
+    }
+}
+
+/**
+ * Helper function - main loop of the background threads
+ */
+static void *worker_main(void *arg)
+{
+    _glite_eds_workers *w = arg;
+    /* Threads are created before the first batch; one that starts late
+     * must still join the batches posted meanwhile */
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;)
+    {
+        while (!w->shutdown && w->generation == seen)
+            pthread_cond_wait(&w->start, &w->lock);
+        if (w->shutdown)
+            break;
+        seen = w->generation;
+        do_jobs(w);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+_glite_eds_workers *_glite_eds_workers_new(int nthreads)
+{
+    _glite_eds_workers *w;
+
+    if (nthreads < 1)
+        nthreads = 1;
+
+    w = calloc(1, sizeof(*w));
+    if (!w)
+        return NULL;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_mutex_init(&w->run_lock, NULL);
+    pthread_cond_init(&w->start, NULL);
+    pthread_cond_init(&w->done, NULL);
+
+    w->threads = calloc(nthreads, sizeof(*w->threads));
+    if (!w->threads)
+    {
+        _glite_eds_workers_free(w);
+        return NULL;
+    }
+
+    /* The caller of _glite_eds_workers_run() is the last worker */
+    for (w->nthreads = 0; w->nthreads < nthreads - 1; w->nthreads++)
+    {
+        if (pthread_create(&w->threads[w->nthreads], NULL, worker_main, w))
+        {
+            _glite_eds_workers_free(w);
+            return NULL;
+        }
+    }
+
+    return w;
+}
+
+int _glite_eds_workers_count(_glite_eds_workers *workers)
+{
+    if (!workers)
+        return 1;
+    return workers->nthreads + 1;
+}
+
+void _glite_eds_workers_run(_glite_eds_workers *workers,
+    _glite_eds_job_func func, void *jobs, size_t job_size, int njobs)
+{
+    int i;
+
+    if (njobs < 1)
+        return;
+
+    /* Nothing to share */
+    if (!workers || !workers->nthreads || njobs == 1)
+    {
+        for (i = 0; i < njobs; i++)
+            func((char *)jobs + i * job_size);
+        return;
+    }
+
+    pthread_mutex_lock(&workers->run_lock);
+    pthread_mutex_lock(&workers->lock);
+
+    workers->func = func;
+    workers->jobs = jobs;
+    workers->job_size = job_size;
+    workers->njobs = njobs;
+    workers->next = 0;
+    workers->remaining = njobs;
+    workers->generation++;
+    pthread_cond_broadcast(&workers->start);
+
+    do_jobs(workers);
+    while (workers->remaining > 0)
+        pthread_cond_wait(&workers->done, &workers->lock);
+
+    pthread_mutex_unlock(&workers->lock);
+    pthread_mutex_unlock(&workers->run_lock);
+}
+
+void _glite_eds_workers_free(_glite_eds_workers *workers)
+{
+    int i;
+
+    if (!workers)
+        return;
+
+    pthread_mutex_lock(&workers->lock);
+    workers->shutdown = 1;
+    pthread_cond_broadcast(&workers->start);
+    pthread_mutex_unlock(&workers->lock);
+
+    for (i = 0; i < workers->nthreads; i++)
+        pthread_join(workers->threads[i], NULL);
+
+    pthread_cond_destroy(&workers->done);
+    pthread_cond_destroy(&workers->start);
+    pthread_mutex_destroy(&workers->run_lock);
+    pthread_mutex_destroy(&workers->lock);
+    free(workers->threads);
+    free(workers);
+}
+
+int _glite_eds_cpu_count(void)
+{
+    long n;
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        return 1;
+    return (int)n;
+}
@@ -0,0 +1,438 @@
+/**
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef EDS_INTERNAL_H
+#define EDS_INTERNAL_H
+
+#include <stddef.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <glite/data/catalog/c/catalog-simple.h>
+
+#include "env_internal.h"
+
+/**********************************************************************
+ * Data type declarations
+ */
+
+/* Pool of worker threads running independent jobs */
+typedef struct _glite_eds_workers _glite_eds_workers;
+
+/* Job function run by the worker threads */
+typedef void (*_glite_eds_job_func)(void *job);
+
+/* Key store endpoints found by service discovery. The list is shared and
+ * must not be modified. */
+typedef struct _glite_eds_endpoints
+{
+    int refs;
+    char *sd_type;      /* service type looked up */
+    time_t fetched;     /* time of the discovery */
+    int count;
+    char **endpoints;
+} _glite_eds_endpoints;
+
+/**********************************************************************
+ * Function prototypes - worker threads
+ */
+
+/*
+ * Create a pool of nthreads workers. The thread calling
+ * _glite_eds_workers_run() counts as one of them, so nthreads - 1
+ * threads are started. Returns NULL if the threads can not be created.
+ */
+_glite_eds_workers *_glite_eds_workers_new(int nthreads);
+
+/* Number of threads (including the caller) working on the jobs */
+int _glite_eds_workers_count(_glite_eds_workers *workers);
+
+/*
+ * Run func on each of the njobs elements of the jobs array (job_size
+ * bytes each) and wait until all of them have finished.
+ */
+void _glite_eds_workers_run(_glite_eds_workers *workers,
+    _glite_eds_job_func func, void *jobs, size_t job_size, int njobs);
+
+/* Stop the threads and free the pool */
+void _glite_eds_workers_free(_glite_eds_workers *workers);
+
+/* Number of online processors, at least 1 */
+int _glite_eds_cpu_count(void);
+
+/* Largest number of key store endpoints contacted at the same time */
+#define EDS_MAX_ENDPOINT_THREADS 16
+
+/**********************************************************************
+ * Function prototypes - library initialization
+ */
+
+/*
+ * Look up a cipher by name. The result is cached for the lifetime of the
+ * library, glite_eds_library_init() must have been called before.
+ * Returns NULL if the cipher is not known.
+ */
+const EVP_CIPHER *_glite_eds_get_cipher(const char *name);
+
+/*
+ * Thread safe replacement of ERR_error_string(ERR_get_error(), NULL): the
+ * returned string is valid until the next call from the same thread.
+ */
+const char *_glite_eds_ssl_error(void);
+
+/**********************************************************************
+ * Function prototypes - key store endpoints
+ */
+
+/*
+ * Run service discovery: the default catalog service first, then the
+ * associated ones. The caller frees the list and its strings.
+ */
+char **_glite_eds_discover_endpoints(int *epcount, char **error);
+
+/*
+ * Get the current endpoint list, discovering it again if it is older than
+ * the configured time to live. The result is released with
+ * _glite_eds_endpoints_release().
+ */
+_glite_eds_endpoints *_glite_eds_endpoints_get(char **error);
+
+/* Drop a reference to an endpoint list */
+void _glite_eds_endpoints_release(_glite_eds_endpoints *list);
+
+/*
+ * Stop using an endpoint list after an error, the next call discovers the
+ * endpoints again. Nothing happens if the list is not the current one.
+ */
+void _glite_eds_endpoints_invalidate(_glite_eds_endpoints *list);
+
+/*
+ * Check which endpoints of a list answer a read-only request, all at once.
+ * Recent results are reused. Sets alive[i] to 1 for each endpoint that
+ * answered, 0 for the others, and returns their count (-1 if out of
+ * memory).
+ */
+int _glite_eds_endpoints_probe(_glite_eds_endpoints *list, int *alive);
+
+/*
+ * Get a list of the endpoints that answer a read-only request. The list is
+ * not shared, it is released with _glite_eds_endpoints_release().
+ */
+_glite_eds_endpoints *_glite_eds_endpoints_live(char **error);
+
+/*
+ * Get the endpoints the key pieces are written to: all of them, or only
+ * the ones that answer if GLITE_EDS_VALIDATE_ENDPOINTS is set. Fails if
+ * fewer answer than GLITE_EDS_VALIDATE_MIN, by default than the pieces
+ * needed to rebuild a key split among all of them.
+ */
+_glite_eds_endpoints *_glite_eds_endpoints_write(char **error);
+
+/* Forget the results of the liveness checks */
+void _glite_eds_probe_cleanup(void);
+
+/**********************************************************************
+ * Function prototypes - catalog connection pool
+ */
+
+/*
+ * Get a catalog context for an endpoint: an unused one still connected if
+ * there is one, a new one otherwise. Its calls are limited to the deadline
+ * of the thread. Returns NULL like glite_catalog_new().
+ */
+glite_catalog_ctx *_glite_eds_ctx_get(const char *endpoint);
+
+/*
+ * Give back a context returned by _glite_eds_ctx_get(). It is kept open
+ * for the next request unless pooling is disabled, enough connections to
+ * the endpoint are already unused, or failed is set and the error was not
+ * reported by the service itself.
+ */
+void _glite_eds_ctx_put(glite_catalog_ctx *ctx, const char *endpoint,
+    int failed);
+
+/* Close all unused connections */
+void _glite_eds_pool_cleanup(void);
+
+/**********************************************************************
+ * Function prototypes - key cache
+ */
+
+/*
+ * Look up the joined key of an id. Returns 1 and copies of the data if it
+ * is known, -1 if the id is known to have no key, 0 otherwise.
+ */
+int _glite_eds_keycache_get(const char *id, char **hex_key, char **hex_iv,
+    char **cipher, char **keyinfo);
+
+/* Remember the joined key of an id */
+void _glite_eds_keycache_put(const char *id, const char *hex_key,
+    const char *hex_iv, const char *cipher, const char *keyinfo);
+
+/* Remember for a short while that no key is registered for an id */
+void _glite_eds_keycache_put_missing(const char *id);
+
+/* Forget what is known about the key of an id */
+void _glite_eds_keycache_invalidate(const char *id);
+
+/* Forget all keys and release the locked memory */
+void _glite_eds_keycache_cleanup(void);
+
+/**********************************************************************
+ * Function prototypes - keys
+ */
+
+/*
+ * Look up the joined key of an id in the key cache, then in the key
+ * stores. On failure *missing tells if no key is registered for the id.
+ */
+int _glite_eds_key_get(char *id, char **hex_key, char **hex_iv,
+    char **cipher, char **keyinfo, int *missing, char **error);
+
+/* Split a new key and store the pieces in the key stores */
+int _glite_eds_key_put(char *id, char *hex_key, char *hex_iv, char *cipher,
+    char *keyinfo, char **error);
+
+/* Why a key store request failed, when the service did not answer */
+#define EDS_UNREACHABLE   1
+#define EDS_TIMED_OUT     2     /* the time left to the call ran out */
+
+/*
+ * Store one key piece in one key store within a deadline (0 for none). On
+ * failure *unreachable tells if the key store did not answer, or was
+ * skipped as it keeps failing.
+ */
+int _glite_eds_piece_put(char *endpoint, char *id, char *hex_key,
+    char *hex_iv, char *cipher, char *keyinfo, int keys_needed, int key_index,
+    double deadline, int *unreachable, char **error);
+
+/* Remove the key piece of an id from one key store within a deadline */
+int _glite_eds_piece_remove(char *endpoint, char *id, double deadline,
+    char **error);
+
+/*
+ * Store the split keys of several ids with batched requests: the piece of
+ * ids[i] for endpoints[j] is shares[i * epcount + j]. An id is registered on
+ * all endpoints or on none; errors[i] is set for the failed ones, and why[i]
+ * tells why (EDS_FAILED_*).
+ */
+void _glite_eds_key_put_multi(char **ids, int nids, char **endpoints,
+    int epcount, char **shares, char **hex_ivs, char *cipher, char *keyinfo,
+    unsigned int keys_needed, char **errors, unsigned char *why);
+
+/* Remove the keys of several ids with batched requests, an id that is not
+ * registered counting as removed. Errors as above. */
+void _glite_eds_key_remove_multi(char **ids, int nids, char **endpoints,
+    int epcount, char **errors, unsigned char *why);
+
+/* Why an id failed in a batched request */
+#define EDS_FAILED_LOST     1   /* an endpoint could not be reached */
+#define EDS_FAILED_REFUSED  2   /* an endpoint refused the request */
+
+/**********************************************************************
+ * Function prototypes - agent client
+ */
+
+/* Returned by the agent calls if no agent could be reached: the caller
+ * does the work itself */
+#define EDS_AGENT_ABSENT 1
+
+/* _glite_eds_key_get() done by the agent */
+int _glite_eds_agent_get(const char *id, char **hex_key, char **hex_iv,
+    char **cipher, char **keyinfo, int *missing, char **error);
+
+/* _glite_eds_key_put() done by the agent */
+int _glite_eds_agent_put(const char *id, const char *hex_key,
+    const char *hex_iv, const char *cipher, const char *keyinfo,
+    char **error);
+
+/* glite_eds_unregister() done by the agent */
+int _glite_eds_agent_unregister(const char *id, char **error);
+
+/**********************************************************************
+ * Function prototypes - time budget
+ */
+
+/* Budget in milliseconds set by GLITE_EDS_TIMEOUT, 0 if there is none */
+int _glite_eds_default_timeout(void);
+
+/*
+ * Start an operation of the calling thread with a budget of timeout_ms
+ * (none if 0 or less), within the budget of the operation it is part of.
+ * Returns the previous deadline, to be given to _glite_eds_deadline_end().
+ */
+double _glite_eds_deadline_begin(int timeout_ms);
+
+/* Deadline timeout_ms from now (none if 0 or less), within the one of the
+ * current operation of the thread */
+double _glite_eds_deadline_within(int timeout_ms);
+
+/* End an operation, setting errno to ETIMEDOUT if it failed for lack of
+ * time */
+void _glite_eds_deadline_end(double previous, int failed);
+
+/* Note that a request of the current operation ran out of time */
+void _glite_eds_deadline_timed_out(void);
+
+/*
+ * Deadline of the current operation of the thread (CLOCK_MONOTONIC
+ * seconds), 0 if there is none. Threads working for the operation set
+ * the deadline they were given; _glite_eds_deadline_set() returns the
+ * previous one.
+ */
+double _glite_eds_deadline_get(void);
+double _glite_eds_deadline_set(double deadline);
+
+/* Tell if a deadline (0 for none) has passed */
+int _glite_eds_deadline_passed(double deadline);
+
+/* Seconds left until a deadline, negative if there is none */
+double _glite_eds_deadline_left(double deadline);
+
+/* Limit the calls of a catalog context to a deadline (0 for none) */
+void _glite_eds_deadline_apply(glite_catalog_ctx *ctx, double deadline);
+
+/**********************************************************************
+ * Function prototypes - write quorum replication
+ */
+
+/*
+ * Minimum count of pieces required to rebuild a key split for epcount key
+ * stores
+ */
+unsigned int _glite_eds_keys_needed(int epcount);
+
+/*
+ * Number of key stores that must store their piece of a key split for
+ * epcount of them, keys_needed pieces joining it, before a registration
+ * returns. 0 if all of them must.
+ */
+int _glite_eds_write_quorum(int epcount, int keys_needed);
+
+/*
+ * Store the pieces of a key (one per endpoint of the list) and return once
+ * quorum key stores have stored theirs; the others go on in the
+ * background. The list reference and the pieces are taken over. If the
+ * quorum can not be reached the stored pieces are removed and -1 is
+ * returned.
+ */
+int _glite_eds_replicate(char *id, _glite_eds_endpoints *list,
+    unsigned char **pieces, char *hex_iv, char *cipher, char *keyinfo,
+    int keys_needed, int quorum, char **error);
+
+/* Give up storing the pieces of an id that is being removed */
+void _glite_eds_replication_cancel(const char *id);
+
+/* Stop the retries, wait for the requests in progress and forget the
+ * registrations that are not complete */
+void _glite_eds_replication_cleanup(void);
+
+/**********************************************************************
+ * Function prototypes - write-behind journal
+ */
+
+/* Tell if GLITE_EDS_JOURNAL asks for the journal */
+int _glite_eds_journal_enabled(void);
+
+/*
+ * Append the pieces of a new key (one per endpoint) to the journal and
+ * return once they are on disk; the key stores get them in the background.
+ * The pieces are taken over.
+ */
+int _glite_eds_journal_put(char *id, char **endpoints, int epcount,
+    unsigned char **pieces, char *hex_iv, char *cipher, char *keyinfo,
+    unsigned int keys_needed, char **error);
+
+/* Append the removal of a key to the journal, or drop its registration if
+ * it has not been sent yet */
+int _glite_eds_journal_unregister(char *id, char **error);
+
+/* Join the key of an id that is still in the journal of the process.
+ * Returns 1 if it was found. */
+int _glite_eds_journal_get(const char *id, char **hex_key, char **hex_iv,
+    char **cipher, char **keyinfo);
+
+/* Stop the flusher after the batch in progress, and leave what has not been
+ * sent to the next process */
+void _glite_eds_journal_cleanup(void);
+
+/**********************************************************************
+ * Function prototypes - asynchronous operations
+ */
+
+/* Wait for the queued and running operations, then stop the threads */
+void _glite_eds_async_cleanup(void);
+
+/**********************************************************************
+ * Function prototypes - endpoint latencies and counters
+ */
+
+/* Remember how long a successful request to an endpoint took */
+void _glite_eds_latency_record(const char *endpoint, double seconds);
+
+/*
+ * Latency percentile (0-100) of the recent requests to an endpoint in
+ * seconds, or a negative value if there are not enough of them yet.
+ */
+double _glite_eds_latency_percentile(const char *endpoint, int percentile);
+
+/* Moving average of the latency of an endpoint, negative if unknown */
+double _glite_eds_latency_average(const char *endpoint);
+
+/*
+ * Account for a request to an endpoint: ok is 0 if the endpoint could not
+ * be reached. Repeated failures open its circuit.
+ */
+void _glite_eds_endpoint_result(const char *endpoint, int ok);
+
+/*
+ * Tell if a request may be sent to an endpoint: its circuit is closed, or
+ * the request becomes the probe of an open circuit after its cooldown.
+ * Returns 0 if the endpoint should be skipped.
+ */
+int _glite_eds_endpoint_allowed(const char *endpoint);
+
+/*
+ * Tell if _glite_eds_endpoint_allowed() would let a request through now,
+ * without claiming the probe or counting a skip. For ordering endpoints
+ * before any request is sent.
+ */
+int _glite_eds_endpoint_usable(const char *endpoint);
+
+/* Count key piece requests */
+void _glite_eds_count_reads(int n);
+
+/* Count requests left out because of the circuit of their endpoint */
+void _glite_eds_count_skips(int n);
+
+/*
+ * Count a hedged request if the hedges stay within budget percent of the
+ * requests. Returns 0 if the hedge should not be sent.
+ */
+int _glite_eds_hedge_acquire(int budget);
+
+/* Count a hedge that was answered first */
+void _glite_eds_count_hedge_won(void);
+
+/* Count a catalog context handed out, reused from the pool or new */
+void _glite_eds_count_connection(int reused);
+
+/* Count a key cache lookup, answered by the cache or not */
+void _glite_eds_count_key_cache(int hit);
+
+#endif /* EDS_INTERNAL_H */
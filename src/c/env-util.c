@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  GLite Data Management - Settings read from the environment
+ *
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include "env_internal.h"
+
+int _glite_env_int(const char *name, int def, int min)
+{
+    char *value, *end;
+    long res;
+
+    value = getenv(name);
+    if (!value || !*value)
+        return def;
+    errno = 0;
+    res = strtol(value, &end, 10);
+    if (*end || errno || res < min || res > INT_MAX)
+        return def;
+    return (int)res;
+}
@@ -0,0 +1,34 @@
+/**
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef ENV_INTERNAL_H
+#define ENV_INTERNAL_H
+
+/**********************************************************************
+ * Function prototypes - settings from the environment, shared by the
+ * catalog client and the encrypted data storage API
+ */
+
+/*
+ * Integer value of an environment variable: def if it is unset, empty,
+ * not a whole number or below min.
+ */
+int _glite_env_int(const char *name, int def, int min);
+
+#endif /* ENV_INTERNAL_H */
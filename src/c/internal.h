@@ -84,6 +84,21 @@ struct _glite_catalog_ctx
 	/* virtual methods ... */
 	glite_catalog_decode_exception_func	decode_exception;
 
+	/* Keep the connection open between calls */
+	int				keepalive;
+	/* The last error came from the transport, not from the service */
+	int				connection_error;
+
+	/* Time limits of connecting and of each send/receive, in seconds
+	 * (0 means no limit) */
+	int				connect_timeout;
+	int				io_timeout;
+	/* Monotonic time the calls must be over by, 0 if there is none */
+	double				deadline;
+	/* Start and shortest time limit of the current call */
+	double				call_start;
+	double				call_limit;
+
 	/* Data specific to an endpoint */
 	char				*interface_version;
 	int				readDir_limit;
@@ -108,6 +123,44 @@ int _glite_catalog_init_endpoint(glite_catalog_ctx *ctx,
 /* Convert the SOAP fault to an error message */
 void _glite_catalog_fault_to_error(glite_catalog_ctx *ctx, const char *method);
 
+/*
+ * Set the time limits of the next SOAP call from the timeouts and the
+ * deadline of the context. Returns -1 (with a timeout error) if the
+ * deadline has already passed.
+ */
+int _glite_catalog_begin_call(glite_catalog_ctx *ctx);
+
+/**********************************************************************
+ * Function prototypes - endpoint information cache
+ */
+
+/*
+ * Get the cached interface version of an endpoint. Returns 0 and a copy
+ * of the version, or -1 if it is not known.
+ */
+int _glite_catalog_cache_get_version(const char *endpoint, char **version);
+
+/* Remember the interface version of an endpoint */
+void _glite_catalog_cache_set_version(const char *endpoint,
+	const char *version);
+
+/*
+ * Get a cached integer service property of an endpoint. Returns -1 if it
+ * is not known.
+ */
+int _glite_catalog_cache_get_prop(const char *endpoint, const char *name,
+	int *value);
+
+/*
+ * Remember an integer service property of an endpoint. It is dropped
+ * together with the interface version.
+ */
+void _glite_catalog_cache_set_prop(const char *endpoint, const char *name,
+	int value);
+
+/* Forget everything about an endpoint */
+void _glite_catalog_cache_invalidate(const char *endpoint);
+
 /**********************************************************************
  * SOAP type conversion functions
  */
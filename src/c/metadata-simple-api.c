@@ -134,11 +134,15 @@ static int get_int_prop(glite_catalog_ctx *ctx, const char *name)
 	char *prop, *p;
 	int value;
 
+	if (!_glite_catalog_cache_get_prop(ctx->endpoint, name, &value))
+		return value;
+
 	prop = glite_metadata_getServiceMetadata(ctx, name);
 	if (!prop)
 	{
 		if (ctx->errclass != GLITE_CATALOG_EXCEPTION_NOTEXISTS)
 			return -1;
+		_glite_catalog_cache_set_prop(ctx->endpoint, name, 0);
 		return 0;
 	}
 
@@ -152,6 +156,7 @@ static int get_int_prop(glite_catalog_ctx *ctx, const char *name)
 		return -1;
 	}
 	free(prop);
+	_glite_catalog_cache_set_prop(ctx->endpoint, name, value);
 	return value;
 }
 
@@ -190,6 +195,7 @@ static int update_interface_version(glite_catalog_ctx *ctx)
 	/* free it, in case it was initialized */
 	free(ctx->interface_version);
 	ctx->interface_version = version;
+	_glite_catalog_cache_set_version(ctx->endpoint, version);
 	return 0;
 }
 
@@ -203,14 +209,18 @@ static int is_ctx_ok(glite_catalog_ctx *ctx)
 		return FALSE;
 
     /* If the context is already initialized for the metadata port,
-	 * do nothing */
+	 * only the time limits of the call are left to set */
 	if (ctx->port_type == GLITE_CATALOG_PORT_METADATA)
-		return TRUE;
+		return !_glite_catalog_begin_call(ctx);
 	/* If the context is already initialized for some other port,
 	 * bail out */
 	if (ctx->port_type != GLITE_CATALOG_PORT_NONE)
 		return FALSE;
 
+	/* The initialization may ask the service too */
+	if (_glite_catalog_begin_call(ctx))
+		return FALSE;
+
     /* overriding the "virtual methods" */
     ctx->decode_exception = &decode_exception;
 
@@ -223,12 +233,18 @@ static int is_ctx_ok(glite_catalog_ctx *ctx)
     if (ret)
         return FALSE;
 
-    ret = update_interface_version(ctx);
-    if (ret)
-        return FALSE;
+    /* Other contexts may have asked the same endpoint already */
+    free(ctx->interface_version);
+    ctx->interface_version = NULL;
+    if (_glite_catalog_cache_get_version(ctx->endpoint, &ctx->interface_version))
+    {
+        ret = update_interface_version(ctx);
+        if (ret)
+            return FALSE;
+    }
 
     ctx->port_type = GLITE_CATALOG_PORT_METADATA;
-	return TRUE;
+	return !_glite_catalog_begin_call(ctx);
 }
 
 /**********************************************************************
@@ -243,7 +259,8 @@ int glite_metadata_get_query_limit(glite_catalog_ctx *ctx)
 	if (ctx->query_limit > 0)
 		return ctx->query_limit;
 
-	return get_int_prop(ctx, "limit.query");
+	ctx->query_limit = get_int_prop(ctx, "limit.query");
+	return ctx->query_limit;
 }
 
 /**********************************************************************
@@ -811,6 +828,26 @@ glite_catalog_Attribute **glite_metadata_getAttributes(glite_catalog_ctx *ctx,
 	return result;
 }
 
+int glite_metadata_getAttributes_multi(glite_catalog_ctx *ctx, int nitems,
+	const char * const items[], int nattributes,
+	const char * const attributes[], glite_catalog_Attribute **results[],
+	int resultCounts[])
+{
+	int i;
+
+	/* The service takes one item per request. They are sent one after the
+	 * other over the same connection, which is kept open if keep-alive is
+	 * enabled. */
+	for (i = 0; i < nitems; i++)
+	{
+		results[i] = glite_metadata_getAttributes(ctx, items[i],
+			nattributes, attributes, &resultCounts[i]);
+		if (resultCounts[i] < 0)
+			break;
+	}
+	return i;
+}
+
 glite_catalog_Attribute **glite_metadata_listAttributes(glite_catalog_ctx *ctx,
 	const char *item, int *resultCount)
 {
@@ -1012,6 +1049,36 @@ int glite_metadata_createEntry_multi(glite_catalog_ctx *ctx, int nitems,
 	return 0;
 }
 
+int glite_metadata_createEntryWithAttributes(glite_catalog_ctx *ctx,
+	const char *item, const char *schema, int nattributes,
+	const glite_catalog_Attribute * const attributes[])
+{
+	glite_catalog_errclass errclass;
+	char *error;
+
+	/* The two requests can not be pipelined: the service would set the
+	 * attributes even if the entry already existed */
+	if (glite_metadata_createEntry(ctx, item, schema))
+		return -1;
+	if (!glite_metadata_setAttributes(ctx, item, nattributes, attributes))
+		return 0;
+
+	/* The service may not be reachable to clean up after a transport
+	 * error, and may have set the attributes anyway */
+	if (ctx->connection_error)
+		return -1;
+
+	error = ctx->last_error;
+	errclass = ctx->errclass;
+	ctx->last_error = NULL;
+	glite_metadata_removeEntry(ctx, item);
+	free(ctx->last_error);
+	ctx->last_error = error;
+	ctx->errclass = errclass;
+	ctx->connection_error = 0;
+	return -1;
+}
+
 int glite_metadata_removeEntry(glite_catalog_ctx *ctx, const char *item)
 {
 	if (!item)
@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  gLite Encrypted Data Storage key agent: keeps the key store endpoints,
+ *  connections and recently used keys for the commands of a user session.
+ *
+ */
+
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glite/data/hydra/c/eds-simple.h>
+
+#define PROGNAME     "glite-eds-agent"
+#define PROGAUTHOR   "(C) EGEE"
+
+#define TRACE_LOG(a)  if(debug) fprintf a
+#define TRACE_ERR(a)  fprintf a
+
+/* Seconds a key is kept by default */
+#define AGENT_KEY_TTL "60"
+/* Clients served at once, the others wait in the listen queue */
+#define AGENT_MAX_CLIENTS 64
+/* Microseconds to wait before accepting again when out of descriptors */
+#define AGENT_ACCEPT_BACKOFF 100000
+
+static volatile sig_atomic_t stop;
+
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clients_done = PTHREAD_COND_INITIALIZER;
+static int clients;
+
+static void print_usage_and_die(FILE * out){
+    fprintf(out, "\n");
+    fprintf(out, "usage: %s [-d] [-a socket] [-t seconds]\n", PROGNAME);
+    fprintf(out, "       %s -k\n", PROGNAME);
+    fprintf(out, " Optional parameters:\n");
+    fprintf(out, "  -a path : bind the agent to this socket\n");
+    fprintf(out, "  -t n    : seconds a key is kept by the agent (default %s)\n",
+        AGENT_KEY_TTL);
+    fprintf(out, "  -d      : debug mode, stay in the foreground\n");
+    fprintf(out, "  -k      : stop the agent of the environment\n");
+    fprintf(out, "  -h      : print this screen\n");
+    fprintf(out, "  -V      : print version and exit\n");
+    if (out == stdout) {
+        exit(0);
+    }
+    exit(-1);
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+/**
+ * Serve one client, in its own thread
+ */
+static void *client_run(void *arg)
+{
+    int fd = (int)(long)arg;
+    char *error = NULL;
+
+    if (glite_eds_agent_serve(fd, &error)) {
+        TRACE_ERR((stderr, "%s\n", error));
+        free(error);
+    }
+    close(fd);
+
+    pthread_mutex_lock(&clients_lock);
+    clients--;
+    pthread_cond_signal(&clients_done);
+    pthread_mutex_unlock(&clients_lock);
+
+    return NULL;
+}
+
+/**
+ * Wait until one more client can be served. Returns -1 if the agent is
+ * told to stop meanwhile.
+ */
+static int client_slot(void)
+{
+    struct timespec ts;
+
+    pthread_mutex_lock(&clients_lock);
+    while (clients >= AGENT_MAX_CLIENTS && !stop) {
+        // Wake up now and then to notice a signal
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec++;
+        pthread_cond_timedwait(&clients_done, &clients_lock, &ts);
+    }
+    if (stop) {
+        pthread_mutex_unlock(&clients_lock);
+        return -1;
+    }
+    clients++;
+    pthread_mutex_unlock(&clients_lock);
+    return 0;
+}
+
+/**
+ * Give back the slot of a client whose thread could not be started
+ */
+static void client_slot_release(void)
+{
+    pthread_mutex_lock(&clients_lock);
+    clients--;
+    pthread_mutex_unlock(&clients_lock);
+}
+
+/**
+ * Stop the agent of the environment
+ */
+static int kill_agent(void)
+{
+    char *value;
+    pid_t pid;
+
+    value = getenv(GLITE_EDS_AGENT_PID_ENV);
+    if (!value || (pid = (pid_t)atol(value)) <= 0) {
+        TRACE_ERR((stderr, "%s not set, cannot kill agent\n",
+            GLITE_EDS_AGENT_PID_ENV));
+        return -1;
+    }
+    if (kill(pid, SIGTERM)) {
+        TRACE_ERR((stderr, "Cannot kill agent %d: %s\n", (int)pid,
+            strerror(errno)));
+        return -1;
+    }
+
+    fprintf(stdout, "unset %s;\n", GLITE_EDS_AGENT_SOCK_ENV);
+    fprintf(stdout, "unset %s;\n", GLITE_EDS_AGENT_PID_ENV);
+    fprintf(stdout, "echo Agent pid %d killed;\n", (int)pid);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    pthread_attr_t attr;
+    pthread_t thread;
+    char dir[PATH_MAX] = "";
+    char *path = NULL, *tmp, *error = NULL;
+    int flag, debug = 0, fd, client;
+    char *ttl = AGENT_KEY_TTL;
+    pid_t pid;
+
+    while ((flag = getopt (argc, argv, "a:t:dkhV")) != -1) {
+        switch (flag) {
+            case 'a':
+                path = optarg;
+                break;
+            case 't':
+                ttl = optarg;
+                break;
+            case 'd':
+                debug = 1;
+                break;
+            case 'k':
+                return kill_agent();
+            case 'h':
+                print_usage_and_die(stdout);
+                break;
+            case 'V':
+                fprintf(stdout, "<%s> Version %s by %s\n",
+                    PROGNAME, PACKAGE_VERSION, PROGAUTHOR);
+                exit(0);
+            default:
+                print_usage_and_die(stderr);
+                break;
+        } // End Switch
+    } // End while
+
+    if (argc != optind) {
+        print_usage_and_die(stderr);
+    }
+
+    // The agent does the requests itself, and keeps the keys for a while
+    // -------------------------------------------------------------------------
+    unsetenv(GLITE_EDS_AGENT_SOCK_ENV);
+    unsetenv(GLITE_EDS_AGENT_PID_ENV);
+    setenv(GLITE_EDS_KEY_CACHE_TTL_ENV, ttl, 0);
+
+    // Create the socket, in a private directory by default
+    // -------------------------------------------------------------------------
+    umask(077);
+    if (!path) {
+        tmp = getenv("TMPDIR");
+        snprintf(dir, sizeof(dir), "%s/glite-eds-XXXXXX",
+            tmp && *tmp ? tmp : "/tmp");
+        if (!mkdtemp(dir)) {
+            TRACE_ERR((stderr, "Cannot create directory %s: %s\n", dir,
+                strerror(errno)));
+            return -1;
+        }
+        if (asprintf(&path, "%s/agent.%d", dir, (int)getpid()) < 0) {
+            rmdir(dir);
+            return -1;
+        }
+    }
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        TRACE_ERR((stderr, "Socket path %s is too long\n", path));
+        if (*dir)
+            rmdir(dir);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(fd, SOMAXCONN)) {
+        TRACE_ERR((stderr, "Cannot listen on %s: %s\n", path, strerror(errno)));
+        if (*dir)
+            rmdir(dir);
+        return -1;
+    }
+
+    // Go to the background, the parent tells the shell where we are
+    // -------------------------------------------------------------------------
+    if (!debug) {
+        pid = fork();
+        if (pid < 0) {
+            TRACE_ERR((stderr, "fork() failed: %s\n", strerror(errno)));
+            unlink(path);
+            if (*dir)
+                rmdir(dir);
+            return -1;
+        }
+        if (pid > 0) {
+            fprintf(stdout, "%s=%s; export %s;\n", GLITE_EDS_AGENT_SOCK_ENV,
+                path, GLITE_EDS_AGENT_SOCK_ENV);
+            fprintf(stdout, "%s=%d; export %s;\n", GLITE_EDS_AGENT_PID_ENV,
+                (int)pid, GLITE_EDS_AGENT_PID_ENV);
+            fprintf(stdout, "echo Agent pid %d;\n", (int)pid);
+            return 0;
+        }
+
+        setsid();
+        if (chdir("/")) {
+            // not fatal, the paths are absolute
+        }
+        client = open("/dev/null", O_RDWR);
+        if (client >= 0) {
+            dup2(client, 0);
+            dup2(client, 1);
+            dup2(client, 2);
+            if (client > 2)
+                close(client);
+        }
+    } else {
+        fprintf(stdout, "%s=%s; export %s;\n", GLITE_EDS_AGENT_SOCK_ENV,
+            path, GLITE_EDS_AGENT_SOCK_ENV);
+        fprintf(stdout, "%s=%d; export %s;\n", GLITE_EDS_AGENT_PID_ENV,
+            (int)getpid(), GLITE_EDS_AGENT_PID_ENV);
+        fprintf(stdout, "echo Agent pid %d;\n", (int)getpid());
+        fflush(stdout);
+    }
+
+    // Send what the commands left in the journal, and keep an eye on it
+    // -------------------------------------------------------------------------
+    tmp = getenv(GLITE_EDS_JOURNAL_ENV);
+    if (tmp && *tmp && glite_eds_journal_flush(0, &error) < 0) {
+        TRACE_ERR((stderr, "Cannot flush the journal: %s\n", error));
+        free(error);
+        error = NULL;
+    }
+
+    // Serve the clients until told to stop
+    // -------------------------------------------------------------------------
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (!stop) {
+        if (client_slot())
+            break;
+        client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            client_slot_release();
+            if (errno == EINTR)
+                continue;
+            TRACE_ERR((stderr, "accept() failed: %s\n", strerror(errno)));
+            // Out of descriptors or memory: let the clients finish first
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+                errno == ENOMEM)
+                usleep(AGENT_ACCEPT_BACKOFF);
+            continue;
+        }
+        TRACE_LOG((stderr, "New client on fd %d\n", client));
+        if (pthread_create(&thread, &attr, client_run, (void *)(long)client)) {
+            TRACE_ERR((stderr, "Cannot start a thread for a client\n"));
+            client_slot_release();
+            close(client);
+        }
+    }
+
+    TRACE_LOG((stderr, "Stopping\n"));
+    close(fd);
+    unlink(path);
+    if (*dir)
+        rmdir(dir);
+
+    return 0;
+}
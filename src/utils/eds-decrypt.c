@@ -30,9 +30,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <getopt.h>
 
 #include <stdio.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <glite/data/hydra/c/eds-simple.h>
@@ -53,6 +55,9 @@ static void print_usage_and_die(FILE * out){
     fprintf(out, " input_filename : The encrypted file to be decrypted \n");
     fprintf(out, " output_filename: The decrypted file which is written \n");
     fprintf(out, " Optional flags:\n");
+    fprintf(out, "  -t <n>  : number of decryption threads (default: 0, one per CPU)\n");
+    fprintf(out, "  -o, --offset <n> : decrypt only from this plaintext offset\n");
+    fprintf(out, "  -l, --length <n> : decrypt only this many plaintext bytes\n");
     fprintf(out, "  -h      : print this screen\n");
     fprintf(out, "  -q      : quiet mode\n");
     fprintf(out, "  -v      : verbose mode\n");
@@ -63,14 +68,38 @@ static void print_usage_and_die(FILE * out){
     exit(-1);
 }
 
+static const struct option long_options[] = {
+    {"offset", required_argument, NULL, 'o'},
+    {"length", required_argument, NULL, 'l'},
+    {NULL, 0, NULL, 0}
+};
+
 int main(int argc, char **argv)
 {
     int flag;
     char *in, *id, *out;
     int silent = 0; // false
+    int threads = 0;
+    int range = 0; // false
+    off_t offset = 0, length = -1;
 
-    while ((flag = getopt(argc, argv, "qhvV")) != -1) {
+    while ((flag = getopt_long(argc, argv, "qhvVt:o:l:", long_options, NULL)) != -1) {
         switch (flag) {
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'o':
+                offset = strtoll(optarg, NULL, 10);
+                if (offset < 0)
+                    print_usage_and_die(stderr);
+                range = 1;
+                break;
+            case 'l':
+                length = strtoll(optarg, NULL, 10);
+                if (length < 0)
+                    print_usage_and_die(stderr);
+                range = 1;
+                break;
             case 'q':
                 silent = 1; // true
                 unsetenv(TOOL_USER_VERBOSE);
@@ -98,32 +127,64 @@ int main(int argc, char **argv)
     
     id = argv[optind++]; in = argv[optind++]; out = argv[optind++];
     
+    // Open input file
+    // -------------------------------------------------------------------------
+    int in_fd = open(in, O_RDONLY);
+    if (in_fd < 0) {
+        const char * error_msg = strerror(errno);
+        TRACE_ERR((stderr, "Cannot Open Local Input File %s. "
+                    "Error is \"%s (code: %d)\"\n", in, error_msg, errno));
+        return -1;
+    }
+
     // Initialize eds library
     // -------------------------------------------------------------------------
     char *error;
     EVP_CIPHER_CTX *dctx;
+    off_t read_offset = 0, read_left = -1;
 
-    if (NULL == (dctx = glite_eds_decrypt_init(id, &error)))
+    if (range) {
+        struct stat statbuf;
+        if (fstat(in_fd, &statbuf) < 0) {
+            const char * error_msg = strerror(errno);
+            TRACE_ERR((stderr, "Cannot Stat Local Input File %s. "
+                        "Error is \"%s (code: %d)\"\n", in, error_msg, errno));
+            close(in_fd);
+            return -1;
+        }
+        dctx = glite_eds_decrypt_range_init(id, offset, length, statbuf.st_size,
+                &read_offset, &read_left, &error);
+    } else {
+        dctx = glite_eds_decrypt_init(id, &error);
+    }
+    if (NULL == dctx)
     {
         TRACE_ERR((stderr, "Error during glite_eds_decrypt_init: %s\n", error));
         free(error);
+        close(in_fd);
         return -1;
     }
 
+    if (glite_eds_set_threads(dctx, threads, &error))
+    {
+        TRACE_ERR((stderr, "Error during glite_eds_set_threads: %s\n", error));
+        free(error);
+        close(in_fd);
+        return -1;
+    }
 
-    // Open input file
-    // -------------------------------------------------------------------------
-    int in_fd = open(in, O_RDONLY);
-    if (in_fd < 0) {
+    // Only the ciphertext blocks covering the range are read
+    if (read_offset && lseek(in_fd, read_offset, SEEK_SET) != read_offset) {
         const char * error_msg = strerror(errno);
-        TRACE_ERR((stderr, "Cannot Open Local Input File %s. "
+        TRACE_ERR((stderr, "Cannot Seek Local Input File %s. "
                     "Error is \"%s (code: %d)\"\n", in, error_msg, errno));
+        close(in_fd);
         return -1;
     }
 
     // Open output file
     // -------------------------------------------------------------------------
-    int out_fd = open(out, O_WRONLY|O_CREAT, 0640);
+    int out_fd = open(out, O_WRONLY|O_CREAT|O_TRUNC, 0640);
     if (out_fd < 0) {
         const char * error_msg = strerror(errno);
         TRACE_ERR((stderr, "Cannot Open Local Output File %s. "
@@ -134,60 +195,76 @@ int main(int argc, char **argv)
 
     // Do decryption
     // -------------------------------------------------------------------------
-    const int in_buf_size = 65536;
+    const int in_buf_size = 4194304;
     int in_read;
     char *in_buf = (char *)malloc(in_buf_size);
-    in_read = read(in_fd, in_buf, in_buf_size);
+    const int out_buf_size = glite_eds_output_size(dctx, in_buf_size);
+    char *out_buf = (char *)malloc(out_buf_size);
+    if (!in_buf || !out_buf) {
+        TRACE_ERR((stderr, "Failed to allocate buffers of size %d bytes!\n",
+                    out_buf_size));
+        free(in_buf); free(out_buf);
+        close(in_fd); close(out_fd);
+        return -1;
+    }
+    in_read = read(in_fd, in_buf, (read_left >= 0 && read_left < in_buf_size) ?
+            (int)read_left : in_buf_size);
     while (in_read) {
         if (-1 == in_read)
         {
             const char * error_msg = strerror(errno);
             TRACE_ERR((stderr, "\nFatal error during output write. "
                         "Error is \"%s (code: %d)\"\n", error_msg, errno));
+            free(in_buf); free(out_buf);
             close(in_fd); close(out_fd);
             return -1;
         }
         int enc_buffer_size;
-        char *enc_buffer;
-        if (glite_eds_decrypt_block(dctx, in_buf, in_read, &enc_buffer, &enc_buffer_size, &error))
+        if (glite_eds_decrypt_block_into(dctx, in_buf, in_read, out_buf, out_buf_size,
+                    &enc_buffer_size, &error))
         {
             TRACE_ERR((stderr, "Error during glite_eds_decrypt_block: %s\n",
                        error));
             free(error);
+            free(in_buf); free(out_buf);
             close(in_fd); close(out_fd);
             return -1;
         }
         
-        int out_write = write(out_fd, enc_buffer, enc_buffer_size);
-        free(enc_buffer);
+        int out_write = write(out_fd, out_buf, enc_buffer_size);
         if (out_write != enc_buffer_size) {
             const char * error_msg = strerror(errno);
             TRACE_ERR((stderr, "\nFatal error during output write. "
                         "Error is \"%s (code: %d)\"\n", error_msg, errno));
+            free(in_buf); free(out_buf);
             close(in_fd); close(out_fd);
             return -1;
         }
         
-        in_read = read(in_fd, in_buf, in_buf_size);
+        if (read_left >= 0)
+            read_left -= in_read;
+        in_read = read(in_fd, in_buf, (read_left >= 0 && read_left < in_buf_size) ?
+                (int)read_left : in_buf_size);
     }
     
     int final_buf_size;
-    char *final_buf;
-    if (glite_eds_decrypt_final(dctx, &final_buf, &final_buf_size, &error))
+    if (glite_eds_decrypt_final_into(dctx, out_buf, out_buf_size, &final_buf_size, &error))
     {
         TRACE_ERR((stderr, "Error during glite_eds_decrypt_final: %s\n",
                  error));
         free(error);
+        free(in_buf); free(out_buf);
         close(in_fd); close(out_fd);
         return -1;
     }
-    write(out_fd, final_buf, final_buf_size);
+    write(out_fd, out_buf, final_buf_size);
     
     if (!silent){
         TRACE_LOG((stdout,"\n"));
     }
     
     free(in_buf);
+    free(out_buf);
     
     // Close Local input and output File
     // -------------------------------------------------------------------------
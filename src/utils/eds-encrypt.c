@@ -33,6 +33,7 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <glite/data/hydra/c/eds-simple.h>
@@ -53,6 +54,7 @@ static void print_usage_and_die(FILE * out){
     fprintf(out, " input_filename : The plaintext file to be encrypted \n");
     fprintf(out, " output_filename: The encrypted file which is written \n");
     fprintf(out, " Optional flags:\n");
+    fprintf(out, "  -t <n>  : number of encryption threads (default: 0, one per CPU)\n");
     fprintf(out, "  -h      : print this screen\n");
     fprintf(out, "  -q      : quiet mode\n");
     fprintf(out, "  -v      : verbose mode\n");
@@ -68,9 +70,13 @@ int main(int argc, char **argv)
     int flag;
     char *in, *id, *out;
     int silent = 0; // false
+    int threads = 0;
 
-    while ((flag = getopt(argc, argv, "qhvV")) != -1) {
+    while ((flag = getopt(argc, argv, "qhvVt:")) != -1) {
         switch (flag) {
+            case 't':
+                threads = atoi(optarg);
+                break;
             case 'q':
                 silent = 1; // true
                 unsetenv(TOOL_USER_VERBOSE);
@@ -109,6 +115,13 @@ int main(int argc, char **argv)
         free(error);
         return -1;
     }
+
+    if (glite_eds_set_threads(ectx, threads, &error))
+    {
+        TRACE_ERR((stderr, "Error during glite_eds_set_threads: %s\n", error));
+        free(error);
+        return -1;
+    }
     
     // Open input file
     // -------------------------------------------------------------------------
@@ -132,9 +145,18 @@ int main(int argc, char **argv)
 
     // Do encryption
     // -------------------------------------------------------------------------
-    const int in_buf_size = 65536;
+    const int in_buf_size = 4194304;
     int in_read;
     char *in_buf = (char *)malloc(in_buf_size);
+    const int out_buf_size = glite_eds_output_size(ectx, in_buf_size);
+    char *out_buf = (char *)malloc(out_buf_size);
+    if (!in_buf || !out_buf) {
+        TRACE_ERR((stderr, "Failed to allocate buffers of size %d bytes!\n",
+                    out_buf_size));
+        free(in_buf); free(out_buf);
+        close(in_fd); close(out_fd);
+        return -1;
+    }
 
     in_read = read(in_fd, in_buf, in_buf_size);
     while (in_read) {
@@ -143,26 +165,28 @@ int main(int argc, char **argv)
             const char * error_msg = strerror(errno);
             TRACE_ERR((stderr, "\nFatal error during output write. "
                         "Error is \"%s (code: %d)\"\n", error_msg, errno));
+            free(in_buf); free(out_buf);
             close(in_fd); close(out_fd);
             return -1;
         }
         int enc_buffer_size;
-        char *enc_buffer;
-        if (glite_eds_encrypt_block(ectx, in_buf, in_read, &enc_buffer, &enc_buffer_size, &error))
+        if (glite_eds_encrypt_block_into(ectx, in_buf, in_read, out_buf, out_buf_size,
+                    &enc_buffer_size, &error))
         {
             TRACE_ERR((stderr, "Error during glite_eds_encrypt_block: %s\n",
                        error));
             free(error);
+            free(in_buf); free(out_buf);
             close(in_fd); close(out_fd);
             return -1;
         }
         
-        int out_write = write(out_fd, enc_buffer, enc_buffer_size);
-        free(enc_buffer);
+        int out_write = write(out_fd, out_buf, enc_buffer_size);
         if (out_write != enc_buffer_size) {
             const char * error_msg = strerror(errno);
             TRACE_ERR((stderr, "\nFatal error during output write. "
                         "Error is \"%s (code: %d)\"\n", error_msg, errno));
+            free(in_buf); free(out_buf);
             close(in_fd); close(out_fd);
             return -1;
         }
@@ -171,22 +195,23 @@ int main(int argc, char **argv)
     }
     
     int final_buf_size;
-    char *final_buf;
-    if (glite_eds_encrypt_final(ectx, &final_buf, &final_buf_size, &error))
+    if (glite_eds_encrypt_final_into(ectx, out_buf, out_buf_size, &final_buf_size, &error))
     {
         TRACE_ERR((stderr, "Error during glite_eds_encrypt_final: %s\n",
                  error));
         free(error);
+        free(in_buf); free(out_buf);
         close(in_fd); close(out_fd);
         return -1;
     }
-    write(out_fd, final_buf, final_buf_size);
+    write(out_fd, out_buf, final_buf_size);
     
     if (!silent){
         TRACE_LOG((stdout,"\n"));
     }
     
     free(in_buf);
+    free(out_buf);
     
     // Close Local input and output File
     // -------------------------------------------------------------------------
@@ -29,6 +29,7 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -61,6 +62,9 @@ static void print_usage_and_die(FILE * out) {
     fprintf(out, "  -i <id>        : the ID to use to look up the decryption key of this file "
             "(defaults to the remotefilename's GUID).\n");
     fprintf (out, " Optional parameters:\n");
+    fprintf (out, "  -t <n>  : number of decryption threads (default: 0, one per CPU)\n");
+    fprintf (out, "  -o, --offset <n> : get only from this plaintext offset\n");
+    fprintf (out, "  -l, --length <n> : get only this many plaintext bytes\n");
     fprintf (out, "  -h      : print this screen\n");
     fprintf (out, "  -q      : quiet mode\n");
     fprintf (out, "  -v      : verbose mode\n");
@@ -69,6 +73,12 @@ static void print_usage_and_die(FILE * out) {
     exit((out == stdout) ? 0 : -1);
 }
 
+static const struct option long_options[] = {
+    {"offset", required_argument, NULL, 'o'},
+    {"length", required_argument, NULL, 'l'},
+    {NULL, 0, NULL, 0}
+};
+
 int main(int argc, char* argv[])
 {
     char localfilename[GFAL_LFN_LENGTH];
@@ -81,10 +91,29 @@ int main(int argc, char* argv[])
 
     char *id = NULL;
     int silent     = false;
+    int threads    = 0;
+    int range      = false;
+    off_t offset   = 0;
+    off_t length   = -1;
 
     int flag;
-    while ((flag = getopt (argc, argv, "qhvVi:")) != -1) {
+    while ((flag = getopt_long (argc, argv, "qhvVi:t:o:l:", long_options, NULL)) != -1) {
         switch (flag) {
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'o':
+                offset = strtoll(optarg, NULL, 10);
+                if (offset < 0)
+                    print_usage_and_die(stderr);
+                range = true;
+                break;
+            case 'l':
+                length = strtoll(optarg, NULL, 10);
+                if (length < 0)
+                    print_usage_and_die(stderr);
+                range = true;
+                break;
             case 'q':
                 silent = true;
                 unsetenv(TOOL_USER_VERBOSE);
@@ -176,26 +205,56 @@ int main(int argc, char* argv[])
         }
     }
 
+    // Get remote file size
+    // -------------------------------------------------------------------------
+    struct stat statbuf;
+    if (gfal_stat(remotefilename, &statbuf) < 0) {
+        TRACE_ERR((stderr,"Cannot Get Remote File Stat. Error is \"%s (code: %d)\"\n",
+                    strerror(errno), errno));
+        goto err_close_gfal;
+    }
+    off_t size = statbuf.st_size;
+    off_t read_offset = 0;
+
     // Initialize eds library
     // -------------------------------------------------------------------------
     char *error;
     EVP_CIPHER_CTX *dctx;
+    char *dec_buffer = NULL;
 
-    dctx = glite_eds_decrypt_init(id, &error);
+    if (range) {
+        dctx = glite_eds_decrypt_range_init(id, offset, length, statbuf.st_size,
+                &read_offset, &size, &error);
+    } else {
+        dctx = glite_eds_decrypt_init(id, &error);
+    }
     if (dctx == NULL) {
         TRACE_ERR((stderr, "Error during glite_eds_decrypt_init: %s\n", error));
         goto err_close_gfal;
     }
 
-    // Get remote file size
+    if (glite_eds_set_threads(dctx, threads, &error)) {
+        TRACE_ERR((stderr, "Error during glite_eds_set_threads: %s\n", error));
+        goto err_free_eds;
+    }
+
+    // Only the ciphertext blocks covering the range are read
     // -------------------------------------------------------------------------
-    struct stat statbuf;
-    if (gfal_stat(remotefilename, &statbuf) < 0) {
-        TRACE_ERR((stderr,"Cannot Get Remote File Stat. Error is \"%s (code: %d)\"\n",
+    if (read_offset && gfal_lseek(fh, read_offset, SEEK_SET) != read_offset) {
+        TRACE_ERR((stderr,"Cannot Seek Remote File. Error is \"%s (code: %d)\"\n",
                     strerror(errno), errno));
         goto err_free_eds;
-    } 
-    off_t size = statbuf.st_size;
+    }
+
+    // Allocate decryption buffer, reused for every block
+    // -------------------------------------------------------------------------
+    int dec_buffer_capacity = glite_eds_output_size(dctx, TRANSFERBLOCKSIZE);
+    dec_buffer = (char *)malloc(dec_buffer_capacity);
+    if (!dec_buffer) {
+        TRACE_ERR((stderr, "Failed to allocate decryption buffer of size %d bytes!\n",
+                    dec_buffer_capacity));
+        goto err_free_eds;
+    }
 
     // Open local file
     // -------------------------------------------------------------------------
@@ -212,7 +271,8 @@ int main(int argc, char* argv[])
     // Read Remote File
     // -------------------------------------------------------------------------
     while (bytesread < size) {
-        int nread = gfal_read(fh,buffer,TRANSFERBLOCKSIZE);
+        int nread = gfal_read(fh, buffer, (size - bytesread < TRANSFERBLOCKSIZE) ?
+                (int)(size - bytesread) : TRANSFERBLOCKSIZE);
         if (nread <= 0) {
             if (nread == 0) errno = ENODATA;
             TRACE_ERR((stderr,"Fatal error during remote read. Error is \"%s (code: %d)\"\n",
@@ -223,14 +283,13 @@ int main(int argc, char* argv[])
         }
 
         int dec_buffer_size;
-        char *dec_buffer;
-        if (glite_eds_decrypt_block(dctx, buffer, nread, &dec_buffer, &dec_buffer_size, &error)) {
+        if (glite_eds_decrypt_block_into(dctx, buffer, nread, dec_buffer,
+                    dec_buffer_capacity, &dec_buffer_size, &error)) {
             TRACE_ERR((stderr, "Error during glite_eds_encrypt_block: %s\n", error));
             goto err_close_fdump;
         }
 
         int nwrite = write(fdump, dec_buffer, dec_buffer_size);
-        free(dec_buffer);
         if (nwrite != dec_buffer_size) {
             TRACE_ERR((stderr,"Fatal error during local write. Error is \"%s (code: %d)\"\n",
                         strerror(errno), errno));
@@ -274,15 +333,14 @@ int main(int argc, char* argv[])
     // Write final block
     // -------------------------------------------------------------------------
     int final_buf_size;
-    char *final_buf;
-    if (glite_eds_decrypt_final(dctx, &final_buf, &final_buf_size, &error)) {
+    if (glite_eds_decrypt_final_into(dctx, dec_buffer, dec_buffer_capacity,
+                &final_buf_size, &error)) {
         TRACE_ERR((stderr, "Error during glite_eds_encrypt_final: %s\n", error));
         goto err_close_fdump;
     }
 
     if (final_buf_size) {
-        int nwrite = write(fdump, final_buf, final_buf_size);
-        free(final_buf);
+        int nwrite = write(fdump, dec_buffer, final_buf_size);
         if (nwrite != final_buf_size) {
             TRACE_ERR((stderr,"Fatal error during local write. Error is \"%s (code: %d)\"\n",
                         strerror(errno), errno));
@@ -293,6 +351,8 @@ int main(int argc, char* argv[])
         byteswritten += nwrite;
     }
 
+    free(dec_buffer);
+
     // Close Local File
     // -------------------------------------------------------------------------
     if (close(fdump)) {
@@ -344,6 +404,7 @@ int main(int argc, char* argv[])
 err_close_fdump:
     close(fdump);
 err_free_eds:
+    free(dec_buffer);
     glite_eds_finalize(dctx, &error);
 err_close_gfal:
     gfal_close(fh);
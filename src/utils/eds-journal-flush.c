@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  gLite Encrypted Data Storage journal flush: sends the key registrations
+ *  and removals left in the write-behind journal.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glite/data/hydra/c/eds-simple.h>
+
+#define PROGNAME     "glite-eds-journal-flush"
+#define PROGAUTHOR   "(C) EGEE"
+
+#define TRACE_LOG(a)  if(!silent) fprintf a
+#define TRACE_ERR(a)  fprintf a
+
+static void print_usage_and_die(FILE * out){
+    fprintf (out, "\n");
+    fprintf (out, "usage: %s [-j directory] [-t seconds]\n", PROGNAME);
+    fprintf (out, " Optional parameters:\n");
+    fprintf (out, "  -j dir  : journal directory (default $%s)\n",
+        GLITE_EDS_JOURNAL_ENV);
+    fprintf (out, "  -t n    : seconds to wait at most (default no limit)\n");
+    fprintf (out, "  -h      : print this screen\n");
+    fprintf (out, "  -q      : quiet mode\n");
+    fprintf (out, "  -v      : verbose mode\n");
+    fprintf (out, "  -V      : print version and exit\n");
+    if(out == stdout){
+        exit(0);
+    }
+    exit(-1);
+}
+
+int main(int argc, char* argv[]) {
+
+    int silent     = 0;
+    int timeout_ms = -1;
+    char *error    = NULL;
+    char *dir;
+    int res;
+
+    int flag;
+    while ((flag = getopt (argc, argv, "j:t:qhvV")) != -1) {
+        switch (flag) {
+            case 'j':
+                setenv(GLITE_EDS_JOURNAL_ENV, optarg, 1);
+                break;
+            case 't':
+                timeout_ms = atoi(optarg) * 1000;
+                if (timeout_ms < 0)
+                    timeout_ms = -1;
+                break;
+            case 'q':
+                silent = 1;
+                break;
+            case 'h':
+                print_usage_and_die(stdout);
+                break;
+            case 'v':
+                silent = 0;
+                break;
+            case 'V':
+                fprintf (stdout, "<%s> Version %s by %s\n",
+                    PROGNAME, PACKAGE_VERSION, PROGAUTHOR);
+                exit(0);
+            default:
+                print_usage_and_die(stderr);
+                break;
+        } // End Switch
+    } // End while
+
+    if (argc != optind) {
+        print_usage_and_die(stderr);
+    }
+
+    dir = getenv(GLITE_EDS_JOURNAL_ENV);
+    if (!dir || !*dir) {
+        TRACE_ERR((stderr, "%s is not set, there is no journal to flush\n",
+            GLITE_EDS_JOURNAL_ENV));
+        return -1;
+    }
+
+    // The requests still waiting when the time is up stay in the journal
+    // -------------------------------------------------------------------------
+    res = glite_eds_journal_flush(timeout_ms, &error);
+    glite_eds_library_cleanup();
+
+    if (res < 0) {
+        TRACE_ERR((stderr, "Error during glite_eds_journal_flush: %s\n", error));
+        free(error);
+        return -1;
+    }
+    if (res > 0) {
+        TRACE_ERR((stderr, "The journal in %s is not empty yet\n", dir));
+        return 1;
+    }
+
+    if(!silent) {
+        fprintf(stdout, "The journal in %s has been flushed\n", dir);
+    }
+
+    return 0;
+}
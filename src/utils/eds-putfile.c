@@ -65,6 +65,7 @@ static void print_usage_and_die(FILE * out){
             "(defaults to the remotefilename's GUID).\n");
     fprintf(out, "  -c name : cipher name to use\n");
     fprintf(out, "  -k n    : key size to use in bits\n");
+    fprintf(out, "  -t n    : number of encryption threads (default: 0, one per CPU)\n");
     fprintf(out, "  -u      : don't actually encrypt the data, just do the key gen/registration\n");
     fprintf(out, "            this is useful for some special setups where the SE crypts by itself\n");
     fprintf(out, "  -h      : print this screen\n");
@@ -80,6 +81,7 @@ int main(int argc, char **argv)
     int flag, key_size = 0;
     char *cipher = NULL;
     int silent = false, reg_only = false;
+    int threads = 0;
     char localfilename[GFAL_LFN_LENGTH];
     char remotefilename[GFAL_LFN_LENGTH + 7];
     char errbuf[256];
@@ -89,7 +91,7 @@ int main(int argc, char **argv)
     struct timezone tz;
     char *id = NULL;
 
-    while ((flag = getopt (argc, argv, "qhvVuc:k:i:")) != -1) {
+    while ((flag = getopt (argc, argv, "qhvVuc:k:i:t:")) != -1) {
         switch (flag) {
             case 'q':
                 silent = true;
@@ -131,6 +133,9 @@ int main(int argc, char **argv)
                     TRACE_ERR((stderr, "Parsing key size failed!"));
                 }
                 break;
+            case 't':
+                threads = atoi(optarg);
+                break;
             default:
                 print_usage_and_die(stderr);
                 break;
@@ -219,6 +224,7 @@ int main(int argc, char **argv)
     // -------------------------------------------------------------------------
     char *error;
     EVP_CIPHER_CTX *ectx;
+    char *enc_buffer = NULL;
 
     ectx = glite_eds_register_encrypt_init(id, cipher, key_size, &error);
     if (ectx == NULL) {
@@ -227,6 +233,21 @@ int main(int argc, char **argv)
         goto err_close_gfal;
     }
 
+    if (glite_eds_set_threads(ectx, threads, &error)) {
+        TRACE_ERR((stderr, "Error during glite_eds_set_threads: %s\n", error));
+        goto err_free_eds;
+    }
+
+    // Allocate encryption buffer, reused for every block
+    // -------------------------------------------------------------------------
+    int enc_buffer_capacity = glite_eds_output_size(ectx, TRANSFERBLOCKSIZE);
+    enc_buffer = (char *)malloc(enc_buffer_capacity);
+    if (!enc_buffer) {
+        TRACE_ERR((stderr, "Failed to allocate encryption buffer of size %d bytes!\n",
+                    enc_buffer_capacity));
+        goto err_free_eds;
+    }
+
     off_t bytesread = 0;
     off_t byteswritten = 0;
 
@@ -243,24 +264,24 @@ int main(int argc, char **argv)
             goto err_free_eds;
         }
 
-        int enc_buffer_size;
-        char *enc_buffer;
+        int out_buffer_size;
+        char *out_buffer;
 
         if (reg_only) {  // don't actually do the encryption
-            enc_buffer_size = nread;
-            enc_buffer = buffer;
+            out_buffer_size = nread;
+            out_buffer = buffer;
         } else {  // do the encryption
-            if (glite_eds_encrypt_block(ectx, buffer, nread, &enc_buffer, 
-                        &enc_buffer_size, &error)) {
+            if (glite_eds_encrypt_block_into(ectx, buffer, nread, enc_buffer,
+                        enc_buffer_capacity, &out_buffer_size, &error)) {
                 TRACE_ERR((stderr, "Error during glite_eds_encrypt_block: %s\n",
                             error));
                 goto err_free_eds;
             }
+            out_buffer = enc_buffer;
         }
 
-        int nwrite = gfal_write(fh, enc_buffer, enc_buffer_size);
-        if (enc_buffer != buffer) free(enc_buffer);
-        if (nwrite != enc_buffer_size) {
+        int nwrite = gfal_write(fh, out_buffer, out_buffer_size);
+        if (nwrite != out_buffer_size) {
             TRACE_ERR((stderr, "Fatal error during remote write. Error is \"%s (code: %d)\"\n",
                         strerror(errno), errno));
             TRACE_ERR((stderr,"Transfer Finished after %lld/%lld bytes!\n",
@@ -303,10 +324,10 @@ int main(int argc, char **argv)
     // Write final block
     // -------------------------------------------------------------------------
     int final_buf_size = 0;
-    char *final_buf;
 
     if (!reg_only) {
-        if (glite_eds_encrypt_final(ectx, &final_buf, &final_buf_size, &error)) {
+        if (glite_eds_encrypt_final_into(ectx, enc_buffer, enc_buffer_capacity,
+                    &final_buf_size, &error)) {
             TRACE_ERR((stderr, "Error during glite_eds_encrypt_final: %s\n",
                         error));
             goto err_free_eds;
@@ -314,8 +335,7 @@ int main(int argc, char **argv)
     }
 
     if (final_buf_size) {
-        int nwrite = gfal_write(fh, final_buf, final_buf_size);
-        free(final_buf);
+        int nwrite = gfal_write(fh, enc_buffer, final_buf_size);
         if (nwrite != final_buf_size) {
             TRACE_ERR((stderr, "Fatal error during remote write. Error is \"%s (code: %d)\"\n",
                         strerror(errno), errno));
@@ -326,6 +346,8 @@ int main(int argc, char **argv)
         byteswritten += nwrite;
     }
 
+    free(enc_buffer);
+
     // Shut down encryption
     // -------------------------------------------------------------------------
     glite_eds_finalize(ectx, &error);
@@ -358,6 +380,13 @@ int main(int argc, char **argv)
             strerror(errno), errno));
     }
 
+    // Let the key stores that were left behind catch up before exiting
+    // -------------------------------------------------------------------------
+    if (glite_eds_replication_wait(id, -1, &error) < 0) {
+        TRACE_ERR((stderr, "WARNING: Key not stored in every key store: %s\n", error));
+        free(error);
+    }
+
     gettimeofday(&abs_stop_time, &tz);
     float abs_time = ((float)((abs_stop_time.tv_sec - abs_start_time.tv_sec)*1000
                 + (abs_stop_time.tv_usec - abs_start_time.tv_usec) / 1000));
@@ -390,6 +419,7 @@ int main(int argc, char **argv)
     // - try to clean all written or registered entries
 
 err_free_eds:
+    free(enc_buffer);
     glite_eds_finalize(ectx, &error);
 err_unregister_eds:
     if (glite_eds_unregister(id, &error)) {
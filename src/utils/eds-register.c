@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -47,16 +48,21 @@
 
 #define TRANSFERBLOCKSIZE 10000000
 
+/* IDs registered with one call in bulk mode */
+#define BULK_CHUNK 10000
+
 static void print_usage_and_die(FILE * out){
     fprintf(out, "\n");
     fprintf(out, "usage: %s <ID>\n", PROGNAME);
+    fprintf(out, "       %s -f <FILE>\n", PROGNAME);
     fprintf(out, "  ID      : The remote ID (lfn or GUID) of the key \n");
+    fprintf(out, "  FILE    : file with one ID per line, '-' for stdin\n");
     fprintf(out, " Optional parameters:\n");
     fprintf(out, "  -c name : cipher name to use\n");
     fprintf(out, "  -k n    : key size to use in bits\n");
     fprintf(out, "  -h      : print this screen\n");
     fprintf(out, "  -q      : quiet mode\n");
-    fprintf(out, "  -v      : verbose mode\n");
+    fprintf(out, "  -v      : verbose mode, with -f lists every registered ID\n");
     fprintf(out, "  -t      : test endpoints\n");
     fprintf(out, "  -V      : print version and exit\n");
     if (out == stdout) {
@@ -65,14 +71,110 @@ static void print_usage_and_die(FILE * out){
     exit(-1);
 }
 
+/**
+ * Register the IDs of a chunk and report the failed ones, and in verbose
+ * mode the registered ones. Returns the number of failures.
+ */
+static int register_chunk(char **ids, int nids, char *cipher, int key_size,
+    int verbose)
+{
+    char *error = NULL;
+    int *results;
+    int i, failed = 0;
+
+    results = (int *)malloc(nids * sizeof(*results));
+    if (!results) {
+        TRACE_ERR((stderr, "Out of memory\n"));
+        return nids;
+    }
+
+    if (glite_eds_register_multi(ids, nids, cipher, key_size, results, &error))
+    {
+        TRACE_ERR((stderr, "Error during glite_eds_register_multi: %s\n", error));
+        free(error);
+    }
+    for (i = 0; i < nids; i++) {
+        if (results[i]) {
+            TRACE_ERR((stderr, "Failed to register ID '%s'\n", ids[i]));
+            failed++;
+        } else if (verbose) {
+            fprintf(stdout, "A key has been generated and registered for ID '%s'\n",
+                ids[i]);
+        }
+    }
+
+    free(results);
+    return failed;
+}
+
+/**
+ * Bulk mode: register the IDs listed in a file, one per line.
+ * Returns 0 if all of them were registered.
+ */
+static int register_file(const char *filename, char *cipher, int key_size,
+    int silent, int verbose)
+{
+    char *ids[BULK_CHUNK];
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int nids = 0, total = 0, failed = 0, read_error = 0;
+    FILE *in;
+
+    if (!strcmp(filename, "-"))
+        in = stdin;
+    else if (!(in = fopen(filename, "r"))) {
+        TRACE_ERR((stderr, "Cannot open '%s': %s\n", filename, strerror(errno)));
+        return -1;
+    }
+
+    while ((len = getline(&line, &size, in)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (!len)
+            continue;
+
+        ids[nids++] = line;
+        line = NULL;
+        size = 0;
+        if (nids == BULK_CHUNK) {
+            failed += register_chunk(ids, nids, cipher, key_size, verbose);
+            total += nids;
+            while (nids)
+                free(ids[--nids]);
+        }
+    }
+    free(line);
+    if (ferror(in)) {
+        TRACE_ERR((stderr, "Error reading '%s': %s\n", filename, strerror(errno)));
+        read_error = 1;
+    }
+    if (in != stdin)
+        fclose(in);
+
+    if (nids) {
+        failed += register_chunk(ids, nids, cipher, key_size, verbose);
+        total += nids;
+        while (nids)
+            free(ids[--nids]);
+    }
+
+    TRACE_LOG((stdout, "Keys have been generated and registered for %d of %d IDs\n",
+        total - failed, total));
+
+    return (failed || read_error) ? -1 : 0;
+}
+
 int main(int argc, char **argv)
 {
     int flag, key_size = 0;
     char *cipher = NULL;
+    char *filename = NULL;
     int silent = 0;
+    int verbose = 0;
     int valid = 0;
 
-    while ((flag = getopt (argc, argv, "qthvVc:k:")) != -1) {
+    while ((flag = getopt (argc, argv, "qthvVc:k:f:")) != -1) {
         switch (flag) {
             case 'q':
                 silent = 1;
@@ -85,10 +187,14 @@ int main(int argc, char **argv)
                 break;
             case 'v':
                 silent = 0;
+                verbose = 1;
                 break;
             case 'c':
                 cipher = strdup(optarg);
                 break;
+            case 'f':
+                filename = optarg;
+                break;
             case 'k':
                 if (1 != sscanf(optarg, "%d", &key_size))
                 {
@@ -105,6 +211,13 @@ int main(int argc, char **argv)
         } // End Switch
     } // End while
     
+    if (filename) {
+        if (argc != optind) {
+            print_usage_and_die(stderr);
+        }
+        return register_file(filename, cipher, key_size, silent, verbose);
+    }
+
     if (argc != (optind+1)) {
         print_usage_and_die(stderr);
     }
@@ -129,6 +242,13 @@ int main(int argc, char **argv)
         return -1;
     }
 
+    // Let the key stores that were left behind catch up before exiting
+    if (glite_eds_replication_wait(argv[optind], -1, &error) < 0)
+    {
+        TRACE_ERR((stderr, "WARNING: Key not stored in every key store: %s\n", error));
+        free(error);
+    }
+
     if(!silent) {
         fprintf(stdout, "A key has been generated and registered for ID '%s'\n", argv[optind]);
     }
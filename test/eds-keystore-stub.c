@@ -0,0 +1,476 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  GLite Data Management - In-memory stand-in for the key stores, the
+ *  catalog client and the service discovery, for the tests of the
+ *  encrypted data storage API
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <glite/data/glite-util.h>
+#include <glite/data/catalog/c/catalog-simple.h>
+#include <glite/data/catalog/metadata/c/metadata-simple.h>
+#include <ServiceDiscovery.h>
+
+/* Number of key stores served */
+#define STUB_STORES             3
+/* Attributes kept for an entry */
+#define STUB_ATTRS              8
+
+/* Entry of a key store */
+struct stub_entry {
+    char *endpoint;
+    char *item;
+    int nattrs;
+    char *names[STUB_ATTRS];
+    char *values[STUB_ATTRS];
+    struct stub_entry *next;
+};
+
+struct _glite_catalog_ctx {
+    char *endpoint;
+    char error[256];
+    glite_catalog_errclass errclass;
+};
+
+static pthread_mutex_t stub_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stub_entry *entries;
+
+/**
+ * Helper function - record the error of a call
+ */
+static int stub_error(glite_catalog_ctx *ctx, glite_catalog_errclass errclass,
+    const char *what, const char *item)
+{
+    ctx->errclass = errclass;
+    snprintf(ctx->error, sizeof(ctx->error), "%s: %s on %s", what, item,
+        ctx->endpoint);
+    return -1;
+}
+
+/**
+ * Helper function - find an entry. Must be called with the lock held.
+ */
+static struct stub_entry **stub_find(const char *endpoint, const char *item)
+{
+    struct stub_entry **p;
+
+    for (p = &entries; *p; p = &(*p)->next)
+    {
+        if (!strcmp((*p)->item, item) && !strcmp((*p)->endpoint, endpoint))
+            break;
+    }
+    return p;
+}
+
+/**
+ * Helper function - free an entry
+ */
+static void stub_entry_free(struct stub_entry *e)
+{
+    int i;
+
+    for (i = 0; i < e->nattrs; i++)
+    {
+        free(e->names[i]);
+        free(e->values[i]);
+    }
+    free(e->endpoint);
+    free(e->item);
+    free(e);
+}
+
+/**********************************************************************
+ * Service discovery
+ */
+
+char *glite_discover_service_by_version(const char *type, const char *name,
+    const char *version, char **error)
+{
+    (void)type;
+    (void)name;
+    (void)version;
+    (void)error;
+    return strdup("keystore-1");
+}
+
+/**
+ * Helper function - new service of a key store
+ */
+static SDService *stub_service(int index)
+{
+    SDService *service;
+    char endpoint[128];
+
+    snprintf(endpoint, sizeof(endpoint),
+        "https://localhost:8443/%d/glite-data-hydra-service/services/Hydra",
+        index + 1);
+    service = (SDService *)calloc(1, sizeof(*service));
+    if (service)
+        service->endpoint = strdup(endpoint);
+    return service;
+}
+
+SDService *SD_getService(const char *name, SDException *exception)
+{
+    (void)name;
+    memset(exception, 0, sizeof(*exception));
+    return stub_service(0);
+}
+
+SDServiceList *SD_listAssociatedServices(const char *name, const char *type,
+    const char *site, SDVOList *vos, SDException *exception)
+{
+    SDServiceList *list;
+    int i;
+
+    (void)name;
+    (void)type;
+    (void)site;
+    (void)vos;
+    memset(exception, 0, sizeof(*exception));
+    list = (SDServiceList *)calloc(1, sizeof(*list));
+    if (!list)
+        return NULL;
+    list->services = (SDService **)calloc(STUB_STORES - 1,
+        sizeof(*list->services));
+    for (i = 0; list->services && i < STUB_STORES - 1; i++)
+        list->services[list->numServices++] = stub_service(i + 1);
+    return list;
+}
+
+void SD_freeService(SDService *service)
+{
+    if (!service)
+        return;
+    free(service->endpoint);
+    free(service);
+}
+
+void SD_freeServiceList(SDServiceList *list)
+{
+    int i;
+
+    if (!list)
+        return;
+    for (i = 0; i < list->numServices; i++)
+        SD_freeService(list->services[i]);
+    free(list->services);
+    free(list);
+}
+
+void SD_freeException(SDException *exception)
+{
+    (void)exception;
+}
+
+/**********************************************************************
+ * Catalog client
+ */
+
+glite_catalog_ctx *glite_catalog_new(const char *endpoint)
+{
+    glite_catalog_ctx *ctx;
+
+    ctx = (glite_catalog_ctx *)calloc(1, sizeof(*ctx));
+    if (!ctx)
+        return NULL;
+    ctx->endpoint = strdup(endpoint);
+    if (!ctx->endpoint)
+    {
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void glite_catalog_free(glite_catalog_ctx *ctx)
+{
+    if (!ctx)
+        return;
+    free(ctx->endpoint);
+    free(ctx);
+}
+
+void glite_catalog_set_keepalive(glite_catalog_ctx *ctx, int enable)
+{
+    (void)ctx;
+    (void)enable;
+}
+
+void glite_catalog_set_deadline(glite_catalog_ctx *ctx,
+    const struct timespec *deadline)
+{
+    (void)ctx;
+    (void)deadline;
+}
+
+const char *glite_catalog_get_error(glite_catalog_ctx *ctx)
+{
+    return ctx ? ctx->error : "Out of memory";
+}
+
+glite_catalog_errclass glite_catalog_get_errclass(glite_catalog_ctx *ctx)
+{
+    return ctx ? ctx->errclass : GLITE_CATALOG_ERROR_OUTOFMEMORY;
+}
+
+int glite_catalog_is_connection_error(glite_catalog_ctx *ctx)
+{
+    /* The stand-in is always reachable */
+    (void)ctx;
+    return 0;
+}
+
+void glite_catalog_Attribute_freeArray(glite_catalog_ctx *ctx, int nattributes,
+    glite_catalog_Attribute *attributes[])
+{
+    int i;
+
+    (void)ctx;
+    if (!attributes)
+        return;
+    for (i = 0; i < nattributes; i++)
+    {
+        if (!attributes[i])
+            continue;
+        free(attributes[i]->name);
+        free(attributes[i]->value);
+        free(attributes[i]->type);
+        free(attributes[i]);
+    }
+    free(attributes);
+}
+
+/**********************************************************************
+ * Metadata catalog
+ */
+
+int glite_metadata_get_query_limit(glite_catalog_ctx *ctx)
+{
+    (void)ctx;
+    return 0;
+}
+
+char *glite_metadata_getVersion(glite_catalog_ctx *ctx)
+{
+    (void)ctx;
+    return strdup("3.1.0");
+}
+
+int glite_metadata_createEntry(glite_catalog_ctx *ctx, const char *item,
+    const char *schema)
+{
+    struct stub_entry **p, *e;
+
+    (void)schema;
+    pthread_mutex_lock(&stub_lock);
+    p = stub_find(ctx->endpoint, item);
+    if (*p)
+    {
+        pthread_mutex_unlock(&stub_lock);
+        return stub_error(ctx, GLITE_CATALOG_EXCEPTION_EXISTS,
+            "Entry exists", item);
+    }
+    e = (struct stub_entry *)calloc(1, sizeof(*e));
+    if (e)
+    {
+        e->endpoint = strdup(ctx->endpoint);
+        e->item = strdup(item);
+    }
+    if (!e || !e->endpoint || !e->item)
+    {
+        pthread_mutex_unlock(&stub_lock);
+        if (e)
+            stub_entry_free(e);
+        return stub_error(ctx, GLITE_CATALOG_ERROR_OUTOFMEMORY,
+            "Out of memory", item);
+    }
+    *p = e;
+    pthread_mutex_unlock(&stub_lock);
+    return 0;
+}
+
+int glite_metadata_createEntry_multi(glite_catalog_ctx *ctx, int nitems,
+    const char **items[2])
+{
+    int i, j;
+
+    /* All of them or none */
+    for (i = 0; i < nitems; i++)
+    {
+        if (glite_metadata_createEntry(ctx, items[0][i], items[1][i]))
+            break;
+    }
+    if (i == nitems)
+        return 0;
+    for (j = 0; j < i; j++)
+        glite_metadata_removeEntry(ctx, items[0][j]);
+    return -1;
+}
+
+int glite_metadata_removeEntry(glite_catalog_ctx *ctx, const char *item)
+{
+    struct stub_entry **p, *e;
+
+    pthread_mutex_lock(&stub_lock);
+    p = stub_find(ctx->endpoint, item);
+    e = *p;
+    if (e)
+        *p = e->next;
+    pthread_mutex_unlock(&stub_lock);
+    if (!e)
+        return stub_error(ctx, GLITE_CATALOG_EXCEPTION_NOTEXISTS,
+            "No such entry", item);
+    stub_entry_free(e);
+    return 0;
+}
+
+int glite_metadata_removeEntry_multi(glite_catalog_ctx *ctx, int nitems,
+    const char * const items[])
+{
+    int i, res = 0;
+
+    for (i = 0; i < nitems; i++)
+        res |= glite_metadata_removeEntry(ctx, items[i]);
+    return res;
+}
+
+int glite_metadata_setAttributes(glite_catalog_ctx *ctx, const char *item,
+    int nattributes, const glite_catalog_Attribute * const attributes[])
+{
+    struct stub_entry *e;
+    char *value;
+    int i, j;
+
+    pthread_mutex_lock(&stub_lock);
+    e = *stub_find(ctx->endpoint, item);
+    if (!e)
+    {
+        pthread_mutex_unlock(&stub_lock);
+        return stub_error(ctx, GLITE_CATALOG_EXCEPTION_NOTEXISTS,
+            "No such entry", item);
+    }
+    for (i = 0; i < nattributes; i++)
+    {
+        for (j = 0; j < e->nattrs; j++)
+        {
+            if (!strcmp(e->names[j], attributes[i]->name))
+                break;
+        }
+        value = strdup(attributes[i]->value ? attributes[i]->value : "");
+        if (!value || (j == e->nattrs && (j == STUB_ATTRS ||
+            !(e->names[j] = strdup(attributes[i]->name)))))
+        {
+            free(value);
+            pthread_mutex_unlock(&stub_lock);
+            return stub_error(ctx, GLITE_CATALOG_ERROR_OUTOFMEMORY,
+                "Too many attributes", item);
+        }
+        if (j == e->nattrs)
+            e->nattrs++;
+        free(e->values[j]);
+        e->values[j] = value;
+    }
+    pthread_mutex_unlock(&stub_lock);
+    return 0;
+}
+
+int glite_metadata_createEntryWithAttributes(glite_catalog_ctx *ctx,
+    const char *item, const char *schema, int nattributes,
+    const glite_catalog_Attribute * const attributes[])
+{
+    if (glite_metadata_createEntry(ctx, item, schema))
+        return -1;
+    if (glite_metadata_setAttributes(ctx, item, nattributes, attributes))
+    {
+        glite_metadata_removeEntry(ctx, item);
+        return -1;
+    }
+    return 0;
+}
+
+glite_catalog_Attribute **glite_metadata_getAttributes(glite_catalog_ctx *ctx,
+    const char *item, int nattributes, const char * const attributes[],
+    int *resultCount)
+{
+    glite_catalog_Attribute **result;
+    struct stub_entry *e;
+    int i, j, n = 0;
+
+    result = (glite_catalog_Attribute **)calloc(nattributes ? nattributes : 1,
+        sizeof(*result));
+    if (!result)
+    {
+        *resultCount = -1;
+        stub_error(ctx, GLITE_CATALOG_ERROR_OUTOFMEMORY, "Out of memory", item);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&stub_lock);
+    e = *stub_find(ctx->endpoint, item);
+    if (!e)
+    {
+        pthread_mutex_unlock(&stub_lock);
+        free(result);
+        *resultCount = -1;
+        stub_error(ctx, GLITE_CATALOG_EXCEPTION_NOTEXISTS, "No such entry",
+            item);
+        return NULL;
+    }
+    for (i = 0; i < nattributes; i++)
+    {
+        for (j = 0; j < e->nattrs; j++)
+        {
+            if (!strcmp(e->names[j], attributes[i]))
+                break;
+        }
+        if (j == e->nattrs)
+            continue;
+        result[n] = (glite_catalog_Attribute *)calloc(1, sizeof(**result));
+        if (!result[n])
+            break;
+        result[n]->name = strdup(e->names[j]);
+        result[n]->value = strdup(e->values[j]);
+        n++;
+    }
+    pthread_mutex_unlock(&stub_lock);
+
+    *resultCount = n;
+    return result;
+}
+
+int glite_metadata_getAttributes_multi(glite_catalog_ctx *ctx, int nitems,
+    const char * const items[], int nattributes,
+    const char * const attributes[], glite_catalog_Attribute **results[],
+    int resultCounts[])
+{
+    int i;
+
+    for (i = 0; i < nitems; i++)
+    {
+        results[i] = glite_metadata_getAttributes(ctx, items[i], nattributes,
+            attributes, &resultCounts[i]);
+        if (!results[i])
+            break;
+    }
+    return i;
+}
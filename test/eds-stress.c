@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) Members of the EGEE Collaboration. 2006-2010.
+ * See http://www.eu-egee.org/partners/ for details on the copyright
+ * holders.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *  GLite Data Management - Stress test of the encrypted data storage API
+ *  used from several threads at the same time, against the in-memory key
+ *  stores of eds-keystore-stub.c
+ *
+ *  usage: eds-stress [threads [iterations]]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <glite/data/catalog/c/catalog-simple.h>
+#include <glite/data/hydra/c/eds-simple.h>
+
+#define STRESS_THREADS      8
+#define STRESS_ITERATIONS   20
+/* Largest buffer encrypted at once */
+#define STRESS_SIZE         200000
+
+static const char *ciphers[] = {
+    "aes-128-cbc", "aes-192-cbc", "aes-256-ctr", "aes-128-gcm"
+};
+
+static pthread_mutex_t failures_lock = PTHREAD_MUTEX_INITIALIZER;
+static int iterations, failures;
+
+/**
+ * Helper function - report the failure of a step of a thread
+ */
+static void failed(long thread, const char *id, const char *what, char *error)
+{
+    pthread_mutex_lock(&failures_lock);
+    failures++;
+    fprintf(stderr, "thread %ld, %s: %s failed: %s\n", thread, id, what,
+        error ? error : "no error");
+    pthread_mutex_unlock(&failures_lock);
+    free(error);
+}
+
+/**
+ * Helper function - register a key, encrypt a buffer with it and decrypt
+ * it again. Returns 0 on success.
+ */
+static int round_trip(long thread, int iteration, unsigned int *seed)
+{
+    EVP_CIPHER_CTX *ctx;
+    char id[64], *plain, *sealed = NULL, *opened = NULL, *error = NULL;
+    int size, cap, len, sealed_len, opened_len, i, res = -1;
+
+    snprintf(id, sizeof(id), "eds-stress-%d-%ld-%d", (int)getpid(), thread,
+        iteration);
+    size = 1 + rand_r(seed) % STRESS_SIZE;
+    plain = (char *)malloc(size);
+    if (!plain)
+    {
+        failed(thread, id, "malloc", NULL);
+        return -1;
+    }
+    for (i = 0; i < size; i++)
+        plain[i] = (char)rand_r(seed);
+
+    ctx = glite_eds_register_encrypt_init(id,
+        (char *)ciphers[(thread + iteration) % 4], 0, &error);
+    if (!ctx)
+    {
+        failed(thread, id, "glite_eds_register_encrypt_init", error);
+        goto out;
+    }
+    /* Some contexts use worker threads of their own */
+    if (iteration % 3 == 0 && glite_eds_set_threads(ctx, 2, &error))
+        failed(thread, id, "glite_eds_set_threads", error);
+    cap = glite_eds_output_size(ctx, size) + glite_eds_output_size(ctx, 0);
+    sealed = (char *)malloc(cap);
+    if (!sealed || glite_eds_encrypt_block_into(ctx, plain, size, sealed, cap,
+        &sealed_len, &error) || glite_eds_encrypt_final_into(ctx,
+        sealed + sealed_len, cap - sealed_len, &len, &error))
+    {
+        failed(thread, id, "encryption", error);
+        glite_eds_finalize(ctx, &error);
+        goto out;
+    }
+    sealed_len += len;
+    glite_eds_finalize(ctx, &error);
+
+    ctx = glite_eds_decrypt_init(id, &error);
+    if (!ctx)
+    {
+        failed(thread, id, "glite_eds_decrypt_init", error);
+        goto out;
+    }
+    if (iteration % 2 == 0 && glite_eds_set_threads(ctx, 2, &error))
+        failed(thread, id, "glite_eds_set_threads", error);
+    cap = glite_eds_output_size(ctx, sealed_len) + glite_eds_output_size(ctx, 0);
+    opened = (char *)malloc(cap);
+    if (!opened || glite_eds_decrypt_block_into(ctx, sealed, sealed_len,
+        opened, cap, &opened_len, &error) || glite_eds_decrypt_final_into(ctx,
+        opened + opened_len, cap - opened_len, &len, &error))
+    {
+        failed(thread, id, "decryption", error);
+        glite_eds_finalize(ctx, &error);
+        goto out;
+    }
+    opened_len += len;
+    glite_eds_finalize(ctx, &error);
+    if (opened_len != size || memcmp(opened, plain, size))
+    {
+        failed(thread, id, "comparison", NULL);
+        goto out;
+    }
+
+    if (glite_eds_unregister(id, &error))
+    {
+        failed(thread, id, "glite_eds_unregister", error);
+        goto out;
+    }
+    /* The error of a call belongs to it, whatever the other threads do */
+    ctx = glite_eds_decrypt_init(id, &error);
+    if (ctx)
+    {
+        glite_eds_finalize(ctx, &error);
+        failed(thread, id, "decryption of a removed key", NULL);
+        goto out;
+    }
+    if (!error || !strstr(error, id))
+    {
+        failed(thread, id, "error of a removed key", error);
+        goto out;
+    }
+    free(error);
+    res = 0;
+
+out:
+    free(plain);
+    free(sealed);
+    free(opened);
+    return res;
+}
+
+/**
+ * Helper function - main function of a thread
+ */
+static void *stress_thread(void *arg)
+{
+    long thread = (long)arg;
+    unsigned int seed = (unsigned int)thread;
+    int i;
+
+    for (i = 0; i < iterations; i++)
+        round_trip(thread, i, &seed);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t *threads;
+    char *error = NULL;
+    long i, nthreads;
+
+    nthreads = argc > 1 ? atol(argv[1]) : STRESS_THREADS;
+    iterations = argc > 2 ? atoi(argv[2]) : STRESS_ITERATIONS;
+    if (nthreads < 1 || iterations < 1)
+    {
+        fprintf(stderr, "usage: %s [threads [iterations]]\n", argv[0]);
+        return 2;
+    }
+
+    /* Nothing else than the stand-in key stores, and their endpoints must
+     * not end up in the caches of the user */
+    unsetenv(GLITE_EDS_JOURNAL_ENV);
+    unsetenv(GLITE_EDS_AGENT_SOCK_ENV);
+    unsetenv(GLITE_CATALOG_INFO_CACHE_ENV);
+    setenv(GLITE_EDS_ENDPOINT_CACHE_ENV, "", 1);
+    if (glite_eds_library_init(&error))
+    {
+        fprintf(stderr, "glite_eds_library_init failed: %s\n", error);
+        free(error);
+        return 1;
+    }
+
+    threads = (pthread_t *)calloc(nthreads, sizeof(*threads));
+    if (!threads)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&threads[i], NULL, stress_thread, (void *)i))
+        {
+            fprintf(stderr, "cannot start thread %ld\n", i);
+            nthreads = i;
+            failures++;
+            break;
+        }
+    }
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    glite_eds_library_cleanup();
+
+    printf("%ld threads, %d iterations each: %d failures\n", nthreads,
+        iterations, failures);
+    return failures ? 1 : 0;
+}